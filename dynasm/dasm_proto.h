@@ -57,12 +57,21 @@ DASM_FDEF void dasm_setupglobal(Dst_DECL, void **gl, unsigned int maxgl);
 /* Grow PC label array. Can be called after dasm_setup(), too. */
 DASM_FDEF void dasm_growpc(Dst_DECL, unsigned int maxpc);
 
+/* Grow section buffer. Can be called after dasm_setup(), too. */
+DASM_FDEF void dasm_growsection(Dst_DECL, int secnum, size_t maxpos);
+
+/* Find runs of plain bytes in an actionlist, used by dasm_setup(). */
+DASM_FDEF void dasm_setupruns(Dst_DECL, const void *actionlist, size_t size);
+
 /* Setup encoder. */
 DASM_FDEF void dasm_setup(Dst_DECL, const void *actionlist);
 
 /* Feed encoder with actions. Calls are generated by pre-processor. */
 DASM_FDEF void dasm_put(Dst_DECL, int start, ...);
 
+/* Feed encoder with a snippet of fixed size. Generated by dynasm -S. */
+DASM_FDEF void dasm_putfixed(Dst_DECL, int start, int i0, int i1, int i2, int i3);
+
 /* Link sections and return the resulting size. */
 DASM_FDEF int dasm_link(Dst_DECL, size_t *szp);
 
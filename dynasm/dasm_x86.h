@@ -64,6 +64,10 @@ typedef struct dasm_Section {
 struct dasm_State {
   size_t psize;			/* Allocated size of this structure. */
   dasm_ActList actionlist;	/* Current actionlist pointer. */
+  const unsigned char *run;	/* Runs of plain bytes in it or NULL. */
+  unsigned char *runs;		/* Runs of plain bytes in runlist. */
+  size_t runsize;
+  dasm_ActList runlist;
   int *lglabels;		/* Local/global chain/pos ptrs. */
   size_t lgsize;
   int *pclabels;		/* PC label chains/pos ptrs. */
@@ -73,6 +77,12 @@ struct dasm_State {
   size_t codesize;		/* Total size of all code sections. */
   int maxsection;		/* 0 <= sectionidx < maxsection. */
   int status;			/* Status code. */
+#ifdef DASM_STATS
+  size_t nput;			/* dasm_put calls since dasm_setup(). */
+  size_t nputfixed;		/* dasm_putfixed calls. */
+  size_t nactbytes;		/* Bytes of actions dasm_put went through. */
+  size_t nlink;			/* dasm_link calls. */
+#endif
   dasm_Section sections[1];	/* All sections. Alloc-extended. */
 };
 
@@ -95,6 +105,10 @@ void dasm_init(Dst_DECL, int maxsection)
   D->pclabels = NULL;
   D->pcsize = 0;
   D->globals = NULL;
+  D->run = NULL;
+  D->runs = NULL;
+  D->runsize = 0;
+  D->runlist = NULL;
   D->maxsection = maxsection;
   for (i = 0; i < maxsection; i++) {
     D->sections[i].buf = NULL;  /* Need this for pass3. */
@@ -114,6 +128,7 @@ void dasm_free(Dst_DECL)
       DASM_M_FREE(Dst, D->sections[i].buf, D->sections[i].bsize);
   if (D->pclabels) DASM_M_FREE(Dst, D->pclabels, D->pcsize);
   if (D->lglabels) DASM_M_FREE(Dst, D->lglabels, D->lgsize);
+  if (D->runs) DASM_M_FREE(Dst, D->runs, D->runsize);
   DASM_M_FREE(Dst, D, D->psize);
 }
 
@@ -134,14 +149,51 @@ void dasm_growpc(Dst_DECL, unsigned int maxpc)
   memset((void *)(((unsigned char *)D->pclabels)+osz), 0, D->pcsize-osz);
 }
 
+/* Grow buffer of a section to hold at least maxpos positions. Optional, saves
+** reallocations while the section is filled. Can be called after dasm_setup(),
+** too.
+*/
+void dasm_growsection(Dst_DECL, int secnum, size_t maxpos)
+{
+  dasm_State *D = Dst_REF;
+  dasm_Section *sec = D->sections + secnum;
+  DASM_M_GROW(Dst, int, sec->buf, sec->bsize,
+    (maxpos + 2*DASM_MAXSECPOS)*sizeof(int));
+  sec->rbuf = sec->buf - DASM_SEC2POS(secnum);
+  sec->epos = (int)sec->bsize/sizeof(int) - DASM_MAXSECPOS+DASM_SEC2POS(secnum);
+}
+
+/* Find runs of plain bytes (copied to the code as they are) in an actionlist
+** of size bytes. Optional, then all passes skip a run at once, whenever
+** dasm_setup() is called with this actionlist. A shorter run is still right,
+** runs are cut so that 8 bytes can be read from the start of each.
+*/
+void dasm_setupruns(Dst_DECL, const void *actionlist, size_t size)
+{
+  dasm_State *D = Dst_REF;
+  dasm_ActList a = (dasm_ActList)actionlist;
+  size_t i;
+  DASM_M_GROW(Dst, unsigned char, D->runs, D->runsize, size);
+  for (i = size; i-- > 0; ) {
+    int n = a[i] < DASM_DISP ? 1 + (i+1 < size ? D->runs[i+1] : 0) : 0;
+    D->runs[i] = (unsigned char)(i+8 > size ? 0 : n > 255 ? 255 : n);
+  }
+  D->runlist = a;
+  D->run = D->actionlist == a ? D->runs : NULL;
+}
+
 /* Setup encoder. */
 void dasm_setup(Dst_DECL, const void *actionlist)
 {
   dasm_State *D = Dst_REF;
   int i;
   D->actionlist = (dasm_ActList)actionlist;
+  D->run = D->runlist == D->actionlist ? D->runs : NULL;
   D->status = DASM_S_OK;
   D->section = &D->sections[0];
+#ifdef DASM_STATS
+  D->nput = D->nputfixed = D->nactbytes = D->nlink = 0;
+#endif
   if (D->lgsize) memset((void *)D->lglabels, 0, D->lgsize);
   if (D->pclabels) memset((void *)D->pclabels, 0, D->pcsize);
   for (i = 0; i < D->maxsection; i++) {
@@ -169,6 +221,7 @@ void dasm_put(Dst_DECL, int start, ...)
   va_list ap;
   dasm_State *D = Dst_REF;
   dasm_ActList p = D->actionlist + start;
+  const unsigned char *run = D->run;
   dasm_Section *sec = D->section;
   int pos = sec->pos, ofs = sec->ofs, mrm = -1;
   int *b;
@@ -185,7 +238,9 @@ void dasm_put(Dst_DECL, int start, ...)
 
   va_start(ap, start);
   while (1) {
-    int action = *p++;
+    int action;
+    if (run) { int n = run[p - D->actionlist]; p += n; ofs += n; }
+    action = *p++;
     if (action < DASM_DISP) {
       ofs++;
     } else if (action <= DASM_REL_A) {
@@ -268,9 +323,57 @@ void dasm_put(Dst_DECL, int start, ...)
   }
 stop:
   va_end(ap);
+#ifdef DASM_STATS
+  D->nput++;
+  D->nactbytes += (size_t)(p - (D->actionlist + start));
+#endif
   sec->pos = pos;
   sec->ofs = ofs;
 }
+
+/* Pass 1 for a snippet of fixed size (see dynasm -S): store its template and
+** immediates, which are just copied and patched by pass 3.
+*/
+void dasm_putfixed(Dst_DECL, int start, int i0, int i1, int i2, int i3)
+{
+  dasm_State *D = Dst_REF;
+  dasm_ActList p = D->actionlist + start;
+  dasm_Section *sec = D->section;
+  int pos = sec->pos;
+  int *b;
+
+  if (pos >= sec->epos) {
+    DASM_M_GROW(Dst, int, sec->buf, sec->bsize,
+      sec->bsize + 2*DASM_MAXSECPOS*sizeof(int));
+    sec->rbuf = sec->buf - DASM_POS2BIAS(pos);
+    sec->epos = (int)sec->bsize/sizeof(int) - DASM_MAXSECPOS+DASM_POS2BIAS(pos);
+  }
+
+  b = sec->rbuf;
+  b[pos++] = ~start;  /* Fixed snippets are marked by a negative start. */
+  b[pos] = i0; b[pos+1] = i1; b[pos+2] = i2; b[pos+3] = i3;
+#ifdef DASM_CHECKS
+  {
+    int i;
+    for (i = 0; i < p[1]; i++) {
+      int n = b[pos+i];
+      switch (p[3+2*i]) {
+      case DASM_IMM_S: if (((n+128)&-256) == 0) continue; break;
+      case DASM_IMM_B: if ((n&-256) == 0) continue; break;
+      case DASM_IMM_W: if ((n&-65536) == 0) continue; break;
+      default: continue;
+      }
+      D->status = DASM_S_RANGE_I|start;
+      return;
+    }
+  }
+#endif
+#ifdef DASM_STATS
+  D->nputfixed++;
+#endif
+  sec->pos = pos + p[1];
+  sec->ofs += p[0];
+}
 #undef CK
 
 /* Pass 2: Link sections, shrink branches/aligns, fix label offsets. */
@@ -280,6 +383,9 @@ int dasm_link(Dst_DECL, size_t *szp)
   int secnum;
   int ofs = 0;
 
+#ifdef DASM_STATS
+  D->nlink++;
+#endif
 #ifdef DASM_CHECKS
   *szp = 0;
   if (D->status != DASM_S_OK) return D->status;
@@ -307,10 +413,20 @@ int dasm_link(Dst_DECL, size_t *szp)
     int lastpos = sec->pos;
 
     while (pos != lastpos) {
-      dasm_ActList p = D->actionlist + b[pos++];
+      dasm_ActList p;
       int op = 0;
+      if (b[pos] < 0) {  /* Fixed snippet: nothing to link. */
+	pos += 1 + D->actionlist[~b[pos] + 1];
+	continue;
+      }
+      p = D->actionlist + b[pos++];
       while (1) {
-	int action = *p++;
+	int action;
+	if (D->run) {
+	  int n = D->run[p - D->actionlist];
+	  if (n) { p += n; op = p[-1]; }
+	}
+	action = *p++;
 	switch (action) {
 	case DASM_REL_LG: p++;
 	  /* fallthrough */
@@ -391,6 +507,9 @@ int dasm_encode(Dst_DECL, void *buffer)
   dasm_State *D = Dst_REF;
   unsigned char *base = (unsigned char *)buffer;
   unsigned char *cp = base;
+  unsigned char *end = base + D->codesize;
+  dasm_ActList al = D->actionlist;
+  const unsigned char *run = D->run;
   int secnum;
 
   /* Encode all code sections. No support for data sections (yet). */
@@ -400,11 +519,37 @@ int dasm_encode(Dst_DECL, void *buffer)
     int *endb = sec->rbuf + sec->pos;
 
     while (b != endb) {
-      dasm_ActList p = D->actionlist + *b++;
+      dasm_ActList p;
       unsigned char *mark = NULL;
+      if (*b < 0) {  /* Fixed snippet: copy template, patch immediates. */
+	int i, nimm;
+	p = al + ~*b++;
+	nimm = p[1];
+	memcpy(cp, p + 2 + 2*nimm, p[0]);
+	for (i = 0; i < nimm; i++) {
+	  unsigned char *next = cp;
+	  int n = *b++;
+	  cp += p[2+2*i];
+	  switch (p[3+2*i]) {
+	  case DASM_IMM_S: case DASM_IMM_B: dasmb(n); break;
+	  case DASM_IMM_W: dasmw(n); break;
+	  default: dasmd(n); break;
+	  }
+	  cp = next;
+	}
+	cp += p[0];
+	continue;
+      }
+      p = al + *b++;
       while (1) {
-	int action = *p++;
-	int n = (action >= DASM_DISP && action <= DASM_ALIGN) ? *b++ : 0;
+	int action, n;
+	if (run) {  /* Copy short runs with a single (over)write. */
+	  n = run[p - al];
+	  if (n > 0 && n <= 8 && cp + 8 <= end) { memcpy(cp, p, 8); cp += n; p += n; }
+	  else while (n-- > 0) *cp++ = *p++;
+	}
+	action = *p++;
+	n = (action >= DASM_DISP && action <= DASM_ALIGN) ? *b++ : 0;
 	switch (action) {
 	case DASM_DISP: if (!mark) mark = cp; {
 	  unsigned char *mm = mark;
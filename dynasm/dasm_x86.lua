@@ -182,13 +182,55 @@ local function dedupechunk(offset)
   end
 end
 
+-- Sizes of the immediates a fixed snippet may have.
+local map_fixedimm = { IMM_S = 1, IMM_B = 1, IMM_W = 2, IMM_D = 4 }
+
+-- Replace the action list chunk at offset by a template for dasm_putfixed(),
+-- if it has just plain bytes and up to 4 immediates of fixed size: its length,
+-- the number of immediates, a (position, action) pair for each of them and the
+-- bytes with zeros in place of the immediates.
+local function wfixed(offset)
+  local al, tmpl, imm = actlist, {}, {}
+  local i = offset+1
+  while true do
+    local action = al[i]
+    i = i + 1
+    if action < actfirst then
+      tmpl[#tmpl+1] = action
+    elseif action == map_action.ESC then
+      tmpl[#tmpl+1] = al[i]
+      i = i + 1
+    elseif action == map_action.STOP then
+      break
+    else
+      local sz = map_fixedimm[action_names[action-actfirst+1]]
+      if not sz then return false end
+      imm[#imm+1] = #tmpl
+      imm[#imm+1] = action
+      for _=1,sz do tmpl[#tmpl+1] = 0 end
+    end
+  end
+  if #tmpl == 0 or #tmpl > 255 or #imm > 8 then return false end
+  for j=offset+1,#al do al[j] = nil end
+  wputxb(#tmpl)
+  wputxb(#imm/2)
+  for _,b in ipairs(imm) do wputxb(b) end
+  for _,b in ipairs(tmpl) do wputxb(b) end
+  return true
+end
+
 -- Flush action list (intervening C code or buffer pos overflow).
 local function wflush(term)
   local offset = actargs[1]
   if #actlist == offset then return end -- Nothing to flush.
   if not term then waction("STOP") end -- Terminate action list.
+  local func = "put"
+  if g_opt.specialize and not term and wfixed(offset) then
+    func = "putfixed" -- Always with 4 immediates.
+    for i=#actargs+1,5 do actargs[i] = "0" end
+  end
   dedupechunk(offset)
-  wcall("put", actargs) -- Add call to dasm_put().
+  wcall(func, actargs) -- Add call to dasm_put() or dasm_putfixed().
   actargs = { #actlist } -- Actionlist offset is 1st arg to next dasm_put().
   secpos = 1 -- The actionlist offset occupies a buffer position, too.
 end
@@ -990,6 +990,7 @@ Usage: dynasm [OPTION]... INFILE.dasc|-
 
   -L, --nolineno       Suppress CPP line number information in output.
   -F, --flushline      Flush action list for every line.
+  -S, --specialize     Use dasm_putfixed() for snippets of fixed size.
 
   -D NAME[=SUBST]      Define a substitution.
   -U NAME              Undefine a substitution.
@@ -1016,6 +1017,7 @@ function opt_map.nocomment() g_opt.comment = false end
 function opt_map.maccomment() g_opt.maccomment = true end
 function opt_map.nolineno() g_opt.cpp = false end
 function opt_map.flushline() g_opt.flushline = true end
+function opt_map.specialize() g_opt.specialize = true end
 function opt_map.dumpdef() g_opt.dumpdef = g_opt.dumpdef + 1 end
 
 ------------------------------------------------------------------------------
@@ -1025,7 +1027,7 @@ local opt_alias = {
   h = "help", ["?"] = "help", V = "version",
   o = "outfile", I = "include",
   c = "ccomment", C = "cppcomment", N = "nocomment", M = "maccomment",
-  L = "nolineno", F = "flushline",
+  L = "nolineno", F = "flushline", S = "specialize",
   P = "dumpdef", A = "dumparch",
 }
 
@@ -30,11 +30,18 @@
 #define _BSD_SOURCE
 #define _DEFAULT_SOURCE
 
+// For `memfd_create` (Linux specific) we need _GNU_SOURCE.
+#define _GNU_SOURCE
+
 // First, some generic includes.
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
 
 // These defines are very not not portable. But the rest of our program depends
 // on bigger details of the x86-64 architecture anyways, so assuming that int is
@@ -42,18 +49,68 @@
 typedef unsigned char u8;
 typedef int i32;
 typedef unsigned int u32;
+typedef long long i64;
+typedef unsigned long long u64;
 
 // We need mmap and mprotect (on POSIX systems) or VirtualAlloc and
-// VirtualProtect (on Windows). See their later use in this file.
+// VirtualProtect (on Windows), and the page size. See their later use in this file.
+// On POSIX systems we also catch faults in the guard pages of stacks, see `RunStack`.
 #if _WIN32
 #include <windows.h>
+#include <io.h>
 #else
 #include <sys/mman.h>
+#include <unistd.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
 #define MAP_ANONYMOUS MAP_ANON
 #endif
 #endif
 
+// CPUID, to find out which vector instructions we can use, see
+// `cpu_has_avx2`, and the time stamp counter, see `block_profile_create`.
+#if _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+// We compile in background threads (see `CompilePool`), for which we need
+// threads, mutexes and condition variables. These are thin wrappers over
+// pthreads, or their counterparts on Windows.
+#if _WIN32
+typedef SRWLOCK Mutex;
+typedef CONDITION_VARIABLE Cond;
+typedef HANDLE Thread;
+#define mutex_init(m) InitializeSRWLock(m)
+#define mutex_destroy(m) ((void) (m))
+#define mutex_lock(m) AcquireSRWLockExclusive(m)
+#define mutex_unlock(m) ReleaseSRWLockExclusive(m)
+#define cond_init(c) InitializeConditionVariable(c)
+#define cond_destroy(c) ((void) (c))
+#define cond_wait(c, m) SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define cond_signal(c) WakeConditionVariable(c)
+#define cond_broadcast(c) WakeAllConditionVariable(c)
+#else
+#include <pthread.h>
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+typedef pthread_t Thread;
+#define mutex_init(m) pthread_mutex_init(m, NULL)
+#define mutex_destroy(m) pthread_mutex_destroy(m)
+#define mutex_lock(m) pthread_mutex_lock(m)
+#define mutex_unlock(m) pthread_mutex_unlock(m)
+#define cond_init(c) pthread_cond_init(c, NULL)
+#define cond_destroy(c) pthread_cond_destroy(c)
+#define cond_wait(c, m) pthread_cond_wait(c, m)
+#define cond_signal(c) pthread_cond_signal(c)
+#define cond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
 // For Macs we need to use MAP_JIT, we wrap it in `MAP_JIT_VALUE`, so we can be
 // platform independent in the rest of the code. Also on Macs we have to
 // explicitly invalidate the instruction cache for the processor to see the new
@@ -138,6 +195,16 @@ void sys_icache_invalidate(void *start, size_t len);
 // we wouldn't have them enabled in a (sufficiently tested) release build.
 #define DASM_CHECKS
 
+// DynASM also counts the snippets put and the actions they go through, for
+// `CompileStats`. Building with -DJIT_STATS=0 compiles this out, together with
+// the statistics themselves.
+#ifndef JIT_STATS
+#define JIT_STATS 1
+#endif
+#if JIT_STATS
+#define DASM_STATS
+#endif
+
 // Now we can finally include the DynASM headers. The first one contains just
 // the declarations of functions we can use or fallback definitions of macros,
 // some of which we chose to override above. This header file is generic and
@@ -239,6 +306,15 @@ void sys_icache_invalidate(void *start, size_t len);
 //  Generally most bytes correspond to instruction bytes directly, while the
 //  high bytes (233+ at the moment) are DASM instructions.
 //
+//  We run the preprocessor with `-S` (see `meson.build`). Then a snippet
+//  that has nothing but instruction bytes and up to four immediates of a
+//  fixed size (no registers chosen at runtime, no labels) isn't written as
+//  DASM instructions, but as a template of its bytes with the positions of
+//  the immediates, and translates to a call of `dasm_putfixed`. Its encoding
+//  is then just a copy of the template and stores of the immediates, without
+//  interpreting the action list. Most of our snippets do use registers chosen
+//  at runtime (e.g. those from `TosCache`) though, and go through `dasm_put`.
+//
 
 // Labels are a well known to anybody who has seen any assembly code. They allow
 // us to refer to positions in the code (or data, ...) by human readable names,
@@ -307,18 +383,27 @@ void sys_icache_invalidate(void *start, size_t len);
 //         };
 
 // DynASM support multiple sectinons, though they are all currently limited to
-// executable code, and "data" or "bss" sections are not supported. We will do
-// with just one section for "code" we declare it here, which causes the
-// preprocessor to define a couple of section related macros -- one for each
-// section to give it an index, and one for the total number of sections that
-// will came handy later, when we call `dasm_init` which needs to know the
-// maximal number of sections we want to use.
-//|.section code
+// executable code, and "data" or "bss" sections are not supported. We declare
+// them here, which causes the preprocessor to define a couple of section
+// related macros -- one for each section to give it an index, and one for the
+// total number of sections that will came handy later, when we call
+// `dasm_init` which needs to know the maximal number of sections we want to
+// use.
+//
+// We have two: "code" for most of our code and "cold" for code which rarely
+// runs (slow paths, like refilling the input, and the exits of the program).
+// The directives `.code` and `.cold` switch between them. All the code put
+// into a section ends up together, and the sections are laid out in order,
+// so the cold code ends up after all the rest, and doesn't take space in the
+// instruction caches between the hot parts. Every compilation starts in the
+// first section.
+//|.section code, cold
 //
 // The above translates to something like:
 //
 //         #define DASM_SECTION_CODE   0
-//         #define DASM_MAXSECTION     1
+//         #define DASM_SECTION_COLD   1
+//         #define DASM_MAXSECTION     2
 
 // In these days of virtual memory, most of the memory we can allocate won't be
 // executable. So we need to allocate our own pages of memory, where we will put
@@ -329,766 +414,9342 @@ void sys_icache_invalidate(void *start, size_t len);
 // executable at the same time (this is known as W^X and even strictly enforced
 // by some operating systems).
 //
-// Apart from the checks the below function is mostly a copy of the one from
-// Peter Cawley's DynASM tutorial, we just do more checking with asserts and try
-// to support Macs.
+// Asking the operating system for fresh pages for each compiled function is
+// simple, but wasteful: even a tiny function takes a whole page (and a separate
+// mapping, of which there is a limited number per process), and changing the
+// protection of each takes a system call, which also has to flush the TLBs.
+// So instead we have a "code cache": we reserve large regions of memory
+// upfront and carve the functions out of them.
 //
-// What the function does, is that it receives a dynasm state, with some
-// snippets already put into it with `dasm_put` which is essentially a first
-// pass over the code, where we are just pasting together snippets and DynASM is
-// interpolating them with the evaluations of the used expressions. `dasm_link`
-// is the second pass we need to do on the pending code. The call to the
-// function essentially tells dynasm that here our assembly pasting ends. It
-// will do a pass over the code determining the relative offsets of labels, etc.
-// and most importantly it will already figure out the final length of the
-// code and return it to use through an output parameter. We use that size to
-// allocate enough writable pages from the operating system and tell DynASM to
-// encode the code there. This will not only allow us to mark those pages
-// executable and have the code in an executable area, but also allows DynASM to
-// know the final destination of the code, so it can finalize relative offsets
-// to e.g. global labels, which (in general) are not in the pending piece of
-// code. After we have the code in our buffer, we ask the operating to change
-// the protection of the pages there to make the area non-writable, but
-// executable. Finally we return a pointer (`void *`) to the start of the
-// buffer. This leaves our function generic and we don't have to limit our
-// linking and encoding to a single function signature -- the caller can cast in
-// any way they like.
-static void *
-our_dasm_link_and_encode(Dst_DECL)
+//  - Small functions are rounded up to one of a few size classes and packed
+//    into pages dedicated to that class ("slabs"). Larger functions get a run
+//    of whole pages.
+//
+//  - Fresh pages are writable. Functions are encoded into them and stay
+//    unusable until `code_cache_seal` is called, which makes all the pages
+//    written since the last call executable, with a single `mprotect` call per
+//    region (pages in between which were already sealed, or are free, are
+//    simply included). So compiling a batch of functions and sealing them once
+//    pays for one permission change.
+//
+//  - Once a page is sealed, we never make it writable again while there is
+//    code on it, since that code could be running. Sealing thus also closes
+//    the partially filled slabs, later allocations go to fresh pages. When all
+//    functions on a sealed page are freed, the page goes back to the pool.
+//
+// The regions are aligned to 2 MiB, so that the kernel can back them with
+// transparent huge pages, which we ask for if it's supported.
+//
+// Changing the protection of pages isn't free either: the kernel has to
+// shoot down stale TLB entries on all cores the process runs on. On Linux the
+// code cache can also work in a "dual mapped" mode, where each region is a
+// memory file (`memfd_create`) mapped twice: once writable and once
+// executable. The code is written through the writable view (see
+// `code_writable`) and run from the executable view, so the permissions never
+// change and sealing is free. Everywhere else (where `CODE_DUAL_MAP` is not
+// defined, notably on Macs with their `MAP_JIT`) we fall back to `mprotect`.
+// The mode is not W^X in the strict sense, the code is writable through the
+// other view, but no single address is ever both writable and executable.
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+#define CODE_DUAL_MAP
+#endif
+#define CODE_REGION_SIZE ((size_t) 64 << 20)
+#define CODE_REGION_ALIGN ((size_t) 2 << 20)
+#define CODE_MIN_CLASS_SHIFT 6
+#define CODE_CLASSES 6 // 64, 128, ..., 2048 bytes
+
+enum {
+	PAGE_FRESH,  // Never used, or recycled. Writable.
+	PAGE_OPEN,   // Holds code that is not sealed yet. Writable.
+	PAGE_SEALED, // Executable.
+};
+
+// Bookkeeping for a single page of a region.
+typedef struct {
+	u8 state;
+	// Whether the page has to be made writable before it is reused.
+	u8 readonly;
+	// Size class of a slab, or `CODE_CLASSES` for (the first page of) a
+	// run of pages of a large function.
+	u8 cls;
+	// Number of live functions on the page, or the number of pages of a
+	// large function.
+	u32 live;
+	// Next free slot of an open slab.
+	u32 next_slot;
+} CodePage;
+
+typedef struct CodeRegion {
+	struct CodeRegion *next;
+	u8 *base;           // Executable view, addresses of code are from here.
+	u8 *rw;             // Writable view, same as `base` unless dual mapped.
+	size_t npages;
+	size_t fresh;       // Pages from this one on have never been used.
+	size_t open_lo;     // Range of pages which may be open.
+	size_t open_hi;
+	CodePage pages[];
+} CodeRegion;
+
+typedef struct {
+	size_t page_size;
+	int dual;           // Whether the regions are dual mapped.
+	CodeRegion *regions;
+	// Recycled pages, as a stack. Large functions take runs of them out
+	// of the middle, see `code_recycled_run`.
+	struct { CodeRegion *region; size_t page; } *recycled;
+	size_t nrecycled;
+	size_t recycled_cap;
+	// The slab currently being filled for each size class.
+	struct { CodeRegion *region; size_t page; int valid; } slabs[CODE_CLASSES];
+	// Compiler threads share the cache. The lock is taken by
+	// `code_cache_seal` and `code_free`, and has to be held around
+	// `code_alloc` together with writing the code, so that no page is
+	// sealed while some thread is still writing to it.
+	Mutex lock;
+	// Statistics.
+	size_t reserved;    // Bytes of reserved regions.
+	size_t allocated;   // Bytes handed out (after rounding).
+	size_t seals;       // Number of `mprotect` calls made to seal pages.
+	// Where the code compiled into the cache is registered, if anywhere,
+	// see `DebugInfo`. Freeing the code unregisters it.
+	struct DebugInfo *debug;
+	// Where the compilations into the cache are counted, if anywhere, see
+	// `CompileStats`.
+	struct CompileStats *stats;
+} CodeCache;
+
+static size_t
+system_page_size(void)
 {
-	size_t size;
-	void* code;
-	assert(dasm_checkstep(Dst, 0) == DASM_S_OK);
-	assert(dasm_link(Dst, &size) == DASM_S_OK);
 #ifdef _WIN32
-	code = VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
 #else
-	code = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_JIT_VALUE, -1, 0);
+	return (size_t) sysconf(_SC_PAGESIZE);
 #endif
-	assert(dasm_encode(Dst, code) == DASM_S_OK);
-#ifdef _WIN32
-	DWORD original;
-	VirtualProtect(code, size, PAGE_EXECUTE_READ, &original);
+}
+
+// Compiled code is just bytes in anonymous memory, profilers and debuggers
+// know nothing about it. There are a few ways to tell them, `DebugInfo` does
+// those that are asked for (`kinds`) for each function compiled into a code
+// cache which points to it:
+//
+//  - `DEBUG_PERF_MAP`: a line with the address, size and name of the function
+//    appended to `/tmp/perf-PID.map`, where `perf report` looks for symbols.
+//
+//  - `DEBUG_JITDUMP`: records in `/tmp/jit-PID.dump`, in the format `perf
+//    inject --jit` turns into ELF files, with the code itself and a line table
+//    (see below). Perf finds the file by the mapping of it which we keep.
+//
+//          https://github.com/torvalds/linux/blob/master/tools/perf/Documentation/jitdump-specification.txt
+//
+//  - `DEBUG_GDB`: an in-memory ELF object with a symbol for the function
+//    and the line table as DWARF, registered with GDB through its JIT
+//    interface (`__jit_debug_register_code` below). This is what LuaJIT does,
+//    see its `lj_gdbjit.c`.
+//
+//          https://sourceware.org/gdb/current/onlinedocs/gdb.html/JIT-Interface.html
+//
+// The "source" of the code is the bytecode, so the line table maps addresses
+// of the code to bytecode offsets, as lines of the file `source`. Line N is
+// the instruction at offset N - 1, since lines start at one.
+enum {
+	DEBUG_PERF_MAP = 1,
+	DEBUG_JITDUMP = 2,
+	DEBUG_GDB = 4,
+};
+
+typedef struct {
+	void *address;
+	u32 offset;
+} DebugLine;
+
+// The GDB JIT interface. GDB puts a breakpoint into the function and looks at
+// the descriptor when it's hit, both are found by their names, which is why
+// they aren't `static`. The descriptor is global, so is the interface, only
+// one `DebugInfo` in the process should use it.
+struct jit_code_entry {
+	struct jit_code_entry *next_entry;
+	struct jit_code_entry *prev_entry;
+	const char *symfile_addr;
+	u64 symfile_size;
+};
+
+struct jit_descriptor {
+	u32 version;
+	u32 action_flag; // 0 nothing, 1 register, 2 unregister `relevant_entry`.
+	struct jit_code_entry *relevant_entry;
+	struct jit_code_entry *first_entry;
+};
+
+struct jit_descriptor __jit_debug_descriptor = { 1, 0, NULL, NULL };
+
+#if _MSC_VER
+__declspec(noinline)
 #else
-	mprotect(code, size, PROT_READ | PROT_EXEC);
+__attribute__((noinline))
 #endif
-#if defined(__APPLE__) && defined(__MACH__)
-	sys_icache_invalidate(code, size);
+void
+__jit_debug_register_code(void)
+{
+#if !_MSC_VER
+	__asm__ volatile ("");
 #endif
-	return code;
 }
 
+// A registered object file, together with the code it describes.
+typedef struct {
+	struct jit_code_entry entry;
+	void *code;
+} GdbEntry;
 
-// All instructions implicitly bump the instruction pointer by their length
-// after they are executed, unless stated otherwise.
-enum op {
-	// Take 4 bytes from the instruction stream, interpret them as little
-	// endian two's complement signed integer and push them on to the stack.
-	OP_CONSTANT,
+typedef struct DebugInfo {
+	int kinds;
+	const char *source;
+	Mutex lock;
+	FILE *perf_map;
+	FILE *jitdump;
+	void *jitdump_mapping;
+	u64 code_index;
+} DebugInfo;
 
-	// Pop `b` and `a` respectively from the stack, push `a + b` on to the
-	// stack.
-	OP_ADD,
+// Bytes of the files and objects we build.
+typedef struct {
+	u8 *bytes;
+	size_t len;
+	size_t cap;
+} Blob;
 
-	// Pop a value from top of the stack and print it.
-	OP_PRINT,
+static void
+blob_put(Blob *blob, const void *data, size_t len)
+{
+	if (blob->len + len > blob->cap) {
+		while (blob->len + len > blob->cap) {
+			blob->cap = blob->cap ? 2 * blob->cap : 256;
+		}
+		blob->bytes = realloc(blob->bytes, blob->cap);
+		assert(blob->bytes);
+	}
+	memcpy(blob->bytes + blob->len, data, len);
+	blob->len += len;
+}
 
-	// Take a value from the input stream and advance the input position.
-	OP_INPUT,
+// Little endian integers of `size` bytes.
+static void
+blob_int(Blob *blob, u64 value, int size)
+{
+	for (int i = 0; i < size; i++) {
+		u8 byte = (u8) (value >> (8 * i));
+		blob_put(blob, &byte, 1);
+	}
+}
 
-	// Pop a value from top of the stack and don't use it for anything.
-	OP_DISCARD,
+static void
+blob_uleb(Blob *blob, u64 value)
+{
+	do {
+		u8 byte = value & 0x7f;
+		value >>= 7;
+		byte |= value ? 0x80 : 0;
+		blob_put(blob, &byte, 1);
+	} while (value);
+}
 
-	// Take 4 bytes from the instruction stream, interpret them as little
-	// endian two's complement signed integer to be used as an offset
-	// relative to the top of the stack (i.e. offset 0 corresponds to the
-	// 32 bit value on top of the stack, offset 1 corresponds to the 32 bit
-	// value 1 below the top of the stack). Push the value found on that
-	// offset (relative to the top of the stack) on top of the stack.
-	OP_GET,
+static void
+blob_sleb(Blob *blob, i64 value)
+{
+	for (;;) {
+		u8 byte = value & 0x7f;
+		value >>= 7; // Arithmetic shift, as everywhere we care about.
+		if ((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40))) {
+			blob_put(blob, &byte, 1);
+			return;
+		}
+		byte |= 0x80;
+		blob_put(blob, &byte, 1);
+	}
+}
 
-	// Take 4 bytes from the instruction stream, interpret them as little
-	// endian two's complement signed integer to be used as an offset
-	// relative to the top of the stack (i.e. offset 0 corresponds to the
-	// 32 bit value on top of the stack, offset 1 corresponds to the 32 bit
-	// value 1 below the top of the stack). Pop a value from top of the
-	// stack. Assign the value to the slot at the offset (relative to the
-	// top of the stack).
-	OP_SET,
+static void
+blob_str(Blob *blob, const char *str)
+{
+	blob_put(blob, str, strlen(str) + 1);
+}
 
-	// Pop `b` and `a` respectively from top of the stack. Compare them and
-	// push a positive value to the top of the stack if `a` is bigger then
-	// `b`, negative value if `b` is bigger than `a` and 0 if `a` is equal
-	// to `b`.
-	OP_CMP,
+// Patch a 32 bit length at `at` to the bytes following it.
+static void
+blob_patch_len(Blob *blob, size_t at)
+{
+	u32 len = (u32) (blob->len - at - 4);
+	for (int i = 0; i < 4; i++) {
+		blob->bytes[at + i] = (u8) (len >> (8 * i));
+	}
+}
 
-	// Take 4 bytes from the instruction stream, interpret them as little
-	// endian two's complement signed integer to be used as an offset in the
-	// instruction stream. Pop a value from top of the stack. If the value
-	// is positive, then apply the offset (in bytes) to the current
-	// instruction pointer. Note that the offset is relative to the start
-	// of the `OP_JGT` instruction, i.e. the instruction pointer is only
-	// bumped by the length of the instruction in case the conditional
-	// jump isn't executed.
-	OP_JGT,
+static u64
+debug_timestamp(void)
+{
+#ifdef _WIN32
+	return 0;
+#else
+	// Perf records with the monotonic clock (`perf record -k mono`).
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000000 + (u64) ts.tv_nsec;
+#endif
+}
 
-	// Halt the execution of the program.
-	OP_HALT,
-};
+// The id of the calling thread, as perf knows it. Code is compiled on the
+// threads of the `CompilePool` too.
+static u64
+debug_thread_id(void)
+{
+#if defined(__linux__) && defined(SYS_gettid)
+	return (u64) syscall(SYS_gettid);
+#elif defined(_WIN32)
+	return 0;
+#else
+	return (u64) getpid();
+#endif
+}
 
-static void *
-compile(u8 *program, size_t program_len)
+// Start writing debug info of the `kinds` (`DEBUG_*`), with `source` as the
+// name of the bytecode file. Gives NULL if some file can't be created.
+static DebugInfo *
+debug_info_create(int kinds, const char *source)
 {
-	// Here is the promised local variable holding the `dasm_State *`
-	// itself. Though as defined with the macros above, we and other
-	// functions will generally use it with the name `ds` and expect a
-	// double pointer.
-	dasm_State *dasm_state;
-	dasm_State **ds = &dasm_state;
+	DebugInfo *debug = calloc(1, sizeof(*debug));
+	assert(debug);
+	debug->kinds = kinds;
+	debug->source = source;
+	mutex_init(&debug->lock);
+#ifdef _WIN32
+	if (kinds & (DEBUG_PERF_MAP | DEBUG_JITDUMP)) {
+		free(debug);
+		return NULL;
+	}
+#else
+	char path[64];
+	if (kinds & DEBUG_PERF_MAP) {
+		snprintf(path, sizeof(path), "/tmp/perf-%ld.map", (long) getpid());
+		debug->perf_map = fopen(path, "w");
+	}
+	if (kinds & DEBUG_JITDUMP) {
+		snprintf(path, sizeof(path), "/tmp/jit-%ld.dump", (long) getpid());
+		debug->jitdump = fopen(path, "w+b");
+	}
+	if (((kinds & DEBUG_PERF_MAP) && !debug->perf_map) || ((kinds & DEBUG_JITDUMP) && !debug->jitdump)) {
+		if (debug->perf_map) {
+			fclose(debug->perf_map);
+		}
+		if (debug->jitdump) {
+			fclose(debug->jitdump);
+		}
+		free(debug);
+		return NULL;
+	}
+	if (debug->jitdump) {
+		Blob header = {0};
+		blob_int(&header, 0x4A695444, 4); // "JiTD"
+		blob_int(&header, 1, 4);          // version
+		blob_int(&header, 40, 4);         // size of the header
+		blob_int(&header, 62, 4);         // EM_X86_64
+		blob_int(&header, 0, 4);
+		blob_int(&header, (u64) getpid(), 4);
+		blob_int(&header, debug_timestamp(), 8);
+		blob_int(&header, 0, 8);          // flags
+		fwrite(header.bytes, 1, header.len, debug->jitdump);
+		fflush(debug->jitdump);
+		free(header.bytes);
+		// The executable mapping is what perf records, and how it finds
+		// the file later, without it the file is of no use.
+		void *mapping = mmap(NULL, system_page_size(), PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(debug->jitdump), 0);
+		if (mapping == MAP_FAILED) {
+			if (debug->perf_map) {
+				fclose(debug->perf_map);
+			}
+			fclose(debug->jitdump);
+			free(debug);
+			return NULL;
+		}
+		debug->jitdump_mapping = mapping;
+	}
+#endif
+	return debug;
+}
 
-	// Each state has to be initialized with a call to `dasm_init`. As
-	// promised, we use the macro `Dst`, instead of referring to `ds`
-	// directly. This gives us more consistency with rest of the functions
-	// and calls and is flexible. In any case the name `Dst` is referred to
-	// by the `dasm_put` calls generated by the preprocessor. The second
-	// argument tells DynASM the number of sections we will be using. We
-	// only need 1, the section for all our code, but we also diligently used
-	// the `.section` directive above and told DynASM what names we wanted
-	// to give to our sections (we chose "code" for our single one) and thus
-	// now have available the macro DASM_MAXSECTION generated by the
-	// preprocessor.
-	dasm_init(Dst, DASM_MAXSECTION);
+// The ELF object for GDB: the code is in `.text` (without its bytes, GDB
+// reads them from memory), there is a symbol for it, and a compilation unit
+// with a line table in DWARF 2.
+static Blob
+debug_elf_object(DebugInfo *debug, const char *name, void *code, size_t size, const DebugLine *lines, size_t nlines)
+{
+	enum { SEC_NULL, SEC_TEXT, SEC_SYMTAB, SEC_STRTAB, SEC_INFO, SEC_ABBREV, SEC_LINE, SEC_SHSTRTAB, SEC__MAX };
+	static const char *const section_names[SEC__MAX] = {
+		"", ".text", ".symtab", ".strtab", ".debug_info", ".debug_abbrev", ".debug_line", ".shstrtab",
+	};
+	Blob sections[SEC__MAX] = {{0}};
+	u64 address = (u64) (uintptr_t) code;
 
-	// We are not using global labels and in a simple template JIT likely
-	// won't find the need, but we sill need to setup the globals, because
-	// local labels can only be used when global labels are setup. And local
-	// labels come handy pretty quickly (our snippets may need to contain
-	// loops for example).
-	void *our_dasm_labels[DASM_LBL__MAX];
-	dasm_setupglobal(Dst, our_dasm_labels, DASM_LBL__MAX);
+	// Symbols: the null one, the file (local) and the function.
+	Blob *strtab = &sections[SEC_STRTAB];
+	blob_str(strtab, "");
+	blob_str(strtab, debug->source);
+	blob_str(strtab, name);
+	Blob *symtab = &sections[SEC_SYMTAB];
+	blob_put(symtab, (u8 [24]) {0}, 24);
+	blob_int(symtab, 1, 4);                             // name
+	blob_int(symtab, 4, 1);                             // STT_FILE, STB_LOCAL
+	blob_int(symtab, 0, 1);
+	blob_int(symtab, 0xfff1, 2);                        // SHN_ABS
+	blob_int(symtab, 0, 8);
+	blob_int(symtab, 0, 8);
+	blob_int(symtab, 1 + strlen(debug->source) + 1, 4); // name
+	blob_int(symtab, 0x12, 1);                          // STT_FUNC, STB_GLOBAL
+	blob_int(symtab, 0, 1);
+	blob_int(symtab, SEC_TEXT, 2);
+	blob_int(symtab, 0, 8);                             // offset in .text
+	blob_int(symtab, size, 8);
 
-	// Now that we have our dynasm state initialized, we potentially want to
-	// reuse it to assemble multiple pastings of templates and not just one.
-	// Calling `dasm_init` and `dasm_free` everytime is an option, but we
-	// can just reuse the same state. We just have to initialize each
-	// "trace" with a call to `dasm_setup`, which we have to do even if we
-	// want to process a single "trace" like we are doing in this example.
-	// So here it is. We have to provide the byte array prepared by the
-	// preprocessor. There can only be one `.actions` directive per file,
-	// which means that all `dasm_put` calls in one file are based on that
-	// single actions array (called `our_dasm_actions` in this case), so we
-	// really don't want to pass anything other here. (One could
-	// probably have different files with different `.actions`, but
-	// "templates" from different files couldn't be mixed since DASM stores
-	// the current actions in its internal state and it can't be changed in
-	// any other way than `dasm_setup`, which resets the state.)
-	dasm_setup(Dst, our_dasm_actions);
+	// One compilation unit, the abbreviation 1 says which attributes it
+	// has and in what form.
+	Blob *abbrev = &sections[SEC_ABBREV];
+	blob_uleb(abbrev, 1);
+	blob_uleb(abbrev, 0x11);            // DW_TAG_compile_unit
+	blob_int(abbrev, 0, 1);             // DW_CHILDREN_no
+	blob_uleb(abbrev, 0x03);            // DW_AT_name
+	blob_uleb(abbrev, 0x08);            // DW_FORM_string
+	blob_uleb(abbrev, 0x11);            // DW_AT_low_pc
+	blob_uleb(abbrev, 0x01);            // DW_FORM_addr
+	blob_uleb(abbrev, 0x12);            // DW_AT_high_pc
+	blob_uleb(abbrev, 0x01);            // DW_FORM_addr
+	blob_uleb(abbrev, 0x10);            // DW_AT_stmt_list
+	blob_uleb(abbrev, 0x06);            // DW_FORM_data4
+	blob_int(abbrev, 0, 2);
+	blob_int(abbrev, 0, 1);
+	Blob *info = &sections[SEC_INFO];
+	blob_int(info, 0, 4);               // length, patched below
+	blob_int(info, 2, 2);               // version
+	blob_int(info, 0, 4);               // offset into .debug_abbrev
+	blob_int(info, 8, 1);               // address size
+	blob_uleb(info, 1);
+	blob_str(info, debug->source);
+	blob_int(info, address, 8);
+	blob_int(info, address + size, 8);
+	blob_int(info, 0, 4);               // offset into .debug_line
+	blob_patch_len(info, 0);
 
-	// We want to translate jumps from the bytecode to jumps in the assembly
-	// code and want dynasm to figure out the (relative) offsets as needed
-	// by the instructions. For example our `OP_JGT` instruction has an
-	// immediate operand which is the (byte) offset to apply in case a jump
-	// should be taken. The machine code encodes similarly a relative offset
-	// for a (conditional) jump, but it will be a different one than the one
-	// in the bytecode. Since there is a potentially arbitrary number of
-	// instructions in the bytecode we want to compile, we can't possibly
-	// use local labels (1:, ..., 9:), because there are only 9 of them and
-	// already want to be able to use them for local control flow (in one or
-	// possible more templates pasted together) such as conditional
-	// execution or loops. Global labels are also not suitable, because
-	// these have symbolic names and we would have a hard time encoding
-	// things like "instruction 5 needs to jump 8 bytes back, which is a
-	// beginning of another instruction".
-	//
-	// DynASM has us covered and offers "pc labels", also called "dynamic
-	// labels", which are just positive integers (internally used as
-	// indices). These labels are dynamic, because the integers are
-	// determined at the time of `dasm_put`, i.e. they can be arbitrary C
-	// expressions that can evaluate to different values at different times
-	// the snippet is pasted (also called "encoding-time constants"). So
-	// again same shape (snippet), but with different values. We will be
-	// using these labels in a really straightforward way - we'll want to
-	// have a dynamic label for each instruction. When we encounter a jump
-	// instruction, we can just point the jump to the dynamic label of the
-	// destination. This works fine for backward as well as forward jumps,
-	// as with all labels, DynASM is able to resolve relative offsets,
-	// because it does multiple passes on the code. This is even simpler
-	// than our compiler, which had to "fixup" forward jumps!
-	//
-	// Because the dynamic labels are indices to a DynASM internal array, we
-	// need to "preallocate" the ones we'll need, and if we ever need more,
-	// we'll have to allocate more. This is done with call to `dasm_growpc`.
-	// After call to `dasm_growpc(Dst, N)`, dynamic labels 0 through at
-	// least N - 1 will be available to us.
-	//
-	// Our bytecode is a compact serialization - instructions have different
-	// lengths and jumps are based on byte offsets. We will go for a simple
-	// route and instead of somehow numbering the instructions from 0 to
-	// the number of instructions (and then figuring out the forward jump
-	// destinations in a second pass), we'll just have a dynamic label for
-	// each _byte_. Then even for forward jumps we are able to calculate
-	// their byte offset in the instruction stream, where we will be put an
-	// appropriate dynamic label later, and DynASM will resolve it in its
-	// second pass. Having a label for each _byte_ is potentially
-	// really wasteful as a lot of instructions have lengthy immediates, but
-	// it's really simple. (The dynamic labels and the backing array are
-	// also reused for multiple runs, if we don't `dasm_free` immediately,
-	// but just `dasm_setup` before each run).
-	dasm_growpc(Dst, program_len);
+	// The line table is a program for a state machine, which produces
+	// rows (address, line). We advance both and emit a row for each line.
+	static const u8 opcode_lengths[12] = { 0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1 };
+	Blob *line = &sections[SEC_LINE];
+	blob_int(line, 0, 4);               // length, patched below
+	blob_int(line, 2, 2);               // version
+	blob_int(line, 0, 4);               // header length, patched below
+	blob_int(line, 1, 1);               // minimum instruction length
+	blob_int(line, 1, 1);               // default is_stmt
+	blob_int(line, (u8) -5, 1);         // line base
+	blob_int(line, 14, 1);              // line range
+	blob_int(line, 13, 1);              // opcode base
+	blob_put(line, opcode_lengths, sizeof(opcode_lengths));
+	blob_int(line, 0, 1);               // no include directories
+	blob_str(line, debug->source);
+	blob_uleb(line, 0);                 // directory
+	blob_uleb(line, 0);                 // modification time
+	blob_uleb(line, 0);                 // length
+	blob_int(line, 0, 1);               // no more files
+	blob_patch_len(line, 6);
+	blob_int(line, 0, 1);               // DW_LNE_set_address
+	blob_uleb(line, 9);
+	blob_int(line, 2, 1);
+	blob_int(line, address, 8);
+	u64 row_address = address;
+	i64 row_line = 1;
+	for (size_t i = 0; i < nlines; i++) {
+		u64 at = (u64) (uintptr_t) lines[i].address;
+		i64 to = (i64) lines[i].offset + 1;
+		blob_int(line, 2, 1);           // DW_LNS_advance_pc
+		blob_uleb(line, at - row_address);
+		blob_int(line, 3, 1);           // DW_LNS_advance_line
+		blob_sleb(line, to - row_line);
+		blob_int(line, 1, 1);           // DW_LNS_copy
+		row_address = at;
+		row_line = to;
+	}
+	blob_int(line, 2, 1);               // DW_LNS_advance_pc
+	blob_uleb(line, address + size - row_address);
+	blob_int(line, 0, 1);               // DW_LNE_end_sequence
+	blob_uleb(line, 1);
+	blob_int(line, 1, 1);
+	blob_patch_len(line, 0);
 
-	// Now we have a fully initialized DynASM state for this round of
-	// pasting together some assembly snippets. Remember that the lines with
-	// assembly preceded with `//|` will be translated to calls to
-	// `dasm_put(...)`.  So indeed what we are just doing is by controlling
-	// the C execution we determine which assembly snippets we want to paste
-	// together. With DynASM we can form arbitrary pieces of code, but we
-	// somehow need to execute the code. We of course know how to execute
-	// some other code in assembly - jump to it or call it. Both essentially
-	// do a similar thing - through a relative offset or absolute address
-	// stored in a register they change the instruction pointer (and call
-	// additionally pushes to the stack the previous instruction pointer
-	// which pointed to the _next_ instruction, so after we return from the
-	// call, we can just resume the execution).
+	Blob *shstrtab = &sections[SEC_SHSTRTAB];
+	u32 name_offsets[SEC__MAX];
+	for (int i = 0; i < SEC__MAX; i++) {
+		name_offsets[i] = (u32) shstrtab->len;
+		blob_str(shstrtab, section_names[i]);
+	}
 
-	// But we want to also somehow jump to our code from C. Unlike the
-	// popular belief, the semantics of "goto statements" in C are not such
-	// low level as a jumps in assembly, so we'll have to do with function
-	// calls. All functions in C respect something that is called the ABI
-	// of the platform, the "Application Binary Interface". The set of rules
-	// for low level code, so that e.g. functions compiled with one compiler
-	// can call functions compiled with another compiler. The ABI is usually
-	// specific to both the current processor architecture (e.g. x86-64),
-	// because the instruction set is really constraining us in what our
-	// "binaries" may look like, as well as the operating system (e.g.
-	// Linux), because not only we somehow need to communicate with the
-	// operating system, but they historically evolved differently and e.g.
-	// have different needs, so the ABI differs. Importantly for us, the ABI
-	// defines sizes of C integer types (e.g. `long` is 64-bit on x86-64
-	// Linux, but 32-bit on x86-64 Windows) as well as how parameters and
-	// return values are passed. For simplicity we will care only about
-	// the System V x86-64 ABI, used notably by Linux and other operating
-	// systems.
-	//
-	//     https://gitlab.com/x86-psABIs/x86-64-ABI
-	//     https://gitlab.com/x86-psABIs/x86-64-ABI/-/jobs/artifacts/master/raw/x86-64-ABI/abi.pdf?job=build
-	//
-	// Notably, Windows has a custom x86-64 ABI:
-	//
-	//     https://learn.microsoft.com/en-us/cpp/build/x64-calling-convention?view=msvc-170
-	//
-	// See also a blog post by Eli Bendersky:
+	// The ELF header, the contents of the sections and the section headers.
+	Blob elf = {0};
+	blob_put(&elf, "\x7f" "ELF", 4);
+	blob_int(&elf, 2, 1);               // 64 bit
+	blob_int(&elf, 1, 1);               // little endian
+	blob_int(&elf, 1, 1);               // version
+	blob_put(&elf, (u8 [9]) {0}, 9);
+	blob_int(&elf, 1, 2);               // ET_REL
+	blob_int(&elf, 62, 2);              // EM_X86_64
+	blob_int(&elf, 1, 4);               // version
+	blob_int(&elf, 0, 8);               // entry
+	blob_int(&elf, 0, 8);               // program headers
+	blob_int(&elf, 0, 8);               // section headers, patched below
+	blob_int(&elf, 0, 4);               // flags
+	blob_int(&elf, 64, 2);              // size of this header
+	blob_int(&elf, 0, 2);
+	blob_int(&elf, 0, 2);
+	blob_int(&elf, 64, 2);              // size of a section header
+	blob_int(&elf, SEC__MAX, 2);
+	blob_int(&elf, SEC_SHSTRTAB, 2);
+	u64 offsets[SEC__MAX];
+	for (int i = 0; i < SEC__MAX; i++) {
+		while (elf.len % 8) {
+			blob_int(&elf, 0, 1);
+		}
+		offsets[i] = elf.len;
+		blob_put(&elf, sections[i].bytes, sections[i].len);
+	}
+	while (elf.len % 8) {
+		blob_int(&elf, 0, 1);
+	}
+	u64 shoff = elf.len;
+	for (int i = 0; i < 8; i++) {
+		elf.bytes[40 + i] = (u8) (shoff >> (8 * i));
+	}
+	for (int i = 0; i < SEC__MAX; i++) {
+		u32 type = i == SEC_NULL ? 0 : i == SEC_TEXT ? 8 : i == SEC_SYMTAB ? 2 : i == SEC_STRTAB || i == SEC_SHSTRTAB ? 3 : 1;
+		blob_int(&elf, name_offsets[i], 4);
+		blob_int(&elf, type, 4);
+		blob_int(&elf, i == SEC_TEXT ? 6 : 0, 8);                 // SHF_ALLOC | SHF_EXECINSTR
+		blob_int(&elf, i == SEC_TEXT ? address : 0, 8);
+		blob_int(&elf, i == SEC_NULL ? 0 : offsets[i], 8);
+		blob_int(&elf, i == SEC_TEXT ? size : sections[i].len, 8);
+		blob_int(&elf, i == SEC_SYMTAB ? SEC_STRTAB : 0, 4);      // link
+		blob_int(&elf, i == SEC_SYMTAB ? 2 : 0, 4);               // first global symbol
+		blob_int(&elf, i == SEC_TEXT ? 16 : 1, 8);                // alignment
+		blob_int(&elf, i == SEC_SYMTAB ? 24 : 0, 8);              // entry size
+		free(sections[i].bytes);
+	}
+	return elf;
+}
+
+static int
+debug_line_compare(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t) ((const DebugLine *) a)->address;
+	uintptr_t y = (uintptr_t) ((const DebugLine *) b)->address;
+	return x < y ? -1 : x > y;
+}
+
+// Tell the profilers and debuggers about the function `name` of `size` bytes
+// at `code`, with the bytecode offsets of the code at the `lines` (in any
+// order, they are sorted here).
+static void
+debug_info_register(DebugInfo *debug, const char *name, void *code, size_t size, DebugLine *lines, size_t nlines)
+{
+	if (nlines > 0) {
+		qsort(lines, nlines, sizeof(lines[0]), debug_line_compare);
+	}
+	mutex_lock(&debug->lock);
+	if (debug->perf_map) {
+		fprintf(debug->perf_map, "%llx %zx %s\n", (unsigned long long) (uintptr_t) code, size, name);
+		fflush(debug->perf_map);
+	}
+	if (debug->jitdump) {
+		// The line table has to come before the code it describes.
+		Blob record = {0};
+		u64 timestamp = debug_timestamp();
+		if (nlines > 0) {
+			blob_int(&record, 2, 4);    // JIT_CODE_DEBUG_INFO
+			blob_int(&record, 0, 4);    // size, patched below
+			blob_int(&record, timestamp, 8);
+			blob_int(&record, (u64) (uintptr_t) code, 8);
+			blob_int(&record, nlines, 8);
+			for (size_t i = 0; i < nlines; i++) {
+				blob_int(&record, (u64) (uintptr_t) lines[i].address, 8);
+				blob_int(&record, (u64) lines[i].offset + 1, 4);
+				blob_int(&record, 0, 4);
+				blob_str(&record, debug->source);
+			}
+			for (int i = 0; i < 4; i++) {
+				record.bytes[4 + i] = (u8) (record.len >> (8 * i));
+			}
+		}
+		size_t load = record.len;
+		blob_int(&record, 0, 4);            // JIT_CODE_LOAD
+		blob_int(&record, 0, 4);            // size, patched below
+		blob_int(&record, timestamp, 8);
+#ifdef _WIN32
+		blob_int(&record, 0, 8);
+#else
+		blob_int(&record, (u64) getpid(), 4);
+		blob_int(&record, debug_thread_id(), 4);
+#endif
+		blob_int(&record, (u64) (uintptr_t) code, 8);
+		blob_int(&record, (u64) (uintptr_t) code, 8);
+		blob_int(&record, size, 8);
+		blob_int(&record, debug->code_index++, 8);
+		blob_str(&record, name);
+		blob_put(&record, code, size);
+		for (int i = 0; i < 4; i++) {
+			record.bytes[load + 4 + i] = (u8) ((record.len - load) >> (8 * i));
+		}
+		fwrite(record.bytes, 1, record.len, debug->jitdump);
+		fflush(debug->jitdump);
+		free(record.bytes);
+	}
+	if (debug->kinds & DEBUG_GDB) {
+		Blob elf = debug_elf_object(debug, name, code, size, lines, nlines);
+		GdbEntry *entry = calloc(1, sizeof(*entry));
+		assert(entry);
+		entry->code = code;
+		entry->entry.symfile_addr = (const char *) elf.bytes;
+		entry->entry.symfile_size = elf.len;
+		entry->entry.next_entry = __jit_debug_descriptor.first_entry;
+		if (entry->entry.next_entry) {
+			entry->entry.next_entry->prev_entry = &entry->entry;
+		}
+		__jit_debug_descriptor.first_entry = &entry->entry;
+		__jit_debug_descriptor.relevant_entry = &entry->entry;
+		__jit_debug_descriptor.action_flag = 1;
+		__jit_debug_register_code();
+	}
+	mutex_unlock(&debug->lock);
+}
+
+// Forget about the function at `code`, which is about to be freed. Only GDB
+// needs to be told.
+static void
+debug_info_unregister(DebugInfo *debug, void *code)
+{
+	if (!(debug->kinds & DEBUG_GDB)) {
+		return;
+	}
+	mutex_lock(&debug->lock);
+	for (struct jit_code_entry *e = __jit_debug_descriptor.first_entry; e; e = e->next_entry) {
+		GdbEntry *entry = (GdbEntry *) e;
+		if (entry->code != code) {
+			continue;
+		}
+		if (e->prev_entry) {
+			e->prev_entry->next_entry = e->next_entry;
+		} else {
+			__jit_debug_descriptor.first_entry = e->next_entry;
+		}
+		if (e->next_entry) {
+			e->next_entry->prev_entry = e->prev_entry;
+		}
+		__jit_debug_descriptor.relevant_entry = e;
+		__jit_debug_descriptor.action_flag = 2;
+		__jit_debug_register_code();
+		free((void *) e->symfile_addr);
+		free(entry);
+		break;
+	}
+	mutex_unlock(&debug->lock);
+}
+
+// Close the files. The code should be freed by now.
+static void
+debug_info_destroy(DebugInfo *debug)
+{
+#ifndef _WIN32
+	if (debug->jitdump_mapping) {
+		munmap(debug->jitdump_mapping, system_page_size());
+	}
+#endif
+	if (debug->jitdump) {
+		fclose(debug->jitdump);
+	}
+	if (debug->perf_map) {
+		fclose(debug->perf_map);
+	}
+	mutex_destroy(&debug->lock);
+	free(debug);
+}
+
+static void
+code_protect(CodeCache *cache, u8 *start, size_t len, int executable)
+{
+	if (cache->dual) {
+		return;
+	}
+#ifdef _WIN32
+	DWORD original;
+	BOOL ok = VirtualProtect(start, len, executable ? PAGE_EXECUTE_READ : PAGE_READWRITE, &original);
+	assert(ok);
+	(void) ok;
+#else
+	int ret = mprotect(start, len, executable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE);
+	assert(ret == 0);
+	(void) ret;
+#endif
+#if defined(__APPLE__) && defined(__MACH__)
+	if (executable) {
+		sys_icache_invalidate(start, len);
+	}
+#endif
+}
+
+#ifndef _WIN32
+// Map `size` bytes of anonymous memory aligned to `CODE_REGION_ALIGN`. We map
+// more than we need, to be able to trim the start and the end to get an
+// aligned region. With `PROT_NONE` this only reserves the address space, to be
+// mapped over later. The pages which need `MAP_JIT` have to be mapped like
+// this right away: Macs refuse `MAP_JIT` together with `MAP_FIXED`, so it
+// can't be mapped over a reservation.
+static u8 *
+map_aligned(size_t size, int prot, int flags)
+{
+	size_t over = size + CODE_REGION_ALIGN;
+	u8 *raw = mmap(0, over, prot, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	if (raw == MAP_FAILED) {
+		return NULL;
+	}
+	u8 *base = (u8 *) (((uintptr_t) raw + CODE_REGION_ALIGN - 1) & ~(uintptr_t) (CODE_REGION_ALIGN - 1));
+	if (base > raw) {
+		munmap(raw, (size_t) (base - raw));
+	}
+	if (raw + over > base + size) {
+		munmap(base + size, (size_t) (raw + over - (base + size)));
+	}
+#ifdef MADV_HUGEPAGE
+	if (prot != PROT_NONE) {
+		madvise(base, size, MADV_HUGEPAGE);
+	}
+#endif
+	return base;
+}
+
+#ifdef CODE_DUAL_MAP
+// Map `size` bytes of the memory file `fd` at the reserved `base`.
+static int
+map_at(u8 *base, size_t size, int prot, int fd)
+{
+	if (mmap(base, size, prot, MAP_FIXED | MAP_SHARED, fd, 0) == MAP_FAILED) {
+		return 0;
+	}
+#ifdef MADV_HUGEPAGE
+	madvise(base, size, MADV_HUGEPAGE);
+#endif
+	return 1;
+}
+#endif
+#endif
+
+// Reserve a new region of at least `size` bytes.
+static CodeRegion *
+code_region_new(CodeCache *cache, size_t size)
+{
+	size = (size + CODE_REGION_ALIGN - 1) & ~(CODE_REGION_ALIGN - 1);
+	u8 *base = NULL;
+	u8 *rw = NULL;
+#ifdef _WIN32
+	base = rw = VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!base) {
+		return NULL;
+	}
+#else
+	if (!cache->dual) {
+		base = rw = map_aligned(size, PROT_READ | PROT_WRITE, MAP_JIT_VALUE);
+		if (!base) {
+			return NULL;
+		}
+	}
+#ifdef CODE_DUAL_MAP
+	else {
+		base = map_aligned(size, PROT_NONE, 0);
+		if (!base) {
+			return NULL;
+		}
+		int fd = memfd_create("jit-code", MFD_CLOEXEC);
+		rw = map_aligned(size, PROT_NONE, 0);
+		int ok = fd >= 0 && rw && ftruncate(fd, (off_t) size) == 0
+			&& map_at(rw, size, PROT_READ | PROT_WRITE, fd)
+			&& map_at(base, size, PROT_READ | PROT_EXEC, fd);
+		// The mappings keep the memory file alive.
+		if (fd >= 0) {
+			close(fd);
+		}
+		if (!ok) {
+			munmap(base, size);
+			if (rw) {
+				munmap(rw, size);
+			}
+			return NULL;
+		}
+	}
+#endif
+#endif
+	size_t npages = size / cache->page_size;
+	CodeRegion *region = calloc(1, sizeof(*region) + npages * sizeof(region->pages[0]));
+	assert(region);
+	region->base = base;
+	region->rw = rw;
+	region->npages = npages;
+	region->open_lo = npages;
+	region->next = cache->regions;
+	cache->regions = region;
+	cache->reserved += size;
+	return region;
+}
+
+// Create a code cache, dual mapped if `dual` is nonzero and the platform
+// supports it (check `cache->dual` for the mode actually used).
+static CodeCache *
+code_cache_create(int dual)
+{
+	CodeCache *cache = calloc(1, sizeof(*cache));
+	assert(cache);
+	cache->page_size = system_page_size();
+	mutex_init(&cache->lock);
+#ifdef CODE_DUAL_MAP
+	cache->dual = dual;
+#else
+	(void) dual;
+#endif
+	return cache;
+}
+
+static void
+code_cache_destroy(CodeCache *cache)
+{
+	CodeRegion *region = cache->regions;
+	while (region) {
+		CodeRegion *next = region->next;
+#ifdef _WIN32
+		VirtualFree(region->base, 0, MEM_RELEASE);
+#else
+		munmap(region->base, region->npages * cache->page_size);
+		if (region->rw != region->base) {
+			munmap(region->rw, region->npages * cache->page_size);
+		}
+#endif
+		free(region);
+		region = next;
+	}
+	free(cache->recycled);
+	mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+static void
+code_page_open(CodeRegion *region, size_t page, u8 cls)
+{
+	region->pages[page].state = PAGE_OPEN;
+	region->pages[page].cls = cls;
+	region->pages[page].live = 0;
+	region->pages[page].next_slot = 0;
+	if (page < region->open_lo) {
+		region->open_lo = page;
+	}
+	if (page + 1 > region->open_hi) {
+		region->open_hi = page + 1;
+	}
+}
+
+// Take a run of `n` contiguous pages out of the pool of recycled pages, if
+// there is one. Below `fresh` exactly the recycled pages are `PAGE_FRESH`, so
+// runs are found by going from the recycled pages which start one.
+static int
+code_recycled_run(CodeCache *cache, size_t n, CodeRegion **regionp, size_t *pagep)
+{
+	for (size_t i = cache->nrecycled; i-- > 0;) {
+		CodeRegion *region = cache->recycled[i].region;
+		size_t page = cache->recycled[i].page;
+		if ((page > 0 && region->pages[page - 1].state == PAGE_FRESH) || page + n > region->fresh) {
+			continue;
+		}
+		size_t len = 1;
+		while (len < n && region->pages[page + len].state == PAGE_FRESH) {
+			len++;
+		}
+		if (len < n) {
+			continue;
+		}
+		for (size_t j = 0; j < cache->nrecycled;) {
+			if (cache->recycled[j].region == region && cache->recycled[j].page - page < n) {
+				cache->recycled[j] = cache->recycled[--cache->nrecycled];
+			} else {
+				j++;
+			}
+		}
+		*regionp = region;
+		*pagep = page;
+		return 1;
+	}
+	return 0;
+}
+
+// Get `n` contiguous writable pages. They may come from the pool of recycled
+// pages, otherwise they are taken from the never used part of some region,
+// and if there is none that is big enough, from a new region.
+static u8 *
+code_pages_alloc(CodeCache *cache, size_t n, u8 cls, CodeRegion **regionp, size_t *pagep)
+{
+	CodeRegion *region = NULL;
+	size_t page = 0;
+	if (n == 1 && cache->nrecycled > 0) {
+		cache->nrecycled--;
+		region = cache->recycled[cache->nrecycled].region;
+		page = cache->recycled[cache->nrecycled].page;
+	}
+	if (region || code_recycled_run(cache, n, &region, &page)) {
+		int readonly = 0;
+		for (size_t i = 0; i < n; i++) {
+			readonly |= region->pages[page + i].readonly;
+			region->pages[page + i].readonly = 0;
+		}
+		if (readonly) {
+			code_protect(cache, region->base + page * cache->page_size, n * cache->page_size, 0);
+		}
+	} else {
+		for (region = cache->regions; region; region = region->next) {
+			if (region->npages - region->fresh >= n) {
+				break;
+			}
+		}
+		if (!region) {
+			size_t size = n * cache->page_size;
+			region = code_region_new(cache, size > CODE_REGION_SIZE ? size : CODE_REGION_SIZE);
+			if (!region) {
+				return NULL;
+			}
+		}
+		page = region->fresh;
+		region->fresh += n;
+	}
+	for (size_t i = 0; i < n; i++) {
+		code_page_open(region, page + i, cls);
+	}
+	region->pages[page].live = cls == CODE_CLASSES ? (u32) n : 0;
+	*regionp = region;
+	*pagep = page;
+	return region->base + page * cache->page_size;
+}
+
+// Like `code_alloc`, but the code always gets a run of whole pages to itself.
+static void *
+code_alloc_pages(CodeCache *cache, size_t size)
+{
+	size_t n = (size + cache->page_size - 1) / cache->page_size;
+	CodeRegion *region;
+	size_t page;
+	void *code = code_pages_alloc(cache, n ? n : 1, CODE_CLASSES, &region, &page);
+	if (code) {
+		cache->allocated += (n ? n : 1) * cache->page_size;
+	}
+	return code;
+}
+
+// Allocate writable memory for `size` bytes of code. It can be executed only
+// after a call to `code_cache_seal`. The caller holds `cache->lock`.
+static void *
+code_alloc(CodeCache *cache, size_t size)
+{
+	int cls = 0;
+	while (cls < CODE_CLASSES && ((size_t) 1 << (cls + CODE_MIN_CLASS_SHIFT)) < size) {
+		cls++;
+	}
+	size_t slot_size = (size_t) 1 << (cls + CODE_MIN_CLASS_SHIFT);
+	if (cls == CODE_CLASSES || slot_size > cache->page_size) {
+		return code_alloc_pages(cache, size);
+	}
+
+	// Small functions go to the current slab of their size class, if it
+	// has room, otherwise we open a new one.
+	CodeRegion *region = cache->slabs[cls].region;
+	size_t page = cache->slabs[cls].page;
+	if (!cache->slabs[cls].valid || (region->pages[page].next_slot + 1) * slot_size > cache->page_size) {
+		if (!code_pages_alloc(cache, 1, (u8) cls, &region, &page)) {
+			return NULL;
+		}
+		cache->slabs[cls].region = region;
+		cache->slabs[cls].page = page;
+		cache->slabs[cls].valid = 1;
+	}
+	CodePage *info = &region->pages[page];
+	u8 *code = region->base + page * cache->page_size + info->next_slot * slot_size;
+	info->next_slot++;
+	info->live++;
+	cache->allocated += slot_size;
+	return code;
+}
+
+// Make all the code allocated since the last call executable.
+static void
+code_cache_seal(CodeCache *cache)
+{
+	mutex_lock(&cache->lock);
+	for (CodeRegion *region = cache->regions; region; region = region->next) {
+		if (region->open_lo >= region->open_hi) {
+			continue;
+		}
+		for (size_t page = region->open_lo; page < region->open_hi; page++) {
+			if (region->pages[page].state == PAGE_OPEN) {
+				region->pages[page].state = PAGE_SEALED;
+			}
+			region->pages[page].readonly = 1;
+		}
+		code_protect(cache, region->base + region->open_lo * cache->page_size, (region->open_hi - region->open_lo) * cache->page_size, 1);
+		cache->seals += !cache->dual;
+		region->open_lo = region->npages;
+		region->open_hi = 0;
+	}
+	for (int cls = 0; cls < CODE_CLASSES; cls++) {
+		cache->slabs[cls].valid = 0;
+	}
+	mutex_unlock(&cache->lock);
+}
+
+static void
+code_page_recycle(CodeCache *cache, CodeRegion *region, size_t page)
+{
+	if (cache->nrecycled == cache->recycled_cap) {
+		cache->recycled_cap = cache->recycled_cap ? 2 * cache->recycled_cap : 16;
+		cache->recycled = realloc(cache->recycled, cache->recycled_cap * sizeof(cache->recycled[0]));
+		assert(cache->recycled);
+	}
+	// Sealed pages will be made writable once they are reused.
+	cache->recycled[cache->nrecycled].region = region;
+	cache->recycled[cache->nrecycled].page = page;
+	region->pages[page].state = PAGE_FRESH;
+	cache->nrecycled++;
+}
+
+static CodeRegion *
+code_region_of(CodeCache *cache, void *code)
+{
+	CodeRegion *region = cache->regions;
+	while (region && ((u8 *) code < region->base || (u8 *) code >= region->base + region->npages * cache->page_size)) {
+		region = region->next;
+	}
+	assert(region && "code not from this cache");
+	return region;
+}
+
+// The address through which code allocated by `code_alloc` is to be written.
+static void *
+code_writable(CodeCache *cache, void *code)
+{
+	if (!cache->dual) {
+		return code;
+	}
+	CodeRegion *region = code_region_of(cache, code);
+	return region->rw + ((u8 *) code - region->base);
+}
+
+static void
+code_release(CodeCache *cache, void *code)
+{
+	CodeRegion *region = code_region_of(cache, code);
+	size_t page = (size_t) ((u8 *) code - region->base) / cache->page_size;
+	CodePage *info = &region->pages[page];
+	if (info->cls == CODE_CLASSES) {
+		size_t n = info->live;
+		for (size_t i = 0; i < n; i++) {
+			code_page_recycle(cache, region, page + i);
+		}
+		cache->allocated -= n * cache->page_size;
+		return;
+	}
+	cache->allocated -= (size_t) 1 << (info->cls + CODE_MIN_CLASS_SHIFT);
+	if (--info->live > 0) {
+		return;
+	}
+	if (info->state == PAGE_OPEN) {
+		// Nobody could have run code from an open page yet, so it can
+		// be filled again from the start.
+		info->next_slot = 0;
+	} else {
+		code_page_recycle(cache, region, page);
+	}
+}
+
+// Overwrite `len` bytes of code at `at`, which may already be sealed (and
+// running, on other threads only as `call_link` allows).
+static void
+code_patch(CodeCache *cache, u8 *at, const void *bytes, size_t len)
+{
+	mutex_lock(&cache->lock);
+	u8 *page = (u8 *) ((uintptr_t) at & ~(uintptr_t) (cache->page_size - 1));
+	size_t span = (size_t) (at + len - page);
+	code_protect(cache, page, span, 0);
+	memcpy(code_writable(cache, at), bytes, len);
+	code_protect(cache, page, span, 1);
+	mutex_unlock(&cache->lock);
+}
+
+// Free code allocated by `code_alloc`.
+static void
+code_free(CodeCache *cache, void *code)
+{
+	if (cache->debug) {
+		debug_info_unregister(cache->debug, code);
+	}
+	mutex_lock(&cache->lock);
+	code_release(cache, code);
+	mutex_unlock(&cache->lock);
+}
+
+// Current time in seconds, for benchmarks.
+static double
+now(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Apart from the checks and the code cache the below function is mostly a copy
+// of the one from Peter Cawley's DynASM tutorial, we just do more checking with
+// asserts and try to support Macs.
+//
+// What the function does, is that it receives a dynasm state, with some
+// snippets already put into it with `dasm_put` which is essentially a first
+// pass over the code, where we are just pasting together snippets and DynASM is
+// interpolating them with the evaluations of the used expressions. `dasm_link`
+// is the second pass we need to do on the pending code. The call to the
+// function essentially tells dynasm that here our assembly pasting ends. It
+// will do a pass over the code determining the relative offsets of labels, etc.
+// and most importantly it will already figure out the final length of the
+// code and return it to use through an output parameter. We use that size to
+// allocate enough writable memory from the code cache and tell DynASM to
+// encode the code there. This will not only allow us to later mark that memory
+// executable and have the code in an executable area, but also allows DynASM to
+// know the final destination of the code, so it can finalize relative offsets
+// to e.g. global labels, which (in general) are not in the pending piece of
+// code. The allocation and encoding happen under the lock of the code cache,
+// the link step, like all the `dasm_put` calls before it, only touches our
+// own DynASM state, so any number of threads can be there at once, each with
+// its own state. Making the code executable (and non-writable) is left to the caller,
+// who calls `code_cache_seal` once for any number of compiled functions.
+// Finally we return a pointer (`void *`) to the start of the buffer. This
+// leaves our function generic and we don't have to limit our linking and
+// encoding to a single function signature -- the caller can cast in any way
+// they like. If the caller is interested in the size of the code, they can pass
+// a non-NULL `sizep`. Similarly, with a non-NULL `times` the seconds spent
+// linking and encoding are added to `times[0]` and `times[1]`.
+//
+// If the code cache is dual mapped, DynASM encodes the code through the
+// writable view, so it sees a different address than the one the code will
+// run at. Relative offsets are not affected, but the addresses of global
+// labels are, so we move them over to the executable view. (Absolute
+// addresses of labels embedded directly in the code, or relative offsets to
+// absolute addresses outside of the code would be wrong, we don't use these.)
+static void *
+our_dasm_link_and_encode(Dst_DECL, CodeCache *cache, void **globals, int nglobals, size_t *sizep, double *times)
+{
+	size_t size;
+	void* code;
+	double start = times ? now() : 0;
+	int status = dasm_checkstep(Dst, 0);
+	assert(status == DASM_S_OK);
+	status = dasm_link(Dst, &size);
+	assert(status == DASM_S_OK);
+	double linked = times ? now() : 0;
+	mutex_lock(&cache->lock);
+	code = code_alloc(cache, size);
+	assert(code);
+	u8 *writable = code_writable(cache, code);
+	status = dasm_encode(Dst, writable);
+	mutex_unlock(&cache->lock);
+	assert(status == DASM_S_OK);
+	if (times) {
+		times[0] += linked - start;
+		times[1] += now() - linked;
+	}
+	(void) status;
+	for (int i = 0; i < nglobals; i++) {
+		u8 *label = globals[i];
+		if (label >= writable && label <= writable + size) {
+			globals[i] = (u8 *) code + (label - writable);
+		}
+	}
+	if (sizep) {
+		*sizep = size;
+	}
+	return code;
+}
+
+
+// All instructions implicitly bump the instruction pointer by their length
+// after they are executed, unless stated otherwise.
+enum op {
+	// Take 4 bytes from the instruction stream, interpret them as little
+	// endian two's complement signed integer and push them on to the stack.
+	OP_CONSTANT,
+
+	// Pop `b` and `a` respectively from the stack, push `a + b` on to the
+	// stack.
+	OP_ADD,
+
+	// Pop a value from top of the stack and print it.
+	OP_PRINT,
+
+	// Take a value from the input stream and advance the input position.
+	OP_INPUT,
+
+	// Pop a value from top of the stack and don't use it for anything.
+	OP_DISCARD,
+
+	// Take 4 bytes from the instruction stream, interpret them as little
+	// endian two's complement signed integer to be used as an offset
+	// relative to the top of the stack (i.e. offset 0 corresponds to the
+	// 32 bit value on top of the stack, offset 1 corresponds to the 32 bit
+	// value 1 below the top of the stack). Push the value found on that
+	// offset (relative to the top of the stack) on top of the stack.
+	OP_GET,
+
+	// Take 4 bytes from the instruction stream, interpret them as little
+	// endian two's complement signed integer to be used as an offset
+	// relative to the top of the stack (i.e. offset 0 corresponds to the
+	// 32 bit value on top of the stack, offset 1 corresponds to the 32 bit
+	// value 1 below the top of the stack). Pop a value from top of the
+	// stack. Assign the value to the slot at the offset (relative to the
+	// top of the stack).
+	OP_SET,
+
+	// Pop `b` and `a` respectively from top of the stack. Compare them and
+	// push a positive value to the top of the stack if `a` is bigger then
+	// `b`, negative value if `b` is bigger than `a` and 0 if `a` is equal
+	// to `b`.
+	OP_CMP,
+
+	// Take 4 bytes from the instruction stream, interpret them as little
+	// endian two's complement signed integer to be used as an offset in the
+	// instruction stream. Pop a value from top of the stack. If the value
+	// is positive, then apply the offset (in bytes) to the current
+	// instruction pointer. Note that the offset is relative to the start
+	// of the `OP_JGT` instruction, i.e. the instruction pointer is only
+	// bumped by the length of the instruction in case the conditional
+	// jump isn't executed.
+	OP_JGT,
+
+	// Halt the execution of the program.
+	OP_HALT,
+
+	// Take 4 bytes from the instruction stream, interpret them as little
+	// endian two's complement signed integer to be used as an offset in the
+	// instruction stream, relative to the start of the `OP_CALL`
+	// instruction. Remember the instruction following this one on the
+	// return stack and continue at the offset, the entry of a function.
+	// The return stack is separate from the operand stack, which the
+	// function shares with its caller. The calls can nest at most
+	// `CALL_DEPTH_MAX` deep, a call deeper than that halts the program.
+	OP_CALL,
+
+	// Continue with the instruction remembered by the last `OP_CALL`, and
+	// forget it. Without any, halt the execution of the program.
+	OP_RET,
+};
+
+#define CALL_DEPTH_MAX 4096
+
+// Length of each instruction in bytes (opcode plus immediate operand). Any
+// pass that walks over the bytecode needs this, the instructions are of
+// different lengths and can only be decoded from the start.
+static size_t
+op_length(enum op op)
+{
+	switch (op) {
+	case OP_CONSTANT:
+	case OP_GET:
+	case OP_SET:
+	case OP_JGT:
+	case OP_CALL:
+		return 5;
+	default:
+		return 1;
+	}
+}
+
+// Read the 4 byte immediate operand of the instruction at `instrptr`, i.e.
+// from a position one byte behind it (which skips the opcode).
+static i32
+read_operand(const u8 *instrptr)
+{
+	return (i32) (
+		((u32)instrptr[1] << 0) |
+		((u32)instrptr[2] << 8) |
+		((u32)instrptr[3] << 16) |
+		((u32)instrptr[4] << 24));
+}
+
+// Whether the instruction ends a block, i.e. the next one may run after
+// something else than this one (or not at all). Calls end blocks too, the
+// function may read input before it returns, see `find_input_checks`.
+static int
+op_ends_block(enum op op)
+{
+	return op == OP_JGT || op == OP_HALT || op == OP_CALL || op == OP_RET;
+}
+
+// Whether there is any `OP_CALL` (or `OP_RET`) in the program, which is then
+// compiled as units, see `Module`.
+static int
+program_has_calls(const u8 *program, size_t program_len)
+{
+	for (const u8 *instrptr = program; instrptr < program + program_len; instrptr += op_length(*instrptr)) {
+		if (*instrptr == OP_CALL || *instrptr == OP_RET) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Options which influence the code we generate. Passing `NULL` instead of a
+// pointer to this struct to `compile` gives the defaults.
+typedef struct {
+	// The number of slots on top of the operand stack that may be kept in
+	// registers, see `TosCache` below. Zero gives the plain push/pop code.
+	int tos_regs;
+
+	// The number of slots deeper in the stack that may be pinned to
+	// registers, see `find_pinned_slots` below.
+	int pin_slots;
+
+	// Whether to compile common instruction sequences as one, see
+	// `find_fusions` below.
+	int peephole;
+
+	// Whether to compile the program as a loop over a batch of inputs, see
+	// `Batch` below.
+	int batch;
+
+	// Whether to run batches 4 records at a time in vector registers,
+	// if the processor can and the program allows it, see `compile_lanes`.
+	int simd;
+
+	// Whether to run them 8 records at a time in 32-bit lanes instead, if
+	// all values of the program are known to fit, see `Range`. The values
+	// of the input are below `1 << input_bits`, if that's not zero.
+	int narrow;
+	int input_bits;
+
+	// Whether to compile with the optimizing tier, see `compile_optimized`.
+	// Batches are left to the template compiler.
+	int optimize;
+
+	// Whether to count the runs of each block (1), and also the cycles
+	// spent in them (2), see `BlockProfile`. Only the template compiler
+	// instruments the code, and not for batches. The interpreter counts
+	// the runs as well.
+	int instrument;
+} CompileOptions;
+
+static const CompileOptions default_compile_options = {
+	.tos_regs = 4,
+	.pin_slots = 4,
+	.peephole = 1,
+	.simd = 1,
+	.narrow = 1,
+};
+
+// Translating each instruction on its own into pushes and pops of the machine
+// stack is simple, but the code is dominated by memory traffic: `OP_ADD`
+// becomes `pop rcx; pop rax; add rax, rcx; push rax` even if the operands
+// were pushed just by the previous instruction. The register cache keeps track
+// of the operand stack at compile time ("virtual stack") and lets the top few
+// slots live in registers instead of memory. Values are pushed to the machine
+// stack ("spilled") only when the cache is full, and all of them are spilled
+// when we reach a point where the state of the cache can't be known statically
+// -- a label which can be jumped to, a jump, or a call to a C function, which
+// could clobber the (caller saved) registers.
+//
+// The virtual stack looks like this, with the top `cached` slots in `regs`
+// (deepest first) and the rest in memory at `rsp`:
+//
+//         slot k (from the top)   k < cached:  register regs[cached - 1 - k]
+//                                 k >= cached: [rsp + 8 * (k - cached)]
+//
+// We only ever use caller saved registers for the cache. `rax` is left out, so
+// that snippets can use it as scratch.
+//
+// Slots deeper in the stack, which `OP_GET` and `OP_SET` keep coming back to
+// (like the counters of loops), may also be "pinned" to callee saved registers
+// for the whole function, see `find_pinned_slots`. A pinned slot still has its
+// place in memory, so that the offsets of the other slots don't change, but
+// when it's not cached, its value is in its register instead.
+static const int tos_pool[] = {
+	1,  // rcx
+	2,  // rdx
+	6,  // rsi
+	7,  // rdi
+	8,  // r8
+	9,  // r9
+	10, // r10
+	11, // r11
+};
+#define TOS_POOL_SIZE ((int) (sizeof(tos_pool) / sizeof(tos_pool[0])))
+
+// An instruction takes at most two registers out of the pool for its operands
+// besides the cached ones, so this many registers can be cached at most.
+#define TOS_REGS_MAX (TOS_POOL_SIZE - 2)
+
+typedef struct {
+	int limit;                // Maximum number of cached slots.
+	int cached;               // Number of slots currently in registers.
+	int regs[TOS_POOL_SIZE];  // Their registers, from the deepest one.
+	unsigned busy;            // Registers used by the current instruction.
+	const int *pins;          // Registers of pinned slots (from the bottom), or NULL.
+	int depth;                // Depth of the operand stack, kept with `pins`.
+} TosCache;
+
+// The register slot `i` (from the bottom of the stack) is pinned to, or -1.
+static int
+tos_pin(TosCache *tc, int i)
+{
+	return tc->pins && i >= 0 ? tc->pins[i] : -1;
+}
+
+// Get a register for a new value: one that holds neither a cached slot, nor an
+// operand of the instruction we are currently compiling.
+static int
+tos_alloc(TosCache *tc)
+{
+	unsigned used = tc->busy;
+	for (int i = 0; i < tc->cached; i++) {
+		used |= 1u << tc->regs[i];
+	}
+	for (int i = 0; i < TOS_POOL_SIZE; i++) {
+		if (!(used & (1u << tos_pool[i]))) {
+			tc->busy |= 1u << tos_pool[i];
+			return tos_pool[i];
+		}
+	}
+	assert(0 && "register cache ran out of registers");
+	return -1;
+}
+
+// Move the deepest cached slot to the machine stack. It is directly above the
+// slots which are already in memory, so a plain `push` does it. A pinned slot
+// goes to its register as well.
+static void
+tos_spill_one(Dst_DECL, TosCache *tc)
+{
+	int pin = tos_pin(tc, tc->depth - tc->cached);
+	if (pin >= 0 && pin != tc->regs[0]) {
+		//| mov Rq(pin), Rq(tc->regs[0])
+	}
+	//| push Rq(tc->regs[0])
+	tc->cached--;
+	for (int i = 0; i < tc->cached; i++) {
+		tc->regs[i] = tc->regs[i + 1];
+	}
+}
+
+// Bring the operand stack into its canonical form: everything in memory.
+static void
+tos_flush(Dst_DECL, TosCache *tc)
+{
+	while (tc->cached > 0) {
+		tos_spill_one(Dst, tc);
+	}
+}
+
+// Push the value in register `r` on top of the virtual stack.
+static void
+tos_push(Dst_DECL, TosCache *tc, int r)
+{
+	if (tc->limit == 0) {
+		int pin = tos_pin(tc, tc->depth);
+		if (pin >= 0 && pin != r) {
+			//| mov Rq(pin), Rq(r)
+		}
+		//| push Rq(r)
+		tc->depth++;
+		return;
+	}
+	if (tc->cached == tc->limit) {
+		tos_spill_one(Dst, tc);
+	}
+	tc->regs[tc->cached++] = r;
+	tc->depth++;
+}
+
+// Pop the top of the virtual stack and return the register holding it.
+static int
+tos_pop(Dst_DECL, TosCache *tc)
+{
+	tc->depth--;
+	if (tc->cached > 0) {
+		int r = tc->regs[--tc->cached];
+		tc->busy |= 1u << r;
+		return r;
+	}
+	int pin = tos_pin(tc, tc->depth);
+	if (pin >= 0) {
+		//| add rsp, 8
+		tc->busy |= 1u << pin;
+		return pin;
+	}
+	int r = tos_alloc(tc);
+	//| pop Rq(r)
+	return r;
+}
+
+// Where slot `k` (counted from the top of the stack) lives. Returns its
+// register, or -1 and stores its index in memory (relative to `rsp`).
+static int
+tos_slot(TosCache *tc, int k, int *mem)
+{
+	if (k < tc->cached) {
+		*mem = -1;
+		return tc->regs[tc->cached - 1 - k];
+	}
+	int pin = tos_pin(tc, tc->depth - 1 - k);
+	if (pin >= 0) {
+		*mem = -1;
+		return pin;
+	}
+	*mem = k - tc->cached;
+	return -1;
+}
+
+// Mark the operands of the just compiled instruction as free again.
+static void
+tos_done(TosCache *tc)
+{
+	tc->busy = 0;
+}
+
+// Find where the compiled code checks the bounds of the input, see `Input`.
+// Blocks start at the entry, at each jump target and after each jump (or
+// halt, call and return, see `op_ends_block`). The array has the number of values read in the block at its start,
+// and zero everywhere else.
+static u32 *
+find_input_checks(u8 *program, size_t program_len, u8 *targets)
+{
+	u32 *checks = calloc(program_len ? program_len : 1, sizeof(checks[0]));
+	assert(checks);
+	size_t block = 0;
+	for (u8 *instrptr = program; instrptr < program + program_len; instrptr += op_length(*instrptr)) {
+		size_t offset = (size_t) (instrptr - program);
+		if (targets[offset]) {
+			block = offset;
+		}
+		if (*instrptr == OP_INPUT) {
+			checks[block]++;
+		} else if (op_ends_block(*instrptr)) {
+			block = offset + op_length(*instrptr);
+		}
+	}
+	return checks;
+}
+
+// Find where the blocks (as in `find_input_checks`) start, in a calloced
+// array with a nonzero entry at each start, and their number in `*nblocks`.
+// Blocks are numbered in order by instrumented code, see `BlockProfile`.
+static u8 *
+find_blocks(u8 *program, size_t program_len, u8 *targets, size_t *nblocks)
+{
+	u8 *blocks = calloc(program_len ? program_len : 1, 1);
+	assert(blocks);
+	*nblocks = 0;
+	int block = 1;
+	for (u8 *instrptr = program; instrptr < program + program_len; instrptr += op_length(*instrptr)) {
+		size_t offset = (size_t) (instrptr - program);
+		if (block || targets[offset]) {
+			blocks[offset] = 1;
+			(*nblocks)++;
+		}
+		block = op_ends_block(*instrptr);
+	}
+	return blocks;
+}
+
+// Find the instructions of the unit of a program with calls which starts at
+// `start` (see `Module`), in a calloced array with a nonzero entry at each.
+// These are the instructions reachable from the start by jumps and by falling
+// through, also over calls (after the function returns), but not into them.
+static u8 *
+find_unit(u8 *program, size_t program_len, size_t start)
+{
+	u8 *unit = calloc(program_len ? program_len : 1, 1);
+	size_t *work = malloc((program_len + 1) * sizeof(work[0]));
+	assert(unit && work);
+	size_t nwork = 0;
+	work[nwork++] = start;
+	while (nwork > 0) {
+		size_t offset = work[--nwork];
+		while (offset < program_len && !unit[offset]) {
+			u8 *instrptr = program + offset;
+			unit[offset] = 1;
+			if (*instrptr == OP_JGT && offset + 5 <= program_len) {
+				ptrdiff_t target = (ptrdiff_t) offset + read_operand(instrptr);
+				if (target >= 0 && (size_t) target < program_len && !unit[target]) {
+					work[nwork++] = (size_t) target;
+				}
+			}
+			if (*instrptr == OP_HALT || *instrptr == OP_RET) {
+				break;
+			}
+			offset += op_length(*instrptr);
+		}
+	}
+	free(work);
+	return unit;
+}
+
+// Find all instructions that are targets of jumps. Before each of these, the
+// register cache needs to be flushed, since we can arrive there from multiple
+// places. We return a calloced array with a nonzero entry for each target:
+// `TARGET_LOOP` is set for the heads of loops (targets of backward jumps),
+// `TARGET_JUMP` for the rest, and for the entries of functions (targets of
+// calls). Jumps outside of the program are ignored here, they would be caught
+// by DynASM as undefined labels anyway.
+#define TARGET_JUMP 1
+#define TARGET_LOOP 2
+
+static u8 *
+find_jump_targets(u8 *program, size_t program_len)
+{
+	u8 *targets = calloc(program_len ? program_len : 1, 1);
+	assert(targets);
+	for (u8 *instrptr = program; instrptr < program + program_len; instrptr += op_length(*instrptr)) {
+		if (*instrptr == OP_JGT && instrptr + 5 <= program + program_len) {
+			ptrdiff_t target = (instrptr - program) + read_operand(instrptr);
+			if (target >= 0 && (size_t) target < program_len) {
+				targets[target] |= target <= instrptr - program ? TARGET_LOOP : TARGET_JUMP;
+			}
+		} else if (*instrptr == OP_CALL && instrptr + 5 <= program + program_len) {
+			ptrdiff_t target = (instrptr - program) + read_operand(instrptr);
+			if (target >= 0 && (size_t) target < program_len) {
+				targets[target] |= TARGET_JUMP;
+			}
+		}
+	}
+	return targets;
+}
+
+// The dynamic labels of the jump targets, see `compile_template`. They are
+// numbered densely in the order of the program, label `i` is at the offset
+// `offsets[i]`.
+typedef struct {
+	u32 *offsets;
+	size_t count;
+} JumpLabels;
+
+static JumpLabels
+find_jump_labels(const u8 *targets, size_t program_len)
+{
+	JumpLabels labels = {0};
+	for (size_t i = 0; i < program_len; i++) {
+		labels.count += targets[i] != 0;
+	}
+	labels.offsets = malloc((labels.count ? labels.count : 1) * sizeof(labels.offsets[0]));
+	assert(labels.offsets);
+	size_t n = 0;
+	for (size_t i = 0; i < program_len; i++) {
+		if (targets[i]) {
+			labels.offsets[n++] = (u32) i;
+		}
+	}
+	return labels;
+}
+
+// The label of the jump target at `offset`, found by binary search, or -1 if
+// there is no target there.
+static int
+find_jump_label(const JumpLabels *labels, ptrdiff_t offset)
+{
+	size_t lo = 0, hi = labels->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if ((ptrdiff_t) labels->offsets[mid] < offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < labels->count && (ptrdiff_t) labels->offsets[lo] == offset ? (int) lo : -1;
+}
+
+// The label of the jump target at `offset`, which has to exist.
+static int
+jump_label(const JumpLabels *labels, size_t offset)
+{
+	int label = find_jump_label(labels, (ptrdiff_t) offset);
+	assert(label >= 0 && "jump outside of the program");
+	return label;
+}
+
+// The depth of the operand stack before each instruction, if it's the same
+// whichever way we get there, in a malloced array, together with the largest
+// depth in `*max_depth`. We only get to an instruction from the previous one,
+// or by a jump, so one pass is enough: backward jumps have to agree with what
+// we already know, forward jumps tell the depth at their target. Programs
+// where the depth isn't static, which run past their end, jump into the middle
+// of an instruction or have unreachable code give `NULL`.
+static int *
+find_stack_depths(u8 *program, size_t program_len, int *max_depth)
+{
+	size_t alloc_len = program_len ? program_len : 1;
+	int *depths = malloc(alloc_len * sizeof(depths[0]));
+	u8 *boundary = calloc(alloc_len, 1);
+	assert(depths && boundary);
+	for (size_t i = 0; i < program_len; i++) {
+		depths[i] = -1;
+	}
+	*max_depth = 0;
+	int ok = 1;
+	int depth = 0;
+	for (u8 *instrptr = program; ok && instrptr < program + program_len; instrptr += op_length(*instrptr)) {
+		size_t offset = (size_t) (instrptr - program);
+		boundary[offset] = 1;
+		if (depth < 0) {
+			depth = depths[offset];
+		} else if (depths[offset] >= 0 && depths[offset] != depth) {
+			ok = 0;
+			break;
+		}
+		if (depth < 0 || instrptr + op_length(*instrptr) > program + program_len) {
+			// Unreachable (or cut) code.
+			ok = 0;
+			break;
+		}
+		depths[offset] = depth;
+		switch (*instrptr) {
+		case OP_CONSTANT: depth += 1; break;
+		case OP_INPUT: depth += 1; break;
+		case OP_ADD: ok = depth >= 2; depth -= 1; break;
+		case OP_CMP: ok = depth >= 2; depth -= 1; break;
+		case OP_PRINT: ok = depth >= 1; depth -= 1; break;
+		case OP_DISCARD: ok = depth >= 1; depth -= 1; break;
+		case OP_GET: {
+			i32 k = read_operand(instrptr);
+			ok = k >= 0 && k < depth;
+			depth += 1;
+			break;
+		}
+		case OP_SET: {
+			i32 k = read_operand(instrptr);
+			ok = k >= 0 && k < depth - 1;
+			depth -= 1;
+			break;
+		}
+		case OP_JGT: {
+			ok = depth >= 1;
+			depth -= 1;
+			ptrdiff_t target = (ptrdiff_t) offset + read_operand(instrptr);
+			if (target < 0 || (size_t) target >= program_len) {
+				ok = 0;
+			} else if ((size_t) target <= offset) {
+				ok = ok && boundary[target] && depths[target] == depth;
+			} else if (depths[target] >= 0 && depths[target] != depth) {
+				ok = 0;
+			} else {
+				depths[target] = depth;
+			}
+			break;
+		}
+		case OP_HALT: depth = -1; break;
+		default: ok = 0; break;
+		}
+		if (depth > *max_depth) {
+			*max_depth = depth;
+		}
+	}
+	// Running past the end, and forward jumps into the middle of an
+	// instruction.
+	ok = ok && depth < 0;
+	for (size_t i = 0; ok && i < program_len; i++) {
+		ok = boundary[i] || depths[i] < 0;
+	}
+	free(boundary);
+	if (!ok) {
+		free(depths);
+		return NULL;
+	}
+	return depths;
+}
+
+// The compilers trust the program: an `OP_GET` or `OP_SET` reads and writes
+// wherever its operand points on the machine stack, a pop of an empty operand
+// stack takes whatever is below it (like our return address), and a jump
+// needs a label at its target. Checking any of that as the code runs would
+// cost in the hottest loops, so instead `verify_program` proves, before
+// anything is compiled, that none of it can happen, or rejects the program.
+// What it finds on the way is kept as `ProgramInfo`, for the compiler not to
+// find it again.
+//
+// In one pass over the program it checks that each opcode is known, that the
+// last instruction isn't cut off (so `read_operand` never reads past the
+// end), and that jumps and calls go to the start of an instruction (forward
+// ones are checked once the pass is past them). The depth of the operand
+// stack is then proven at every instruction: statically if it is static (see
+// `find_stack_depths`), otherwise as the smallest it can be whichever way the
+// instruction is reached. That only gets smaller as more ways are found, but
+// never below the pops checked against it, so it settles. Every pop, and
+// every slot accessed, has to be within that depth, and no instruction may
+// fall through past the end, where the compiled code has nothing (so the
+// program can't be empty either). Functions share the operand stack of their
+// callers, so for each of them we find how many values it needs and how deep
+// it leaves the stack, and check the calls against that, see
+// `verify_depths`.
+typedef struct {
+	// The jump targets, see `find_jump_targets`.
+	u8 *targets;
+	// The depth of the operand stack before each instruction and the
+	// largest one, if it's static, see `find_stack_depths`, else `NULL`.
+	int *depths;
+	int max_depth;
+} ProgramInfo;
+
+static const char *op_name(enum op op);
+
+static void
+program_info_free(ProgramInfo *info)
+{
+	free(info->targets);
+	free(info->depths);
+	free(info);
+}
+
+// What running a function does to the operand stack, relative to its depth
+// when it's called: it needs `need` values there, and if it `returns`, leaves
+// the stack at least `delta` deeper (shallower, if negative).
+typedef struct {
+	i64 need;
+	int returns;
+	i64 delta;
+} StackEffect;
+
+// The smallest depth before each instruction reached from an entry, relative
+// to the depth there, how often it got smaller, and a worklist (first in,
+// first out) of the instructions whose depth got smaller. `visited` are the
+// instructions to forget before the next entry.
+typedef struct {
+	i64 *mins;
+	u32 *lowered;
+	u8 *reached;
+	u8 *queued;
+	size_t *work;
+	size_t *visited;
+	size_t nvisited;
+} DepthWork;
+
+// Find the `effect` of running the program from `entry`, with the `effects`
+// of the functions it calls (by `function_at` their entry) as far as we know
+// them. The main unit (`main_unit`) starts on an empty stack, so there an instruction
+// needing more values than there may be is an error, and `OP_RET` halts.
+// A loop that keeps shrinking the stack lowers the depth of its instructions
+// more often than there are instructions (`ninstrs`) in the program, which is
+// an error too. Returns 0 with the reason in `error` for errors.
+static int
+stack_effect(u8 *program, size_t program_len, size_t entry, int main_unit, size_t ninstrs, const u32 *function_at,
+	const StackEffect *effects, DepthWork *dw, StackEffect *effect, char *error, size_t error_len)
+{
+	*effect = (StackEffect) {0};
+	int ok = 1;
+	size_t first = 0, nwork = 0;
+	dw->nvisited = 0;
+	if (entry < program_len) {
+		dw->mins[entry] = 0;
+		dw->lowered[entry] = 0;
+		dw->reached[entry] = dw->queued[entry] = 1;
+		dw->visited[dw->nvisited++] = entry;
+		dw->work[nwork++] = entry;
+	}
+	while (ok && nwork > 0) {
+		size_t offset = dw->work[first];
+		first = (first + 1) % program_len;
+		nwork--;
+		dw->queued[offset] = 0;
+		u8 *instrptr = program + offset;
+		i64 depth = dw->mins[offset];
+		i64 need = 0;
+		i64 next = depth;
+		int falls = 1;
+		switch (*instrptr) {
+		case OP_CONSTANT: next = depth + 1; break;
+		case OP_INPUT: next = depth + 1; break;
+		case OP_ADD: need = 2; next = depth - 1; break;
+		case OP_CMP: need = 2; next = depth - 1; break;
+		case OP_PRINT: need = 1; next = depth - 1; break;
+		case OP_DISCARD: need = 1; next = depth - 1; break;
+		case OP_GET: need = (i64) read_operand(instrptr) + 1; next = depth + 1; break;
+		case OP_SET: need = (i64) read_operand(instrptr) + 2; next = depth - 1; break;
+		case OP_JGT: need = 1; next = depth - 1; break;
+		case OP_HALT: falls = 0; break;
+		case OP_CALL: {
+			const StackEffect *callee = &effects[function_at[offset + (size_t) (ptrdiff_t) read_operand(instrptr)]];
+			need = callee->need;
+			falls = callee->returns;
+			next = depth + callee->delta;
+			break;
+		}
+		case OP_RET:
+			falls = 0;
+			if (!main_unit && (!effect->returns || depth < effect->delta)) {
+				effect->returns = 1;
+				effect->delta = depth;
+			}
+			break;
+		}
+		if (need - depth > effect->need) {
+			if (main_unit) {
+				snprintf(error, error_len, "%s at %zu needs %lld values on the stack, there may be %lld",
+					op_name(*instrptr), offset, need, depth);
+				ok = 0;
+				break;
+			}
+			effect->need = need - depth;
+		}
+		size_t succ[2];
+		size_t nsucc = 0;
+		if (falls) {
+			succ[nsucc++] = offset + op_length(*instrptr);
+		}
+		if (*instrptr == OP_JGT) {
+			succ[nsucc++] = (size_t) ((ptrdiff_t) offset + read_operand(instrptr));
+		}
+		for (size_t i = 0; ok && i < nsucc; i++) {
+			// Only the interpreter would halt running past the end, the
+			// compiled code has nothing there. Jumps are checked already,
+			// this is falling through the last instruction.
+			size_t s = succ[i];
+			if (s >= program_len) {
+				snprintf(error, error_len, "%s at %zu runs past the end", op_name(*instrptr), offset);
+				ok = 0;
+				break;
+			}
+			if (dw->reached[s] && next >= dw->mins[s]) {
+				continue;
+			}
+			if (!dw->reached[s]) {
+				dw->reached[s] = 1;
+				dw->lowered[s] = 0;
+				dw->visited[dw->nvisited++] = s;
+			} else if (++dw->lowered[s] > ninstrs) {
+				snprintf(error, error_len, "the stack may shrink without bound at %zu", s);
+				ok = 0;
+			}
+			dw->mins[s] = next;
+			if (!dw->queued[s]) {
+				dw->queued[s] = 1;
+				dw->work[(first + nwork++) % program_len] = s;
+			}
+		}
+	}
+	for (size_t i = 0; i < dw->nvisited; i++) {
+		dw->reached[dw->visited[i]] = dw->queued[dw->visited[i]] = 0;
+	}
+	return ok;
+}
+
+// Prove that the operand stack is deep enough for every instruction of the
+// program, with the effects of the functions it calls, see `StackEffect`. We
+// start with all functions needing nothing and not returning, and go through
+// them again with what we found until nothing changes. That only ever adds
+// to what they need and lowers how deep they leave the stack, so a recursion
+// which doesn't settle after a few rounds keeps shrinking the stack, which is
+// an error.
+static int
+verify_depths(u8 *program, size_t program_len, char *error, size_t error_len)
+{
+	size_t alloc_len = program_len ? program_len : 1;
+	u32 *function_at = malloc(alloc_len * sizeof(function_at[0]));
+	size_t *functions = malloc(alloc_len * sizeof(functions[0]));
+	assert(function_at && functions);
+	size_t nfunctions = 0, ninstrs = 0;
+	for (size_t i = 0; i < program_len; i++) {
+		function_at[i] = (u32) -1;
+	}
+	for (u8 *instrptr = program; instrptr < program + program_len; instrptr += op_length(*instrptr)) {
+		ninstrs++;
+		if (*instrptr != OP_CALL) {
+			continue;
+		}
+		size_t target = (size_t) (instrptr - program) + (size_t) (ptrdiff_t) read_operand(instrptr);
+		if (function_at[target] == (u32) -1) {
+			function_at[target] = (u32) nfunctions;
+			functions[nfunctions++] = target;
+		}
+	}
+	StackEffect *effects = calloc(nfunctions + 1, sizeof(effects[0]));
+	DepthWork dw = {
+		.mins = malloc(alloc_len * sizeof(dw.mins[0])),
+		.lowered = malloc(alloc_len * sizeof(dw.lowered[0])),
+		.reached = calloc(alloc_len, 1),
+		.queued = calloc(alloc_len, 1),
+		.work = malloc(alloc_len * sizeof(dw.work[0])),
+		.visited = malloc(alloc_len * sizeof(dw.visited[0])),
+	};
+	assert(effects && dw.mins && dw.lowered && dw.reached && dw.queued && dw.work && dw.visited);
+	int ok = 1;
+	for (size_t round = 0, changed = 1; ok && changed; round++) {
+		if (round > 2 * nfunctions + 2) {
+			snprintf(error, error_len, "the calls may shrink the stack without bound");
+			ok = 0;
+			break;
+		}
+		changed = 0;
+		for (size_t f = 0; ok && f < nfunctions; f++) {
+			StackEffect effect;
+			ok = stack_effect(program, program_len, functions[f], 0, ninstrs, function_at, effects, &dw, &effect, error, error_len);
+			if (effect.need != effects[f].need || effect.returns != effects[f].returns || effect.delta != effects[f].delta) {
+				effects[f] = effect;
+				changed = 1;
+			}
+		}
+	}
+	StackEffect effect;
+	ok = ok && stack_effect(program, program_len, 0, 1, ninstrs, function_at, effects, &dw, &effect, error, error_len);
+	free(dw.visited);
+	free(dw.work);
+	free(dw.queued);
+	free(dw.reached);
+	free(dw.lowered);
+	free(dw.mins);
+	free(effects);
+	free(functions);
+	free(function_at);
+	return ok;
+}
+
+// Returns `NULL` with the reason in `error` if the program isn't valid.
+static ProgramInfo *
+verify_program(u8 *program, size_t program_len, char *error, size_t error_len)
+{
+	size_t alloc_len = program_len ? program_len : 1;
+	u8 *boundary = calloc(alloc_len, 1);
+	assert(boundary);
+	int ok = 1;
+	if (program_len == 0) {
+		snprintf(error, error_len, "the program is empty");
+		ok = 0;
+	}
+	u8 *instrptr = program;
+	for (; ok && instrptr < program + program_len; instrptr += op_length(*instrptr)) {
+		size_t offset = (size_t) (instrptr - program);
+		boundary[offset] = 1;
+		if (*instrptr > OP_RET) {
+			snprintf(error, error_len, "unknown opcode %d at %zu", *instrptr, offset);
+			ok = 0;
+		} else if (instrptr + op_length(*instrptr) > program + program_len) {
+			snprintf(error, error_len, "%s at %zu is cut off by the end", op_name(*instrptr), offset);
+			ok = 0;
+		} else if (*instrptr == OP_JGT || *instrptr == OP_CALL) {
+			ptrdiff_t target = (ptrdiff_t) offset + read_operand(instrptr);
+			if (target < 0 || (size_t) target >= program_len || ((size_t) target <= offset && !boundary[target])) {
+				snprintf(error, error_len, "%s at %zu goes to %td, not to an instruction", op_name(*instrptr), offset, target);
+				ok = 0;
+			}
+		} else if ((*instrptr == OP_GET || *instrptr == OP_SET) && read_operand(instrptr) < 0) {
+			snprintf(error, error_len, "%s at %zu of a negative slot", op_name(*instrptr), offset);
+			ok = 0;
+		}
+	}
+	for (instrptr = program; ok && instrptr < program + program_len; instrptr += op_length(*instrptr)) {
+		if (*instrptr != OP_JGT && *instrptr != OP_CALL) {
+			continue;
+		}
+		ptrdiff_t target = (instrptr - program) + read_operand(instrptr);
+		if (!boundary[target]) {
+			snprintf(error, error_len, "%s at %td goes to %td, not to an instruction", op_name(*instrptr), instrptr - program, target);
+			ok = 0;
+		}
+	}
+	free(boundary);
+	if (!ok) {
+		return NULL;
+	}
+
+	ProgramInfo *info = calloc(1, sizeof(*info));
+	assert(info);
+	info->targets = find_jump_targets(program, program_len);
+	info->depths = find_stack_depths(program, program_len, &info->max_depth);
+	if (!info->depths && !verify_depths(program, program_len, error, error_len)) {
+		program_info_free(info);
+		return NULL;
+	}
+	return info;
+}
+
+// The callee saved registers slots can be pinned to, see `TosCache`. `rbx` and
+// `rbp` are taken, which leaves these.
+static const int pin_pool[] = {
+	12, // r12
+	13, // r13
+	14, // r14
+	15, // r15
+};
+#define PIN_POOL_SIZE ((int) (sizeof(pin_pool) / sizeof(pin_pool[0])))
+
+// Choose up to `n` slots to pin to registers for the whole function. Slots
+// are numbered from the bottom of the stack, which needs the depth of the
+// stack to be static (`depths` from `find_stack_depths`). Each `OP_GET` and
+// `OP_SET` counts for the slot it accesses, eight times as much for each loop
+// it's in, and the slots which count the most get the registers. Returns
+// a malloced array with the register of each slot (-1 if it's not pinned)
+// and their number in `*npinned`, or `NULL` if nothing is worth pinning.
+static int *
+find_pinned_slots(u8 *program, size_t program_len, const int *depths, int max_depth, int n, int *npinned)
+{
+	*npinned = 0;
+	if (n > PIN_POOL_SIZE) {
+		n = PIN_POOL_SIZE;
+	}
+	if (!depths || n <= 0) {
+		return NULL;
+	}
+	// Loops are the ranges between backward jumps and their targets, the
+	// nesting level changes by one at each of their ends.
+	int *nesting = calloc(program_len + 1, sizeof(nesting[0]));
+	u64 *weights = calloc((size_t) max_depth + 1, sizeof(weights[0]));
+	assert(nesting && weights);
+	for (u8 *instrptr = program; instrptr < program + program_len; instrptr += op_length(*instrptr)) {
+		size_t offset = (size_t) (instrptr - program);
+		i32 rel = *instrptr == OP_JGT ? read_operand(instrptr) : 1;
+		if (rel <= 0) {
+			nesting[(ptrdiff_t) offset + rel]++;
+			nesting[offset + 5]--;
+		}
+	}
+	int level = 0;
+	for (u8 *instrptr = program; instrptr < program + program_len; instrptr += op_length(*instrptr)) {
+		size_t offset = (size_t) (instrptr - program);
+		level += nesting[offset];
+		u64 weight = (u64) 1 << (3 * (level < 10 ? level : 10));
+		if (*instrptr == OP_GET) {
+			weights[depths[offset] - 1 - read_operand(instrptr)] += weight;
+		} else if (*instrptr == OP_SET) {
+			weights[depths[offset] - 2 - read_operand(instrptr)] += weight;
+		}
+	}
+	free(nesting);
+
+	int *pins = malloc(((size_t) max_depth + 1) * sizeof(pins[0]));
+	assert(pins);
+	for (int i = 0; i <= max_depth; i++) {
+		pins[i] = -1;
+	}
+	for (; *npinned < n; (*npinned)++) {
+		int best = -1;
+		for (int i = 0; i < max_depth; i++) {
+			if (pins[i] < 0 && weights[i] > 0 && (best < 0 || weights[i] > weights[best])) {
+				best = i;
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+		pins[best] = pin_pool[*npinned];
+	}
+	free(weights);
+	if (*npinned == 0) {
+		free(pins);
+		return NULL;
+	}
+	return pins;
+}
+
+// Instruction sequences which the peephole pass recognizes. Compiling them
+// instruction by instruction, we would materialize intermediate values (most
+// notably the -1/0/1 result of `OP_CMP`) only to consume them right away.
+enum fusion {
+	FUSE_NONE,
+
+	// `OP_CMP; OP_JGT` becomes `cmp a, b; jg`.
+	FUSE_CMP_JGT,
+
+	// `OP_CONSTANT c; OP_CMP; OP_JGT` becomes `cmp a, c; jg`.
+	FUSE_CONSTANT_CMP_JGT,
+
+	// `OP_CONSTANT c; OP_ADD` becomes `add a, c`.
+	FUSE_CONSTANT_ADD,
+
+	// `OP_GET i; OP_GET j; OP_ADD` becomes a load and an add with a memory
+	// (or register) operand.
+	FUSE_GET_GET_ADD,
+};
+
+// Does the program contain these opcodes starting at `instrptr`? None but the
+// first instruction may be a jump target, otherwise we would have nowhere to
+// put the label.
+static int
+matches(u8 *program, size_t program_len, u8 *targets, u8 *instrptr, const enum op *ops, int n)
+{
+	u8 *end = program + program_len;
+	for (int i = 0; i < n; i++) {
+		if (instrptr >= end || *instrptr != ops[i] || instrptr + op_length(*instrptr) > end) {
+			return 0;
+		}
+		if (i > 0 && targets[instrptr - program]) {
+			return 0;
+		}
+		instrptr += op_length(*instrptr);
+	}
+	return 1;
+}
+
+// The peephole pass. Runs over the bytecode before we compile it and returns
+// a calloced array, where the entry for each offset which starts a fusable
+// sequence holds the kind of the sequence (`enum fusion`). The sequences don't
+// overlap, we just go left to right and take the longest match.
+static u8 *
+find_fusions(u8 *program, size_t program_len, u8 *targets)
+{
+	static const enum op constant_cmp_jgt[] = { OP_CONSTANT, OP_CMP, OP_JGT };
+	static const enum op cmp_jgt[] = { OP_CMP, OP_JGT };
+	static const enum op constant_add[] = { OP_CONSTANT, OP_ADD };
+	static const enum op get_get_add[] = { OP_GET, OP_GET, OP_ADD };
+	static const struct {
+		const enum op *ops;
+		int n;
+		enum fusion fusion;
+	} patterns[] = {
+		{ constant_cmp_jgt, 3, FUSE_CONSTANT_CMP_JGT },
+		{ get_get_add, 3, FUSE_GET_GET_ADD },
+		{ cmp_jgt, 2, FUSE_CMP_JGT },
+		{ constant_add, 2, FUSE_CONSTANT_ADD },
+	};
+
+	u8 *fusions = calloc(program_len ? program_len : 1, 1);
+	assert(fusions);
+	u8 *instrptr = program;
+	while (instrptr < program + program_len) {
+		size_t len = op_length(*instrptr);
+		for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+			if (matches(program, program_len, targets, instrptr, patterns[i].ops, patterns[i].n)) {
+				fusions[instrptr - program] = patterns[i].fusion;
+				len = 0;
+				for (int j = 0; j < patterns[i].n; j++) {
+					len += op_length(instrptr[len]);
+				}
+				break;
+			}
+		}
+		instrptr += len;
+	}
+	return fusions;
+}
+
+// Code compiled with the `instrument` option counts the runs of each block
+// (see `find_blocks`), in the profile that the `Output` points to, if any.
+// With `instrument` 2, it also measures the cycles of every
+// `BLOCK_SAMPLE_PERIOD`th run of each block, reading the time stamp counter
+// at its start (into `tsc`, remembering the block in `last`, a byte offset
+// into the profile) and at the start of whatever runs next. Reading it on
+// every run would slow the code down many times. The cycles of a block
+// include the C functions it calls. The counters are updated with plain adds,
+// so a profile shouldn't be shared by threads.
+#define BLOCK_SAMPLE_PERIOD 64
+
+typedef struct {
+	u64 runs;
+	u64 cycles;  // Of the sampled runs only.
+} BlockCounter;
+
+typedef struct {
+	u64 tsc;
+	u64 last;  // Zero if no run is being measured.
+	// What reading the counter twice takes, subtracted from each sample.
+	u64 overhead;
+	size_t nblocks;
+	BlockCounter blocks[];
+} BlockProfile;
+
+// What the programs print goes to an output buffer. Formatting each number
+// with `printf` would mean parsing the format string and locking `stdout`
+// for each of them, which for programs printing a lot would be most of their
+// run time. So `OP_PRINT` calls `output_int`, which just formats the number
+// (in decimal, followed by a newline) into the buffer. The buffer is written
+// out when it's full and when the program halts, in large writes: to the file
+// descriptor `fd`, or if `sink` is set, passed to it instead. As the output
+// doesn't go through `stdio`, it shouldn't be mixed with `printf`s to the same
+// file descriptor (without flushing `stdout` first). If a write fails, its
+// `errno` is kept in `error` and the rest of the output is dropped.
+//
+// Everything a run of the compiled code changes is in its `Input` and
+// `Output` (and on its stack), so with one of each per thread, the same code
+// can run in many threads at once, see `Executor`. There the numbers aren't
+// formatted at all: if `values` is set, the first `values_len` of them are
+// stored there and the rest dropped.
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t cap;
+	int fd;
+	int error;
+	void (*sink)(void *ctx, const char *data, size_t len);
+	void *ctx;
+	BlockProfile *profile;
+	i64 *values;
+	size_t values_len;
+} Output;
+
+#define OUTPUT_BUFFER_SIZE ((size_t) 64 << 10)
+
+// The longest number is "-9223372036854775808" plus the newline.
+#define OUTPUT_INT_MAX 21
+
+static void
+output_init(Output *out, int fd)
+{
+	*out = (Output) { .cap = OUTPUT_BUFFER_SIZE, .fd = fd };
+	out->buf = malloc(out->cap);
+	assert(out->buf);
+}
+
+static void
+output_flush(Output *out)
+{
+	if (out->sink) {
+		out->sink(out->ctx, out->buf, out->len);
+	} else {
+		for (size_t done = 0; !out->error && done < out->len;) {
+#ifdef _WIN32
+			int n = _write(out->fd, out->buf + done, (unsigned int) (out->len - done));
+#else
+			ssize_t n = write(out->fd, out->buf + done, out->len - done);
+#endif
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				out->error = n < 0 ? errno : EIO;
+				break;
+			}
+			done += (size_t) n;
+		}
+	}
+	out->len = 0;
+}
+
+// Flush and free the buffer.
+static void
+output_free(Output *out)
+{
+	output_flush(out);
+	free(out->buf);
+	out->buf = NULL;
+}
+
+static void
+output_int(Output *out, i64 value)
+{
+	// Digits are produced two at a time, from the end, which halves the
+	// number of (slow) divisions.
+	static const char pairs[201] =
+		"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+		"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+		"8081828384858687888990919293949596979899";
+	if (out->values) {
+		if (out->values_len > 0) {
+			*out->values++ = value;
+			out->values_len--;
+		}
+		return;
+	}
+	if (out->cap - out->len < OUTPUT_INT_MAX) {
+		output_flush(out);
+	}
+	char digits[OUTPUT_INT_MAX];
+	char *p = digits + sizeof(digits);
+	*--p = '\n';
+	u64 abs = value < 0 ? -(u64) value : (u64) value;
+	while (abs >= 100) {
+		unsigned int pair = (unsigned int) (abs % 100) * 2;
+		abs /= 100;
+		*--p = pairs[pair + 1];
+		*--p = pairs[pair];
+	}
+	if (abs >= 10) {
+		*--p = pairs[abs * 2 + 1];
+		*--p = pairs[abs * 2];
+	} else {
+		*--p = (char) ('0' + abs);
+	}
+	if (value < 0) {
+		*--p = '-';
+	}
+	size_t len = (size_t) (digits + sizeof(digits) - p);
+	memcpy(out->buf + out->len, p, len);
+	out->len += len;
+}
+
+// The input of the programs. Compiled code reads it through a cursor (kept in
+// rbx) and it can't check the bounds for each value it reads, that would
+// double the cost of `OP_INPUT`. Instead, at the start of each straight run of
+// code (a "block", see `find_input_checks`), it checks, with one comparison,
+// that there are enough values left for all the `OP_INPUT`s in the block. If
+// there aren't, `input_refill` gets called, which asks the `refill` callback
+// (if any) for more. That way the input can be a single span (e.g. of a
+// mapped file), or be streamed in batches. If not even the callback has
+// enough values, the program halts at the start of the block, before reading
+// any of them.
+typedef struct Input {
+	const i32 *next;
+	const i32 *end;
+	// Make at least `need` values available in `[next, end)`, keeping the
+	// remaining ones (they may be moved to a different buffer). Returns
+	// zero if there aren't enough values left.
+	int (*refill)(struct Input *in, size_t need);
+	void *ctx;
+} Input;
+
+// Called by the compiled code when fewer than `need` values are left after
+// `cursor`. Returns the new cursor, or NULL if the input has ended.
+static const i32 *
+input_refill(Input *in, const i32 *cursor, size_t need)
+{
+	in->next = cursor;
+	if (!in->refill || !in->refill(in, need) || (size_t) (in->end - in->next) < need) {
+		return NULL;
+	}
+	return in->next;
+}
+
+// Input streamed from a file (like the standard input) in batches, for the
+// `refill` callback of `Input`.
+typedef struct {
+	FILE *f;
+	i32 *buf;
+	size_t cap;
+} InputStream;
+
+#define INPUT_STREAM_BATCH ((size_t) 16 << 10)
+
+static int
+input_stream_refill(Input *in, size_t need)
+{
+	InputStream *stream = in->ctx;
+	size_t left = (size_t) (in->end - in->next);
+	size_t cap = need > INPUT_STREAM_BATCH ? need : INPUT_STREAM_BATCH;
+	if (cap > stream->cap) {
+		i32 *buf = malloc(cap * sizeof(buf[0]));
+		assert(buf);
+		memcpy(buf, in->next, left * sizeof(buf[0]));
+		free(stream->buf);
+		stream->buf = buf;
+		stream->cap = cap;
+	} else {
+		memmove(stream->buf, in->next, left * sizeof(stream->buf[0]));
+	}
+	left += fread(stream->buf + left, sizeof(stream->buf[0]), stream->cap - left, stream->f);
+	in->next = stream->buf;
+	in->end = stream->buf + left;
+	return left >= need;
+}
+
+// A large program doesn't have to be compiled whole before it starts running.
+// It's cut into chunks of about `chunk_len` bytes, which a background thread
+// compiles one after another (see `stream_create`), while the chunks already
+// compiled run. Each chunk is compiled on its own, as if it was the whole
+// program, except that it continues the stack frame set up by the first one.
+// Jumps can't go directly to the chunks which aren't compiled yet, so the
+// jumps (and falling through) from one chunk to another go through `entries`:
+// there is a cell for each jump target of the whole program (chunk starts are
+// made targets as well), holding the address of its code. Until the chunk is
+// compiled, the cell holds `wait_stub`, a bit of code which waits for it with
+// `stream_wait` and then continues to the target. Once a chunk is compiled,
+// its cells are updated and the jumps go straight to it. The jumps within a
+// chunk are direct, as usual.
+typedef struct ProgramStream ProgramStream;
+
+struct ProgramStream {
+	u8 *program;
+	size_t program_len;
+	// Where the chunks start, with the end of the program at `nchunks`.
+	size_t *starts;
+	size_t nchunks;
+	// Jump targets of the whole program and their labels, which index
+	// `entries`.
+	u8 *targets;
+	JumpLabels labels;
+	_Atomic(void *) *entries;
+	// The entry of the program (the code of the first chunk), `wait_stub`
+	// until it's compiled as well.
+	_Atomic(void *) code;
+	void *wait_stub;
+	// The code of the compiled chunks, to be freed.
+	void **chunks;
+	CodeCache *cache;
+	CompileOptions opts;
+	Thread thread;
+	// As in `CompilePool`, the lock only protects the sleeping.
+	Mutex lock;
+	Cond compiled;
+	atomic_size_t waiting;
+	atomic_int stop;
+};
+
+// Wait until the chunk with the code for the `cell` (one of `entries` or
+// `code`) is compiled and return the code.
+static void *
+stream_wait(ProgramStream *stream, _Atomic(void *) *cell)
+{
+	void *code = atomic_load(cell);
+	if (code == stream->wait_stub) {
+		mutex_lock(&stream->lock);
+		atomic_fetch_add(&stream->waiting, 1);
+		while ((code = atomic_load(cell)) == stream->wait_stub) {
+			cond_wait(&stream->compiled, &stream->lock);
+		}
+		atomic_fetch_sub(&stream->waiting, 1);
+		mutex_unlock(&stream->lock);
+	}
+	return code;
+}
+
+// A program with calls is compiled in units: the main one, which runs from the
+// start of the program, and one for each function, which runs from its entry.
+// A unit has the instructions reachable from its start, but doesn't follow
+// calls (`find_unit`), so that a function is compiled only once, however many
+// units call it, and only once it's called for the first time. All units run
+// in the frame of the main one, which reserves room for the return stack of
+// the bytecode in it, see `compile_template`.
+//
+// A call is compiled as a `call rel32` (the return stack buffer of the
+// processor predicts the matching `ret` well), which first goes to a stub in
+// the cold section. The stub calls `call_link` with its `CallSite` and the
+// return address, which compiles the function (unless some other call site
+// did already), patches the `rel32` of the call to point to it and returns it
+// for the stub to jump to. The next time the call goes directly to the
+// function. Code of a unit is sealed before it runs, so the patching makes the
+// page writable for a moment (or writes through the other mapping, see
+// `CodeCache`).
+typedef struct Module Module;
+
+typedef struct {
+	Module *module;
+	// Offset of the entry of the called function.
+	size_t callee;
+} CallSite;
+
+struct Module {
+	u8 *program;
+	size_t program_len;
+	CodeCache *cache;
+	CompileOptions opts;
+	// The compiler context for the functions, created with the first one,
+	// on the thread that runs the program.
+	struct Jit *jit;
+	// The code of the function at each offset of the program, or NULL if
+	// it isn't compiled (yet).
+	void **functions;
+	// All call sites of the compiled units, each in its own allocation, as
+	// the code points to them.
+	CallSite **sites;
+	size_t nsites;
+	size_t sites_cap;
+	// Whether the code runs in more than one thread, see `call_link`.
+	// Linking is serialized by `lock`.
+	int shared;
+	Mutex lock;
+};
+
+// Defined with the rest of `Module`, after the compiler.
+static void *call_link(CallSite *site, u8 *ret);
+
+static Module *
+module_create(u8 *program, size_t program_len, const CompileOptions *opts, CodeCache *cache)
+{
+	Module *module = calloc(1, sizeof(*module));
+	assert(module);
+	module->program = program;
+	module->program_len = program_len;
+	module->cache = cache;
+	module->opts = *opts;
+	module->functions = calloc(program_len ? program_len : 1, sizeof(module->functions[0]));
+	assert(module->functions);
+	mutex_init(&module->lock);
+	return module;
+}
+
+static CallSite *
+module_add_site(Module *module, size_t callee)
+{
+	if (module->nsites == module->sites_cap) {
+		module->sites_cap = module->sites_cap ? 2 * module->sites_cap : 16;
+		module->sites = realloc(module->sites, module->sites_cap * sizeof(module->sites[0]));
+		assert(module->sites);
+	}
+	CallSite *site = malloc(sizeof(*site));
+	assert(site);
+	*site = (CallSite) { .module = module, .callee = callee };
+	module->sites[module->nsites++] = site;
+	return site;
+}
+
+// The compiled code refers to a few things outside of it by their absolute
+// addresses (loaded with `mov64`, see `OP_PRINT`). These addresses differ
+// between processes (think address space layout randomization), so any code
+// which is to be reused by another process, like the one stored in the disk
+// cache, has the places where they are embedded "relocated", i.e. patched
+// with the addresses valid in the process which loads the code.
+enum symbol {
+	SYM_OUTPUT_INT,
+	SYM_OUTPUT_FLUSH,
+	SYM_INPUT_REFILL,
+	SYM_STREAM_WAIT,
+	SYM_CALL_LINK,
+	SYM__MAX,
+};
+
+static uintptr_t
+symbol_address(enum symbol symbol)
+{
+	switch (symbol) {
+	case SYM_OUTPUT_INT: return (uintptr_t) output_int;
+	case SYM_OUTPUT_FLUSH: return (uintptr_t) output_flush;
+	case SYM_INPUT_REFILL: return (uintptr_t) input_refill;
+	case SYM_STREAM_WAIT: return (uintptr_t) stream_wait;
+	case SYM_CALL_LINK: return (uintptr_t) call_link;
+	case SYM__MAX: break;
+	}
+	assert(0 && "unknown symbol");
+	return 0;
+}
+
+// A place in the code holding the 64 bit address of a symbol. While
+// compiling, `offset` is the pc label following the `mov64`, after encoding
+// it's the offset of the address in the code.
+typedef struct {
+	u32 offset;
+	u32 symbol;
+} Reloc;
+
+typedef struct {
+	int label;
+	u32 offset;
+} JitLine;
+
+// What compiling costs, counted over all compilations into a code cache that
+// points to the statistics (by any number of threads). Each compilation (of
+// a program, a chunk of one, or a function, see `jit_encode`) adds:
+//
+//   - the bytes of the bytecode compiled,
+//   - the `dasm_put` calls, and the bytes of the action list they went
+//     through, and the `dasm_putfixed` calls, which don't go through any,
+//   - the `dasm_link` calls,
+//   - the bytes of the encoded code,
+//   - the seconds spent emitting (everything up to linking, the analyses of
+//     the bytecode included), linking and encoding.
+//
+// With a `log`, each compilation also writes a line of JSON there with its own
+// numbers and the occupancy of the code cache right after it. The totals are
+// written by `compile_stats_write` in the text format of Prometheus, which
+// its node exporter (among others) picks up from a file.
+typedef struct CompileStats {
+	Mutex lock;
+	FILE *log;
+	u64 compiles;
+	u64 bytecode_bytes;
+	u64 puts;
+	u64 fixed_puts;
+	u64 action_bytes;
+	u64 links;
+	u64 code_bytes;
+	double seconds[3];
+} CompileStats;
+
+static CompileStats *
+compile_stats_create(FILE *log)
+{
+	CompileStats *stats = calloc(1, sizeof(*stats));
+	assert(stats);
+	mutex_init(&stats->lock);
+	stats->log = log;
+	return stats;
+}
+
+// Free the statistics, closing the log.
+static void
+compile_stats_destroy(CompileStats *stats)
+{
+	if (stats->log) {
+		fclose(stats->log);
+	}
+	mutex_destroy(&stats->lock);
+	free(stats);
+}
+
+static void
+compile_stats_write(CompileStats *stats, CodeCache *cache, FILE *f)
+{
+	static const char *phases[3] = { "emit", "link", "encode" };
+	mutex_lock(&stats->lock);
+	fprintf(f, "# TYPE jit_compiles_total counter\njit_compiles_total %llu\n", stats->compiles);
+	fprintf(f, "# TYPE jit_bytecode_bytes_total counter\njit_bytecode_bytes_total %llu\n", stats->bytecode_bytes);
+	fprintf(f, "# TYPE jit_dasm_puts_total counter\njit_dasm_puts_total %llu\n", stats->puts);
+	fprintf(f, "# TYPE jit_dasm_fixed_puts_total counter\njit_dasm_fixed_puts_total %llu\n", stats->fixed_puts);
+	fprintf(f, "# TYPE jit_dasm_action_bytes_total counter\njit_dasm_action_bytes_total %llu\n", stats->action_bytes);
+	fprintf(f, "# TYPE jit_dasm_links_total counter\njit_dasm_links_total %llu\n", stats->links);
+	fprintf(f, "# TYPE jit_code_bytes_total counter\njit_code_bytes_total %llu\n", stats->code_bytes);
+	fprintf(f, "# TYPE jit_compile_seconds_total counter\n");
+	for (int i = 0; i < 3; i++) {
+		fprintf(f, "jit_compile_seconds_total{phase=\"%s\"} %.9f\n", phases[i], stats->seconds[i]);
+	}
+	mutex_unlock(&stats->lock);
+	mutex_lock(&cache->lock);
+	fprintf(f, "# TYPE jit_code_cache_reserved_bytes gauge\njit_code_cache_reserved_bytes %zu\n", cache->reserved);
+	fprintf(f, "# TYPE jit_code_cache_allocated_bytes gauge\njit_code_cache_allocated_bytes %zu\n", cache->allocated);
+	fprintf(f, "# TYPE jit_code_cache_seals_total counter\njit_code_cache_seals_total %zu\n", cache->seals);
+	mutex_unlock(&cache->lock);
+}
+
+// Write the totals to the file at `path`, replacing it at once, so that
+// whoever reads it never sees a half written file.
+static int
+compile_stats_save(CompileStats *stats, CodeCache *cache, const char *path)
+{
+	char tmp[4096];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE *f = fopen(tmp, "w");
+	if (!f) {
+		return 0;
+	}
+	compile_stats_write(stats, cache, f);
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		remove(tmp);
+		return 0;
+	}
+	return 1;
+}
+
+// A compiler context. It holds the DynASM state and everything that goes with
+// it, so that compiling many programs doesn't pay for the setup of the state
+// (and for growing its buffers) over and over again. Create it once with
+// `jit_create`, pass it to `compile` as many times as needed and finally free
+// it with `jit_destroy`.
+typedef struct Jit {
+	// Here is the promised variable holding the `dasm_State *` itself.
+	// Though as defined with the macros above, we and other functions will
+	// generally use it with the name `ds` and expect a double pointer,
+	// i.e. `&jit->ds`.
+	dasm_State *ds;
+
+	// The array with addresses of global labels, DynASM fills it in
+	// `dasm_encode`.
+	void *labels[DASM_LBL__MAX];
+
+	// Where the compiled code goes. Multiple contexts may share one cache.
+	CodeCache *cache;
+
+	CompileOptions opts;
+
+	// Relocations of the last compiled program.
+	Reloc *relocs;
+	size_t nrelocs;
+	size_t relocs_cap;
+	// The first pc label after those of the bytecode offsets.
+	size_t reloc_labels;
+
+	// Bytecode offsets of the code at pc labels of the last compiled
+	// program, for the line tables of `DebugInfo`. Only collected when the
+	// code cache has one.
+	JitLine *lines;
+	size_t nlines;
+	size_t lines_cap;
+
+	// If `profile` is set, the seconds spent in the phases of compilation
+	// are accumulated here: emitting the code (`dasm_put`), linking and
+	// encoding. It is with `CompileStats`, which get the difference to
+	// `reported` after each compilation.
+	int profile;
+	double times[3];
+	double reported[3];
+
+	// Set while compiling a chunk of a streamed program, which starts at
+	// `chunk_start` of the whole program, see `ProgramStream`.
+	ProgramStream *stream;
+	size_t chunk_start;
+
+	// Set while compiling a unit of a program with calls, the one of the
+	// function at `function`, or the main one if it's -1, see `Module`.
+	Module *module;
+	ptrdiff_t function;
+
+	// If set, what `verify_program` found out about the (whole) program
+	// being compiled, which the template compiler takes instead of finding
+	// it again.
+	const ProgramInfo *info;
+} Jit;
+
+// Load the address of `symbol` into the register `r`, recording where the
+// address ended up. There are no more labels for 8 bytes of the `mov64`
+// immediate, so we put a pc label right after the instruction, after
+// encoding it gives us the end of the address. We number these labels from
+// just after the ones used for the bytecode.
+static void
+emit_symbol(Jit *jit, int r, enum symbol symbol)
+{
+	dasm_State **ds = &jit->ds;
+	if (jit->nrelocs == jit->relocs_cap) {
+		jit->relocs_cap = jit->relocs_cap ? 2 * jit->relocs_cap : 16;
+		jit->relocs = realloc(jit->relocs, jit->relocs_cap * sizeof(jit->relocs[0]));
+		assert(jit->relocs);
+	}
+	u32 label = (u32) (jit->reloc_labels + jit->nrelocs);
+	jit->relocs[jit->nrelocs++] = (Reloc) { .offset = label, .symbol = symbol };
+	dasm_growpc(Dst, label + 1);
+	uintptr_t address = symbol_address(symbol);
+	//| mov64 Rq(r), address
+	//|=>label:
+}
+
+// Call the C function `symbol`, with the arguments already in place. The
+// stack is aligned as the ABI requires, see `OP_PRINT` for how. The caller
+// saved registers are clobbered, so the register cache has to be empty.
+static void
+emit_call(Jit *jit, enum symbol symbol)
+{
+	dasm_State **ds = &jit->ds;
+	emit_symbol(jit, 11, symbol); // r11
+	//| push rsp
+	//| push qword [rsp]
+	//| and rsp, -16
+	//| call r11
+	//| mov rsp, [rsp + 8]
+}
+
+// Record that the code at the pc `label` is for the bytecode at `offset`, see
+// `DebugInfo`.
+static void
+jit_add_line(Jit *jit, int label, size_t offset)
+{
+	if (jit->nlines == jit->lines_cap) {
+		jit->lines_cap = jit->lines_cap ? 2 * jit->lines_cap : 256;
+		jit->lines = realloc(jit->lines, jit->lines_cap * sizeof(jit->lines[0]));
+		assert(jit->lines);
+	}
+	jit->lines[jit->nlines++] = (JitLine) { .label = label, .offset = (u32) offset };
+}
+
+#if JIT_STATS
+// Add the compilation that just finished, of `bytecode_len` bytes into `size`
+// bytes of code, to the `CompileStats` of the code cache.
+static void
+jit_report(Jit *jit, const char *name, size_t bytecode_len, size_t size)
+{
+	CompileStats *stats = jit->cache->stats;
+	dasm_State *D = jit->ds;
+	double seconds[3];
+	for (int i = 0; i < 3; i++) {
+		seconds[i] = jit->times[i] - jit->reported[i];
+		jit->reported[i] = jit->times[i];
+	}
+	mutex_lock(&jit->cache->lock);
+	size_t allocated = jit->cache->allocated;
+	size_t reserved = jit->cache->reserved;
+	mutex_unlock(&jit->cache->lock);
+	mutex_lock(&stats->lock);
+	stats->compiles++;
+	stats->bytecode_bytes += bytecode_len;
+	stats->puts += D->nput;
+	stats->fixed_puts += D->nputfixed;
+	stats->action_bytes += D->nactbytes;
+	stats->links += D->nlink;
+	stats->code_bytes += size;
+	for (int i = 0; i < 3; i++) {
+		stats->seconds[i] += seconds[i];
+	}
+	if (stats->log) {
+		fprintf(stats->log, "{\"name\": \"%s\", \"bytecode_bytes\": %zu, "
+			"\"dasm_puts\": %zu, \"dasm_fixed_puts\": %zu, \"dasm_action_bytes\": %zu, \"dasm_links\": %zu, "
+			"\"code_bytes\": %zu, \"emit_us\": %.3f, \"link_us\": %.3f, \"encode_us\": %.3f, "
+			"\"cache_allocated_bytes\": %zu, \"cache_reserved_bytes\": %zu}\n",
+			name, bytecode_len,
+			D->nput, D->nputfixed, D->nactbytes, D->nlink,
+			size, seconds[0] * 1e6, seconds[1] * 1e6, seconds[2] * 1e6,
+			allocated, reserved);
+		fflush(stats->log);
+	}
+	mutex_unlock(&stats->lock);
+}
+#endif
+
+// Link and encode the code put so far, compiled from `bytecode_len` bytes of
+// the program, and register it as the function `name` if the code cache has
+// `DebugInfo`, and count it in its `CompileStats`.
+static void *
+jit_encode(Jit *jit, const char *name, size_t bytecode_len, size_t *code_size)
+{
+	dasm_State **ds = &jit->ds;
+	size_t size;
+	void *code = our_dasm_link_and_encode(Dst, jit->cache, jit->labels, DASM_LBL__MAX, &size, jit->profile ? &jit->times[1] : NULL);
+	if (code_size) {
+		*code_size = size;
+	}
+#if JIT_STATS
+	if (jit->cache->stats) {
+		jit_report(jit, name, bytecode_len, size);
+	}
+#else
+	(void) bytecode_len;
+#endif
+	DebugInfo *debug = jit->cache->debug;
+	if (debug) {
+		DebugLine *lines = malloc((jit->nlines ? jit->nlines : 1) * sizeof(lines[0]));
+		assert(lines);
+		size_t n = 0;
+		for (size_t i = 0; i < jit->nlines; i++) {
+			int pos = dasm_getpclabel(Dst, jit->lines[i].label);
+			if (pos >= 0) {
+				lines[n++] = (DebugLine) { .address = (u8 *) code + pos, .offset = jit->lines[i].offset };
+			}
+		}
+		debug_info_register(debug, name, code, size, lines, n);
+		free(lines);
+	}
+	jit->nlines = 0;
+	return code;
+}
+
+// Check that there are `need` more values of input, see `Input`. The input is
+// at `[rbp - 16]`. Refilling is the slow path, it goes to the cold section.
+static void
+emit_input_check(Jit *jit, u32 need)
+{
+	dasm_State **ds = &jit->ds;
+	//| mov rcx, [rbp - 16]
+	//| lea rax, [rbx + (int) (4 * need)]
+	//| cmp rax, [rcx + offsetof(Input, end)]
+	//| ja >2
+	//|.cold
+	//|2:
+	//| mov rdi, rcx
+	//| mov rsi, rbx
+	//| mov edx, need
+	emit_call(jit, SYM_INPUT_REFILL);
+	//| test rax, rax
+	//| jz ->input_exhausted
+	//| mov rbx, rax
+	//| jmp >1
+	//|.code
+	//|1:
+}
+
+// Add the cycles since `tsc` to the block being measured, with the profile in
+// rcx, see `BlockProfile`.
+static void
+emit_block_measured(Jit *jit)
+{
+	dasm_State **ds = &jit->ds;
+	//| rdtsc
+	//| shl rdx, 32
+	//| or rax, rdx
+	//| sub rax, [rcx + offsetof(BlockProfile, tsc)]
+	//| mov rdx, [rcx + offsetof(BlockProfile, last)]
+	//| add [rcx + rdx + offsetof(BlockCounter, cycles)], rax
+	//| mov qword [rcx + offsetof(BlockProfile, last)], 0
+}
+
+// Count a run of the block `block`, see `BlockProfile`. The register cache
+// has to be empty. Measuring goes to the cold section.
+static void
+emit_block_tick(Jit *jit, size_t block)
+{
+	dasm_State **ds = &jit->ds;
+	int counter = (int) (offsetof(BlockProfile, blocks) + block * sizeof(BlockCounter));
+	//| mov rcx, [rbp - 8]
+	//| mov rcx, [rcx + offsetof(Output, profile)]
+	//| test rcx, rcx
+	//| jz >1
+	//| add qword [rcx + counter], 1
+	if (jit->opts.instrument > 1) {
+		//| cmp qword [rcx + offsetof(BlockProfile, last)], 0
+		//| jne >2
+		//|3:
+		//| test byte [rcx + counter], BLOCK_SAMPLE_PERIOD - 1
+		//| jz >4
+		//|.cold
+		//|2:
+		emit_block_measured(jit);
+		//| jmp <3
+		//|4:
+		//| mov qword [rcx + offsetof(BlockProfile, last)], counter
+		//| rdtsc
+		//| shl rdx, 32
+		//| or rax, rdx
+		//| mov [rcx + offsetof(BlockProfile, tsc)], rax
+		//| jmp >1
+		//|.code
+	}
+	//|1:
+}
+
+// Finish the measurement of the last block when leaving the compiled code.
+static void
+emit_block_exit(Jit *jit)
+{
+	dasm_State **ds = &jit->ds;
+	if (jit->opts.instrument > 1) {
+		//| mov rcx, [rbp - 8]
+		//| mov rcx, [rcx + offsetof(Output, profile)]
+		//| test rcx, rcx
+		//| jz >1
+		//| cmp qword [rcx + offsetof(BlockProfile, last)], 0
+		//| je >1
+		emit_block_measured(jit);
+		//|1:
+	}
+}
+
+// Jump to the target at `offset` of a streamed program through its cell in
+// `entries`, see `ProgramStream`. The `wait_stub` finds the cell in rax.
+static void
+emit_far_jump(Jit *jit, size_t offset)
+{
+	dasm_State **ds = &jit->ds;
+	ProgramStream *stream = jit->stream;
+	uintptr_t cell = (uintptr_t) &stream->entries[jump_label(&stream->labels, offset)];
+	//| mov64 rax, cell
+	//| jmp qword [rax]
+}
+
+// Jump to the target at `offset` of the compiled program if the last compare
+// says greater. In a chunk of a streamed program, the target may be in some
+// other chunk, then we jump over the far jump instead.
+static void
+emit_jg(Jit *jit, const JumpLabels *labels, ptrdiff_t offset)
+{
+	dasm_State **ds = &jit->ds;
+	int label = find_jump_label(labels, offset);
+	if (label >= 0) {
+		//| jg => label
+		return;
+	}
+	assert(jit->stream && "jump outside of the program");
+	//| jle >1
+	emit_far_jump(jit, (size_t) ((ptrdiff_t) jit->chunk_start + offset));
+	//|1:
+}
+
+// Compile a sequence found by `find_fusions` at `instrptr` and return its
+// length in bytes.
+static size_t
+compile_fusion(Jit *jit, TosCache *tc, const JumpLabels *labels, enum fusion fusion, u8 *program, u8 *instrptr)
+{
+	dasm_State **ds = &jit->ds;
+	switch (fusion) {
+	case FUSE_CMP_JGT: {
+		// Compare the operands directly and jump if `a > b`, which is
+		// exactly when `OP_CMP` would have produced a positive number.
+		ptrdiff_t target = instrptr + 1 - program + read_operand(instrptr + 1);
+		int b = tos_pop(Dst, tc);
+		int a = tos_pop(Dst, tc);
+		tos_flush(Dst, tc);
+		//| cmp Rq(a), Rq(b)
+		emit_jg(jit, labels, target);
+		return 1 + 5;
+	}
+	case FUSE_CONSTANT_CMP_JGT: {
+		// Same as above, but the constant is an immediate operand of
+		// the compare. Comparing to zero is just a test.
+		i32 constant = read_operand(instrptr);
+		ptrdiff_t target = instrptr + 6 - program + read_operand(instrptr + 6);
+		int a = tos_pop(Dst, tc);
+		tos_flush(Dst, tc);
+		if (constant == 0) {
+			//| test Rq(a), Rq(a)
+		} else {
+			//| cmp Rq(a), constant
+		}
+		emit_jg(jit, labels, target);
+		return 5 + 1 + 5;
+	}
+	case FUSE_CONSTANT_ADD: {
+		// The 32 bit immediate is sign extended, just like the constant
+		// would be when pushed.
+		i32 constant = read_operand(instrptr);
+		int a = tos_pop(Dst, tc);
+		//| add Rq(a), constant
+		tos_push(Dst, tc, a);
+		return 5 + 1;
+	}
+	case FUSE_GET_GET_ADD: {
+		// The first `OP_GET` pushes a value, so the operand of the
+		// second one is relative to a stack one slot higher. If it is
+		// zero, it refers to the value loaded by the first `OP_GET`.
+		int i = read_operand(instrptr);
+		int j = read_operand(instrptr + 5);
+		int r = tos_alloc(tc);
+		int mem;
+		int src = tos_slot(tc, i, &mem);
+		if (src >= 0) {
+			//| mov Rq(r), Rq(src)
+		} else {
+			//| mov Rq(r), [rsp + 8 * mem]
+		}
+		if (j == 0) {
+			//| add Rq(r), Rq(r)
+		} else {
+			src = tos_slot(tc, j - 1, &mem);
+			if (src >= 0) {
+				//| add Rq(r), Rq(src)
+			} else {
+				//| add Rq(r), [rsp + 8 * mem]
+			}
+		}
+		tos_push(Dst, tc, r);
+		return 5 + 5 + 1;
+	}
+	case FUSE_NONE:
+		break;
+	}
+	assert(0 && "not a fused sequence");
+	return 0;
+}
+
+// Running a program over many independent inputs by calling the compiled
+// function for each of them pays for the call, the prologue and the epilogue
+// every time. So a program can also be compiled (with the `batch` option) as
+// a loop over a whole batch of input "records", with the function taking a
+// `Batch` instead of `Input` and `Output`:
+//
+//  - Record `i` is `record_len` values at `records + i * record_len`. It's
+//    the input of the program run for the record, the program can't read past
+//    its end (it stops, just like when the input ends).
+//
+//  - The output of the record are the first `outputs_len` values it prints,
+//    which are stored to `outputs + i * outputs_len` (as numbers, not text).
+//    Further values are dropped, slots not printed to are left as they are.
+//
+//  - `OP_HALT` doesn't return, it continues with the next record, with an
+//    empty operand stack.
+//
+// The record and output pointers are kept in the stack frame, so a batch can
+// be split into smaller ones, which can run in parallel, see
+// `batch_run_parallel`.
+typedef struct {
+	// The input of the current record, used by the compiled code. Keep it
+	// first, `[rbp - 16]` points to it, just as to `Input` without batches.
+	Input in;
+	const i32 *records;
+	size_t count;
+	size_t record_len;
+	i64 *outputs;
+	size_t outputs_len;
+} Batch;
+
+// The stack frame of a batch looks like this (the operand stack is below):
+//
+//         [rbp - 8]   next output slot of the record
+//         [rbp - 16]  the batch
+//         [rbp - 24]  end of the output slots of the record
+//         [rbp - 32]  records left
+#define BATCH_FRAME 32
+
+// Save the callee saved registers of `npinned` pinned slots (see
+// `find_pinned_slots`), right after `rbx`, so that the frame below `rbp` looks
+// the same with them or without them.
+static void
+emit_save_pins(Jit *jit, int npinned)
+{
+	dasm_State **ds = &jit->ds;
+	for (int i = 0; i < npinned; i++) {
+		//| push Rq(pin_pool[i])
+	}
+}
+
+// Restore them, in the reverse order, right before `rbx`.
+static void
+emit_restore_pins(Jit *jit, int npinned)
+{
+	dasm_State **ds = &jit->ds;
+	for (int i = npinned - 1; i >= 0; i--) {
+		//| pop Rq(pin_pool[i])
+	}
+}
+
+static void
+emit_batch_prologue(Jit *jit, int npinned)
+{
+	dasm_State **ds = &jit->ds;
+	//| push rbx
+	emit_save_pins(jit, npinned);
+	//| push rbp
+	//| mov rbp, rsp
+	//| sub rsp, BATCH_FRAME
+	//| mov [rbp - 16], rdi
+	//| mov rax, [rdi + offsetof(Batch, outputs)]
+	//| mov [rbp - 24], rax
+	//| mov rax, [rdi + offsetof(Batch, count)]
+	//| mov [rbp - 32], rax
+	//| mov rax, [rdi + offsetof(Batch, records)]
+	//| mov [rdi + offsetof(Batch, in.end)], rax
+
+	// Each record starts here, where the previous one ended, both for the
+	// input and for the outputs.
+	//|->batch_next:
+	//| lea rsp, [rbp - BATCH_FRAME]
+	//| mov rdi, [rbp - 16]
+	//| mov rax, [rbp - 24]
+	//| mov [rbp - 8], rax
+	//| mov rcx, [rdi + offsetof(Batch, outputs_len)]
+	//| lea rax, [rax + rcx * 8]
+	//| mov [rbp - 24], rax
+	//| sub qword [rbp - 32], 1
+	//| jb >1
+	//| mov rbx, [rdi + offsetof(Batch, in.end)]
+	//| mov rax, [rdi + offsetof(Batch, record_len)]
+	//| lea rax, [rbx + rax * 4]
+	//| mov [rdi + offsetof(Batch, in.end)], rax
+	//| jmp >2
+	//|1:
+	//| mov rsp, rbp
+	//| pop rbp
+	emit_restore_pins(jit, npinned);
+	//| pop rbx
+	//| ret
+	//|2:
+}
+
+// Store the value to the next output slot of the record, if there is one
+// left. No call is needed, so unlike `OP_PRINT` without batches, the register
+// cache stays as it is.
+static void
+emit_batch_print(Jit *jit, int value)
+{
+	dasm_State **ds = &jit->ds;
+	//| mov rax, [rbp - 8]
+	//| cmp rax, [rbp - 24]
+	//| jae >1
+	//| mov [rax], Rq(value)
+	//| add rax, 8
+	//| mov [rbp - 8], rax
+	//|1:
+}
+
+static Jit *
+jit_create(const CompileOptions *opts, CodeCache *cache)
+{
+	Jit *jit = calloc(1, sizeof(*jit));
+	assert(jit);
+	jit->opts = opts ? *opts : default_compile_options;
+	jit->cache = cache;
+	jit->profile = cache->stats != NULL;
+	dasm_State **ds = &jit->ds;
+
+	// Each state has to be initialized with a call to `dasm_init`. As
+	// promised, we use the macro `Dst`, instead of referring to `ds`
+	// directly. This gives us more consistency with rest of the functions
+	// and calls and is flexible. In any case the name `Dst` is referred to
+	// by the `dasm_put` calls generated by the preprocessor. The second
+	// argument tells DynASM the number of sections we will be using. We
+	// used the `.section` directive above and told DynASM what names we
+	// wanted to give to our sections ("code" and "cold") and thus now have
+	// available the macro DASM_MAXSECTION generated by the preprocessor.
+	dasm_init(Dst, DASM_MAXSECTION);
+
+	// We are not using global labels and in a simple template JIT likely
+	// won't find the need, but we sill need to setup the globals, because
+	// local labels can only be used when global labels are setup. And local
+	// labels come handy pretty quickly (our snippets may need to contain
+	// loops for example).
+	dasm_setupglobal(Dst, jit->labels, DASM_LBL__MAX);
+	// Most of the bytes in the action list are just copied to the code.
+	// DynASM can skip over each run of them at once, in all three passes,
+	// instead of looking at them one by one, when it finds them upfront.
+	dasm_setupruns(Dst, our_dasm_actions, sizeof(our_dasm_actions));
+	return jit;
+}
+
+// Does the processor (and the operating system, which has to save the upper
+// halves of the registers on context switches) support AVX2? Checked with
+// CPUID and XGETBV, see the Intel SDM, section 14.3 "Detection of Intel AVX
+// instructions".
+static int
+cpu_has_avx2(void)
+{
+	u32 regs[4];
+	u64 xcr0;
+#if _MSC_VER
+	__cpuid((int *) regs, 0);
+	if (regs[0] < 7) {
+		return 0;
+	}
+	__cpuid((int *) regs, 1);
+	if (!(regs[2] & (1u << 27)) || !(regs[2] & (1u << 28))) {
+		return 0;
+	}
+	xcr0 = _xgetbv(0);
+	__cpuidex((int *) regs, 7, 0);
+#else
+	if (__get_cpuid_max(0, NULL) < 7) {
+		return 0;
+	}
+	__cpuid(1, regs[0], regs[1], regs[2], regs[3]);
+	if (!(regs[2] & (1u << 27)) || !(regs[2] & (1u << 28))) {
+		return 0;
+	}
+	u32 lo, hi;
+	__asm__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+	xcr0 = (u64) hi << 32 | lo;
+	__cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+	// XMM and YMM state saved by the OS, and the AVX2 feature bit.
+	return (xcr0 & 6) == 6 && (regs[1] & (1u << 5));
+}
+
+// Programs compiled for batches can also run 4 records at once, one in each
+// 64-bit lane of AVX2 registers. Each slot of the operand stack becomes a
+// vector of the 4 values the records have there, `OP_ADD` becomes `vpaddq`,
+// `OP_CMP` two `vpcmpgtq`s and so on.
+//
+// The hard part are jumps, since each lane may want to go somewhere else. We
+// only go one way, and keep a mask of the lanes which are "active" (in
+// `ymm15`). The other lanes wait: they are not affected by the code we run
+// (stores to slots they still need are blended with the mask) until we get
+// to where they wait:
+//
+//  - A forward jump skips a part of the program. The lanes which jump are
+//    masked off until its target, if all of them do, we actually jump.
+//
+//  - A backward jump closes a loop. The lanes which don't jump are masked off
+//    until the end of the loop, and we jump back while some lane is active.
+//
+// So each jump has a region of code where it changes the mask, and at its
+// end, the mask from before the region is restored. For this to work,
+// regions have to nest, you can't jump into the middle of a loop and out of it
+// beyond its end. This and that the stack has the same depth whichever way we
+// get to an instruction (so that the slots are at known places), is true for
+// programs with structured loops and conditions, and we make sure of it in
+// `plan_lanes`. Other programs are compiled for one record at a time.
+//
+// Lanes also stop on their own, by `OP_HALT` or when their record has too few
+// values left (checked at the same places as with one record, see `Input`).
+// Those are cleared from the "alive" mask, and the mask restored at the end
+// of a region never has them. Once no lane is alive, we go on with the next 4
+// records.
+//
+// The in-tree DynASM encodes VEX instructions (AVX and AVX2) but not EVEX, so
+// there is no AVX-512 variant with 8 lanes of 64 bits. Programs whose values
+// all fit in 32 bits run in 8 lanes of 32 bits instead, see `Range`.
+#define LANES 4
+#define LANES_NARROW 8
+#define LANES_MAX_DEPTH 256
+
+// A region of code where the JGT at `jump` changes the mask. For a forward
+// jump it's the jump and the code it skips, for a backward jump the whole
+// loop.
+typedef struct {
+	size_t start, end;
+	size_t jump;
+	int loop;
+	// The number of regions it's in, which is where its saved mask is kept.
+	int level;
+} LaneRegion;
+
+typedef struct {
+	// The depth of the stack before each instruction.
+	int *depth;
+	int max_depth;
+	// Bits of the (bottom 64) slots which are live before each
+	// instruction, i.e. which may be read before they are written again.
+	u64 *live;
+	// Sorted by where they start, with outer ones first.
+	LaneRegion *regions;
+	size_t nregions;
+	int levels;
+	// Region indices, ordered by where the regions end, with inner ones
+	// first.
+	size_t *by_end;
+	// The region of each JGT instruction, by its offset.
+	size_t *region_of;
+} LanePlan;
+
+static int
+lane_region_outer_first(const void *a, const void *b)
+{
+	const LaneRegion *x = a, *y = b;
+	if (x->start != y->start) {
+		return x->start < y->start ? -1 : 1;
+	}
+	if (x->end != y->end) {
+		return x->end > y->end ? -1 : 1;
+	}
+	// A loop and a forward jump over the same code: the loop starts (and
+	// saves the mask) at the jump instruction, before the jump does.
+	return y->loop - x->loop;
+}
+
+// Where the regions end, for the order in which they are closed: inner ones
+// first, which are those later in the outer first order.
+typedef struct {
+	size_t end;
+	size_t index;
+} LaneRegionEnd;
+
+static int
+lane_region_inner_first(const void *a, const void *b)
+{
+	const LaneRegionEnd *x = a, *y = b;
+	if (x->end != y->end) {
+		return x->end < y->end ? -1 : 1;
+	}
+	return x->index > y->index ? -1 : x->index < y->index;
+}
+
+static void
+plan_lanes_free(LanePlan *plan)
+{
+	free(plan->depth);
+	free(plan->live);
+	free(plan->regions);
+	free(plan->by_end);
+	free(plan->region_of);
+}
+
+// Find out whether the program can run in lanes, and if it can, the depth of
+// the stack at each instruction and the regions of jumps.
+static int
+plan_lanes(u8 *program, size_t program_len, LanePlan *plan)
+{
+	memset(plan, 0, sizeof(*plan));
+	size_t alloc_len = program_len ? program_len : 1;
+	plan->depth = find_stack_depths(program, program_len, &plan->max_depth);
+	if (!plan->depth || plan->max_depth > LANES_MAX_DEPTH) {
+		free(plan->depth);
+		return 0;
+	}
+	plan->regions = malloc(alloc_len * sizeof(plan->regions[0]));
+	plan->region_of = malloc(alloc_len * sizeof(plan->region_of[0]));
+	assert(plan->regions && plan->region_of);
+	int ok = 1;
+	for (u8 *instrptr = program; instrptr < program + program_len; instrptr += op_length(*instrptr)) {
+		if (*instrptr != OP_JGT) {
+			continue;
+		}
+		size_t offset = (size_t) (instrptr - program);
+		size_t target = (size_t) ((ptrdiff_t) offset + read_operand(instrptr));
+		LaneRegion *region = &plan->regions[plan->nregions];
+		region->jump = offset;
+		region->loop = target <= offset;
+		if (region->loop) {
+			region->start = target;
+			region->end = offset + 5;
+		} else {
+			region->start = offset;
+			region->end = target;
+		}
+		plan->region_of[offset] = plan->nregions++;
+	}
+
+	// Liveness of the slots, the usual backward data flow analysis, repeated
+	// until nothing changes (loops need more passes). Slots above 64 are
+	// always live.
+	plan->live = calloc(alloc_len, sizeof(plan->live[0]));
+	assert(plan->live);
+#define SLOT_BIT(i) ((i) < 64 ? (u64) 1 << (i) : 0)
+	for (int changed = 1; changed;) {
+		changed = 0;
+		for (size_t offset = program_len; offset-- > 0;) {
+			int depth = plan->depth[offset];
+			if (depth < 0) {
+				continue;
+			}
+			u8 *instrptr = program + offset;
+			size_t next = offset + op_length(*instrptr);
+			u64 out = 0, use = 0, def = 0;
+			if (*instrptr != OP_HALT && next < program_len) {
+				out = plan->live[next];
+			}
+			switch (*instrptr) {
+			case OP_CONSTANT:
+			case OP_INPUT:
+				def = SLOT_BIT(depth);
+				break;
+			case OP_ADD:
+			case OP_CMP:
+				use = SLOT_BIT(depth - 2) | SLOT_BIT(depth - 1);
+				def = SLOT_BIT(depth - 2);
+				break;
+			case OP_PRINT:
+				use = SLOT_BIT(depth - 1);
+				break;
+			case OP_GET:
+				use = SLOT_BIT(depth - 1 - read_operand(instrptr));
+				def = SLOT_BIT(depth);
+				break;
+			case OP_SET:
+				use = SLOT_BIT(depth - 1);
+				def = SLOT_BIT(depth - 2 - read_operand(instrptr));
+				break;
+			case OP_JGT:
+				use = SLOT_BIT(depth - 1);
+				out |= plan->live[offset + read_operand(instrptr)];
+				break;
+			}
+			u64 in = ((out & ~def) | use) & (depth >= 64 ? ~(u64) 0 : SLOT_BIT(depth) - 1);
+			if (in != plan->live[offset]) {
+				plan->live[offset] = in;
+				changed = 1;
+			}
+		}
+	}
+#undef SLOT_BIT
+
+	// Regions have to nest. We go through them from the outer ones and
+	// keep a stack of the regions we are in.
+	qsort(plan->regions, plan->nregions, sizeof(plan->regions[0]), lane_region_outer_first);
+	size_t *open = malloc((plan->nregions + 1) * sizeof(open[0]));
+	plan->by_end = malloc((plan->nregions + 1) * sizeof(plan->by_end[0]));
+	assert(open && plan->by_end);
+	size_t nopen = 0;
+	for (size_t i = 0; ok && i < plan->nregions; i++) {
+		LaneRegion *region = &plan->regions[i];
+		while (nopen > 0 && plan->regions[open[nopen - 1]].end <= region->start) {
+			nopen--;
+		}
+		if (nopen > 0) {
+			LaneRegion *outer = &plan->regions[open[nopen - 1]];
+			// Crossing regions, or a loop inside a forward jump, both
+			// starting at the jump (the loop would start after it).
+			ok = region->end <= outer->end && !(region->loop && !outer->loop && outer->start == region->start);
+		}
+		region->level = (int) nopen;
+		if (region->level + 1 > plan->levels) {
+			plan->levels = region->level + 1;
+		}
+		open[nopen++] = i;
+		plan->region_of[region->jump] = i;
+	}
+	free(open);
+	LaneRegionEnd *ends = malloc((plan->nregions + 1) * sizeof(ends[0]));
+	assert(ends);
+	for (size_t i = 0; i < plan->nregions; i++) {
+		ends[i] = (LaneRegionEnd) { plan->regions[i].end, i };
+	}
+	qsort(ends, plan->nregions, sizeof(ends[0]), lane_region_inner_first);
+	for (size_t i = 0; i < plan->nregions; i++) {
+		plan->by_end[i] = ends[i].index;
+	}
+	free(ends);
+	if (!ok) {
+		plan_lanes_free(plan);
+		return 0;
+	}
+	return 1;
+}
+
+// The values of the operand stack are 64-bit, but most programs never need
+// more than 32 bits, and with 32-bit lanes twice as many records fit in a
+// vector. We can't ask the values whether they fit, but we can find out
+// whether they always do, before compiling: each slot of the stack gets a
+// range of the values it can have, computed over the program ("abstract
+// interpretation" with intervals). Constants are what they are, `OP_CMP`
+// gives -1 to 1, `OP_ADD` adds the bounds, and `OP_INPUT` gives anything the
+// input may have, which for a batch we know before compiling, see
+// `input_bits`. Where control flow meets, the ranges are joined, and a loop
+// head where a range still grows after the first iteration gets it unbounded
+// ("widening"), so that the analysis ends, but a loop counter ends up there
+// too. Then the values may wrap around, so bounds beyond `RANGE_BIG` count as
+// unbounded as well. If all values are within 32 bits (are "narrow"), the
+// 32-bit arithmetic gives exactly the same results, without any checks.
+typedef struct {
+	i64 lo, hi;
+} Range;
+
+#define RANGE_BIG ((i64) 1 << 40)
+
+static Range
+range_add(Range a, Range b)
+{
+	Range r = { a.lo + b.lo, a.hi + b.hi };
+	r.lo = r.lo < -RANGE_BIG ? -RANGE_BIG : r.lo;
+	r.hi = r.hi > RANGE_BIG ? RANGE_BIG : r.hi;
+	return r;
+}
+
+static int
+range_narrow(Range r)
+{
+	return r.lo >= INT32_MIN && r.hi <= INT32_MAX;
+}
+
+// Join the `depth` ranges of `from` into those kept for a target in `*to`,
+// unbounding those which grow at a loop head. Returns whether `*to` changed.
+static int
+range_join(Range **to, const Range *from, int depth, int widen)
+{
+	if (!*to) {
+		*to = malloc(((size_t) depth + 1) * sizeof(from[0]));
+		assert(*to);
+		memcpy(*to, from, (size_t) depth * sizeof(from[0]));
+		return 1;
+	}
+	int changed = 0;
+	for (int i = 0; i < depth; i++) {
+		Range *r = &(*to)[i];
+		if (from[i].lo < r->lo) {
+			r->lo = widen ? -RANGE_BIG : from[i].lo;
+			changed = 1;
+		}
+		if (from[i].hi > r->hi) {
+			r->hi = widen ? RANGE_BIG : from[i].hi;
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+// Whether all values of the program are narrow (see `Range`), given the
+// depths of its stack (`find_stack_depths`) and that the input values are
+// below `1 << input_bits` (unless it's zero). The ranges at the jump targets
+// are repeatedly updated in passes over the program, until nothing changes.
+static int
+find_narrow(u8 *program, size_t program_len, const int *depths, int max_depth, int input_bits)
+{
+	u8 *targets = find_jump_targets(program, program_len);
+	Range **at = calloc(program_len ? program_len : 1, sizeof(at[0]));
+	Range *cur = malloc(((size_t) max_depth + 1) * sizeof(cur[0]));
+	assert(at && cur);
+	Range input = { 0, input_bits > 0 && input_bits < 32 ? ((i64) 1 << input_bits) - 1 : UINT32_MAX };
+	int narrow = 0;
+	for (int changed = 1; changed;) {
+		changed = 0;
+		narrow = 1;
+		int reachable = 1;
+		for (u8 *instrptr = program; instrptr < program + program_len; instrptr += op_length(*instrptr)) {
+			size_t offset = (size_t) (instrptr - program);
+			int depth = depths[offset];
+			if (targets[offset]) {
+				if (reachable) {
+					changed |= range_join(&at[offset], cur, depth, targets[offset] & TARGET_LOOP);
+				}
+				reachable = at[offset] != NULL;
+				if (reachable) {
+					memcpy(cur, at[offset], (size_t) depth * sizeof(cur[0]));
+				}
+			}
+			if (!reachable || depth < 0) {
+				continue;
+			}
+			switch (*instrptr) {
+			case OP_CONSTANT:
+				cur[depth] = (Range) { read_operand(instrptr), read_operand(instrptr) };
+				break;
+			case OP_INPUT:
+				cur[depth] = input;
+				narrow &= range_narrow(input);
+				break;
+			case OP_ADD:
+				cur[depth - 2] = range_add(cur[depth - 2], cur[depth - 1]);
+				narrow &= range_narrow(cur[depth - 2]);
+				break;
+			case OP_CMP:
+				cur[depth - 2] = (Range) { -1, 1 };
+				break;
+			case OP_GET:
+				cur[depth] = cur[depth - 1 - read_operand(instrptr)];
+				break;
+			case OP_SET:
+				cur[depth - 2 - read_operand(instrptr)] = cur[depth - 1];
+				break;
+			case OP_JGT: {
+				size_t target = (size_t) ((ptrdiff_t) offset + read_operand(instrptr));
+				changed |= range_join(&at[target], cur, depth - 1, targets[target] & TARGET_LOOP);
+				break;
+			}
+			case OP_HALT:
+				reachable = 0;
+				break;
+			}
+		}
+	}
+	for (size_t i = 0; i < program_len; i++) {
+		free(at[i]);
+	}
+	free(at);
+	free(cur);
+	free(targets);
+	return narrow;
+}
+
+// The stack frame of code running in lanes, aligned to 32 bytes, at `rsp`.
+// Vectors have a 64-bit value for each lane, or with 32-bit lanes, a 32-bit
+// one. The input and output pointers take 64 bits in either case, so there
+// is room for eight of them.
+#define LANE_ALIVE	0	// vector: all ones for alive lanes
+#define LANE_SCRATCH	32	// vector: values read or printed by lanes
+#define LANE_IN		64	// input cursors
+#define LANE_IN_END	128	// ends of the records
+#define LANE_OUT	192	// next output slots
+#define LANE_OUT_END	256	// ends of the output slots
+#define LANE_LEFT	320	// records left
+#define LANE_RECORD	328	// the next record
+#define LANE_OUTPUT	336	// output slots of the next record
+#define LANE_SAVED	352	// masks saved by regions, one vector per level
+// Then there are the stack slots which don't fit in registers.
+
+// The bottom 11 stack slots live in `ymm0` to `ymm10`, the rest in the stack
+// frame. The remaining registers are:
+//
+//         ymm11, ymm12, ymm13  temporaries
+//         ymm14                zero
+//         ymm15                mask of the active lanes
+#define LANE_REGS 11
+
+typedef struct {
+	Jit *jit;
+	// With 32-bit lanes (`narrow`) there are `LANES_NARROW` of them,
+	// otherwise `LANES`.
+	int narrow;
+	int n;
+	// Where the stack slots in memory start in the frame.
+	int slots;
+	// Lanes which are waiting have live values in these (bottom 64) slots,
+	// and possibly in any slot above them below the `wait` depth. Anything
+	// we store there has to be blended with the mask, other slots we can
+	// overwrite.
+	u64 wait_live;
+	int wait;
+	// Constants of the program, placed after the code, with pc labels
+	// from `constant_labels` on.
+	i32 *constants;
+	size_t nconstants;
+	size_t constant_labels;
+} Lanes;
+
+#define LANE_SLOT(lanes, i) ((lanes)->slots + 32 * ((i) - LANE_REGS))
+
+static int
+lanes_blend(Lanes *lanes, int slot)
+{
+	return slot < 64 ? (int) (lanes->wait_live >> slot & 1) : slot < lanes->wait;
+}
+
+// Get the register with the slot, loading it into `tmp` if it's in memory.
+static int
+lanes_get(Lanes *lanes, int slot, int tmp)
+{
+	dasm_State **ds = &lanes->jit->ds;
+	if (slot < LANE_REGS) {
+		return slot;
+	}
+	//| vmovdqa ymm(tmp), [rsp + LANE_SLOT(lanes, slot)]
+	return tmp;
+}
+
+// The register to compute a value for the slot into, before `lanes_put`.
+static int
+lanes_dst(Lanes *lanes, int slot)
+{
+	return slot < LANE_REGS && !lanes_blend(lanes, slot) ? slot : 12;
+}
+
+// Store the value in register `reg` to the slot, in the active lanes only if
+// some waiting lane needs the slot.
+static void
+lanes_put(Lanes *lanes, int slot, int reg)
+{
+	dasm_State **ds = &lanes->jit->ds;
+	assert(reg != 13);
+	int blend = lanes_blend(lanes, slot);
+	if (slot >= LANE_REGS && !blend) {
+		//| vmovdqa [rsp + LANE_SLOT(lanes, slot)], ymm(reg)
+	} else if (slot >= LANE_REGS) {
+		//| vmovdqa ymm13, [rsp + LANE_SLOT(lanes, slot)]
+		//| vpblendvb ymm13, ymm13, ymm(reg), ymm15
+		//| vmovdqa [rsp + LANE_SLOT(lanes, slot)], ymm13
+	} else if (blend) {
+		//| vpblendvb ymm(slot), ymm(slot), ymm(reg), ymm15
+	} else if (reg != slot) {
+		//| vmovdqa ymm(slot), ymm(reg)
+	}
+}
+
+// Get a register with a constant of the bytecode in all lanes, broadcast to
+// `tmp`, unless it's zero.
+static int
+lanes_constant(Lanes *lanes, int tmp, i32 value)
+{
+	dasm_State **ds = &lanes->jit->ds;
+	if (value == 0) {
+		return 14;
+	}
+	lanes->constants[lanes->nconstants] = value;
+	if (lanes->narrow) {
+		//| vpbroadcastd ymm(tmp), dword [=>lanes->constant_labels + lanes->nconstants]
+	} else {
+		//| vpbroadcastq ymm(tmp), qword [=>lanes->constant_labels + lanes->nconstants]
+	}
+	lanes->nconstants++;
+	return tmp;
+}
+
+// The arithmetic of the lanes, in their width.
+static void
+lanes_add(Lanes *lanes, int dst, int a, int b)
+{
+	dasm_State **ds = &lanes->jit->ds;
+	if (lanes->narrow) {
+		//| vpaddd ymm(dst), ymm(a), ymm(b)
+	} else {
+		//| vpaddq ymm(dst), ymm(a), ymm(b)
+	}
+}
+
+static void
+lanes_sub(Lanes *lanes, int dst, int a, int b)
+{
+	dasm_State **ds = &lanes->jit->ds;
+	if (lanes->narrow) {
+		//| vpsubd ymm(dst), ymm(a), ymm(b)
+	} else {
+		//| vpsubq ymm(dst), ymm(a), ymm(b)
+	}
+}
+
+static void
+lanes_cmpgt(Lanes *lanes, int dst, int a, int b)
+{
+	dasm_State **ds = &lanes->jit->ds;
+	if (lanes->narrow) {
+		//| vpcmpgtd ymm(dst), ymm(a), ymm(b)
+	} else {
+		//| vpcmpgtq ymm(dst), ymm(a), ymm(b)
+	}
+}
+
+// The bits of the active lanes, in `eax`.
+static void
+lanes_active(Lanes *lanes)
+{
+	dasm_State **ds = &lanes->jit->ds;
+	if (lanes->narrow) {
+		//| vmovmskps eax, ymm15
+	} else {
+		//| vmovmskpd eax, ymm15
+	}
+}
+
+// Kill the active lanes with fewer than `need` values left in their record.
+static void
+lanes_input_check(Lanes *lanes, u32 need)
+{
+	dasm_State **ds = &lanes->jit->ds;
+	lanes_active(lanes);
+	for (int l = 0; l < lanes->n; l++) {
+		//| test eax, 1 << l
+		//| jz >1
+		//| mov rcx, [rsp + LANE_IN_END + 8 * l]
+		//| sub rcx, [rsp + LANE_IN + 8 * l]
+		//| cmp rcx, (int) (4 * need)
+		//| jae >1
+		if (lanes->narrow) {
+			//| mov dword [rsp + LANE_ALIVE + 4 * l], 0
+		} else {
+			//| mov qword [rsp + LANE_ALIVE + 8 * l], 0
+		}
+		//|1:
+	}
+	//| vpand ymm15, ymm15, [rsp + LANE_ALIVE]
+}
+
+// `OP_JGT` with the lanes which jump in `ymm11`, see `compile_lanes`.
+static void
+lanes_jump(Lanes *lanes, const LanePlan *plan, size_t offset, size_t program_len)
+{
+	dasm_State **ds = &lanes->jit->ds;
+	size_t index = plan->region_of[offset];
+	const LaneRegion *region = &plan->regions[index];
+	if (region->loop) {
+		//| vpand ymm15, ymm15, ymm11
+		//| vptest ymm15, ymm15
+		//| jnz =>program_len + index
+	} else {
+		//| vmovdqa [rsp + LANE_SAVED + 32 * region->level], ymm15
+		//| vpandn ymm15, ymm11, ymm15
+		//| vptest ymm15, ymm15
+		//| jz =>region->end
+	}
+}
+
+static void *
+compile_lanes(Jit *jit, u8 *program, size_t program_len, size_t *code_size)
+{
+	dasm_State **ds = &jit->ds;
+	double start = jit->profile ? now() : 0;
+	LanePlan plan;
+	if (!plan_lanes(program, program_len, &plan)) {
+		return NULL;
+	}
+	u8 *targets = find_jump_targets(program, program_len);
+	u32 *checks = find_input_checks(program, program_len, targets);
+	u8 *fusions = jit->opts.peephole ? find_fusions(program, program_len, targets) : NULL;
+	Lanes lanes = { .jit = jit, .slots = LANE_SAVED + 32 * plan.levels };
+	lanes.narrow = jit->opts.narrow && find_narrow(program, program_len, plan.depth, plan.max_depth, jit->opts.input_bits);
+	lanes.n = lanes.narrow ? LANES_NARROW : LANES;
+	lanes.constants = malloc((program_len / 5 + 1) * sizeof(lanes.constants[0]));
+	lanes.constant_labels = program_len + plan.nregions;
+	assert(lanes.constants);
+	int frame = lanes.slots + 32 * (plan.max_depth > LANE_REGS ? plan.max_depth - LANE_REGS : 0);
+
+	// The regions we are in, with the slots live where their lanes wait
+	// (for the innermost one, together with all outer ones).
+	size_t *open = malloc((plan.nregions + 1) * sizeof(open[0]));
+	u64 *open_live = malloc((plan.nregions + 1) * sizeof(open_live[0]));
+	int *open_wait = malloc((plan.nregions + 1) * sizeof(open_wait[0]));
+	assert(open && open_live && open_wait);
+	size_t nopen = 0;
+
+	// Labels of instructions are for forward jumps, which get there before
+	// the regions ending there are closed. Backward jumps go to a label
+	// after their loop is opened, one for each region. The rest are for
+	// the constants.
+	dasm_setup(Dst, our_dasm_actions);
+	dasm_growpc(Dst, lanes.constant_labels + program_len / 5 + 1);
+	jit->nrelocs = 0;
+	jit->nlines = 0;
+
+	// The function takes a `Batch`, which we keep in `rbx`.
+	//| push rbx
+	//| push rbp
+	//| mov rbp, rsp
+	//| sub rsp, frame
+	//| and rsp, -32
+	//| mov rbx, rdi
+	//| mov rax, [rbx + offsetof(Batch, count)]
+	//| mov [rsp + LANE_LEFT], rax
+	//| mov rax, [rbx + offsetof(Batch, records)]
+	//| mov [rsp + LANE_RECORD], rax
+	//| mov rax, [rbx + offsetof(Batch, outputs)]
+	//| mov [rsp + LANE_OUTPUT], rax
+	//| vpxor ymm14, ymm14, ymm14
+
+	// Give the next records to the lanes. If there are fewer than 4 (or 8)
+	// left, the rest of the lanes are dead from the start.
+	//|->lanes_next:
+	//| mov rax, [rsp + LANE_LEFT]
+	//| test rax, rax
+	//| jz ->lanes_ret
+	//| mov rcx, [rsp + LANE_RECORD]
+	//| mov rdx, [rsp + LANE_OUTPUT]
+	//| mov r8, [rbx + offsetof(Batch, record_len)]
+	//| shl r8, 2
+	//| mov r9, [rbx + offsetof(Batch, outputs_len)]
+	//| shl r9, 3
+	for (int l = 0; l < lanes.n; l++) {
+		//| mov [rsp + LANE_IN + 8 * l], rcx
+		//| add rcx, r8
+		//| mov [rsp + LANE_IN_END + 8 * l], rcx
+		//| mov [rsp + LANE_OUT + 8 * l], rdx
+		//| add rdx, r9
+		//| mov [rsp + LANE_OUT_END + 8 * l], rdx
+		//| xor r10d, r10d
+		//| cmp rax, l
+		//| seta r10b
+		//| neg r10
+		if (lanes.narrow) {
+			//| mov [rsp + LANE_ALIVE + 4 * l], r10d
+		} else {
+			//| mov [rsp + LANE_ALIVE + 8 * l], r10
+		}
+	}
+	//| mov [rsp + LANE_RECORD], rcx
+	//| mov [rsp + LANE_OUTPUT], rdx
+	//| sub rax, lanes.n
+	//| jae >1
+	//| xor eax, eax
+	//|1:
+	//| mov [rsp + LANE_LEFT], rax
+	//| vmovdqa ymm15, [rsp + LANE_ALIVE]
+
+	size_t next_start = 0, next_end = 0;
+	for (u8 *instrptr = program; instrptr < program + program_len;) {
+		size_t offset = (size_t) (instrptr - program);
+		int depth = plan.depth[offset];
+		//|=>offset:
+
+		// Regions ending here give the lanes waiting here back. Then
+		// loops starting here save the mask of the lanes entering them.
+		for (; next_end < plan.nregions && plan.regions[plan.by_end[next_end]].end <= offset; next_end++) {
+			LaneRegion *region = &plan.regions[plan.by_end[next_end]];
+			//| vmovdqa ymm15, [rsp + LANE_SAVED + 32 * region->level]
+			//| vpand ymm15, ymm15, [rsp + LANE_ALIVE]
+		}
+		while (nopen > 0 && plan.regions[open[nopen - 1]].end <= offset) {
+			nopen--;
+		}
+		for (; next_start < plan.nregions && plan.regions[next_start].start <= offset; next_start++) {
+			LaneRegion *region = &plan.regions[next_start];
+			int wait = plan.depth[region->end];
+			open_live[nopen] = plan.live[region->end] | (nopen > 0 ? open_live[nopen - 1] : 0);
+			open_wait[nopen] = nopen > 0 && open_wait[nopen - 1] > wait ? open_wait[nopen - 1] : wait;
+			open[nopen++] = next_start;
+			if (region->loop) {
+				//| vmovdqa [rsp + LANE_SAVED + 32 * region->level], ymm15
+				//|=>program_len + next_start:
+			}
+		}
+		lanes.wait_live = nopen > 0 ? open_live[nopen - 1] : 0;
+		lanes.wait = nopen > 0 ? open_wait[nopen - 1] : 0;
+		if (checks[offset]) {
+			lanes_input_check(&lanes, checks[offset]);
+		}
+
+		if (fusions && fusions[offset] != FUSE_NONE) {
+			switch (fusions[offset]) {
+			case FUSE_CMP_JGT: {
+				int a = lanes_get(&lanes, depth - 2, 12);
+				int b = lanes_get(&lanes, depth - 1, 13);
+				lanes_cmpgt(&lanes, 11, a, b);
+				lanes_jump(&lanes, &plan, offset + 1, program_len);
+				instrptr += 1 + 5;
+				break;
+			}
+			case FUSE_CONSTANT_CMP_JGT: {
+				int a = lanes_get(&lanes, depth - 1, 12);
+				int c = lanes_constant(&lanes, 13, read_operand(instrptr));
+				lanes_cmpgt(&lanes, 11, a, c);
+				lanes_jump(&lanes, &plan, offset + 5 + 1, program_len);
+				instrptr += 5 + 1 + 5;
+				break;
+			}
+			case FUSE_CONSTANT_ADD: {
+				int a = lanes_get(&lanes, depth - 1, 12);
+				int dst = lanes_dst(&lanes, depth - 1);
+				int c = lanes_constant(&lanes, 13, read_operand(instrptr));
+				lanes_add(&lanes, dst, a, c);
+				lanes_put(&lanes, depth - 1, dst);
+				instrptr += 5 + 1;
+				break;
+			}
+			case FUSE_GET_GET_ADD: {
+				// The second `OP_GET` may get the copy the first
+				// one pushed.
+				int a = lanes_get(&lanes, depth - 1 - read_operand(instrptr), 12);
+				int k = read_operand(instrptr + 5);
+				int b = k == 0 ? a : lanes_get(&lanes, depth - k, 13);
+				int dst = lanes_dst(&lanes, depth);
+				lanes_add(&lanes, dst, a, b);
+				lanes_put(&lanes, depth, dst);
+				instrptr += 5 + 5 + 1;
+				break;
+			}
+			case FUSE_NONE:
+				break;
+			}
+			continue;
+		}
+
+		switch (*instrptr) {
+		case OP_CONSTANT: {
+			int dst = lanes_dst(&lanes, depth);
+			lanes_put(&lanes, depth, lanes_constant(&lanes, dst, read_operand(instrptr)));
+			instrptr += 5; break;
+		}
+		case OP_ADD: {
+			int a = lanes_get(&lanes, depth - 2, 12);
+			int b = lanes_get(&lanes, depth - 1, 13);
+			int dst = lanes_dst(&lanes, depth - 2);
+			lanes_add(&lanes, dst, a, b);
+			lanes_put(&lanes, depth - 2, dst);
+			instrptr += 1; break;
+		}
+		case OP_CMP: {
+			// (a < b) - (a > b) is -1, 0 or 1, with all ones of the
+			// comparison as -1.
+			int a = lanes_get(&lanes, depth - 2, 12);
+			int b = lanes_get(&lanes, depth - 1, 13);
+			int dst = lanes_dst(&lanes, depth - 2);
+			lanes_cmpgt(&lanes, 11, a, b);
+			lanes_cmpgt(&lanes, dst, b, a);
+			lanes_sub(&lanes, dst, dst, 11);
+			lanes_put(&lanes, depth - 2, dst);
+			instrptr += 1; break;
+		}
+		case OP_PRINT:
+			if (depth - 1 < LANE_REGS) {
+				//| vmovdqa [rsp + LANE_SCRATCH], ymm(depth - 1)
+			} else {
+				//| vmovdqa ymm12, [rsp + LANE_SLOT(&lanes, depth - 1)]
+				//| vmovdqa [rsp + LANE_SCRATCH], ymm12
+			}
+			lanes_active(&lanes);
+			for (int l = 0; l < lanes.n; l++) {
+				//| test eax, 1 << l
+				//| jz >1
+				//| mov rcx, [rsp + LANE_OUT + 8 * l]
+				//| cmp rcx, [rsp + LANE_OUT_END + 8 * l]
+				//| jae >1
+				if (lanes.narrow) {
+					//| movsxd rdx, dword [rsp + LANE_SCRATCH + 4 * l]
+				} else {
+					//| mov rdx, [rsp + LANE_SCRATCH + 8 * l]
+				}
+				//| mov [rcx], rdx
+				//| add rcx, 8
+				//| mov [rsp + LANE_OUT + 8 * l], rcx
+				//|1:
+			}
+			instrptr += 1; break;
+		case OP_INPUT:
+			// Each lane reads from its own record, there's enough left,
+			// see `lanes_input_check`.
+			lanes_active(&lanes);
+			for (int l = 0; l < lanes.n; l++) {
+				//| test eax, 1 << l
+				//| jz >1
+				//| mov rcx, [rsp + LANE_IN + 8 * l]
+				//| mov edx, [rcx]
+				if (lanes.narrow) {
+					//| mov [rsp + LANE_SCRATCH + 4 * l], edx
+				} else {
+					//| mov [rsp + LANE_SCRATCH + 8 * l], rdx
+				}
+				//| add rcx, 4
+				//| mov [rsp + LANE_IN + 8 * l], rcx
+				//|1:
+			}
+			//| vmovdqa ymm12, [rsp + LANE_SCRATCH]
+			lanes_put(&lanes, depth, 12);
+			instrptr += 1; break;
+		case OP_DISCARD:
+			instrptr += 1; break;
+		case OP_GET:
+			lanes_put(&lanes, depth, lanes_get(&lanes, depth - 1 - read_operand(instrptr), 12));
+			instrptr += 5; break;
+		case OP_SET:
+			lanes_put(&lanes, depth - 2 - read_operand(instrptr), lanes_get(&lanes, depth - 1, 12));
+			instrptr += 5; break;
+		case OP_JGT: {
+			int value = lanes_get(&lanes, depth - 1, 12);
+			lanes_cmpgt(&lanes, 11, value, 14);
+			lanes_jump(&lanes, &plan, offset, program_len);
+			instrptr += 5; break;
+		}
+		case OP_HALT:
+			//| vpandn ymm11, ymm15, [rsp + LANE_ALIVE]
+			//| vmovdqa [rsp + LANE_ALIVE], ymm11
+			//| vpxor ymm15, ymm15, ymm15
+			//| vptest ymm11, ymm11
+			//| jz ->lanes_next
+			instrptr += 1; break;
+		}
+	}
+
+	//|->lanes_ret:
+	//| vzeroupper
+	//| mov rsp, rbp
+	//| pop rbp
+	//| pop rbx
+	//| ret
+
+	//|.align 8
+	for (size_t i = 0; i < lanes.nconstants; i++) {
+		//|=>lanes.constant_labels + i:
+		//|.dword lanes.constants[i], lanes.constants[i] < 0 ? -1 : 0
+	}
+
+	free(lanes.constants);
+	free(open);
+	free(open_live);
+	free(open_wait);
+	free(fusions);
+	free(checks);
+	free(targets);
+	plan_lanes_free(&plan);
+	if (jit->profile) {
+		jit->times[0] += now() - start;
+	}
+	return jit_encode(jit, "bytecode_lanes", program_len, code_size);
+}
+
+// The template compiler below translates each instruction (or fused
+// sequence) on its own, in one pass. Programs which run for long can afford to
+// spend more time compiling, so there is also an optimizing tier (the
+// `optimize` option). It first "lifts" the bytecode into a representation
+// which is easier to reason about than a stack machine, SSA ("static single
+// assignment") form:
+//
+//  - The program is split into basic blocks, the same as for input checks:
+//    they start at the entry, at jump targets and after jumps (and halts).
+//
+//  - Each instruction which computes something becomes a value. It's defined
+//    once and refers to its operands directly, not through slots of the
+//    operand stack. `OP_GET`, `OP_SET` and `OP_DISCARD` disappear, they only
+//    move values around the stack at compile time.
+//
+//  - Where blocks meet, a slot may hold different values depending on where
+//    we came from. So each block has a parameter for each slot of the stack
+//    at its start, and the jumps to it pass the values of the slots as
+//    arguments. (This is the same thing as the phi functions of textbooks,
+//    just written differently.)
+//
+// For this the stack has to have the same depth whichever way we get to an
+// instruction, see `find_stack_depths`. Other programs are left to the
+// template compiler.
+//
+// In SSA form, simplifications are easy to do and cheap to repeat until
+// nothing changes:
+//
+//  - Values of constant operands are precomputed ("constant folding"), a jump
+//    on the result of `OP_CMP` is a jump on the comparison itself (`OP_CONSTANT
+//    0; OP_CMP; OP_JGT` ends up as `cmp value, 0; jg`), and a jump on a
+//    constant is either always or never taken.
+//
+//  - A parameter which gets the same value from all the jumps to its block
+//    is that value. That's most slots below the top of the stack in loops.
+//
+//  - Loops which only count, like the multiplication loop of `main`, are
+//    replaced by the computation of what they leave on the stack, see
+//    `ir_simplify_loop`.
+//
+// What is not used after that is dead and removed, e.g. values stored with
+// `OP_SET` to slots which are overwritten before anything reads them. Finally,
+// each value gets a register (or a stack slot, if there are not enough of
+// them) by linear scan register allocation, see `ir_allocate`, and the code is
+// emitted block after block.
+//
+// When the interpreter compiles a hot loop (`--exec=tiered`), it also knows
+// which way each `OP_JGT` went so far. A direction never taken is then not
+// compiled at all, the branch goes to an exit back to the interpreter instead
+// ("deoptimization"). This is a guess, but one which lets the simplifications
+// above go further: the code behind the exit is gone, and with it the values
+// it passes to the blocks it jumps to. If the guess turns out wrong, the exit
+// hands the state of the program over to the interpreter, which goes on from
+// the bytecode of the direction taken. For that each exit (and each loop head,
+// where the interpreter enters the compiled code in the first place) has the
+// values of the slots of the stack recorded, see `Safepoint`.
+
+enum ir_op {
+	IR_CONST,	// `imm`
+	IR_PARAM,	// a parameter of its block
+	IR_INPUT,
+	IR_ADD,		// a + b
+	IR_SUB,		// a - b
+	IR_MUL,		// a * b
+	IR_CMP,		// a > b ? 1 : a == b ? 0 : -1
+	IR_TRIP_DOWN,	// a - 1 > b ? a - b : 1, see `ir_simplify_loop`
+	IR_TRIP_UP,	// b > a + 1 ? b - a : 1
+	IR_PRINT,	// prints a
+};
+
+#define IR_NONE ((u32) -1)
+
+typedef struct {
+	u8 op;
+	u8 live;
+	// The block it's computed in, `IR_NONE` for constants, which aren't
+	// computed anywhere (they are immediates of the instructions using them).
+	u32 block;
+	u32 a, b;
+	i64 imm;
+	// What it was replaced by (the value itself if not replaced).
+	u32 same;
+	u32 uses;
+	// The live range and the location given by `ir_allocate`: a register,
+	// or a stack slot if negative, see `IR_SPILL`.
+	u32 start, end;
+	int loc;
+} IrValue;
+
+enum ir_exit {
+	IR_HALT,
+	IR_JUMP,	// to `succ[0]`
+	IR_BRANCH,	// to `succ[0]` if a > b, otherwise to `succ[1]`
+	IR_DEOPT,	// back to the interpreter, at `offset` with `slots`
+};
+
+// Which ways the interpreter has seen an `OP_JGT` go, see `interpret`.
+#define BRANCH_TAKEN 1
+#define BRANCH_NOT_TAKEN 2
+
+typedef struct {
+	size_t offset;
+	u32 need;
+	int reachable;
+	u32 *params;
+	u32 nparams;
+	// The values computed in the block, in order.
+	u32 *insts;
+	u32 ninsts, insts_cap;
+	u8 exit;
+	u32 a, b;
+	// The successors, with arguments for their parameters.
+	u32 succ[2];
+	u32 *args[2];
+	// The (distinct) reachable blocks jumping here, see `ir_link`.
+	u32 *preds;
+	u32 npreds;
+	// Positions for the register allocator.
+	u32 start, end;
+	// The values of the slots of the stack at the start, the parameters as
+	// they were built (they may be replaced later). For an `IR_DEOPT`
+	// block these are used by the exit, which is taken when the `OP_JGT`
+	// at `branch` goes the way `direction`.
+	u32 *slots;
+	u32 nslots;
+	size_t branch;
+	u8 direction;
+	// Whether the interpreter can enter the code here (a loop head). It
+	// comes with any values in the slots, so the parameters stay. Then the
+	// values live at the start other than the parameters, see `ir_live_in`.
+	u8 entry;
+	u32 *live_in;
+	u32 nlive_in, live_in_cap;
+} IrBlock;
+
+typedef struct {
+	IrValue *values;
+	u32 nvalues, values_cap;
+	IrBlock *blocks;
+	u32 nblocks;
+} Ir;
+
+static u32
+ir_value(Ir *ir, enum ir_op op, u32 block, u32 a, u32 b, i64 imm)
+{
+	if (ir->nvalues == ir->values_cap) {
+		ir->values_cap = ir->values_cap ? 2 * ir->values_cap : 256;
+		ir->values = realloc(ir->values, ir->values_cap * sizeof(ir->values[0]));
+		assert(ir->values);
+	}
+	u32 v = ir->nvalues++;
+	ir->values[v] = (IrValue) { .op = op, .block = block, .a = a, .b = b, .imm = imm, .same = v };
+	return v;
+}
+
+static u32
+ir_const(Ir *ir, i64 imm)
+{
+	return ir_value(ir, IR_CONST, IR_NONE, 0, 0, imm);
+}
+
+// Add a value computed by the block, after those already there.
+static u32
+ir_inst(Ir *ir, u32 block, enum ir_op op, u32 a, u32 b)
+{
+	u32 v = ir_value(ir, op, block, a, b, 0);
+	IrBlock *blk = &ir->blocks[block];
+	if (blk->ninsts == blk->insts_cap) {
+		blk->insts_cap = blk->insts_cap ? 2 * blk->insts_cap : 8;
+		blk->insts = realloc(blk->insts, blk->insts_cap * sizeof(blk->insts[0]));
+		assert(blk->insts);
+	}
+	blk->insts[blk->ninsts++] = v;
+	return v;
+}
+
+static u32
+ir_resolve(Ir *ir, u32 v)
+{
+	while (ir->values[v].same != v) {
+		v = ir->values[v].same;
+	}
+	return v;
+}
+
+static int
+ir_is_const(Ir *ir, u32 v, i64 imm)
+{
+	return ir->values[v].op == IR_CONST && ir->values[v].imm == imm;
+}
+
+static int
+ir_nsucc(const IrBlock *blk)
+{
+	return blk->exit == IR_BRANCH ? 2 : blk->exit == IR_JUMP;
+}
+
+static void
+ir_free(Ir *ir)
+{
+	for (u32 b = 0; b < ir->nblocks; b++) {
+		IrBlock *blk = &ir->blocks[b];
+		free(blk->params);
+		free(blk->insts);
+		free(blk->args[0]);
+		free(blk->args[1]);
+		free(blk->preds);
+		free(blk->slots);
+		free(blk->live_in);
+	}
+	free(ir->blocks);
+	free(ir->values);
+}
+
+// Whether the branch went only one way, so that we compile an exit for the
+// other, see `ir_deopt`.
+static int
+ir_speculated(u8 seen)
+{
+	return seen == BRANCH_TAKEN || seen == BRANCH_NOT_TAKEN;
+}
+
+// Replace the jump `s` of the branch at the end of the block `b` (which has
+// `depth` arguments) by a jump to a new `IR_DEOPT` block, which continues in
+// the interpreter where the jump went. Its parameters are its slots.
+static void
+ir_deopt(Ir *ir, u32 b, int s, u32 depth, size_t branch)
+{
+	u32 d = ir->nblocks++;
+	IrBlock *deopt = &ir->blocks[d];
+	deopt->offset = ir->blocks[ir->blocks[b].succ[s]].offset;
+	deopt->exit = IR_DEOPT;
+	deopt->branch = branch;
+	deopt->direction = s == 0 ? BRANCH_TAKEN : BRANCH_NOT_TAKEN;
+	deopt->nparams = deopt->nslots = depth;
+	deopt->params = malloc(((size_t) depth + 1) * sizeof(deopt->params[0]));
+	deopt->slots = malloc(((size_t) depth + 1) * sizeof(deopt->slots[0]));
+	assert(deopt->params && deopt->slots);
+	for (u32 i = 0; i < depth; i++) {
+		deopt->slots[i] = deopt->params[i] = ir_value(ir, IR_PARAM, d, 0, 0, i);
+	}
+	ir->blocks[b].succ[s] = d;
+}
+
+// Lift the program into SSA form. We go through each block with the stack of
+// values in the slots, starting with the parameters. With `branches` (see
+// `interpret`), directions of `OP_JGT` not seen go to `IR_DEOPT` blocks,
+// after all the others. With `enterable`, loop heads are entries.
+static int
+ir_build(Ir *ir, u8 *program, size_t program_len, const u8 *branches, int enterable)
+{
+	memset(ir, 0, sizeof(*ir));
+	int max_depth;
+	int *depths = find_stack_depths(program, program_len, &max_depth);
+	if (!depths) {
+		return 0;
+	}
+	u8 *targets = find_jump_targets(program, program_len);
+	u32 *checks = find_input_checks(program, program_len, targets);
+	u32 *block_at = malloc((program_len ? program_len : 1) * sizeof(block_at[0]));
+	assert(block_at);
+	int starts = 1;
+	u32 ndeopts = 0;
+	for (u8 *instrptr = program; instrptr < program + program_len; instrptr += op_length(*instrptr)) {
+		size_t offset = (size_t) (instrptr - program);
+		block_at[offset] = starts || targets[offset] ? ir->nblocks++ : IR_NONE;
+		starts = op_ends_block(*instrptr);
+		ndeopts += *instrptr == OP_JGT && branches && ir_speculated(branches[offset]);
+	}
+	u32 nblocks = ir->nblocks;
+	ir->blocks = calloc((size_t) nblocks + ndeopts, sizeof(ir->blocks[0]));
+	assert(ir->blocks);
+	for (size_t offset = 0; offset < program_len; offset += op_length(program[offset])) {
+		if (block_at[offset] != IR_NONE) {
+			ir->blocks[block_at[offset]].offset = offset;
+		}
+	}
+
+	u32 *stack = malloc(((size_t) max_depth + 1) * sizeof(stack[0]));
+	assert(stack);
+	for (u32 b = 0; b < nblocks; b++) {
+		IrBlock *blk = &ir->blocks[b];
+		int depth = depths[blk->offset];
+		blk->need = checks[blk->offset];
+		blk->entry = enterable && (targets[blk->offset] & TARGET_LOOP);
+		blk->nparams = blk->nslots = (u32) depth;
+		blk->params = malloc(((size_t) depth + 1) * sizeof(blk->params[0]));
+		blk->slots = malloc(((size_t) depth + 1) * sizeof(blk->slots[0]));
+		assert(blk->params && blk->slots);
+		for (int i = 0; i < depth; i++) {
+			stack[i] = blk->slots[i] = blk->params[i] = ir_value(ir, IR_PARAM, b, 0, 0, i);
+		}
+		u8 *instrptr = program + blk->offset;
+		for (;;) {
+			switch (*instrptr) {
+			case OP_CONSTANT:
+				stack[depth++] = ir_const(ir, read_operand(instrptr));
+				break;
+			case OP_INPUT:
+				stack[depth++] = ir_inst(ir, b, IR_INPUT, 0, 0);
+				break;
+			case OP_ADD:
+				depth--;
+				stack[depth - 1] = ir_inst(ir, b, IR_ADD, stack[depth - 1], stack[depth]);
+				break;
+			case OP_CMP:
+				depth--;
+				stack[depth - 1] = ir_inst(ir, b, IR_CMP, stack[depth - 1], stack[depth]);
+				break;
+			case OP_PRINT:
+				depth--;
+				ir_inst(ir, b, IR_PRINT, stack[depth], 0);
+				break;
+			case OP_DISCARD:
+				depth--;
+				break;
+			case OP_GET:
+				stack[depth] = stack[depth - 1 - read_operand(instrptr)];
+				depth++;
+				break;
+			case OP_SET:
+				depth--;
+				stack[depth - 1 - read_operand(instrptr)] = stack[depth];
+				break;
+			case OP_JGT:
+				depth--;
+				blk->exit = IR_BRANCH;
+				blk->a = stack[depth];
+				blk->b = ir_const(ir, 0);
+				blk->succ[0] = block_at[instrptr - program + read_operand(instrptr)];
+				break;
+			case OP_HALT:
+				blk->exit = IR_HALT;
+				break;
+			}
+			size_t next = (size_t) (instrptr - program) + op_length(*instrptr);
+			if (*instrptr == OP_HALT) {
+				break;
+			}
+			if (*instrptr == OP_JGT || block_at[next] != IR_NONE) {
+				int n = blk->exit == IR_BRANCH ? 2 : 1;
+				if (n == 1) {
+					blk->exit = IR_JUMP;
+				}
+				blk->succ[n - 1] = block_at[next];
+				for (int s = 0; s < n; s++) {
+					blk->args[s] = malloc(((size_t) depth + 1) * sizeof(stack[0]));
+					assert(blk->args[s]);
+					memcpy(blk->args[s], stack, (size_t) depth * sizeof(stack[0]));
+				}
+				size_t offset = (size_t) (instrptr - program);
+				if (*instrptr == OP_JGT && branches && ir_speculated(branches[offset])) {
+					ir_deopt(ir, b, branches[offset] == BRANCH_TAKEN, (u32) depth, offset);
+				}
+				break;
+			}
+			instrptr = program + next;
+		}
+	}
+	free(stack);
+	free(block_at);
+	free(checks);
+	free(targets);
+	free(depths);
+	return 1;
+}
+
+// The optimizing tier compiles the whole program, and only when the depth of
+// the stack is static. With `--exec=trace` the interpreter compiles hot loops
+// one at a time instead, as traces: once a backward jump is taken `hot`
+// times, the interpreter records the instructions of the next iteration of
+// the loop, from its head until it's back there, and which way each `OP_JGT`
+// went. That is one straight path through the loop, with the calls of the
+// interpreter in between gone, whatever the blocks and jumps along it.
+//
+// The path is lifted into SSA form like a program (see `ir_build`), with a
+// block wherever an input check is, and each `OP_JGT` becomes a guard: the
+// way the trace went continues the path, the other exits to the interpreter
+// ("side exit", an `IR_DEOPT` block). The loop is lifted twice, the first
+// iteration ("peeled") is where the interpreter enters the trace and leads
+// into the second, which jumps back to its own start. The loop then isn't an
+// entry, so slots which stay the same in it are simplified away as in any
+// loop, and values computed only from them and constants are moved ahead of
+// it, into the last block of the first iteration ("loop invariant
+// hoisting"), see `ir_hoist`. The rest is the optimizing tier: the same
+// simplifications, registers and code, with the frame image for the
+// interpreter at the entry and the exits.
+//
+// A trace only touches the top `depth` slots of the stack, deeper ones stay
+// with the interpreter, so it works whatever the depth of the stack (it has
+// to be the same again at the end of the iteration though). Traces which
+// would call, return or halt, or are longer than `TRACE_MAX`, are given up
+// and their loop isn't recorded again.
+#define TRACE_MAX 1024
+
+typedef struct {
+	size_t start;
+	size_t len;
+	// The depth of the stack at the start, while recording, then the
+	// number of slots the trace touches.
+	size_t entry_depth;
+	u32 depth;
+	// Whether each `OP_JGT` on the way was taken.
+	u8 taken[TRACE_MAX];
+	size_t ntaken;
+} Trace;
+
+// A new block of the trace, starting at `offset` with `depth` slots, the
+// parameters, which are also put in `stack` if it's not `NULL`.
+static u32
+ir_trace_block(Ir *ir, u32 *stack, u32 depth, size_t offset)
+{
+	u32 b = ir->nblocks++;
+	IrBlock *blk = &ir->blocks[b];
+	blk->offset = offset;
+	blk->nparams = blk->nslots = depth;
+	blk->params = malloc(((size_t) depth + 1) * sizeof(blk->params[0]));
+	blk->slots = malloc(((size_t) depth + 1) * sizeof(blk->slots[0]));
+	assert(blk->params && blk->slots);
+	for (u32 i = 0; i < depth; i++) {
+		blk->slots[i] = blk->params[i] = ir_value(ir, IR_PARAM, b, 0, 0, i);
+		if (stack) {
+			stack[i] = blk->params[i];
+		}
+	}
+	return b;
+}
+
+// Lift the trace into SSA form, the entry is the block 0. Returns the start
+// of the loop, with the block jumping there from the first iteration in
+// `*pre`.
+static u32
+ir_build_trace(Ir *ir, u8 *program, size_t program_len, const Trace *trace, u32 *pre)
+{
+	memset(ir, 0, sizeof(*ir));
+	u8 *targets = find_jump_targets(program, program_len);
+	u32 *checks = find_input_checks(program, program_len, targets);
+	free(targets);
+	// Each instruction ends at most two blocks, the next one and an exit.
+	ir->blocks = calloc(4 * trace->len + 1, sizeof(ir->blocks[0]));
+	u32 *stack = malloc(((size_t) trace->depth + trace->len + 1) * sizeof(stack[0]));
+	assert(ir->blocks && stack);
+	u32 depth = trace->depth;
+	u32 b = ir_trace_block(ir, stack, depth, trace->start);
+	ir->blocks[b].entry = 1;
+	ir->blocks[b].need = checks[trace->start];
+	u32 head = IR_NONE;
+	for (int peeled = 1; peeled >= 0; peeled--) {
+		size_t offset = trace->start;
+		size_t ntaken = 0;
+		for (size_t n = 0; n < trace->len; n++) {
+			u8 *instrptr = program + offset;
+			size_t next = offset + op_length(*instrptr);
+			// A guard goes on with `next` as the way `s` of the
+			// branch, the other way exits at `exit`.
+			int guard = 0;
+			int s = 0;
+			size_t exit = 0;
+			u32 cond = IR_NONE;
+			switch (*instrptr) {
+			case OP_CONSTANT:
+				stack[depth++] = ir_const(ir, read_operand(instrptr));
+				break;
+			case OP_INPUT:
+				stack[depth++] = ir_inst(ir, b, IR_INPUT, 0, 0);
+				break;
+			case OP_ADD:
+				depth--;
+				stack[depth - 1] = ir_inst(ir, b, IR_ADD, stack[depth - 1], stack[depth]);
+				break;
+			case OP_CMP:
+				depth--;
+				stack[depth - 1] = ir_inst(ir, b, IR_CMP, stack[depth - 1], stack[depth]);
+				break;
+			case OP_PRINT:
+				depth--;
+				ir_inst(ir, b, IR_PRINT, stack[depth], 0);
+				break;
+			case OP_DISCARD:
+				depth--;
+				break;
+			case OP_GET:
+				stack[depth] = stack[depth - 1 - read_operand(instrptr)];
+				depth++;
+				break;
+			case OP_SET:
+				depth--;
+				stack[depth - 1 - read_operand(instrptr)] = stack[depth];
+				break;
+			case OP_JGT: {
+				depth--;
+				cond = stack[depth];
+				size_t target = offset + read_operand(instrptr);
+				int taken = trace->taken[ntaken++];
+				guard = target != next;
+				s = !taken;
+				exit = taken ? next : target;
+				next = taken ? target : next;
+				break;
+			}
+			}
+			int last = n + 1 == trace->len;
+			if (!guard && !last && !checks[next]) {
+				offset = next;
+				continue;
+			}
+
+			// The block ends here, the next one starts the loop
+			// after the first iteration.
+			IrBlock *blk = &ir->blocks[b];
+			u32 *args = malloc(((size_t) depth + 1) * sizeof(args[0]));
+			assert(args);
+			memcpy(args, stack, (size_t) depth * sizeof(args[0]));
+			u32 to = head;
+			if (!(last && !peeled)) {
+				to = ir_trace_block(ir, stack, depth, next);
+				ir->blocks[to].need = checks[next];
+			}
+			if (last && peeled) {
+				head = to;
+				*pre = b;
+			}
+			if (guard) {
+				u32 d = ir_trace_block(ir, NULL, depth, exit);
+				ir->blocks[d].exit = IR_DEOPT;
+				ir->blocks[d].branch = offset;
+				ir->blocks[d].direction = s == 0 ? BRANCH_NOT_TAKEN : BRANCH_TAKEN;
+				blk->exit = IR_BRANCH;
+				blk->a = cond;
+				blk->b = ir_const(ir, 0);
+				blk->succ[s] = to;
+				blk->args[s] = args;
+				blk->succ[1 - s] = d;
+				blk->args[1 - s] = malloc(((size_t) depth + 1) * sizeof(args[0]));
+				assert(blk->args[1 - s]);
+				memcpy(blk->args[1 - s], args, (size_t) depth * sizeof(args[0]));
+			} else {
+				blk->exit = IR_JUMP;
+				blk->succ[0] = to;
+				blk->args[0] = args;
+			}
+			b = to;
+			offset = next;
+		}
+		assert(offset == trace->start && depth == trace->depth);
+	}
+	free(stack);
+	free(checks);
+	return head;
+}
+
+// Find the blocks reachable from the entry and their predecessors.
+static void
+ir_link(Ir *ir)
+{
+	u32 *work = malloc(((size_t) ir->nblocks + 1) * sizeof(work[0]));
+	u32 *counts = calloc((size_t) ir->nblocks + 1, sizeof(counts[0]));
+	assert(work && counts);
+	for (u32 b = 0; b < ir->nblocks; b++) {
+		ir->blocks[b].reachable = 0;
+		ir->blocks[b].npreds = 0;
+	}
+	size_t nwork = 0;
+	ir->blocks[0].reachable = 1;
+	work[nwork++] = 0;
+	while (nwork > 0) {
+		IrBlock *blk = &ir->blocks[work[--nwork]];
+		for (int s = 0; s < ir_nsucc(blk); s++) {
+			if (s == 1 && blk->succ[1] == blk->succ[0]) {
+				break;
+			}
+			IrBlock *succ = &ir->blocks[blk->succ[s]];
+			counts[blk->succ[s]]++;
+			if (!succ->reachable) {
+				succ->reachable = 1;
+				work[nwork++] = blk->succ[s];
+			}
+		}
+	}
+	for (u32 b = 0; b < ir->nblocks; b++) {
+		free(ir->blocks[b].preds);
+		ir->blocks[b].preds = malloc(((size_t) counts[b] + 1) * sizeof(u32));
+		assert(ir->blocks[b].preds);
+	}
+	for (u32 b = 0; b < ir->nblocks; b++) {
+		IrBlock *blk = &ir->blocks[b];
+		for (int s = 0; blk->reachable && s < ir_nsucc(blk); s++) {
+			if (s == 1 && blk->succ[1] == blk->succ[0]) {
+				break;
+			}
+			IrBlock *succ = &ir->blocks[blk->succ[s]];
+			succ->preds[succ->npreds++] = b;
+		}
+	}
+	free(counts);
+	free(work);
+}
+
+// The block `p` no longer jumps to `b`. (Whether `b` is still reachable is
+// found out by the next `ir_link`.)
+static void
+ir_remove_pred(Ir *ir, u32 b, u32 p)
+{
+	IrBlock *blk = &ir->blocks[b];
+	for (u32 i = 0; i < blk->npreds; i++) {
+		if (blk->preds[i] == p) {
+			blk->preds[i] = blk->preds[--blk->npreds];
+			break;
+		}
+	}
+}
+
+// Remove the parameter `i` of the block, and its arguments from the jumps to
+// it.
+static void
+ir_remove_param(Ir *ir, u32 b, u32 i)
+{
+	IrBlock *blk = &ir->blocks[b];
+	blk->nparams--;
+	memmove(&blk->params[i], &blk->params[i + 1], (blk->nparams - i) * sizeof(blk->params[0]));
+	for (u32 p = 0; p < blk->npreds; p++) {
+		IrBlock *pred = &ir->blocks[blk->preds[p]];
+		for (int s = 0; s < ir_nsucc(pred); s++) {
+			if (pred->succ[s] == b) {
+				memmove(&pred->args[s][i], &pred->args[s][i + 1], (blk->nparams - i) * sizeof(u32));
+			}
+		}
+	}
+}
+
+// Replace the parameters of the block which get the same value from all
+// jumps (other than from the block itself, a loop) by that value. An entry
+// has the interpreter jumping there as well.
+static int
+ir_forward_params(Ir *ir, u32 b)
+{
+	IrBlock *blk = &ir->blocks[b];
+	int changed = 0;
+	if (blk->entry) {
+		return 0;
+	}
+	for (u32 i = blk->nparams; i-- > 0;) {
+		u32 param = blk->params[i];
+		u32 same = IR_NONE;
+		int unique = 1;
+		for (u32 p = 0; unique && p < blk->npreds; p++) {
+			IrBlock *pred = &ir->blocks[blk->preds[p]];
+			for (int s = 0; s < ir_nsucc(pred); s++) {
+				if (pred->succ[s] != b) {
+					continue;
+				}
+				u32 arg = pred->args[s][i] = ir_resolve(ir, pred->args[s][i]);
+				if (arg == param) {
+					continue;
+				}
+				if (same != IR_NONE && same != arg) {
+					unique = 0;
+				}
+				same = arg;
+			}
+		}
+		if (unique && same != IR_NONE) {
+			ir->values[param].same = same;
+			ir_remove_param(ir, b, i);
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+// Fold the constants and the branches, in reachable blocks. We go in the
+// order of the blocks, replacing parameters first, so that constants get
+// through whole chains of blocks in one pass.
+static int
+ir_fold(Ir *ir)
+{
+	int changed = 0;
+	for (u32 b = 0; b < ir->nblocks; b++) {
+		IrBlock *blk = &ir->blocks[b];
+		if (!blk->reachable) {
+			continue;
+		}
+		changed |= ir_forward_params(ir, b);
+		u32 n = 0;
+		for (u32 i = 0; i < blk->ninsts; i++) {
+			u32 v = blk->insts[i];
+			IrValue *value = &ir->values[v];
+			if (value->op != IR_INPUT) {
+				value->a = ir_resolve(ir, value->a);
+			}
+			if (value->op != IR_INPUT && value->op != IR_PRINT) {
+				value->b = ir_resolve(ir, value->b);
+			}
+			u32 a = value->a, b = value->b;
+			int consts = value->op != IR_INPUT && value->op != IR_PRINT
+				&& ir->values[a].op == IR_CONST && ir->values[b].op == IR_CONST;
+			// Wrapping arithmetic, as in the machine code.
+			u64 x = (u64) ir->values[a].imm, y = (u64) ir->values[b].imm;
+			u32 same = v;
+			switch (value->op) {
+			case IR_ADD:
+				if (consts) {
+					same = ir_const(ir, (i64) (x + y));
+				} else if (ir_is_const(ir, b, 0)) {
+					same = a;
+				} else if (ir_is_const(ir, a, 0)) {
+					same = b;
+				}
+				break;
+			case IR_SUB:
+				if (consts) {
+					same = ir_const(ir, (i64) (x - y));
+				} else if (ir_is_const(ir, b, 0)) {
+					same = a;
+				}
+				break;
+			case IR_MUL:
+				if (consts) {
+					same = ir_const(ir, (i64) (x * y));
+				} else if (ir_is_const(ir, b, 1)) {
+					same = a;
+				} else if (ir_is_const(ir, a, 1)) {
+					same = b;
+				}
+				break;
+			case IR_CMP:
+				if (consts) {
+					i64 sx = (i64) x, sy = (i64) y;
+					same = ir_const(ir, sx > sy ? 1 : sx == sy ? 0 : -1);
+				} else if (a == b) {
+					same = ir_const(ir, 0);
+				}
+				break;
+			}
+			if (same != v) {
+				ir->values[v].same = same;
+				changed = 1;
+			} else {
+				blk->insts[n++] = v;
+			}
+		}
+		blk->ninsts = n;
+
+		if (blk->exit != IR_BRANCH) {
+			continue;
+		}
+		blk->a = ir_resolve(ir, blk->a);
+		blk->b = ir_resolve(ir, blk->b);
+		IrValue *a = &ir->values[blk->a];
+		if (a->op == IR_CMP && ir_is_const(ir, blk->b, 0)) {
+			// The result of `OP_CMP` is positive exactly if a > b.
+			blk->a = ir_resolve(ir, a->a);
+			blk->b = ir_resolve(ir, a->b);
+			changed = 1;
+		}
+		int taken = -1;
+		if (ir->values[blk->a].op == IR_CONST && ir->values[blk->b].op == IR_CONST) {
+			taken = ir->values[blk->a].imm > ir->values[blk->b].imm;
+		} else if (blk->a == blk->b) {
+			taken = 0;
+		}
+		if (taken >= 0) {
+			if (blk->succ[0] != blk->succ[1]) {
+				// The jump we drop.
+				ir_remove_pred(ir, blk->succ[taken], b);
+			}
+			if (!taken) {
+				free(blk->args[0]);
+				blk->succ[0] = blk->succ[1];
+				blk->args[0] = blk->args[1];
+			} else {
+				free(blk->args[1]);
+			}
+			blk->args[1] = NULL;
+			blk->exit = IR_JUMP;
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+// Whether the value is the same in all iterations of the loop of the block
+// `b` (to a limited depth of operands).
+static int
+ir_invariant(Ir *ir, u32 b, u32 v, int limit)
+{
+	IrValue *value = &ir->values[v];
+	IrBlock *blk = &ir->blocks[b];
+	if (value->op == IR_CONST || value->block != b) {
+		return 1;
+	}
+	switch (value->op) {
+	case IR_PARAM:
+		for (u32 i = 0; i < blk->nparams; i++) {
+			if (blk->params[i] == v) {
+				return ir_resolve(ir, blk->args[0][i]) == v;
+			}
+		}
+		return 0;
+	case IR_ADD:
+	case IR_SUB:
+	case IR_MUL:
+	case IR_CMP:
+		return limit > 0 && ir_invariant(ir, b, ir_resolve(ir, value->a), limit - 1)
+			&& ir_invariant(ir, b, ir_resolve(ir, value->b), limit - 1);
+	default:
+		return 0;
+	}
+}
+
+// If `v` is `param + step` or `step + param` with `step` invariant, return
+// the step, otherwise `IR_NONE`.
+static u32
+ir_step(Ir *ir, u32 b, u32 v, u32 param)
+{
+	IrValue *value = &ir->values[v];
+	if (value->op != IR_ADD || value->block != b) {
+		return IR_NONE;
+	}
+	u32 x = ir_resolve(ir, value->a), y = ir_resolve(ir, value->b);
+	if (x == param && ir_invariant(ir, b, y, 4)) {
+		return y;
+	}
+	if (y == param && ir_invariant(ir, b, x, 4)) {
+		return x;
+	}
+	return IR_NONE;
+}
+
+// A block which jumps back to itself, without reading the input or printing,
+// is a loop which only computes. If it counts a slot (the "induction
+// variable") one by one towards a limit which doesn't change, and jumps while
+// the count didn't reach it
+//
+//         next = count - 1; if (next > limit) jump   or
+//         next = count + 1; if (limit > next) jump
+//
+// we can tell the number of iterations `k` (at least 1) at its start, and
+// skip it: the count ends up at `count - k` (`count + k`), a slot adding
+// something invariant ends up at `slot + step * k` and a slot set to
+// something invariant is that. If anything else computed by the loop is used
+// after it, we don't touch it.
+//
+// Counting down, the loop ends after the first iteration if `count - 1 <=
+// limit`. Otherwise it ends once the count (going down by one, without
+// skipping the limit) is `limit`, after `count - limit` iterations. This is
+// true even when `count - 1` wraps around, with wrapping arithmetic.
+typedef struct {
+	u32 block;
+	// The index of the parameter which counts.
+	u32 counter;
+	u32 limit;
+	enum ir_op trip;
+	// The uses of values of the loop after it, see `ir_simplify_loops`.
+	size_t uses;
+} IrLoop;
+
+// Whether the block is such a loop.
+static int
+ir_counted_loop(Ir *ir, u32 b, IrLoop *loop)
+{
+	IrBlock *blk = &ir->blocks[b];
+	if (!blk->reachable || blk->exit != IR_BRANCH || blk->succ[0] != b || blk->succ[1] == b || blk->need) {
+		return 0;
+	}
+	for (u32 i = 0; i < blk->ninsts; i++) {
+		enum ir_op op = ir->values[blk->insts[i]].op;
+		if (op == IR_INPUT || op == IR_PRINT) {
+			return 0;
+		}
+	}
+	u32 next = ir_resolve(ir, blk->a), limit = ir_resolve(ir, blk->b);
+	enum ir_op trip = IR_TRIP_DOWN;
+	if (ir_invariant(ir, b, next, 4)) {
+		u32 t = next;
+		next = limit;
+		limit = t;
+		trip = IR_TRIP_UP;
+	}
+	if (!ir_invariant(ir, b, limit, 4)) {
+		return 0;
+	}
+	for (u32 i = 0; i < blk->nparams; i++) {
+		u32 step = ir_step(ir, b, next, blk->params[i]);
+		if (ir_resolve(ir, blk->args[0][i]) == next && step != IR_NONE
+		    && ir_is_const(ir, step, trip == IR_TRIP_DOWN ? -1 : 1)) {
+			*loop = (IrLoop) { .block = b, .counter = i, .limit = limit, .trip = trip };
+			return 1;
+		}
+	}
+	return 0;
+}
+
+typedef struct {
+	u32 loop;
+	u32 *use;
+} IrLoopUse;
+
+// Rewrite the loop with its uses (the places referring to its values after
+// it), if we can tell what all of them are.
+static int
+ir_simplify_loop(Ir *ir, const IrLoop *loop, IrLoopUse *uses, size_t nuses)
+{
+	u32 b = loop->block;
+	IrBlock *blk = &ir->blocks[b];
+
+	// Which slot each of the used values is the next value of, if any.
+	u32 *slots = malloc((nuses + 1) * sizeof(slots[0]));
+	assert(slots);
+	int ok = 1;
+	for (size_t u = 0; ok && u < nuses; u++) {
+		u32 v = *uses[u].use;
+		slots[u] = IR_NONE;
+		for (u32 i = 0; slots[u] == IR_NONE && i < blk->nparams; i++) {
+			if (ir_resolve(ir, blk->args[0][i]) == v
+			    && (i == loop->counter || ir_step(ir, b, v, blk->params[i]) != IR_NONE)) {
+				slots[u] = i;
+			}
+		}
+		ok = slots[u] != IR_NONE || ir_invariant(ir, b, v, 4);
+	}
+	if (!ok) {
+		free(slots);
+		return 0;
+	}
+
+	// Their values after the loop, in terms of the parameters and the
+	// number of iterations.
+	u32 *finals = malloc(((size_t) blk->nparams + 1) * sizeof(finals[0]));
+	assert(finals);
+	for (u32 i = 0; i < blk->nparams; i++) {
+		finals[i] = IR_NONE;
+	}
+	u32 k = ir_inst(ir, b, loop->trip, blk->params[loop->counter], loop->limit);
+	for (size_t u = 0; u < nuses; u++) {
+		u32 i = slots[u];
+		if (i == IR_NONE) {
+			continue;
+		}
+		if (finals[i] == IR_NONE) {
+			u32 param = blk->params[i];
+			if (i == loop->counter) {
+				finals[i] = ir_inst(ir, b, loop->trip == IR_TRIP_DOWN ? IR_SUB : IR_ADD, param, k);
+			} else {
+				u32 step = ir_step(ir, b, *uses[u].use, param);
+				finals[i] = ir_inst(ir, b, IR_ADD, param, ir_inst(ir, b, IR_MUL, step, k));
+			}
+		}
+		*uses[u].use = finals[i];
+	}
+	free(finals);
+	free(slots);
+	free(blk->args[0]);
+	blk->args[0] = blk->args[1];
+	blk->args[1] = NULL;
+	blk->succ[0] = blk->succ[1];
+	blk->exit = IR_JUMP;
+	ir_remove_pred(ir, b, b);
+	return 1;
+}
+
+// Simplify the first loop we can, going through the uses of the values of
+// loops once: by the exit, and by any other block (the exit has only the loop
+// before it, so its parameters are often replaced by the values of the loop).
+static int
+ir_simplify_loops(Ir *ir)
+{
+	IrLoop *loops = malloc(((size_t) ir->nblocks + 1) * sizeof(loops[0]));
+	u32 *loop_of = malloc(((size_t) ir->nblocks + 1) * sizeof(loop_of[0]));
+	assert(loops && loop_of);
+	u32 nloops = 0;
+	size_t added = 0;
+	for (u32 b = 0; b < ir->nblocks; b++) {
+		loop_of[b] = IR_NONE;
+		if (ir_counted_loop(ir, b, &loops[nloops])) {
+			loop_of[b] = nloops++;
+			added += 3 * (size_t) ir->blocks[b].nparams + 1;
+		}
+	}
+	if (nloops == 0) {
+		free(loop_of);
+		free(loops);
+		return 0;
+	}
+
+	// We make room for the values we add first, so that the pointers to
+	// the uses stay valid.
+	if (ir->nvalues + added > ir->values_cap) {
+		while (ir->nvalues + added > ir->values_cap) {
+			ir->values_cap *= 2;
+		}
+		ir->values = realloc(ir->values, ir->values_cap * sizeof(ir->values[0]));
+		assert(ir->values);
+	}
+	IrLoopUse *uses = NULL;
+	size_t nuses = 0, uses_cap = 0;
+#define IR_LOOP_USE(use_, in) do { \
+		u32 *use = (use_); \
+		*use = ir_resolve(ir, *use); \
+		u32 block = ir->values[*use].block; \
+		if (block != IR_NONE && loop_of[block] != IR_NONE && (block != c || (in))) { \
+			if (nuses == uses_cap) { \
+				uses_cap = uses_cap ? 2 * uses_cap : 16; \
+				uses = realloc(uses, uses_cap * sizeof(uses[0])); \
+				assert(uses); \
+			} \
+			uses[nuses++] = (IrLoopUse) { loop_of[block], use }; \
+			loops[loop_of[block]].uses++; \
+		} \
+	} while (0)
+	for (u32 c = 0; c < ir->nblocks; c++) {
+		IrBlock *blk = &ir->blocks[c];
+		if (!blk->reachable) {
+			continue;
+		}
+		for (u32 i = 0; i < blk->ninsts; i++) {
+			IrValue *value = &ir->values[blk->insts[i]];
+			if (value->op != IR_INPUT) {
+				IR_LOOP_USE(&value->a, 0);
+			}
+			if (value->op != IR_INPUT && value->op != IR_PRINT) {
+				IR_LOOP_USE(&value->b, 0);
+			}
+		}
+		// The jump back of a loop is not a use after it, the exit is.
+		for (int s = 0; s < ir_nsucc(blk); s++) {
+			for (u32 i = 0; i < ir->blocks[blk->succ[s]].nparams; i++) {
+				IR_LOOP_USE(&blk->args[s][i], s == 1);
+			}
+		}
+		if (blk->exit == IR_BRANCH) {
+			IR_LOOP_USE(&blk->a, 0);
+			IR_LOOP_USE(&blk->b, 0);
+		}
+		for (u32 i = 0; blk->exit == IR_DEOPT && i < blk->nslots; i++) {
+			IR_LOOP_USE(&blk->slots[i], 0);
+		}
+	}
+#undef IR_LOOP_USE
+
+	// Group the uses by loops.
+	IrLoopUse *grouped = malloc((nuses + 1) * sizeof(grouped[0]));
+	assert(grouped);
+	size_t first = 0;
+	for (u32 l = 0; l < nloops; l++) {
+		size_t n = loops[l].uses;
+		loops[l].uses = first;
+		first += n;
+	}
+	for (size_t u = 0; u < nuses; u++) {
+		grouped[loops[uses[u].loop].uses++] = uses[u];
+	}
+	// One loop at a time: the limit of a later loop may be a value of this
+	// one, which `IrLoop` has from before it was rewritten, so the loops
+	// are found again after each.
+	int changed = 0;
+	first = 0;
+	for (u32 l = 0; l < nloops && !changed; l++) {
+		changed = ir_simplify_loop(ir, &loops[l], grouped + first, loops[l].uses - first);
+		first = loops[l].uses;
+	}
+	free(grouped);
+	free(uses);
+	free(loop_of);
+	free(loops);
+	return changed;
+}
+
+// Remove the values which are not used, starting from those which have to
+// stay: reads of the input, prints, the operands of branches and the slots
+// at exits to the interpreter.
+static void
+ir_remove_dead(Ir *ir)
+{
+	u32 *work = malloc(((size_t) ir->nvalues + 1) * sizeof(work[0]));
+	assert(work);
+	size_t nwork = 0;
+	for (u32 v = 0; v < ir->nvalues; v++) {
+		ir->values[v].live = 0;
+		ir->values[v].uses = 0;
+	}
+#define IR_MARK(v) do { \
+		u32 v_ = (v); \
+		if (!ir->values[v_].live) { \
+			ir->values[v_].live = 1; \
+			work[nwork++] = v_; \
+		} \
+	} while (0)
+	for (u32 b = 0; b < ir->nblocks; b++) {
+		IrBlock *blk = &ir->blocks[b];
+		if (!blk->reachable) {
+			continue;
+		}
+		for (u32 i = 0; i < blk->nparams; i++) {
+			ir->values[blk->params[i]].imm = i;
+		}
+		for (u32 i = 0; i < blk->ninsts; i++) {
+			IrValue *value = &ir->values[blk->insts[i]];
+			value->a = ir_resolve(ir, value->a);
+			value->b = ir_resolve(ir, value->b);
+			if (value->op == IR_INPUT || value->op == IR_PRINT) {
+				IR_MARK(blk->insts[i]);
+			}
+		}
+		for (int s = 0; s < ir_nsucc(blk); s++) {
+			for (u32 i = 0; i < ir->blocks[blk->succ[s]].nparams; i++) {
+				blk->args[s][i] = ir_resolve(ir, blk->args[s][i]);
+			}
+		}
+		if (blk->exit == IR_BRANCH) {
+			blk->a = ir_resolve(ir, blk->a);
+			blk->b = ir_resolve(ir, blk->b);
+			IR_MARK(blk->a);
+			IR_MARK(blk->b);
+		}
+		for (u32 i = 0; blk->exit == IR_DEOPT && i < blk->nslots; i++) {
+			blk->slots[i] = ir_resolve(ir, blk->slots[i]);
+			IR_MARK(blk->slots[i]);
+		}
+	}
+	while (nwork > 0) {
+		IrValue *value = &ir->values[work[--nwork]];
+		switch (value->op) {
+		case IR_PARAM: {
+			IrBlock *blk = &ir->blocks[value->block];
+			for (u32 p = 0; p < blk->npreds; p++) {
+				IrBlock *pred = &ir->blocks[blk->preds[p]];
+				for (int s = 0; s < ir_nsucc(pred); s++) {
+					if (pred->succ[s] == value->block) {
+						IR_MARK(pred->args[s][value->imm]);
+					}
+				}
+			}
+			break;
+		}
+		case IR_PRINT:
+			IR_MARK(value->a);
+			break;
+		case IR_ADD:
+		case IR_SUB:
+		case IR_MUL:
+		case IR_CMP:
+		case IR_TRIP_DOWN:
+		case IR_TRIP_UP:
+			IR_MARK(value->a);
+			IR_MARK(value->b);
+			break;
+		}
+	}
+#undef IR_MARK
+
+	// Drop the rest and count the uses of what is left.
+	for (u32 b = 0; b < ir->nblocks; b++) {
+		IrBlock *blk = &ir->blocks[b];
+		if (!blk->reachable) {
+			continue;
+		}
+		u32 n = 0;
+		for (u32 i = 0; i < blk->ninsts; i++) {
+			u32 v = blk->insts[i];
+			if (ir->values[v].live) {
+				blk->insts[n++] = v;
+			}
+		}
+		blk->ninsts = n;
+		for (u32 i = blk->nparams; i-- > 0;) {
+			if (!ir->values[blk->params[i]].live) {
+				ir_remove_param(ir, b, i);
+			}
+		}
+	}
+	for (u32 b = 0; b < ir->nblocks; b++) {
+		IrBlock *blk = &ir->blocks[b];
+		if (!blk->reachable) {
+			continue;
+		}
+		for (u32 i = 0; i < blk->ninsts; i++) {
+			IrValue *value = &ir->values[blk->insts[i]];
+			if (value->op != IR_INPUT) {
+				ir->values[value->a].uses++;
+			}
+			if (value->op != IR_INPUT && value->op != IR_PRINT) {
+				ir->values[value->b].uses++;
+			}
+		}
+		for (int s = 0; s < ir_nsucc(blk); s++) {
+			for (u32 i = 0; i < ir->blocks[blk->succ[s]].nparams; i++) {
+				ir->values[blk->args[s][i]].uses++;
+			}
+		}
+		if (blk->exit == IR_BRANCH) {
+			ir->values[blk->a].uses++;
+			ir->values[blk->b].uses++;
+		}
+		for (u32 i = 0; blk->exit == IR_DEOPT && i < blk->nslots; i++) {
+			ir->values[blk->slots[i]].uses++;
+		}
+	}
+	free(work);
+}
+
+static void
+ir_optimize(Ir *ir)
+{
+	for (int changed = 1; changed;) {
+		ir_link(ir);
+		changed = ir_fold(ir);
+		changed |= ir_simplify_loops(ir);
+	}
+	ir_link(ir);
+	ir_remove_dead(ir);
+}
+
+// Move the values of the loop of a trace starting at `head` which only depend
+// on values from before it (and constants) to the end of `pre`, the block
+// jumping to the loop from the first iteration, see `Trace`. All blocks after
+// `head` are only reached through it, so `pre` is before all of them.
+static void
+ir_hoist(Ir *ir, u32 head, u32 pre)
+{
+	if (!ir->blocks[pre].reachable) {
+		return;
+	}
+	for (u32 b = head; b < ir->nblocks; b++) {
+		IrBlock *blk = &ir->blocks[b];
+		if (!blk->reachable) {
+			continue;
+		}
+		u32 n = 0;
+		for (u32 i = 0; i < blk->ninsts; i++) {
+			u32 v = blk->insts[i];
+			IrValue *value = &ir->values[v];
+			IrValue *x = &ir->values[value->a], *y = &ir->values[value->b];
+			int pure = value->op == IR_ADD || value->op == IR_SUB || value->op == IR_MUL || value->op == IR_CMP;
+			if (!pure || (x->op != IR_CONST && x->block >= head) || (y->op != IR_CONST && y->block >= head)) {
+				blk->insts[n++] = v;
+				continue;
+			}
+			IrBlock *to = &ir->blocks[pre];
+			if (to->ninsts == to->insts_cap) {
+				to->insts_cap = to->insts_cap ? 2 * to->insts_cap : 8;
+				to->insts = realloc(to->insts, to->insts_cap * sizeof(to->insts[0]));
+				assert(to->insts);
+			}
+			to->insts[to->ninsts++] = v;
+			value->block = pre;
+		}
+		blk->ninsts = n;
+	}
+}
+
+// Whether the value needs a location. Constants are immediates, prints don't
+// have a result and unused input is skipped.
+static int
+ir_allocated(const IrValue *value)
+{
+	return value->op != IR_CONST && value->op != IR_PRINT && (value->op != IR_INPUT || value->uses > 0);
+}
+
+// Registers for values. Those which are live across a call (of `output_int`
+// for `OP_PRINT`, or of `input_refill` in the input check at the start of a
+// block) need callee saved registers, which we save in the prologue. `rax`,
+// `rcx`, `rdx` and `r11` are scratch registers, `rbx` is the input cursor,
+// as everywhere.
+static const int ir_caller_saved[] = { 6, 7, 8, 9, 10 }; // rsi, rdi, r8, r9, r10
+static const int ir_callee_saved[] = { 12, 13, 14, 15 }; // r12, r13, r14, r15
+
+#define IR_REG_CALLEE(r) ((r) >= 12)
+
+// The stack frame below the one of the template code (see `compile`): the
+// frame image (see `Safepoint`), the callee saved registers and then the
+// spilled values.
+//
+//         [rbp - 24]                  frame image
+//         [rbp - 32] ... [rbp - 56]   r12, r13, r14, r15
+//         [rbp - 64] ...              spilled values
+#define IR_SPILL(loc) (-64 - 8 * (-1 - (loc)))
+
+// The index of a location in the frame image: the registers by their number,
+// then the spilled values from the lowest address.
+#define IR_IMAGE_REGS 16
+#define IR_IMAGE(loc, nspills) ((loc) >= 0 ? (loc) : IR_IMAGE_REGS + (nspills) + (loc))
+
+typedef struct {
+	u32 start;
+	u32 value;
+} IrInterval;
+
+static int
+ir_interval_cmp(const void *a, const void *b)
+{
+	const IrInterval *x = a, *y = b;
+	if (x->start != y->start) {
+		return x->start < y->start ? -1 : 1;
+	}
+	return x->value < y->value ? -1 : x->value > y->value;
+}
+
+// Extend the live range of `v` for a use in the block `use`: if it's not the
+// block where `v` is defined, it's live from the start of the block, and at
+// the ends of all blocks which lead there (from the definition). Those blocks
+// (and `use`) have it live at their start, which entries note.
+static void
+ir_live_in(Ir *ir, u32 v, u32 use, u32 *stamp, u32 *work)
+{
+	IrValue *value = &ir->values[v];
+	size_t nwork = 0;
+	if (use == value->block || stamp[use] == v + 1) {
+		return;
+	}
+	stamp[use] = v + 1;
+	work[nwork++] = use;
+	while (nwork > 0) {
+		IrBlock *blk = &ir->blocks[work[--nwork]];
+		if (blk->start < value->start) {
+			value->start = blk->start;
+		}
+		if (blk->entry) {
+			if (blk->nlive_in == blk->live_in_cap) {
+				blk->live_in_cap = blk->live_in_cap ? 2 * blk->live_in_cap : 16;
+				blk->live_in = realloc(blk->live_in, blk->live_in_cap * sizeof(blk->live_in[0]));
+				assert(blk->live_in);
+			}
+			blk->live_in[blk->nlive_in++] = v;
+		}
+		for (u32 p = 0; p < blk->npreds; p++) {
+			u32 pred = blk->preds[p];
+			if (ir->blocks[pred].end > value->end) {
+				value->end = ir->blocks[pred].end;
+			}
+			if (pred != value->block && stamp[pred] != v + 1) {
+				stamp[pred] = v + 1;
+				work[nwork++] = pred;
+			}
+		}
+	}
+}
+
+static void
+ir_use(Ir *ir, u32 v, u32 block, u32 pos, u32 *stamp, u32 *work)
+{
+	IrValue *value = &ir->values[v];
+	if (!ir_allocated(value)) {
+		return;
+	}
+	if (pos > value->end) {
+		value->end = pos;
+	}
+	if (pos < value->start) {
+		value->start = pos;
+	}
+	ir_live_in(ir, v, block, stamp, work);
+}
+
+// Linear scan register allocation: the live ranges (from the first to the
+// last position where the value is live, with the blocks laid out in order)
+// sorted by their starts get any free register. If there is none, the one
+// (of the value in a register, or the new one) ending last is spilled. Returns
+// the number of spill slots.
+static int
+ir_allocate(Ir *ir)
+{
+	// The positions: the parameters are defined at the start of a block,
+	// the input check is just after it, then the values, the exit is at
+	// the end.
+	u32 pos = 0;
+	u32 ncalls = 0;
+	for (u32 b = 0; b < ir->nblocks; b++) {
+		IrBlock *blk = &ir->blocks[b];
+		if (!blk->reachable) {
+			continue;
+		}
+		blk->start = pos;
+		for (u32 i = 0; i < blk->nparams; i++) {
+			ir->values[blk->params[i]].start = ir->values[blk->params[i]].end = pos;
+		}
+		for (u32 i = 0; i < blk->ninsts; i++) {
+			IrValue *value = &ir->values[blk->insts[i]];
+			value->start = value->end = pos + 2 + 2 * i;
+			ncalls += value->op == IR_PRINT;
+		}
+		ncalls += blk->need > 0;
+		blk->end = pos + 2 + 2 * blk->ninsts;
+		pos = blk->end + 2;
+	}
+
+	u32 *calls = malloc(((size_t) ncalls + 1) * sizeof(calls[0]));
+	u32 *stamp = calloc((size_t) ir->nblocks + 1, sizeof(stamp[0]));
+	u32 *work = malloc(((size_t) ir->nblocks + 1) * sizeof(work[0]));
+	assert(calls && stamp && work);
+	ncalls = 0;
+	for (u32 b = 0; b < ir->nblocks; b++) {
+		IrBlock *blk = &ir->blocks[b];
+		if (!blk->reachable) {
+			continue;
+		}
+		if (blk->need) {
+			calls[ncalls++] = blk->start + 1;
+		}
+		for (u32 i = 0; i < blk->ninsts; i++) {
+			IrValue *value = &ir->values[blk->insts[i]];
+			switch (value->op) {
+			case IR_PRINT:
+				calls[ncalls++] = value->start;
+				ir_use(ir, value->a, b, value->start, stamp, work);
+				break;
+			case IR_INPUT:
+				break;
+			default:
+				ir_use(ir, value->a, b, value->start, stamp, work);
+				ir_use(ir, value->b, b, value->start, stamp, work);
+				break;
+			}
+		}
+		// The slots of an exit are used by the jump there, which makes
+		// them live only up to here, not up to the exit at the end.
+		for (int s = 0; s < ir_nsucc(blk); s++) {
+			IrBlock *succ = &ir->blocks[blk->succ[s]];
+			for (u32 i = 0; i < succ->nparams; i++) {
+				ir_use(ir, blk->args[s][i], b, blk->end, stamp, work);
+			}
+			for (u32 i = 0; succ->exit == IR_DEOPT && i < succ->nslots; i++) {
+				ir_use(ir, succ->slots[i], b, blk->end, stamp, work);
+			}
+		}
+		if (blk->exit == IR_BRANCH) {
+			ir_use(ir, blk->a, b, blk->end, stamp, work);
+			ir_use(ir, blk->b, b, blk->end, stamp, work);
+		}
+	}
+	free(work);
+	free(stamp);
+
+	IrInterval *intervals = malloc(((size_t) ir->nvalues + 1) * sizeof(intervals[0]));
+	assert(intervals);
+	size_t nintervals = 0;
+	for (u32 b = 0; b < ir->nblocks; b++) {
+		IrBlock *blk = &ir->blocks[b];
+		for (u32 i = 0; blk->reachable && i < blk->nparams; i++) {
+			intervals[nintervals++] = (IrInterval) { ir->values[blk->params[i]].start, blk->params[i] };
+		}
+		for (u32 i = 0; blk->reachable && i < blk->ninsts; i++) {
+			if (ir_allocated(&ir->values[blk->insts[i]])) {
+				intervals[nintervals++] = (IrInterval) { ir->values[blk->insts[i]].start, blk->insts[i] };
+			}
+		}
+	}
+	qsort(intervals, nintervals, sizeof(intervals[0]), ir_interval_cmp);
+
+	// The values in registers, by register.
+	u32 active[16];
+	for (int r = 0; r < 16; r++) {
+		active[r] = IR_NONE;
+	}
+	int nspills = 0;
+	size_t call = 0;
+	for (size_t i = 0; i < nintervals; i++) {
+		IrValue *value = &ir->values[intervals[i].value];
+		for (int r = 0; r < 16; r++) {
+			if (active[r] != IR_NONE && ir->values[active[r]].end <= value->start) {
+				active[r] = IR_NONE;
+			}
+		}
+		while (call < ncalls && calls[call] <= value->start) {
+			call++;
+		}
+		int callee = call < ncalls && calls[call] < value->end;
+		int reg = -1;
+		if (!callee) {
+			for (size_t j = 0; reg < 0 && j < sizeof(ir_caller_saved) / sizeof(ir_caller_saved[0]); j++) {
+				if (active[ir_caller_saved[j]] == IR_NONE) {
+					reg = ir_caller_saved[j];
+				}
+			}
+		}
+		for (size_t j = 0; reg < 0 && j < sizeof(ir_callee_saved) / sizeof(ir_callee_saved[0]); j++) {
+			if (active[ir_callee_saved[j]] == IR_NONE) {
+				reg = ir_callee_saved[j];
+			}
+		}
+		if (reg < 0) {
+			int last = -1;
+			for (int r = 0; r < 16; r++) {
+				if (active[r] != IR_NONE && (!callee || IR_REG_CALLEE(r))
+				    && (last < 0 || ir->values[active[r]].end > ir->values[active[last]].end)) {
+					last = r;
+				}
+			}
+			if (last >= 0 && ir->values[active[last]].end > value->end) {
+				ir->values[active[last]].loc = -1 - nspills++;
+				reg = last;
+			}
+		}
+		if (reg < 0) {
+			value->loc = -1 - nspills++;
+		} else {
+			value->loc = reg;
+			active[reg] = intervals[i].value;
+		}
+	}
+	free(intervals);
+	free(calls);
+	return nspills;
+}
+
+// Load the value into the register `r`.
+static void
+ir_load(Jit *jit, Ir *ir, int r, u32 v)
+{
+	dasm_State **ds = &jit->ds;
+	IrValue *value = &ir->values[v];
+	if (value->op == IR_CONST) {
+		i32 imm = (i32) value->imm;
+		u64 imm64 = (u64) value->imm;
+		if (value->imm == imm) {
+			//| mov Rq(r), imm
+		} else {
+			//| mov64 Rq(r), imm64
+		}
+	} else if (value->loc < 0) {
+		//| mov Rq(r), [rbp + IR_SPILL(value->loc)]
+	} else if (value->loc != r) {
+		//| mov Rq(r), Rq(value->loc)
+	}
+}
+
+static void
+ir_store(Jit *jit, Ir *ir, u32 v, int r)
+{
+	dasm_State **ds = &jit->ds;
+	IrValue *value = &ir->values[v];
+	if (value->loc < 0) {
+		//| mov [rbp + IR_SPILL(value->loc)], Rq(r)
+	} else if (value->loc != r) {
+		//| mov Rq(value->loc), Rq(r)
+	}
+}
+
+// `r = r op v` for `IR_ADD`, `IR_SUB` and `IR_MUL`, or `cmp r, v` for
+// `IR_CMP`. Constants which don't fit in 32 bits go through `r11`.
+static void
+ir_arith(Jit *jit, Ir *ir, enum ir_op op, int r, u32 v)
+{
+	dasm_State **ds = &jit->ds;
+	IrValue *value = &ir->values[v];
+	if (value->op == IR_CONST && value->imm == (i32) value->imm) {
+		i32 imm = (i32) value->imm;
+		switch (op) {
+		case IR_ADD:
+			//| add Rq(r), imm
+			break;
+		case IR_SUB:
+			//| sub Rq(r), imm
+			break;
+		case IR_MUL:
+			//| imul Rq(r), Rq(r), imm
+			break;
+		default:
+			//| cmp Rq(r), imm
+			break;
+		}
+		return;
+	}
+	int src = value->loc;
+	if (value->op == IR_CONST) {
+		u64 imm64 = (u64) value->imm;
+		//| mov64 r11, imm64
+		src = 11;
+	}
+	if (src >= 0) {
+		switch (op) {
+		case IR_ADD:
+			//| add Rq(r), Rq(src)
+			break;
+		case IR_SUB:
+			//| sub Rq(r), Rq(src)
+			break;
+		case IR_MUL:
+			//| imul Rq(r), Rq(src)
+			break;
+		default:
+			//| cmp Rq(r), Rq(src)
+			break;
+		}
+	} else {
+		int offset = IR_SPILL(src);
+		switch (op) {
+		case IR_ADD:
+			//| add Rq(r), [rbp + offset]
+			break;
+		case IR_SUB:
+			//| sub Rq(r), [rbp + offset]
+			break;
+		case IR_MUL:
+			//| imul Rq(r), [rbp + offset]
+			break;
+		default:
+			//| cmp Rq(r), [rbp + offset]
+			break;
+		}
+	}
+}
+
+static int
+ir_in_reg(Ir *ir, u32 v, int r)
+{
+	return ir->values[v].op != IR_CONST && ir->values[v].loc == r;
+}
+
+static void
+ir_emit_value(Jit *jit, Ir *ir, u32 v)
+{
+	dasm_State **ds = &jit->ds;
+	IrValue *value = &ir->values[v];
+	u32 a = value->a, b = value->b;
+	int dst = value->loc;
+	switch (value->op) {
+	case IR_INPUT:
+		if (value->uses == 0) {
+			// Read the value just to skip it.
+		} else if (dst >= 0) {
+			//| mov Rd(dst), [rbx]
+		} else {
+			//| mov eax, [rbx]
+			//| mov [rbp + IR_SPILL(dst)], rax
+		}
+		//| add rbx, 4
+		break;
+	case IR_PRINT:
+		// See `OP_PRINT` and `emit_call`.
+		ir_load(jit, ir, 6, a); // rsi
+		//| mov rdi, [rbp - 8]
+		emit_call(jit, SYM_OUTPUT_INT);
+		break;
+	case IR_ADD:
+	case IR_SUB:
+	case IR_MUL: {
+		if (value->op != IR_SUB && dst >= 0 && ir_in_reg(ir, b, dst)) {
+			u32 t = a;
+			a = b;
+			b = t;
+		}
+		int r = dst >= 0 && !ir_in_reg(ir, b, dst) ? dst : 0;
+		ir_load(jit, ir, r, a);
+		ir_arith(jit, ir, value->op, r, b);
+		ir_store(jit, ir, v, r);
+		break;
+	}
+	case IR_CMP:
+		// As `OP_CMP`, but with `setcc`.
+		ir_load(jit, ir, 0, a);
+		ir_arith(jit, ir, IR_CMP, 0, b);
+		//| setg cl
+		//| setl al
+		//| sub cl, al
+		//| movsx rax, cl
+		ir_store(jit, ir, v, 0);
+		break;
+	case IR_TRIP_DOWN:
+		ir_load(jit, ir, 0, a);
+		ir_load(jit, ir, 1, b);
+		//| lea rdx, [rax - 1]
+		//| sub rax, rcx
+		//| cmp rdx, rcx
+		//| mov edx, 1
+		//| cmovle rax, rdx
+		ir_store(jit, ir, v, 0);
+		break;
+	case IR_TRIP_UP:
+		ir_load(jit, ir, 1, a);
+		ir_load(jit, ir, 2, b);
+		//| mov rax, rdx
+		//| sub rax, rcx
+		//| add rcx, 1
+		//| cmp rdx, rcx
+		//| mov ecx, 1
+		//| cmovle rax, rcx
+		ir_store(jit, ir, v, 0);
+		break;
+	}
+}
+
+// Move the arguments of the `s`-th successor to its parameters. All moves
+// happen "at once", so a register may be read by one move and written by
+// another: we do those where nothing reads the destination anymore first,
+// and if there are none, the rest are cycles, which we break by saving a
+// destination in `rax`. Constants go last, they don't read anything.
+static void
+ir_emit_moves(Jit *jit, Ir *ir, IrBlock *blk, int s)
+{
+	dasm_State **ds = &jit->ds;
+	IrBlock *succ = &ir->blocks[blk->succ[s]];
+	int *dsts = malloc(((size_t) succ->nparams + 1) * sizeof(dsts[0]));
+	int *srcs = malloc(((size_t) succ->nparams + 1) * sizeof(srcs[0]));
+	assert(dsts && srcs);
+	u32 n = 0;
+	for (u32 i = 0; i < succ->nparams; i++) {
+		IrValue *arg = &ir->values[blk->args[s][i]];
+		int dst = ir->values[succ->params[i]].loc;
+		if (arg->op != IR_CONST && arg->loc != dst) {
+			dsts[n] = dst;
+			srcs[n++] = arg->loc;
+		}
+	}
+	while (n > 0) {
+		u32 i = 0;
+		for (; i < n; i++) {
+			u32 j = 0;
+			while (j < n && srcs[j] != dsts[i]) {
+				j++;
+			}
+			if (j == n) {
+				break;
+			}
+		}
+		if (i == n) {
+			i = 0;
+			if (dsts[i] >= 0) {
+				//| mov rax, Rq(dsts[i])
+			} else {
+				//| mov rax, [rbp + IR_SPILL(dsts[i])]
+			}
+			for (u32 j = 0; j < n; j++) {
+				if (srcs[j] == dsts[i]) {
+					srcs[j] = 0;
+				}
+			}
+		}
+		int dst = dsts[i], src = srcs[i];
+		if (dst >= 0 && src >= 0) {
+			//| mov Rq(dst), Rq(src)
+		} else if (dst >= 0) {
+			//| mov Rq(dst), [rbp + IR_SPILL(src)]
+		} else if (src >= 0) {
+			//| mov [rbp + IR_SPILL(dst)], Rq(src)
+		} else {
+			//| mov r11, [rbp + IR_SPILL(src)]
+			//| mov [rbp + IR_SPILL(dst)], r11
+		}
+		n--;
+		dsts[i] = dsts[n];
+		srcs[i] = srcs[n];
+	}
+	for (u32 i = 0; i < succ->nparams; i++) {
+		u32 arg = blk->args[s][i];
+		if (ir->values[arg].op == IR_CONST) {
+			int dst = ir->values[succ->params[i]].loc;
+			ir_load(jit, ir, dst >= 0 ? dst : 0, arg);
+			if (dst < 0) {
+				//| mov [rbp + IR_SPILL(dst)], rax
+			}
+		}
+	}
+	free(srcs);
+	free(dsts);
+}
+
+static int
+ir_has_moves(Ir *ir, IrBlock *blk, int s)
+{
+	IrBlock *succ = &ir->blocks[blk->succ[s]];
+	for (u32 i = 0; i < succ->nparams; i++) {
+		IrValue *arg = &ir->values[blk->args[s][i]];
+		if (arg->op == IR_CONST || arg->loc != ir->values[succ->params[i]].loc) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Where the slots of the operand stack are at a place in the optimized code
+// where the interpreter can enter it or get back to it (a "safepoint"): at
+// the start of a loop head, or at an exit. The interpreter moves them between
+// its stack and a "frame image", an array of `IR_IMAGE_REGS + nspills` values
+// with the registers and the spilled values, see `IR_IMAGE`. `osr_entry`
+// loads the whole frame from it, `->deopt` stores the whole frame to it.
+enum {
+	SLOT_DEAD,	// not used by the compiled code (only at entries)
+	SLOT_CONST,	// `imm`, not in the frame
+	SLOT_FRAME,	// in the frame image at `index`
+};
+
+typedef struct {
+	u8 kind;
+	u32 index;
+	i64 imm;
+} SafepointSlot;
+
+typedef struct {
+	// Where the interpreter is: the instruction at the entry, or the one
+	// to go on with after the exit, which is taken when the `OP_JGT` at
+	// `branch` goes the way `direction` (for the first time).
+	size_t offset;
+	int exit;
+	size_t branch;
+	u8 direction;
+	u32 depth;
+	SafepointSlot *slots;
+} Safepoint;
+
+// A compiled program, together with what we need to enter it in the middle.
+typedef struct {
+	CodeCache *cache;
+	void *code;
+	// Returns -1 once the program halts, see `compile_optimized` for
+	// what else (the template code always runs to the end).
+	int (*osr_entry)(Input *in, Output *out, i64 *stack, size_t depth, void *target);
+	// Offsets of the code of jump targets, indexed by the offset of the
+	// instruction in the bytecode, -1 for instructions that are not
+	// targets.
+	int *entries;
+	// For the optimizing tier, the entries and exits, and the number of
+	// spilled values in the frame image.
+	Safepoint *safepoints;
+	size_t nsafepoints;
+	int nspills;
+	// For a program with calls, its functions, see `Module`.
+	Module *module;
+} Compiled;
+
+// The safepoint for the block, with the values of its slots resolved. At an
+// exit all of them are used. At an entry, the parameters and the values live
+// at the start which are not parameters (those which were the same in all
+// jumps here) have to be the slots, otherwise the block can't be entered
+// with only the stack of the interpreter, and we return 0.
+static int
+ir_safepoint(Ir *ir, u32 b, int nspills, u32 *stamp, Safepoint *safepoint)
+{
+	IrBlock *blk = &ir->blocks[b];
+	*safepoint = (Safepoint) {
+		.offset = blk->offset, .exit = blk->exit == IR_DEOPT,
+		.branch = blk->branch, .direction = blk->direction, .depth = blk->nslots,
+	};
+	safepoint->slots = malloc(((size_t) blk->nslots + 1) * sizeof(safepoint->slots[0]));
+	assert(safepoint->slots);
+	// The values live at the start are stamped `live`, and then `found`
+	// once we find them in the slots.
+	u32 live = 2 * b + 1, found = 2 * b + 2;
+	for (u32 i = 0; i < blk->nparams; i++) {
+		stamp[blk->params[i]] = live;
+	}
+	for (u32 i = 0; i < blk->nlive_in; i++) {
+		stamp[blk->live_in[i]] = live;
+	}
+	for (u32 i = 0; i < blk->nslots; i++) {
+		u32 v = ir_resolve(ir, blk->slots[i]);
+		IrValue *value = &ir->values[v];
+		SafepointSlot *slot = &safepoint->slots[i];
+		if (value->op == IR_CONST) {
+			*slot = (SafepointSlot) { .kind = SLOT_CONST, .imm = value->imm };
+		} else if (safepoint->exit || stamp[v] == live || stamp[v] == found) {
+			assert(ir_allocated(value) && value->live);
+			*slot = (SafepointSlot) { .kind = SLOT_FRAME, .index = (u32) IR_IMAGE(value->loc, nspills) };
+			stamp[v] = found;
+		} else {
+			*slot = (SafepointSlot) { .kind = SLOT_DEAD };
+		}
+	}
+	for (u32 i = 0; i < blk->nparams + blk->nlive_in; i++) {
+		u32 v = i < blk->nparams ? blk->params[i] : blk->live_in[i - blk->nparams];
+		if (stamp[v] != found) {
+			free(safepoint->slots);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void
+safepoints_free(Safepoint *safepoints, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		free(safepoints[i].slots);
+	}
+	free(safepoints);
+}
+
+// Allocate the registers of the optimized `ir` of a program of `program_len`
+// bytes and emit its code as the function `name`, with the entries and exits
+// in `compiled` if it's set, see `compile_optimized`. Frees the `ir`. The time
+// since `start` counts as emitting.
+static void *
+ir_compile(Jit *jit, Ir *ir, size_t program_len, Compiled *compiled, const char *name, double start, size_t *code_size)
+{
+	dasm_State **ds = &jit->ds;
+	int nspills = ir_allocate(ir);
+
+	// The safepoints, the exits are numbered by their index.
+	Safepoint *safepoints = NULL;
+	size_t nsafepoints = 0;
+	u32 *exits = NULL;
+	if (compiled) {
+		safepoints = malloc(((size_t) ir->nblocks + 1) * sizeof(safepoints[0]));
+		exits = malloc(((size_t) ir->nblocks + 1) * sizeof(exits[0]));
+		u32 *stamp = calloc((size_t) ir->nvalues + 1, sizeof(stamp[0]));
+		assert(safepoints && exits && stamp);
+		for (u32 b = 0; b < ir->nblocks; b++) {
+			IrBlock *blk = &ir->blocks[b];
+			exits[b] = IR_NONE;
+			if (!blk->reachable || (!blk->entry && blk->exit != IR_DEOPT)) {
+				blk->entry = 0;
+				continue;
+			}
+			if (ir_safepoint(ir, b, nspills, stamp, &safepoints[nsafepoints])) {
+				exits[b] = (u32) nsafepoints++;
+			} else {
+				blk->entry = 0;
+			}
+		}
+		free(stamp);
+	}
+
+	// A pc label for each block, and one for the moves of the taken jump
+	// of each branch, when there are any. These are emitted after all
+	// blocks, so that the not taken jump just falls through.
+	dasm_setup(Dst, our_dasm_actions);
+	dasm_growpc(Dst, 2 * ir->nblocks);
+	jit->reloc_labels = 2 * ir->nblocks;
+	jit->nrelocs = 0;
+	jit->nlines = 0;
+
+	//| push rbx
+	//| push rbp
+	//| mov rbp, rsp
+	//| mov rbx, [rdi + offsetof(Input, next)]
+	//| push rsi
+	//| push rdi
+	//| push 0
+	//| push r12
+	//| push r13
+	//| push r14
+	//| push r15
+	if (nspills) {
+		//| sub rsp, 8 * nspills
+	}
+
+	// The exits go to the cold section, see below.
+	for (u32 b = 0; b < ir->nblocks; b++) {
+		IrBlock *blk = &ir->blocks[b];
+		if (!blk->reachable || blk->exit == IR_DEOPT) {
+			continue;
+		}
+		u32 next = b + 1;
+		while (next < ir->nblocks && (!ir->blocks[next].reachable || ir->blocks[next].exit == IR_DEOPT)) {
+			next++;
+		}
+		// Heads of loops are aligned, see `compile_template`.
+		for (u32 i = 0; i < blk->npreds; i++) {
+			if (blk->preds[i] >= b) {
+				//|.align 16
+				break;
+			}
+		}
+		//|=>b:
+		if (blk->need) {
+			emit_input_check(jit, blk->need);
+		}
+		for (u32 i = 0; i < blk->ninsts; i++) {
+			ir_emit_value(jit, ir, blk->insts[i]);
+		}
+		switch (blk->exit) {
+		case IR_HALT:
+			//| mov rax, [rbp - 16]
+			//| mov [rax + offsetof(Input, next)], rbx
+			//| jmp ->input_exhausted
+			break;
+		case IR_BRANCH: {
+			int r = 0;
+			if (ir->values[blk->a].op != IR_CONST && ir->values[blk->a].loc >= 0) {
+				r = ir->values[blk->a].loc;
+			} else {
+				ir_load(jit, ir, 0, blk->a);
+			}
+			ir_arith(jit, ir, IR_CMP, r, blk->b);
+			if (ir_has_moves(ir, blk, 0)) {
+				//| jg =>ir->nblocks + b
+			} else {
+				//| jg =>blk->succ[0]
+			}
+			ir_emit_moves(jit, ir, blk, 1);
+			if (blk->succ[1] != next) {
+				//| jmp =>blk->succ[1]
+			}
+			break;
+		}
+		case IR_JUMP:
+			ir_emit_moves(jit, ir, blk, 0);
+			if (blk->succ[0] != next) {
+				//| jmp =>blk->succ[0]
+			}
+			break;
+		}
+	}
+	for (u32 b = 0; b < ir->nblocks; b++) {
+		IrBlock *blk = &ir->blocks[b];
+		if (blk->reachable && blk->exit == IR_BRANCH && ir_has_moves(ir, blk, 0)) {
+			//|=>ir->nblocks + b:
+			ir_emit_moves(jit, ir, blk, 0);
+			//| jmp =>blk->succ[0]
+		}
+	}
+
+	// Halting and running out of input are the same as in the template
+	// code, we just restore the registers we saved.
+	//|.cold
+	//|->input_exhausted:
+	//| mov rdi, [rbp - 8]
+	emit_call(jit, SYM_OUTPUT_FLUSH);
+	//| mov eax, -1
+	//|->leave:
+	//| lea rsp, [rbp - 56]
+	//| pop r15
+	//| pop r14
+	//| pop r13
+	//| pop r12
+	//| mov rsp, rbp
+	//| pop rbp
+	//| pop rbx
+	//| ret
+
+	// An exit stores the whole frame to the frame image, and returns its
+	// index to the interpreter, which takes the slots from the image. The
+	// cursor of the input goes back to `Input`, the output is left as it
+	// is, the interpreter goes on with the same buffer.
+	int ndeopts = 0;
+	for (u32 b = 0; b < ir->nblocks; b++) {
+		if (ir->blocks[b].reachable && ir->blocks[b].exit == IR_DEOPT) {
+			//|=>b:
+			//| mov eax, (int) exits[b]
+			//| jmp ->deopt
+			ndeopts++;
+		}
+	}
+	if (ndeopts) {
+		//|->deopt:
+		//| mov rdx, [rbp - 24]
+		for (size_t j = 0; j < sizeof(ir_caller_saved) / sizeof(ir_caller_saved[0]); j++) {
+			//| mov [rdx + 8 * ir_caller_saved[j]], Rq(ir_caller_saved[j])
+		}
+		for (size_t j = 0; j < sizeof(ir_callee_saved) / sizeof(ir_callee_saved[0]); j++) {
+			//| mov [rdx + 8 * ir_callee_saved[j]], Rq(ir_callee_saved[j])
+		}
+		if (nspills) {
+			//| xor ecx, ecx
+			//|1:
+			//| mov r11, [rsp + rcx * 8]
+			//| mov [rdx + rcx * 8 + 8 * IR_IMAGE_REGS], r11
+			//| add ecx, 1
+			//| cmp ecx, nspills
+			//| jb <1
+		}
+		//| mov rcx, [rbp - 16]
+		//| mov [rcx + offsetof(Input, next)], rbx
+		//| jmp ->leave
+	}
+
+	// The entry for on-stack replacement, called as in the template code
+	// (see `compile_template`), but with the frame image instead of the
+	// stack, and the depth unused. The frame image stays at `[rbp - 24]`
+	// for the exits.
+	if (compiled) {
+		//|->osr_entry:
+		//| push rbx
+		//| push rbp
+		//| mov rbp, rsp
+		//| mov rbx, [rdi + offsetof(Input, next)]
+		//| push rsi
+		//| push rdi
+		//| push rdx
+		//| push r12
+		//| push r13
+		//| push r14
+		//| push r15
+		if (nspills) {
+			//| sub rsp, 8 * nspills
+			//| xor ecx, ecx
+			//|1:
+			//| mov rax, [rdx + rcx * 8 + 8 * IR_IMAGE_REGS]
+			//| mov [rsp + rcx * 8], rax
+			//| add ecx, 1
+			//| cmp ecx, nspills
+			//| jb <1
+		}
+		//| mov r11, r8
+		for (size_t j = 0; j < sizeof(ir_callee_saved) / sizeof(ir_callee_saved[0]); j++) {
+			//| mov Rq(ir_callee_saved[j]), [rdx + 8 * ir_callee_saved[j]]
+		}
+		for (size_t j = sizeof(ir_caller_saved) / sizeof(ir_caller_saved[0]); j-- > 0;) {
+			//| mov Rq(ir_caller_saved[j]), [rdx + 8 * ir_caller_saved[j]]
+		}
+		//| jmp r11
+	}
+	//|.code
+
+	// The code of each block, for the line table of `DebugInfo`.
+	if (jit->cache->debug) {
+		for (u32 b = 0; b < ir->nblocks; b++) {
+			if (ir->blocks[b].reachable) {
+				jit_add_line(jit, (int) b, ir->blocks[b].offset);
+			}
+		}
+	}
+
+	if (jit->profile) {
+		jit->times[0] += now() - start;
+	}
+	void *code = jit_encode(jit, name, program_len, code_size);
+	for (size_t i = 0; i < jit->nrelocs; i++) {
+		jit->relocs[i].offset = (u32) dasm_getpclabel(Dst, jit->relocs[i].offset) - 8;
+	}
+	if (compiled) {
+		compiled->osr_entry = jit->labels[DASM_LBL_osr_entry];
+		compiled->entries = malloc((program_len ? program_len : 1) * sizeof(compiled->entries[0]));
+		assert(compiled->entries);
+		for (size_t i = 0; i < program_len; i++) {
+			compiled->entries[i] = -1;
+		}
+		for (u32 b = 0; b < ir->nblocks; b++) {
+			if (ir->blocks[b].entry) {
+				compiled->entries[ir->blocks[b].offset] = dasm_getpclabel(Dst, b);
+			}
+		}
+		compiled->safepoints = safepoints;
+		compiled->nsafepoints = nsafepoints;
+		compiled->nspills = nspills;
+	}
+	free(exits);
+	ir_free(ir);
+	return code;
+}
+
+// Compile the program with the optimizing tier. The function is the same as
+// the one of the template code, `void fun(Input *in, Output *out)`, and
+// checks the input at the same places. Returns `NULL` if the program can't be
+// lifted to SSA form.
+//
+// With `compiled`, the code can be entered in the middle by the interpreter
+// (see `Compiled`) at loop heads. With the interpreter's `branches` as well,
+// it's specialized to them and may return to the interpreter before the
+// program halts. `osr_entry` then returns the index of the exit in the
+// safepoints.
+static void *
+compile_optimized(Jit *jit, u8 *program, size_t program_len, const u8 *branches, Compiled *compiled, size_t *code_size)
+{
+	double start = jit->profile ? now() : 0;
+	Ir ir;
+	if (!ir_build(&ir, program, program_len, compiled ? branches : NULL, compiled != NULL)) {
+		return NULL;
+	}
+	ir_optimize(&ir);
+	return ir_compile(jit, &ir, program_len, compiled, "bytecode_optimized", start, code_size);
+}
+
+static void *
+compile_template(Jit *jit, u8 *program, size_t program_len, size_t *code_size)
+{
+	dasm_State **ds = &jit->ds;
+	const CompileOptions *opts = &jit->opts;
+	double start = jit->profile ? now() : 0;
+
+	// Now that we have our dynasm state initialized (in `jit_create`), we
+	// want to reuse it to assemble multiple pastings of templates and not
+	// just one. Calling `dasm_init` and `dasm_free` everytime is an option,
+	// but we can just reuse the same state. We just have to initialize each
+	// "trace" with a call to `dasm_setup`, which we have to do even if we
+	// want to process a single "trace" like we are doing in this example.
+	// So here it is. We have to provide the byte array prepared by the
+	// preprocessor. There can only be one `.actions` directive per file,
+	// which means that all `dasm_put` calls in one file are based on that
+	// single actions array (called `our_dasm_actions` in this case), so we
+	// really don't want to pass anything other here. (One could
+	// probably have different files with different `.actions`, but
+	// "templates" from different files couldn't be mixed since DASM stores
+	// the current actions in its internal state and it can't be changed in
+	// any other way than `dasm_setup`, which resets the state.)
+	dasm_setup(Dst, our_dasm_actions);
+
+	// We want to translate jumps from the bytecode to jumps in the assembly
+	// code and want dynasm to figure out the (relative) offsets as needed
+	// by the instructions. For example our `OP_JGT` instruction has an
+	// immediate operand which is the (byte) offset to apply in case a jump
+	// should be taken. The machine code encodes similarly a relative offset
+	// for a (conditional) jump, but it will be a different one than the one
+	// in the bytecode. Since there is a potentially arbitrary number of
+	// instructions in the bytecode we want to compile, we can't possibly
+	// use local labels (1:, ..., 9:), because there are only 9 of them and
+	// already want to be able to use them for local control flow (in one or
+	// possible more templates pasted together) such as conditional
+	// execution or loops. Global labels are also not suitable, because
+	// these have symbolic names and we would have a hard time encoding
+	// things like "instruction 5 needs to jump 8 bytes back, which is a
+	// beginning of another instruction".
+	//
+	// DynASM has us covered and offers "pc labels", also called "dynamic
+	// labels", which are just positive integers (internally used as
+	// indices). These labels are dynamic, because the integers are
+	// determined at the time of `dasm_put`, i.e. they can be arbitrary C
+	// expressions that can evaluate to different values at different times
+	// the snippet is pasted (also called "encoding-time constants"). So
+	// again same shape (snippet), but with different values. We will be
+	// using these labels in a really straightforward way - we'll want to
+	// have a dynamic label for each instruction. When we encounter a jump
+	// instruction, we can just point the jump to the dynamic label of the
+	// destination. This works fine for backward as well as forward jumps,
+	// as with all labels, DynASM is able to resolve relative offsets,
+	// because it does multiple passes on the code. This is even simpler
+	// than our compiler, which had to "fixup" forward jumps!
+	//
+	// Because the dynamic labels are indices to a DynASM internal array, we
+	// need to "preallocate" the ones we'll need, and if we ever need more,
+	// we'll have to allocate more. This is done with call to `dasm_growpc`.
+	// After call to `dasm_growpc(Dst, N)`, dynamic labels 0 through at
+	// least N - 1 will be available to us.
+	//
+	// Our bytecode is a compact serialization - instructions have different
+	// lengths and jumps are based on byte offsets. The simplest route would
+	// be to have a dynamic label for each _byte_. Then even for forward
+	// jumps we would be able to calculate their byte offset in the
+	// instruction stream, where we would put an appropriate dynamic label
+	// later, and DynASM would resolve it in its second pass. But that's
+	// really wasteful: the array of labels would be as large as the
+	// program, and `dasm_link` would have to go through all of it, even
+	// though only a few instructions are ever jumped to. So we first find
+	// the jump targets (a quick pass over the bytecode) and number only
+	// them, densely and in order (`find_jump_labels`). Going through the
+	// program, we put the next label at each target, and jumps look up the
+	// label of their destination with a binary search. (The dynamic labels
+	// and the backing array are also reused for multiple runs, since we
+	// don't `dasm_free` immediately, but just `dasm_setup` before each run.
+	// If the array is already large enough, `dasm_growpc` doesn't do
+	// anything).
+	//
+	// A chunk of a streamed program uses the targets of the whole program,
+	// which include its start (see `ProgramStream`).
+	u8 *targets = jit->stream ? jit->stream->targets + jit->chunk_start : jit->info ? jit->info->targets : find_jump_targets(program, program_len);
+	JumpLabels labels = find_jump_labels(targets, program_len);
+
+	// A unit of a program with calls has only some of its instructions,
+	// we skip the rest, see `Module`.
+	size_t unit_start = jit->module && jit->function >= 0 ? (size_t) jit->function : 0;
+	u8 *unit = jit->module ? find_unit(program, program_len, unit_start) : NULL;
+
+	// For the line table of `DebugInfo`, each instruction gets a label
+	// too, numbered after those of the jump targets.
+	size_t line_labels = 0;
+	if (jit->cache->debug) {
+		for (u8 *instrptr = program; instrptr < program + program_len; instrptr += op_length(*instrptr)) {
+			line_labels++;
+		}
+	}
+	dasm_growpc(Dst, labels.count + line_labels);
+	// Similarly the buffer of the code section, where `dasm_put` stores its
+	// actions with their arguments, would grow by doubling as the program is
+	// compiled, and with it copying what was stored so far. A program takes
+	// less than one position per byte of bytecode, so reserve that upfront.
+	dasm_growsection(Dst, DASM_SECTION_CODE, program_len);
+	jit->reloc_labels = labels.count + line_labels;
+	jit->nrelocs = 0;
+	jit->nlines = 0;
+
+	// Now we have a fully initialized DynASM state for this round of
+	// pasting together some assembly snippets. Remember that the lines with
+	// assembly preceded with `//|` will be translated to calls to
+	// `dasm_put(...)`.  So indeed what we are just doing is by controlling
+	// the C execution we determine which assembly snippets we want to paste
+	// together. With DynASM we can form arbitrary pieces of code, but we
+	// somehow need to execute the code. We of course know how to execute
+	// some other code in assembly - jump to it or call it. Both essentially
+	// do a similar thing - through a relative offset or absolute address
+	// stored in a register they change the instruction pointer (and call
+	// additionally pushes to the stack the previous instruction pointer
+	// which pointed to the _next_ instruction, so after we return from the
+	// call, we can just resume the execution).
+
+	// But we want to also somehow jump to our code from C. Unlike the
+	// popular belief, the semantics of "goto statements" in C are not such
+	// low level as a jumps in assembly, so we'll have to do with function
+	// calls. All functions in C respect something that is called the ABI
+	// of the platform, the "Application Binary Interface". The set of rules
+	// for low level code, so that e.g. functions compiled with one compiler
+	// can call functions compiled with another compiler. The ABI is usually
+	// specific to both the current processor architecture (e.g. x86-64),
+	// because the instruction set is really constraining us in what our
+	// "binaries" may look like, as well as the operating system (e.g.
+	// Linux), because not only we somehow need to communicate with the
+	// operating system, but they historically evolved differently and e.g.
+	// have different needs, so the ABI differs. Importantly for us, the ABI
+	// defines sizes of C integer types (e.g. `long` is 64-bit on x86-64
+	// Linux, but 32-bit on x86-64 Windows) as well as how parameters and
+	// return values are passed. For simplicity we will care only about
+	// the System V x86-64 ABI, used notably by Linux and other operating
+	// systems.
+	//
+	//     https://gitlab.com/x86-psABIs/x86-64-ABI
+	//     https://gitlab.com/x86-psABIs/x86-64-ABI/-/jobs/artifacts/master/raw/x86-64-ABI/abi.pdf?job=build
+	//
+	// Notably, Windows has a custom x86-64 ABI:
+	//
+	//     https://learn.microsoft.com/en-us/cpp/build/x64-calling-convention?view=msvc-170
+	//
+	// See also a blog post by Eli Bendersky:
+	//
+	//     https://eli.thegreenplace.net/2011/09/06/stack-frame-layout-on-x86-64
+
+	// Here is the System V ABI 101 (imprecise, but enough to get going):
+	//
+	// First 6 arguments are passed in registers (left-to-right):
+	//
+	//     1. rdi
+	//     2. rsi
+	//     3. rdx
+	//     4. rcx
+	//     5. r8
+	//     6. r9
+	//
+	// The return value is expected to be in the register rax (and rdx if
+	// the return value is small struct like 2 pointers). If there are
+	// more than 6 arguments they pushed on to the stack right-to-left. Even
+	// arguments that are smaller than 64 bits use the full registers to be
+	// passed. Small-ish structs are passed as if all the struct members
+	// were passed as arguments separately.
+	//
+	// These registers are _callee_ saved (i.!e. the function that called us
+	// expects the values in these registers to be preserved, so we, the
+	// callee, need to preserve the registers by not using them or restoring
+	// them to their original values):
+	//
+	//     rbp ("base pointer")
+	//     rsp ("stack pointer")
+	//     rbx
+	//     r12
+	//     r13
+	//     r14
+	//     r15
+	//
+	// These registers are _caller_ saved (i.e. we as the callee can use
+	// them freely, since if the caller needs the their values they need to
+	// save the values anyway, on the other hand if we call some other
+	// function, we are the caller and the function can possibly change any
+	// of the registers, so we have to save the values if we need them):
+	//
+	//     rdi
+	//     rsi
+	//     rdx
+	//     rcx
+	//     r8
+	//     r9
+	//
+	//     rax
+	//     r10
+	//     r11
+	//
+	// Notably all registers used for parameter passing are caller saved.
+	// Obviously the return value register is also caller saved, but note
+	// that the callee is free to change it also in the case there is no
+	// return value ("the functions returns void").
+	//
+	// There are other subtlities to AMD64 System V ABI:
+	//
+	//  - Stack is kept aligned at 16 bytes.
+	//  - Vararg functions expect in the "al" (rax) register the
+	//    _upper bound_ of used vector registers (xmm0, etc.).
+	//
+	// I mostly ignore these below. "It works on my machine", but may lead
+	// to subtle and hard to debug issues, so beware!
+
+	// Now is a good time to decide on how and where to store the data we
+	// need. We won't need the program at runtime, since it will be
+	// hardcoded into the code (including the immediates, etc.), but we will
+	// need the stack (since we will just translate the bytecode for stack
+	// machine into assembly, not change its workings substantially) and
+	// also a pointer to the current input position.
+	//
+	// The pointer to inputs will be passed to us as an argument - this is
+	// the runtime data that our program will process. The `OP_INPUT`
+	// instructions take one 32 bit number from the input and advance the
+	// input pointer (by 4 bytes). We assume that the caller provided
+	// sufficient number of inputs for the program at hand, so we don't
+	// necessarily need the length of the input nor check it at runtime.
+	// Since it is our only argument it will be in rdi, but that is a caller
+	// saved register and when we later execute `OP_PRINT`, we are the
+	// caller, so we need to save the register. We could either `push` and
+	// `pop` rdi around each call, or move the argument to a callee saved
+	// register, which we can save once in the entry to the function and
+	// restore once at the end of the function. This makes for a much
+	// simpler book keeping, though as always, if we save multiple callee
+	// saved registers with `push`, we have to restore them with `pop` in
+	// the _reverse_ order.
+	//
+	// For stack, we'll just use the x86-64 (call) stack. `OP_PUSH` will
+	// translate directly to `push` and `OP_POP` directly to `pop`. These
+	// instructions change the value of `rsp`, which though a "general
+	// purpose register" is usually used as the stack pointer exactly
+	// because some instructions can manipulate it compactly (`call` is
+	// another example of an instruction that implicitly changes the stack
+	// pointer by pushing the return address). So for us `rsp` will
+	// represent pointer to the top of the stack, and we will have to
+	// embrace its constraints. In particular `rsp` points to the position
+	// where the current top of the stack _is_, not one past it like other
+	// schemes do, and the stack grows downwards. So top of the stack is at
+	// offset zero from top of the stack, and if we want to push a value to
+	// the stack, we first need to decrement the stack pointer and then put
+	// the value at the stack pointer position, while to pop we need to
+	// read the value from the current stack pointer and then increment it.
+	// I.e. pre-decrement push and post-increment pop (we would get another
+	// combination if the stack pointer pointed one past the top of the
+	// stack, or the stack grew upwards). While we have to keep that in
+	// mind, this is what the `push` / `pop` instructions will do for us,
+	// and we won't have to do it manually). See also another blog post by
+	// Eli Bendersky, which has illustrations:
+	//
+	//     https://eli.thegreenplace.net/2011/02/04/where-the-top-of-the-stack-is-on-x86/
+	//
+	// (Note that the blog post concerns x86 whose stack operations are 32
+	// bit, while on x86-64 stack operations are 64 bit, e.g. push
+	// instructions decrement the stack by 8).
+
+	// Here comes the entry to our function, the "prologue". Here we usually
+	// want to save all the callee saved registers that we intend to use.
+	// Usually prologue starts with "push rbp" and "mov rbp, rsp", which
+	// establish the "stack frame" (also called "call frame"), see the
+	// linked blog posts by Eli Bendersky for details. Instead we start by
+	// pushing rbx. We will use this callee save register to store the input
+	// pointer -- while the caller passes us the input pointer as the first
+	// argument in rdi, it would get clobbered once we call other function
+	// ourselves. Storing it in a callee saved register and
+	// storing/restoring the register on entry/exit keeps the management
+	// simple. Callee The thing is that the execution of the program may
+	// leave some values on the stack. By resetting the rbp we could get
+	// easily rid of them, though it would need for us to address
+	// relatively to the rsp to restore rbx if it were pushed after rbp.
+	// So we simply push it before (and this restore it with pop after we
+	// restore the base pointer).
+
+	//
+	// Actually, the first argument is not a pointer to the input values,
+	// but to an `Input`, which holds the cursor (which we load into rbx)
+	// and the end of the available input. When the program ends, we store
+	// the cursor back, so that the caller knows how much was read.
+	//
+	// Our second argument (in rsi) is the pointer to the output buffer.
+	// We only need it for the calls to `output_int` and `output_flush`,
+	// so we don't spend a register on it, we push it to the stack as the
+	// first thing in our stack frame, where it stays at `[rbp - 8]`. We do
+	// the same with the `Input`, at `[rbp - 16]`. The operand stack starts
+	// right below them.
+
+	//
+	// A program compiled for batches has its own prologue, see `Batch`.
+	//
+	// Slots pinned to registers (see `find_pinned_slots`) need their
+	// callee saved registers saved as well, we do it right after rbx.
+	//
+	// The chunks of a streamed program after the first one continue in its
+	// frame, and they don't pin slots, which would have to agree across
+	// the chunks.
+	//
+	// A program with calls doesn't have a static depth, so it doesn't pin
+	// slots either. Its main unit reserves the return stack of the program
+	// right below the `Input`, `CALL_DEPTH_MAX` return addresses, and keeps
+	// the pointer to the next free one in r12, the first pin register,
+	// saved as if it was pinned. A function continues in the frame: its
+	// entry takes the return address pushed by the `call` off the operand
+	// stack and onto the return stack, or halts if that's full.
+	int max_depth = 0;
+	int *depths = NULL;
+	if (jit->info) {
+		depths = jit->info->depths;
+		max_depth = jit->info->max_depth;
+	} else if (opts->pin_slots > 0 && !jit->stream) {
+		depths = find_stack_depths(program, program_len, &max_depth);
+	}
+	int npinned;
+	int *pins = find_pinned_slots(program, program_len, depths, max_depth, opts->pin_slots, &npinned);
+	int nsaved = jit->module ? 1 : npinned;
+
+	if (opts->batch) {
+		emit_batch_prologue(jit, npinned);
+	} else if (jit->module && jit->function >= 0) {
+		//| pop rax
+		//| lea rcx, [rbp - 16]
+		//| cmp r12, rcx
+		//| jae ->call_halt
+		//| mov [r12], rax
+		//| add r12, 8
+		size_t first = 0;
+		while (!unit[first]) {
+			first++;
+		}
+		if (first != unit_start) {
+			//| jmp => find_jump_label(&labels, (ptrdiff_t) unit_start)
+		}
+	} else if (!jit->stream || jit->chunk_start == 0) {
+		//| push rbx
+		emit_save_pins(jit, nsaved);
+		//| push rbp
+		//| mov rbp, rsp
+		//| mov rbx, [rdi + offsetof(Input, next)]
+		//| push rsi
+		//| push rdi
+		if (jit->module) {
+			//| sub rsp, 8 * CALL_DEPTH_MAX
+			//| mov r12, rsp
+		}
+	}
+
+	// Now we will go through all instructions and translate them one by
+	// one. For each instruction we have a snippet of assembly, that will be
+	// interpolated with value computed from embedded C expressions
+	// ("encoding-time constants").
+	u8 *instrptr = program;
+	u8 *end = program + program_len;
+
+	// This macro is a helper, which reads a 4 byte immediate operand from
+	// a position one byte behind the instruction pointer (which skips the
+	// opcode).
+	#define OPERAND() read_operand(instrptr)
+
+	// The register cache (see `TosCache` above) starts empty, since at the
+	// entry the operand stack is (trivially) all in memory. We need to know
+	// where the jumps lead to (`targets` from above), because the cache is
+	// flushed there.
+	TosCache tc = {
+		.limit = opts->tos_regs < 0 ? 0 : opts->tos_regs < TOS_REGS_MAX ? opts->tos_regs : TOS_REGS_MAX,
+		.pins = pins,
+	};
+	u32 *checks = find_input_checks(program, program_len, targets);
+
+	// Instrumented code counts the runs of blocks at their starts, where
+	// the register cache is empty as well, see `BlockProfile`.
+	size_t nblocks;
+	size_t next_block = 0;
+	u8 *blocks = opts->instrument && !opts->batch ? find_blocks(program, program_len, targets, &nblocks) : NULL;
+
+	// The peephole pass runs over the whole bytecode before the main loop
+	// and tells us where instruction sequences start, that we can compile
+	// as one, see `find_fusions`.
+	u8 *fusions = opts->peephole ? find_fusions(program, program_len, targets) : NULL;
+
+	int next_label = 0;
+	while (instrptr < end) {
+
+		// Read the current opcode, which distinguishes the current
+		// instruction.
+		enum op op = (enum op)*instrptr;
+
+		// If this instruction is a jump target, put here its label, the
+		// next one in order. Any preceding or following jumps to this
+		// instruction will find this label. Note that labels, as well
+		// as offsets, are `int`s. This is because DynASM expects all
+		// arguments to `dasm_put` to `int`s. As mentioned above, in this ABI `int`
+		// is 32 bit, so all values passed to DynASM are limited to the
+		// 32 bit range. This is mostly OK, since in the x86-64 most
+		// immediates encoded in the instruction stream are also limited
+		// to 4 bytes. This 32 bit limitation is thus a limitation of
+		// our target architecture, not necessarily of DynASM, and we
+		// have to somehow deal with that.
+		//
+		// Note that in this case, it's unlikely that we would have
+		// programs larger than 4 gigabytes, i.e. offset would not fit
+		// into 32 bits. But even shorter programs could produce x86-64
+		// executable code larger than 4 gigabytes, and there 32 bit
+		// relative offsets for jumps and calls would also not be
+		// enough.
+		//
+		// Also at the start of the instruction, there is a (commented
+		// out) `int3` instruction. Comment with `//!` (i.e. two forward
+		// slashes and exclamation mark) is not a special syntax
+		// understood by DynASM, just something different than `//|`,
+		// but still a C comment. The `int3` instruction is a "trap to
+		// the debugger". So if you were to uncomment it and run this
+		// program in debugger, the debugger would stop before each
+		// executed (jitted) bytecode instruction. This can be very
+		// useful for debugging, also if paired with a print of some
+		// debug information before/after each trap.
+		//
+		// The heads of loops are aligned to 16 bytes, so that the
+		// processor fetches (and caches decoded) as much of the loop as
+		// possible at once. The padding is only executed when we enter
+		// the loop from above, not on each iteration.
+
+		int offset = (int) (instrptr - program);
+		if (unit && !unit[offset]) {
+			next_label += targets[offset] != 0;
+			next_block += blocks && blocks[offset];
+			instrptr += op_length(op);
+			continue;
+		}
+		if (pins) {
+			tc.depth = depths[offset];
+		}
+		if (targets[offset]) {
+			tos_flush(Dst, &tc);
+		}
+		if (targets[offset] & TARGET_LOOP) {
+			//|.align 16
+		}
+		if (targets[offset]) {
+			//|=> next_label++:
+		}
+		if (line_labels) {
+			int label = (int) (labels.count + jit->nlines);
+			//|=> label:
+			jit_add_line(jit, label, jit->chunk_start + (size_t) offset);
+		}
+		//! int3
+
+		// Blocks which read input start with a check of its bounds (see
+		// `Input`). At the start of a block the register cache is
+		// always empty.
+		if (blocks && blocks[offset]) {
+			assert(tc.cached == 0);
+			emit_block_tick(jit, next_block++);
+		}
+		if (checks[offset]) {
+			assert(tc.cached == 0);
+			emit_input_check(jit, checks[offset]);
+		}
+
+		if (fusions && fusions[offset] != FUSE_NONE) {
+			instrptr += compile_fusion(jit, &tc, &labels, fusions[offset], program, instrptr);
+			tos_done(&tc);
+			continue;
+		}
+
+		// The above  will be translated to roughly:
+		//
+		//         dasm_put(..., offset);
+		//
+		// We could have also said:
+		//
+		//         |=> (int) (instrptr - program)
+		//
+		// Which would translate to:
+		//
+		//         dasm_put(..., (int) (instrptr - program));
+		//
+		// There is nothing much more magic about the embedded C
+		// expressions - DynASM handles them textually, and they are
+		// evaluated at runtime like ordinary C expressions and passed
+		// as arguments to `dasm_put`. Note that officially the
+		// evaluation order of arguments is undefined in C, so it might
+		// a good idea to explicitly evaluate the expressions before
+		// using them in assembly snippets, if they can have side
+		// effects, and even if they don't.
+
+		switch (op) {
+		case OP_CONSTANT: {
+			// If the next instruction is `OP_CONSTANT` we need to
+			// append the code for it, we do it by having an
+			// assembly snippet here, which translates to
+			// `dasm_put`. The instruction has an immediate operand
+			// which we read with a macro and store it in a variable
+			// before passing it to the snippet. While the
+			// `OP_CONSTANT` instruction is generic and an
+			// interpreter has to load the constant from bytecode
+			// everytime, this particular `OP_CONSTANT` will always
+			// have this one same operand, so we can just
+			// embed it in the code. The below translates to `push 4`
+			// if the operand in the instruction stream is
+			// the number 4. This will be pattern matched by DynASM
+			// to be a push of 32 bit immediate (see the unofficial
+			// DynASM instruction reference or other x86-64
+			// instruction references). This is perfect for us,
+			// since we want to push a 32 bit value. If we wanted
+			// to push 64 bit value, we would first have to somehow
+			// get the value to a register (see later) and then use
+			// `push REG`, because there just isn't an instruction
+			// that is able to push 64 bit immediates. DynASM won't
+			// do that for us automatically. What's worse the
+			// argument (passed as vararg) is expected to be an int,
+			// so passing larger values will only result in silent
+			// truncation. Beware!
+
+			i32 operand = OPERAND();
+			if (tc.limit == 0 && tos_pin(&tc, tc.depth) < 0) {
+				//| push operand
+			} else {
+				// With the register cache (or for a pinned
+				// slot), the constant goes into a register
+				// instead. Again a sign extended 32 bit
+				// immediate, just like with `push`.
+				int r = tos_alloc(&tc);
+				//| mov Rq(r), operand
+				tos_push(Dst, &tc, r);
+			}
+
+			// This instruction is 5 bytes long, we have to advance
+			// the instruction pointer by 5 bytes and switch on the
+			// opcode to decide on what to compile next.
+
+			instrptr += 5; break;
+		}
+		case OP_ADD: {
+			// Pop the second argument, pop the first argument, add
+			// the second to the first and push their result. The
+			// operations here are 64 bit. Since stacks work with 64
+			// bit values, the `pop`s and `push`es have to be 64 bit,
+			// but the arithmetic doesn't -- we could just as well
+			// have written `add eax, ecx` to operate on 32 bit
+			// parts of the registers (which will zero out the
+			// upper 32 bits). It would have save us a byte in the
+			// encoding of the instructions and be slightly faster
+			// in runtime (adding 32 bits is faster than adding 64),
+			// but we don't care about such small improvements.
+			//
+			// The pops and pushes go through the register cache,
+			// without it the below becomes exactly the sequence
+			// described above, with it, the operands are likely
+			// already in registers and the result stays in one.
+
+			int b = tos_pop(Dst, &tc);
+			int a = tos_pop(Dst, &tc);
+			//| add Rq(a), Rq(b)
+			tos_push(Dst, &tc, a);
+
+			instrptr += 1; break;
+		}
+		case OP_PRINT: {
+			// Printing is a little tricky. Barring system calls, we
+			// have to call an external function to do the print.
+			// This could be one from an external library, like
+			// `printf`, but that would parse the format string and
+			// lock `stdout` for every single number, which for
+			// programs that print a lot is all the time they take.
+			// So we call our own function, `output_int`, which
+			// formats the number into a buffer, written out only
+			// when it fills up and when the program halts (see
+			// `Output`).
+			// There is one problem though normal calls are based on
+			// signed 32 bit relative offsets, while the x86-64
+			// space is 64 bit, so call targets can be much further
+			// than +-2 GiB. Here we find ourselves at runtime,
+			// where both the static and dynamic loader/linker
+			// have already figured out where everything in the
+			// memory is, after all, our program is already
+			// running. So for example the (64 bit) address of the
+			// `output_int` function is already known. But since we
+			// have not yet mmaped pages for our code, we don't know
+			// whether it will be close to `output_int`!. DynASM has
+			// the capability to handle external names through a
+			// callback which will let us handle that in the
+			// encoding stage where we already know the
+			// destination of our code, but let's not go that far
+			// right now. What we can do is use an _indirect_
+			// through a register - we will store the 64 bit address
+			// of `output_int` in a register, and then call it
+			// with `call REG`. Most instructions don't allow 64 bit
+			// immediate operands, but one does, DynASM calls it
+			// fittingly `mov64`, but other assemblers call it
+			// `movabs`. It can store a 64 bit immediate in a
+			// register. Perfect for us. Though there is another
+			// problem, since the parameters to `dasm_put` are all
+			// 32 bit integers (`int`), how are we going to pass it
+			// to DynASM? Well, DynASM preprocessor knows that the
+			// instruction operand is special and handles it by
+			// passing the lower 32 bits and upper 32 bits
+			// separately. Since the argument to `dasm_put` is
+			// determined by a simple text substitution, and here
+			// the argument will be evaluated twice, we should be
+			// even more careful about complex expressions and side
+			// effects.
+			//
+			// The first argument of `output_int` is the output
+			// buffer, we keep the pointer to it in our stack frame
+			// (see the prologue). The second argument is the number
+			// to print -- we pop that from the stack into a
+			// register. Finally we call the function with an
+			// indirect call instruction.
+			// Note that we cast the address to an integer to avoid
+			// compiler warnings (because dynasm follows it with
+			// truncation to 32 bits or extraction of upper 32 bits
+			// respectively.
+			//
+			// It is important to note, that `output_int` respects
+			// the ABI, so we have to presume it destroys the values
+			// in caller saved registers, we only store our state in
+			// rbx and in the stack frame, so we our fine. Cached
+			// slots of the operand stack are in caller saved
+			// registers though, so we have to flush the register
+			// cache before the call.
+			//
+			// Remember the subtleties of the ABI we ignored so far?
+			// Here they matter. The stack has to be aligned to 16
+			// bytes at the call, but the depth of our operand stack
+			// at this point is arbitrary (and once we enter the
+			// code in the middle from the interpreter, even the
+			// depth isn't known). So we align `rsp` dynamically.
+			// The trick is to save two copies of the original value
+			// of `rsp` before aligning it: after the `and`, which
+			// moves the stack pointer down by either 0 or 8 bytes,
+			// one of them is always at `[rsp + 8]`.
+			//
+			// The call is made by `emit_call` (so that other calls
+			// can be made the same way):
+			//
+			//         mov64 r11, output_int
+			//         push rsp
+			//         push qword [rsp]
+			//         and rsp, -16
+			//         call r11
+			//         mov rsp, [rsp + 8]
+			//
+			// The address is loaded by `emit_symbol`, which also
+			// remembers where in the code it is, which we need to
+			// store the code and load it in another process.
+
+			int value = tos_pop(Dst, &tc);
+			if (opts->batch) {
+				emit_batch_print(jit, value);
+				instrptr += 1; break;
+			}
+			tos_flush(Dst, &tc);
+			//| mov rsi, Rq(value)
+			//| mov rdi, [rbp - 8]
+			emit_call(jit, SYM_OUTPUT_INT);
+
+			// The `mov64` instruction (in `emit_symbol`) translates
+			// to roughly the following:
+			//
+			//     dasm_put(...,
+			//         (unsigned int)(((uintptr_t) output_int)),
+			//         (unsigned int)((((uintptr_t) output_int))>>32),
+			//     )
+
+			instrptr += 1; break;
+		}
+		case OP_INPUT: {
+			// We have to read 32 bits from the place where rbx (the
+			// input pointer) points to and advance it by
+			// those 32 bits so next time we read the next input
+			// value.
+			//
+			// For reading a 32 bit value (aka dword) from memory,
+			// we could just issue a read into some 32 bit
+			// register, like `eax`, i.e. `mov eax, [rbx]`, which
+			// says "read a 32 bit value from a 64 bit address
+			// stored in the rbx register. The size of the read is
+			// determined implicitly from the (in this case
+			// destination) register size. In cases involving
+			// immediates, we usually have to specify whether we are
+			// storing an 8/16/32/64 bit immediate by including the
+			// right keyword for the size (`byte`, `word`, `dword`,
+			// `qword` respectively). But we can also include these
+			// keywords when they are not necessary, if we prefer
+			// that, as we do below by specifying "dword read", even
+			// though it would have been implicit from the use of
+			// `eax` as the destination.
+
+			int r = tos_alloc(&tc);
+			//| mov Rd(r), dword [rbx]
+			//| add rbx, 4
+			tos_push(Dst, &tc, r);
+
+			instrptr += 1; break;
+		}
+		case OP_DISCARD: {
+			// We just `pop` into a register and don't use the
+			// value. That is what `OP_DISCARD` really is. Okay,
+			// since we don't do anything interesting with the
+			// value, we could just increment the stack pointer with
+			// `add rsp, 8`, which would have saved a load to `rax`,
+			// but since we don't care about preserving `rax`, and
+			// use `push` and `pop` instructions in other places, so
+			// we do it for consistency. With the register cache,
+			// the value may have been in a register and then  we
+			// just forget about it.
+
+			tos_pop(Dst, &tc);
+
+			instrptr += 1; break;
+		}
+		case OP_GET: {
+			// For `OP_GET` we have a 32 bit immediate operand which
+			// we will have to use as an offset to the top of the
+			// stack. The offset is in number of elements, and in
+			// our case each elements is 8 bytes. Since we load the
+			// both the constant 8 and the operand as well as the
+			// result of their multiplication are runtime known
+			// values, but constants from the point of view of the
+			// instruction - the multiplication is performed now and
+			// the instruction will only contain the offset
+			// as an immediate, for example if operand is 5, the
+			// instruction will have the immediate value 40 encoded
+			// in it. The way we do that below is slightly risky, we
+			// put the multiplication and read of the operand in the
+			// assembly snippet. The syntax may seem similar to the
+			// well known complex addressing modes of x86-64, where
+			// for example `[rsp + 8 * rax]` would mean of the
+			// possible addressings. The trick here is that DynASM
+			// expects to see `[rsp + rax * 8]`, so it isn't
+			// confused by the leading `8 *`. Since `8 * OPERAND()`
+			// is an encoding time constant, an entirely different
+			// addressing mode will be used `[REG + IMMEDIATE]`.
+			// Evaluating the "constant" before the assembly snippet
+			// and storing it in a variable would have probably made
+			// it much clearer.
+			//
+			// With the register cache the slot may also be in a
+			// register, and if not, the cached slots on top of it
+			// are not in memory, hence the `mem` index may be
+			// smaller than the operand.
+
+			int r = tos_alloc(&tc);
+			int mem;
+			int src = tos_slot(&tc, OPERAND(), &mem);
+			if (src >= 0) {
+				//| mov Rq(r), Rq(src)
+			} else {
+				//| mov Rq(r), [rsp + 8 * mem]
+			}
+			tos_push(Dst, &tc, r);
+
+			// The load from memory translates roughly to:
+			//
+			//     dasm_put(..., 8 * mem);
+
+			instrptr += 5; break;
+		}
+		case OP_SET: {
+			// There isn't anything interesting to `OP_SET`, we
+			// pop a value from top of the stack and then store it
+			// to an offset from (the new) top of the stack.
+
+			int value = tos_pop(Dst, &tc);
+			int mem;
+			int dst = tos_slot(&tc, OPERAND(), &mem);
+			if (dst >= 0) {
+				//| mov Rq(dst), Rq(value)
+			} else {
+				//| mov [rsp + 8 * mem], Rq(value)
+			}
+
+			instrptr += 5; break;
+		}
+		case OP_CMP: {
+			// Here we need to compare two numbers and push a
+			// positive number / negative number / zero as
+			// appropriate. Let's not use setcc, and instead
+			// showcase some local control flow using local labels.
+			// Remember, the "arrows" (`<`, `>`) of local labels
+			// point in the direction where the label is defined,
+			// here we refer to forward labels only. The labels are
+			// also purely based on the order of the instructions,
+			// i.e. the order dasm receives them in, lexical order
+			// in the C source doesn't matter at all.
+			//
+			// Since `mov` doesn't change flags, we can reuse the
+			// register of one of the operands for the result
+			// and decide on the value with jumps after the `cmp`.
+
+			int b = tos_pop(Dst, &tc);
+			int a = tos_pop(Dst, &tc);
+			//| cmp Rq(a), Rq(b)
+			//| mov Rq(a), 1
+			//| jg >1
+			//| mov Rq(a), 0
+			//| je >1
+			//| mov Rq(a), -1
+			//|1:
+			tos_push(Dst, &tc, a);
+
+			instrptr += 1; break;
+		}
+		case OP_JGT: {
+			// Conditional branch based on whether the top of the
+			// stack is a positive number. We set the flags based on
+			// the top of the stack by popping it into a register
+			// and then testing the register with itself. This
+			// effectively compares the register to zero, so we can
+			// use the "greater than" conditional jump. The relative
+			// byte offset to the destination is encoded in
+			// the instruction stream, so we figure out the
+			// (absolute) byte offset from the beginning, and look up
+			// the dynamic label we either already put there, or
+			// will later.
+
+			//
+			// At the destination, the register cache is empty, so
+			// it has to be here as well -- both if we jump, and if
+			// we don't, since the next instruction may as well be
+			// the target of another jump.
+
+			ptrdiff_t target = instrptr - program + OPERAND();
+			int cond = tos_pop(Dst, &tc);
+			tos_flush(Dst, &tc);
+			//| test Rq(cond), Rq(cond)
+			emit_jg(jit, &labels, target);
+
+			instrptr += 5; break;
+		}
+		case OP_HALT: {
+			// When the code compiled by us encounters this
+			// instruction, it should halt the execution, since we
+			// structure the code as a function, here is the right
+			// place for return -- an epilogue including a `ret`
+			// instruction.
+			//
+			// In our scheme we decided to first save rbx and then
+			// rbp/rsp, so here we do the reverse - restore the base
+			// and stack pointers and then restore rbx to the
+			// caller's value.
+			//
+			// Before that, we store the input cursor back to the
+			// `Input` and write out what the program printed, with
+			// a call to `output_flush` just like the one to
+			// `output_int` in `OP_PRINT`. The register cache
+			// doesn't have to be flushed, it's not needed anymore.
+			//
+			// The program halts only once, so all of that goes to
+			// the cold section, out of the way of the code around.
+			//
+			// In a batch, we go on with the next record instead.
+
+			if (opts->batch) {
+				//| jmp ->batch_next
+				tc.cached = 0;
+				instrptr += 1; break;
+			}
+			//| jmp >2
+			//|.cold
+			//|2:
+			if (blocks) {
+				emit_block_exit(jit);
+			}
+			//| mov rax, [rbp - 16]
+			//| mov [rax + offsetof(Input, next)], rbx
+			//| mov rdi, [rbp - 8]
+			emit_call(jit, SYM_OUTPUT_FLUSH);
+			//| mov rsp, rbp
+			//| pop rbp
+			emit_restore_pins(jit, nsaved);
+			//| pop rbx
+			//| ret
+			//|.code
+
+			// Whatever was in the register cache is dropped, just
+			// like the rest of the operand stack.
+			tc.cached = 0;
+
+			instrptr += 1; break;
+		}
+		case OP_CALL: {
+			// The function is in another unit, and until it's
+			// compiled the call goes to a stub, see `Module`. It
+			// gets the return address (the end of the `rel32` to
+			// patch) from the top of the stack. Like at a jump,
+			// the register cache is flushed, the function starts
+			// with it empty and returns with it empty.
+			ptrdiff_t target = instrptr - program + OPERAND();
+			assert(target >= 0 && (size_t) target < program_len && "call outside of the program");
+			CallSite *site = module_add_site(jit->module, (size_t) target);
+			tos_flush(Dst, &tc);
+			if (jit->module->shared) {
+				// The `rel32` aligned, to be patched while
+				// other threads may run the call.
+				//| .align 4
+				//| nop
+				//| nop
+				//| nop
+			}
+			//| call >1
+			//|.cold
+			//|1:
+			//| mov64 rdi, (uintptr_t) site
+			//| mov rsi, [rsp]
+			emit_call(jit, SYM_CALL_LINK);
+			//| jmp rax
+			//|.code
+
+			instrptr += 5; break;
+		}
+		case OP_RET: {
+			// The return address goes back on the machine stack,
+			// for the `ret` to pair with the `call`. Only the main
+			// unit can find the return stack empty, then the
+			// program halts.
+			tos_flush(Dst, &tc);
+			if (jit->function < 0) {
+				//| lea rcx, [rbp - 16 - 8 * CALL_DEPTH_MAX]
+				//| cmp r12, rcx
+				//| je ->call_halt
+			}
+			//| sub r12, 8
+			//| push qword [r12]
+			//| ret
+
+			instrptr += 1; break;
+		}
+		}
+
+		tos_done(&tc);
+	}
+
+	// A chunk of a streamed program which isn't the last one falls through
+	// to the next one.
+	if (jit->stream && jit->chunk_start + program_len < jit->stream->program_len) {
+		tos_flush(Dst, &tc);
+		emit_far_jump(jit, jit->chunk_start + program_len);
+	}
+	free(fusions);
+	free(checks);
+	free(blocks);
+	if (!jit->stream && !jit->info) {
+		free(targets);
+	}
+	free(labels.offsets);
+	if (!jit->info) {
+		free(depths);
+	}
+	free(unit);
+
+	// The entry for on-stack replacement, used to switch from the
+	// interpreter to the compiled code in the middle of the program (see
+	// `interpret`). It's called as a C function
 	//
-	//     https://eli.thegreenplace.net/2011/09/06/stack-frame-layout-on-x86-64
+	//         void osr_entry(Input *in, Output *out, i64 *stack, size_t depth, void *target)
+	//
+	// and sets up the same frame as the normal entry. Then it copies `depth`
+	// values from `stack` (the bottom one first) to the machine stack and
+	// jumps to `target`, which has to be the code of an instruction where
+	// the register cache is empty -- a jump target. Unlike all the code
+	// above, this is a global label, so that we get its address in
+	// `jit->labels` after encoding. Pinned slots (those deep enough to
+	// exist at the target) are loaded into their registers as well.
+	//
+	// Batches and streamed programs can't be entered in the middle, there
+	// is no `osr_entry` for them. Programs with calls only in their main
+	// unit, with the return stack empty.
+	//
+	// This and the rest of the function run only once per call, they go to
+	// the cold section.
+	//|.cold
+	if (!opts->batch && !jit->stream && !(jit->module && jit->function >= 0)) {
+		//|->osr_entry:
+		//| push rbx
+		emit_save_pins(jit, nsaved);
+		//| push rbp
+		//| mov rbp, rsp
+		//| mov rbx, [rdi + offsetof(Input, next)]
+		//| push rsi
+		//| push rdi
+		if (jit->module) {
+			//| sub rsp, 8 * CALL_DEPTH_MAX
+			//| mov r12, rsp
+		}
+		//| xor eax, eax
+		//| jmp >2
+		//|1:
+		//| push qword [rdx + rax * 8]
+		//| add rax, 1
+		//|2:
+		//| cmp rax, rcx
+		//| jb <1
+		for (int i = 0; pins && i < max_depth; i++) {
+			if (pins[i] >= 0) {
+				//| cmp rcx, i
+				//| jbe >3
+				//| mov Rq(pins[i]), [rdx + 8 * i]
+				//|3:
+			}
+		}
+		//| jmp r8
+	}
+	free(pins);
+
+	// Where the program halts when it runs out of input. The cursor is
+	// already stored back by `input_refill`, the rest is the same as in
+	// `OP_HALT`. A record of a batch just ends, without a `refill` the
+	// compiled code never reads past it.
+	//|->input_exhausted:
+	if (opts->batch) {
+		//| jmp ->batch_next
+	} else {
+		if (opts->instrument) {
+			emit_block_exit(jit);
+		}
+		//| mov rdi, [rbp - 8]
+		emit_call(jit, SYM_OUTPUT_FLUSH);
+		//| mov rsp, rbp
+		//| pop rbp
+		emit_restore_pins(jit, nsaved);
+		//| pop rbx
+		//| ret
+	}
+
+	// Where a program with calls halts when the return stack overflows,
+	// or when the main unit returns. The same as `OP_HALT`.
+	if (jit->module) {
+		//|->call_halt:
+		if (opts->instrument) {
+			emit_block_exit(jit);
+		}
+		//| mov rax, [rbp - 16]
+		//| mov [rax + offsetof(Input, next)], rbx
+		//| mov rdi, [rbp - 8]
+		emit_call(jit, SYM_OUTPUT_FLUSH);
+		//| mov rsp, rbp
+		//| pop rbp
+		emit_restore_pins(jit, nsaved);
+		//| pop rbx
+		//| ret
+	}
+	//|.code
+
+	// We `dasm_put` all snippets. Now we need to link and encode them. See
+	// the description of the function for more details.
+	if (jit->profile) {
+		jit->times[0] += now() - start;
+	}
+	char name[64];
+	if (jit->stream) {
+		snprintf(name, sizeof(name), "bytecode_template_%zu", jit->chunk_start);
+	} else if (jit->module && jit->function >= 0) {
+		snprintf(name, sizeof(name), "bytecode_function_%zu", unit_start);
+	} else {
+		snprintf(name, sizeof(name), "bytecode_template");
+	}
+	void *code = jit_encode(jit, name, program_len, code_size);
+	for (size_t i = 0; i < jit->nrelocs; i++) {
+		jit->relocs[i].offset = (u32) dasm_getpclabel(Dst, jit->relocs[i].offset) - 8;
+	}
+
+	// We keep the same DASM state, the next call to `compile` will call
+	// `dasm_setup` and continue with the compilation of another program,
+	// reusing the buffers that have already grown large enough.
+	return code;
+}
+
+// Compile the program with the best compiler the options allow: batches in
+// vector lanes, the optimizing tier, or the template compiler, which can
+// compile anything. The first two give up on programs they don't handle.
+static void *
+compile(Jit *jit, u8 *program, size_t program_len, size_t *code_size)
+{
+	const CompileOptions *opts = &jit->opts;
+	void *code = NULL;
+	if (opts->batch && opts->simd && cpu_has_avx2()) {
+		code = compile_lanes(jit, program, program_len, code_size);
+	} else if (opts->optimize && !opts->batch && !opts->instrument) {
+		code = compile_optimized(jit, program, program_len, NULL, NULL, code_size);
+	}
+	return code ? code : compile_template(jit, program, program_len, code_size);
+}
+
+// Free the DynASM state along with all its buffers, and the context itself.
+// Code compiled with the context is not affected, it lives in the code cache.
+static void
+jit_destroy(Jit *jit)
+{
+	dasm_State **ds = &jit->ds;
+	dasm_free(Dst);
+	free(jit->relocs);
+	free(jit->lines);
+	free(jit);
+}
+
+// The code of the function at `offset` of the program, compiled now if it
+// isn't yet, see `Module`.
+static void *
+module_function(Module *module, size_t offset)
+{
+	if (module->functions[offset]) {
+		return module->functions[offset];
+	}
+	if (!module->jit) {
+		module->jit = jit_create(&module->opts, module->cache);
+	}
+	Jit *jit = module->jit;
+	jit->module = module;
+	jit->function = (ptrdiff_t) offset;
+	void *code = compile_template(jit, module->program, module->program_len, NULL);
+	jit->module = NULL;
+	code_cache_seal(module->cache);
+	module->functions[offset] = code;
+	return code;
+}
+
+// Called by the stub of a call site the first time the call runs, with the
+// return address of the call, right after its `rel32`. Returns the function
+// for the stub to continue with. The call is patched to go to the function
+// directly, unless it's too far (in another region of the code cache), then
+// it keeps going through the stub.
+//
+// If the code runs in other threads too, they may be executing the very call
+// we patch. They see the store of the `rel32` either whole or not at all if
+// it's aligned (which the calls of a shared module are), and only with the
+// cache mapped twice the page stays executable while we write it. Otherwise
+// the call keeps going through the stub.
+static void *
+call_link(CallSite *site, u8 *ret)
+{
+	Module *module = site->module;
+	mutex_lock(&module->lock);
+	void *code = module_function(module, site->callee);
+	ptrdiff_t rel = (u8 *) code - ret;
+	int atomic = module->cache->dual && ((uintptr_t) (ret - 4) & 3) == 0;
+	if (rel == (i32) rel && (!module->shared || atomic)) {
+		i32 rel32 = (i32) rel;
+		code_patch(module->cache, ret - 4, &rel32, sizeof(rel32));
+	}
+	mutex_unlock(&module->lock);
+	return code;
+}
+
+// Free the module with its functions and call sites. The code of the main
+// unit is freed by whoever compiled it.
+static void
+module_destroy(Module *module)
+{
+	for (size_t i = 0; i < module->program_len; i++) {
+		if (module->functions[i]) {
+			code_free(module->cache, module->functions[i]);
+		}
+	}
+	for (size_t i = 0; i < module->nsites; i++) {
+		free(module->sites[i]);
+	}
+	if (module->jit) {
+		jit_destroy(module->jit);
+	}
+	mutex_destroy(&module->lock);
+	free(module->sites);
+	free(module->functions);
+	free(module);
+}
+
+// Compiling the same program in every process we start is wasted work, so
+// compiled code can also be kept in a directory on disk, one file per
+// program. The files are "content addressed": the name of the file is a hash
+// of everything the code depends on -- the bytecode, the compile options and
+// the action list of DynASM (which changes with any change to our snippets).
+// A file looks like this:
+//
+//         code        the encoded code, exactly as in memory
+//         relocs      `nrelocs` times `Reloc`
+//         program     the bytecode, to rule out hash collisions
+//         DiskCodeTrailer
+//
+// The code is at the start of the file, so that it can be mapped right into
+// the code cache (`mmap` wants page aligned file offsets) and we only compile
+// when the file doesn't exist yet. The addresses of symbols in the stored
+// code are zeroed, the loading process patches in its own ones. That touches
+// only the pages with relocations, the rest of them stays shared with the
+// page cache (and other processes using the same file).
+//
+// The trailer is at the end, because only after the code do we know its
+// size. We assume the file is read on the same kind of machine as it was
+// written, so it is in the native byte order.
+#define DISK_CODE_MAGIC "DJITCODE"
+
+typedef struct {
+	char magic[8];
+	u64 key;
+	u64 code_size;
+	u64 nrelocs;
+	u64 program_len;
+} DiskCodeTrailer;
+
+// FNV-1a, continuing from `hash`.
+static u64
+hash_bytes(u64 hash, const void *data, size_t len)
+{
+	const u8 *bytes = data;
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ bytes[i]) * 0x100000001b3;
+	}
+	return hash;
+}
+
+// The key of compiled code in the disk cache. (The options are hashed as raw
+// bytes, `CompileOptions` is all `int`s, so there is no padding.)
+static u64
+disk_cache_key(const CompileOptions *opts, const u8 *program, size_t program_len)
+{
+	u64 hash = 0xcbf29ce484222325;
+	hash = hash_bytes(hash, our_dasm_actions, sizeof(our_dasm_actions));
+	hash = hash_bytes(hash, opts, sizeof(*opts));
+	hash = hash_bytes(hash, program, program_len);
+	return hash;
+}
+
+static void
+disk_cache_path(char *path, size_t size, const char *dir, u64 key)
+{
+	snprintf(path, size, "%s/%016llx.code", dir, key);
+}
+
+// Load code for the program from the disk cache into the code cache. Returns
+// NULL if it's not there (or the file is not usable), otherwise the code,
+// which, as with `compile`, can only be used after the code cache is sealed.
+static void *
+disk_cache_load(const char *dir, CodeCache *cache, u64 key, const u8 *program, size_t program_len, size_t *sizep)
+{
+	char path[4096];
+	disk_cache_path(path, sizeof(path), dir, key);
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		return NULL;
+	}
+	void *code = NULL;
+	Reloc *relocs = NULL;
+	u8 *stored_program = NULL;
+	DiskCodeTrailer trailer;
+	if (fseek(f, -(long) sizeof(trailer), SEEK_END) != 0 || fread(&trailer, sizeof(trailer), 1, f) != 1) {
+		goto out;
+	}
+	if (memcmp(trailer.magic, DISK_CODE_MAGIC, sizeof(trailer.magic)) != 0 || trailer.key != key || trailer.program_len != program_len || trailer.code_size == 0) {
+		goto out;
+	}
+	relocs = malloc(trailer.nrelocs * sizeof(relocs[0]) + 1);
+	stored_program = malloc(program_len + 1);
+	assert(relocs && stored_program);
+	if (fseek(f, (long) trailer.code_size, SEEK_SET) != 0
+	    || fread(relocs, sizeof(relocs[0]), trailer.nrelocs, f) != trailer.nrelocs
+	    || fread(stored_program, 1, program_len, f) != program_len
+	    || memcmp(stored_program, program, program_len) != 0) {
+		goto out;
+	}
+	for (size_t i = 0; i < trailer.nrelocs; i++) {
+		if (relocs[i].symbol >= SYM__MAX || relocs[i].offset + 8 > trailer.code_size) {
+			goto out;
+		}
+	}
+
+	size_t size = (size_t) trailer.code_size;
+	mutex_lock(&cache->lock);
+	code = code_alloc_pages(cache, size);
+	int loaded = 0;
+#if !defined(_WIN32) && !(defined(__APPLE__) && defined(__MACH__))
+	// With a single mapping of the code cache, we can replace its pages
+	// with a private mapping of the file. A dual mapped cache is backed by
+	// its own memory file, there we have to copy, as we do on Macs, where
+	// the pages would lose their `MAP_JIT`.
+	if (code && !cache->dual) {
+		size_t len = (size + cache->page_size - 1) / cache->page_size * cache->page_size;
+		loaded = mmap(code, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno(f), 0) != MAP_FAILED;
+	}
+#endif
+	if (code && !loaded) {
+		loaded = fseek(f, 0, SEEK_SET) == 0 && fread(code_writable(cache, code), 1, size, f) == size;
+	}
+	if (code && loaded) {
+		u8 *writable = code_writable(cache, code);
+		for (size_t i = 0; i < trailer.nrelocs; i++) {
+			u64 address = symbol_address(relocs[i].symbol);
+			memcpy(writable + relocs[i].offset, &address, sizeof(address));
+		}
+	} else if (code) {
+		code_release(cache, code);
+		code = NULL;
+	}
+	mutex_unlock(&cache->lock);
+	// The line table isn't kept in the file, the profilers and debuggers
+	// get just the symbol.
+	if (code && cache->debug) {
+		debug_info_register(cache->debug, "bytecode_cached", code, size, NULL, 0);
+	}
+	if (code && sizep) {
+		*sizep = size;
+	}
+out:
+	free(stored_program);
+	free(relocs);
+	fclose(f);
+	return code;
+}
+
+// Store the code the context has just compiled in the disk cache. Failures
+// are not fatal, the program is just compiled again next time. The file is
+// written under a temporary name first and then renamed, so that other
+// processes never see it incomplete.
+static void
+disk_cache_store(const char *dir, Jit *jit, u64 key, void *code, size_t code_size, const u8 *program, size_t program_len)
+{
+	char path[4096];
+	char tmp[4096 + 32];
+	disk_cache_path(path, sizeof(path), dir, key);
+#ifdef _WIN32
+	snprintf(tmp, sizeof(tmp), "%s.%lu.tmp", path, (unsigned long) GetCurrentProcessId());
+#else
+	snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long) getpid());
+#endif
+	FILE *f = fopen(tmp, "wb");
+	if (!f) {
+		return;
+	}
+	u8 *copy = malloc(code_size);
+	assert(copy);
+	memcpy(copy, code, code_size);
+	for (size_t i = 0; i < jit->nrelocs; i++) {
+		memset(copy + jit->relocs[i].offset, 0, 8);
+	}
+	DiskCodeTrailer trailer = {
+		.magic = DISK_CODE_MAGIC,
+		.key = key,
+		.code_size = code_size,
+		.nrelocs = jit->nrelocs,
+		.program_len = program_len,
+	};
+	int ok = fwrite(copy, 1, code_size, f) == code_size
+		&& fwrite(jit->relocs, sizeof(jit->relocs[0]), jit->nrelocs, f) == jit->nrelocs
+		&& fwrite(program, 1, program_len, f) == program_len
+		&& fwrite(&trailer, sizeof(trailer), 1, f) == 1;
+	ok = fclose(f) == 0 && ok;
+	free(copy);
+	if (!ok || rename(tmp, path) != 0) {
+		remove(tmp);
+	}
+}
+
+// Compilation isn't free, for short running programs it may take more time to
+// compile the program than to run it. So the program can also start in an
+// interpreter, our "baseline tier", which executes the bytecode directly. It
+// counts how many times each backward jump lands on its target, and once a
+// loop turns out to be hot, the program is compiled, and its execution
+// continues in the compiled code right at the start of the loop. This is
+// "on-stack replacement": we don't wait for the next time the program is
+// executed, in the middle of its execution we move its state (the operand
+// stack and the input position) from the interpreter to the machine stack and
+// registers, where the compiled code expects it.
+//
+// The interpreter also defines what the compiled code should do, so it mirrors
+// its quirks: the values are 64 bit, constants are sign extended, while the
+// inputs are zero extended (as is the result of `mov eax, dword [rbx]`).
+
+// A growable operand stack for the interpreter, with the bottom at index 0.
+typedef struct {
+	i64 *items;
+	size_t depth;
+	size_t cap;
+} Stack;
+
+static void
+stack_push(Stack *stack, i64 value)
+{
+	if (stack->depth == stack->cap) {
+		stack->cap = stack->cap ? 2 * stack->cap : 64;
+		stack->items = realloc(stack->items, stack->cap * sizeof(stack->items[0]));
+		assert(stack->items);
+	}
+	stack->items[stack->depth++] = value;
+}
+
+static i64
+stack_pop(Stack *stack)
+{
+	assert(stack->depth > 0);
+	return stack->items[--stack->depth];
+}
+
+// Slot `k` counted from the top of the stack.
+static i64 *
+stack_slot(Stack *stack, i32 k)
+{
+	assert(k >= 0 && (size_t) k < stack->depth);
+	return &stack->items[stack->depth - 1 - (size_t) k];
+}
+
+// Compile the program with the context, recording the entries before the
+// DynASM state is reused for another program. The code is not sealed. Only
+// the template compiler and the optimizing tier (specialized to `branches`,
+// see `interpret`) have entries in the middle of the program, so the options
+// choosing other compilers don't apply here. Of a program with calls, only the
+// main unit is compiled, and has entries.
+static Compiled *
+compile_enterable(Jit *jit, u8 *program, size_t program_len, const u8 *branches)
+{
+	dasm_State **ds = &jit->ds;
+	Compiled *compiled = calloc(1, sizeof(*compiled));
+	assert(compiled);
+	compiled->cache = jit->cache;
+	const CompileOptions *opts = &jit->opts;
+	if (program_has_calls(program, program_len)) {
+		compiled->module = module_create(program, program_len, opts, jit->cache);
+	} else if (opts->optimize && !opts->batch && !opts->instrument
+	    && (compiled->code = compile_optimized(jit, program, program_len, branches, compiled, NULL))) {
+		return compiled;
+	}
+	jit->module = compiled->module;
+	jit->function = -1;
+	compiled->code = compile_template(jit, program, program_len, NULL);
+	jit->module = NULL;
+	compiled->osr_entry = jit->labels[DASM_LBL_osr_entry];
+	compiled->entries = malloc((program_len ? program_len : 1) * sizeof(compiled->entries[0]));
+	assert(compiled->entries);
+	// The labels of the targets are numbered in order, see `compile_template`.
+	u8 *targets = find_jump_targets(program, program_len);
+	unsigned int label = 0;
+	for (size_t i = 0; i < program_len; i++) {
+		compiled->entries[i] = targets[i] ? dasm_getpclabel(Dst, label++) : -1;
+	}
+	free(targets);
+	return compiled;
+}
+
+// Compile the trace of a loop of the program, see `Trace`. It's entered at
+// the start of the loop, with the top `trace->depth` slots of the stack, see
+// `osr_enter`, and returns at the exits.
+static Compiled *
+compile_trace(Jit *jit, u8 *program, size_t program_len, const Trace *trace)
+{
+	double start = jit->profile ? now() : 0;
+	Compiled *compiled = calloc(1, sizeof(*compiled));
+	assert(compiled);
+	compiled->cache = jit->cache;
+	Ir ir;
+	u32 pre = 0;
+	u32 head = ir_build_trace(&ir, program, program_len, trace, &pre);
+	ir_optimize(&ir);
+	ir_hoist(&ir, head, pre);
+	compiled->code = ir_compile(jit, &ir, program_len, compiled, "bytecode_trace", start, NULL);
+	return compiled;
+}
+
+static void
+compiled_free(Compiled *compiled)
+{
+	code_free(compiled->cache, compiled->code);
+	if (compiled->module) {
+		module_destroy(compiled->module);
+	}
+	free(compiled->entries);
+	safepoints_free(compiled->safepoints, compiled->nsafepoints);
+	free(compiled);
+}
 
-	// Here is the System V ABI 101 (imprecise, but enough to get going):
-	//
-	// First 6 arguments are passed in registers (left-to-right):
-	//
-	//     1. rdi
-	//     2. rsi
-	//     3. rdx
-	//     4. rcx
-	//     5. r8
-	//     6. r9
-	//
-	// The return value is expected to be in the register rax (and rdx if
-	// the return value is small struct like 2 pointers). If there are
-	// more than 6 arguments they pushed on to the stack right-to-left. Even
-	// arguments that are smaller than 64 bits use the full registers to be
-	// passed. Small-ish structs are passed as if all the struct members
-	// were passed as arguments separately.
-	//
-	// These registers are _callee_ saved (i.!e. the function that called us
-	// expects the values in these registers to be preserved, so we, the
-	// callee, need to preserve the registers by not using them or restoring
-	// them to their original values):
-	//
-	//     rbp ("base pointer")
-	//     rsp ("stack pointer")
-	//     rbx
-	//     r12
-	//     r13
-	//     r14
-	//     r15
-	//
-	// These registers are _caller_ saved (i.e. we as the callee can use
-	// them freely, since if the caller needs the their values they need to
-	// save the values anyway, on the other hand if we call some other
-	// function, we are the caller and the function can possibly change any
-	// of the registers, so we have to save the values if we need them):
-	//
-	//     rdi
-	//     rsi
-	//     rdx
-	//     rcx
-	//     r8
-	//     r9
-	//
-	//     rax
-	//     r10
-	//     r11
-	//
-	// Notably all registers used for parameter passing are caller saved.
-	// Obviously the return value register is also caller saved, but note
-	// that the callee is free to change it also in the case there is no
-	// return value ("the functions returns void").
-	//
-	// There are other subtlities to AMD64 System V ABI:
-	//
-	//  - Stack is kept aligned at 16 bytes.
-	//  - Vararg functions expect in the "al" (rax) register the
-	//    _upper bound_ of used vector registers (xmm0, etc.).
-	//
-	// I mostly ignore these below. "It works on my machine", but may lead
-	// to subtle and hard to debug issues, so beware!
+// Continue the execution of the program from the instruction at `offset` (a
+// jump target with an entry) in the compiled code, with the operand stack, the
+// input and the output taken over from the interpreter. Returns once the
+// program halts, with `NULL`, or at an exit of the optimizing tier, with its
+// safepoint and the operand stack at it in `stack`. The safepoints of a trace
+// only have the top of the stack, the slots below stay as they are.
+static const Safepoint *
+osr_enter(Compiled *compiled, size_t offset, Stack *stack, Input *in, Output *out)
+{
+	assert(compiled->entries[offset] >= 0);
+	void *target = (u8 *) compiled->code + compiled->entries[offset];
+	if (!compiled->safepoints) {
+		compiled->osr_entry(in, out, stack->items, stack->depth, target);
+		return NULL;
+	}
+	const Safepoint *entry = compiled->safepoints;
+	while (entry->exit || entry->offset != offset) {
+		entry++;
+	}
+	assert(entry->depth <= stack->depth);
+	size_t base = stack->depth - entry->depth;
+	i64 *image = calloc(IR_IMAGE_REGS + (size_t) compiled->nspills, sizeof(image[0]));
+	assert(image);
+	for (u32 i = 0; i < entry->depth; i++) {
+		if (entry->slots[i].kind == SLOT_FRAME) {
+			image[entry->slots[i].index] = stack->items[base + i];
+		}
+	}
+	int index = compiled->osr_entry(in, out, image, 0, target);
+	const Safepoint *exit = NULL;
+	if (index >= 0) {
+		exit = &compiled->safepoints[index];
+		stack->depth = base;
+		for (u32 i = 0; i < exit->depth; i++) {
+			const SafepointSlot *slot = &exit->slots[i];
+			stack_push(stack, slot->kind == SLOT_CONST ? slot->imm : image[slot->index]);
+		}
+	}
+	free(image);
+	return exit;
+}
 
-	// Now is a good time to decide on how and where to store the data we
-	// need. We won't need the program at runtime, since it will be
-	// hardcoded into the code (including the immediates, etc.), but we will
-	// need the stack (since we will just translate the bytecode for stack
-	// machine into assembly, not change its workings substantially) and
-	// also a pointer to the current input position.
-	//
-	// The pointer to inputs will be passed to us as an argument - this is
-	// the runtime data that our program will process. The `OP_INPUT`
-	// instructions take one 32 bit number from the input and advance the
-	// input pointer (by 4 bytes). We assume that the caller provided
-	// sufficient number of inputs for the program at hand, so we don't
-	// necessarily need the length of the input nor check it at runtime.
-	// Since it is our only argument it will be in rdi, but that is a caller
-	// saved register and when we later execute `OP_PRINT`, we are the
-	// caller, so we need to save the register. We could either `push` and
-	// `pop` rdi around each call, or move the argument to a callee saved
-	// register, which we can save once in the entry to the function and
-	// restore once at the end of the function. This makes for a much
-	// simpler book keeping, though as always, if we save multiple callee
-	// saved registers with `push`, we have to restore them with `pop` in
-	// the _reverse_ order.
-	//
-	// For stack, we'll just use the x86-64 (call) stack. `OP_PUSH` will
-	// translate directly to `push` and `OP_POP` directly to `pop`. These
-	// instructions change the value of `rsp`, which though a "general
-	// purpose register" is usually used as the stack pointer exactly
-	// because some instructions can manipulate it compactly (`call` is
-	// another example of an instruction that implicitly changes the stack
-	// pointer by pushing the return address). So for us `rsp` will
-	// represent pointer to the top of the stack, and we will have to
-	// embrace its constraints. In particular `rsp` points to the position
-	// where the current top of the stack _is_, not one past it like other
-	// schemes do, and the stack grows downwards. So top of the stack is at
-	// offset zero from top of the stack, and if we want to push a value to
-	// the stack, we first need to decrement the stack pointer and then put
-	// the value at the stack pointer position, while to pop we need to
-	// read the value from the current stack pointer and then increment it.
-	// I.e. pre-decrement push and post-increment pop (we would get another
-	// combination if the stack pointer pointed one past the top of the
-	// stack, or the stack grew upwards). While we have to keep that in
-	// mind, this is what the `push` / `pop` instructions will do for us,
-	// and we won't have to do it manually). See also another blog post by
-	// Eli Bendersky, which has illustrations:
-	//
-	//     https://eli.thegreenplace.net/2011/02/04/where-the-top-of-the-stack-is-on-x86/
-	//
-	// (Note that the blog post concerns x86 whose stack operations are 32
-	// bit, while on x86-64 stack operations are 64 bit, e.g. push
-	// instructions decrement the stack by 8).
+// Compiling on the thread that runs the program stalls the program for the
+// duration of the compilation, which for large programs may well be longer
+// than what we hoped to save by compiling a hot loop. So compilation can also
+// happen in the background, in a pool of compiler threads: the interpreter
+// submits a job and goes on interpreting, checking at each loop head whether
+// the compiled code is ready. The job is thus the "entry" of the program,
+// initially pointing nowhere, meaning "keep interpreting", and atomically
+// switched to the compiled code once it's been encoded and sealed.
+//
+// Each thread has its own compiler context, they only share the code cache.
+// Jobs are distributed to the threads round robin, and each thread takes the
+// newest job from its own queue first. A thread whose queue is empty steals
+// the oldest job from the queue of another thread, so that one thread with a
+// few large programs doesn't hold up the rest, while the others are idle. The
+// queues are guarded by a lock each. Compiling a job takes much longer than
+// taking the lock, so a lock free deque wouldn't be worth the trouble.
+#define COMPILE_BATCH 32
 
-	// Here comes the entry to our function, the "prologue". Here we usually
-	// want to save all the callee saved registers that we intend to use.
-	// Usually prologue starts with "push rbp" and "mov rbp, rsp", which
-	// establish the "stack frame" (also called "call frame"), see the
-	// linked blog posts by Eli Bendersky for details. Instead we start by
-	// pushing rbx. We will use this callee save register to store the input
-	// pointer -- while the caller passes us the input pointer as the first
-	// argument in rdi, it would get clobbered once we call other function
-	// ourselves. Storing it in a callee saved register and
-	// storing/restoring the register on entry/exit keeps the management
-	// simple. Callee The thing is that the execution of the program may
-	// leave some values on the stack. By resetting the rbp we could get
-	// easily rid of them, though it would need for us to address
-	// relatively to the rsp to restore rbx if it were pushed after rbp.
-	// So we simply push it before (and this restore it with pop after we
-	// restore the base pointer).
+typedef struct {
+	u8 *program;
+	size_t program_len;
+	// A copy of the branches seen by the interpreter (or NULL), freed once
+	// compiled.
+	u8 *branches;
+	// NULL until the program is compiled and sealed.
+	_Atomic(Compiled *) compiled;
+} CompileJob;
 
-	//| push rbx
-	//| push rbp
-	//| mov rbp, rsp
-	//| mov rbx, rdi
+typedef struct {
+	Mutex lock;
+	CompileJob **jobs;  // Ring buffer, `cap` is a power of two.
+	size_t head;        // Oldest job, where thieves steal.
+	size_t tail;        // One past the newest job, where the owner pops.
+	size_t cap;
+} JobQueue;
+
+typedef struct CompilePool CompilePool;
+
+typedef struct {
+	CompilePool *pool;
+	size_t index;
+	Thread thread;
+	JobQueue queue;
+} CompileWorker;
+
+struct CompilePool {
+	CodeCache *cache;
+	CompileOptions opts;
+	// The lock only protects the sleeping on the two condition variables,
+	// `pending` is what we are waiting for.
+	Mutex lock;
+	Cond work;              // Signalled when a job is submitted, or on stop.
+	Cond finished;          // A job was finished.
+	atomic_size_t pending;  // Jobs submitted, but not taken yet.
+	atomic_size_t waiting;  // Threads waiting for `finished`.
+	atomic_size_t next;     // Worker to submit the next job to.
+	int stop;
+	size_t nworkers;
+	CompileWorker workers[];
+};
+
+static void
+job_queue_push(JobQueue *queue, CompileJob *job)
+{
+	mutex_lock(&queue->lock);
+	if (queue->tail - queue->head == queue->cap) {
+		size_t cap = queue->cap ? 2 * queue->cap : 16;
+		CompileJob **jobs = malloc(cap * sizeof(jobs[0]));
+		assert(jobs);
+		for (size_t i = queue->head; i < queue->tail; i++) {
+			jobs[i & (cap - 1)] = queue->jobs[i & (queue->cap - 1)];
+		}
+		free(queue->jobs);
+		queue->jobs = jobs;
+		queue->cap = cap;
+	}
+	queue->jobs[queue->tail++ & (queue->cap - 1)] = job;
+	mutex_unlock(&queue->lock);
+}
+
+// Take the newest job if `newest`, otherwise the oldest one.
+static CompileJob *
+job_queue_take(JobQueue *queue, int newest)
+{
+	CompileJob *job = NULL;
+	mutex_lock(&queue->lock);
+	if (queue->head != queue->tail) {
+		size_t i = newest ? --queue->tail : queue->head++;
+		job = queue->jobs[i & (queue->cap - 1)];
+	}
+	mutex_unlock(&queue->lock);
+	return job;
+}
+
+// Seal the code of finished jobs and make it available.
+static void
+compile_pool_publish(CompilePool *pool, CompileJob **jobs, Compiled **compiled, size_t n)
+{
+	code_cache_seal(pool->cache);
+	// Waking up nobody is not free, so we only broadcast if somebody is
+	// waiting. Both the stores and the load are sequentially consistent,
+	// so either the waiter sees the result, or we see the waiter.
+	for (size_t i = 0; i < n; i++) {
+		atomic_store(&jobs[i]->compiled, compiled[i]);
+	}
+	if (atomic_load(&pool->waiting) > 0) {
+		mutex_lock(&pool->lock);
+		cond_broadcast(&pool->finished);
+		mutex_unlock(&pool->lock);
+	}
+}
+
+static void
+compile_worker_run(CompileWorker *worker)
+{
+	CompilePool *pool = worker->pool;
+	Jit *jit = jit_create(&pool->opts, pool->cache);
+	// While more jobs are pending, we compile up to a whole batch of them
+	// before sealing them all at once (see the code cache), otherwise each
+	// job pays for a permission change.
+	CompileJob *jobs[COMPILE_BATCH];
+	Compiled *compiled[COMPILE_BATCH];
+	size_t n = 0;
+	for (;;) {
+		CompileJob *job = job_queue_take(&worker->queue, 1);
+		for (size_t i = 1; !job && i < pool->nworkers; i++) {
+			job = job_queue_take(&pool->workers[(worker->index + i) % pool->nworkers].queue, 0);
+		}
+		if (job) {
+			atomic_fetch_sub(&pool->pending, 1);
+			jobs[n] = job;
+			compiled[n] = compile_enterable(jit, job->program, job->program_len, job->branches);
+			free(job->branches);
+			n++;
+			if (n < COMPILE_BATCH && atomic_load(&pool->pending) > 0) {
+				continue;
+			}
+		}
+		if (n > 0) {
+			compile_pool_publish(pool, jobs, compiled, n);
+			n = 0;
+			continue;
+		}
+		// Nothing to do. If some job is pending, it is being pushed
+		// right now (or taken by another thread), so we just retry.
+		mutex_lock(&pool->lock);
+		while (atomic_load(&pool->pending) == 0 && !pool->stop) {
+			cond_wait(&pool->work, &pool->lock);
+		}
+		int stop = pool->stop && atomic_load(&pool->pending) == 0;
+		mutex_unlock(&pool->lock);
+		if (stop) {
+			break;
+		}
+	}
+	jit_destroy(jit);
+}
+
+#if _WIN32
+static DWORD WINAPI
+compile_worker_main(LPVOID arg)
+{
+	compile_worker_run(arg);
+	return 0;
+}
+#else
+static void *
+compile_worker_main(void *arg)
+{
+	compile_worker_run(arg);
+	return NULL;
+}
+#endif
+
+// Start `nworkers` compiler threads, which compile with `opts` into `cache`.
+static CompilePool *
+compile_pool_create(size_t nworkers, const CompileOptions *opts, CodeCache *cache)
+{
+	assert(nworkers > 0);
+	CompilePool *pool = calloc(1, sizeof(*pool) + nworkers * sizeof(pool->workers[0]));
+	assert(pool);
+	pool->cache = cache;
+	pool->opts = opts ? *opts : default_compile_options;
+	pool->nworkers = nworkers;
+	mutex_init(&pool->lock);
+	cond_init(&pool->work);
+	cond_init(&pool->finished);
+	atomic_init(&pool->pending, 0);
+	atomic_init(&pool->next, 0);
+	atomic_init(&pool->waiting, 0);
+	for (size_t i = 0; i < nworkers; i++) {
+		CompileWorker *worker = &pool->workers[i];
+		worker->pool = pool;
+		worker->index = i;
+		mutex_init(&worker->queue.lock);
+	}
+	// Only start the threads once all the queues exist, the threads
+	// steal from each other right away.
+	for (size_t i = 0; i < nworkers; i++) {
+		CompileWorker *worker = &pool->workers[i];
+#if _WIN32
+		worker->thread = CreateThread(NULL, 0, compile_worker_main, worker, 0, NULL);
+		assert(worker->thread);
+#else
+		int status = pthread_create(&worker->thread, NULL, compile_worker_main, worker);
+		assert(status == 0);
+		(void) status;
+#endif
+	}
+	return pool;
+}
+
+// Queue the program in the job for compilation. The job (and the program) has
+// to stay alive until the compilation is finished, see `compile_pool_wait`.
+// The `branches` (see `interpret`) are copied, the interpreter goes on
+// updating them.
+static void
+compile_pool_submit(CompilePool *pool, CompileJob *job, u8 *program, size_t program_len, const u8 *branches)
+{
+	job->program = program;
+	job->program_len = program_len;
+	job->branches = NULL;
+	if (branches) {
+		job->branches = malloc(program_len ? program_len : 1);
+		assert(job->branches);
+		memcpy(job->branches, branches, program_len);
+	}
+	atomic_init(&job->compiled, NULL);
+	size_t i = atomic_fetch_add(&pool->next, 1) % pool->nworkers;
+	job_queue_push(&pool->workers[i].queue, job);
+	mutex_lock(&pool->lock);
+	atomic_fetch_add(&pool->pending, 1);
+	cond_signal(&pool->work);
+	mutex_unlock(&pool->lock);
+}
+
+// The compiled program if the job is finished, NULL otherwise. Never blocks.
+static Compiled *
+compile_job_poll(CompileJob *job)
+{
+	return atomic_load_explicit(&job->compiled, memory_order_acquire);
+}
+
+// Wait until the job is finished.
+static Compiled *
+compile_pool_wait(CompilePool *pool, CompileJob *job)
+{
+	Compiled *compiled = compile_job_poll(job);
+	if (!compiled) {
+		mutex_lock(&pool->lock);
+		atomic_fetch_add(&pool->waiting, 1);
+		while (!(compiled = atomic_load(&job->compiled))) {
+			cond_wait(&pool->finished, &pool->lock);
+		}
+		atomic_fetch_sub(&pool->waiting, 1);
+		mutex_unlock(&pool->lock);
+	}
+	return compiled;
+}
+
+// Finish all the submitted jobs and stop the threads.
+static void
+compile_pool_destroy(CompilePool *pool)
+{
+	mutex_lock(&pool->lock);
+	pool->stop = 1;
+	cond_broadcast(&pool->work);
+	mutex_unlock(&pool->lock);
+	for (size_t i = 0; i < pool->nworkers; i++) {
+		CompileWorker *worker = &pool->workers[i];
+#if _WIN32
+		WaitForSingleObject(worker->thread, INFINITE);
+		CloseHandle(worker->thread);
+#else
+		pthread_join(worker->thread, NULL);
+#endif
+		free(worker->queue.jobs);
+		mutex_destroy(&worker->queue.lock);
+	}
+	cond_destroy(&pool->finished);
+	cond_destroy(&pool->work);
+	mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+// With `--own-stack` the compiled code doesn't run on the stack of the thread
+// that started it, but on one allocated for the run, as small as the program
+// needs. The code keeps the operand stack on the machine stack and pushes
+// without checking for room, so below the stack is an inaccessible guard
+// page, and hitting it stops the program with an error instead of running
+// over whatever memory is there.
+//
+// How much the program needs is known when the depth of its operand stack is
+// static (see `find_stack_depths`): a slot is 8 bytes in the template code,
+// 32 in the vector registers of a batch (see `compile_lanes`), and the
+// optimizing tier spills at most one value per byte of bytecode. On top of
+// that go the frames of the compiled code and of the C functions it calls,
+// and what the thread library keeps at the top of the stack. Programs
+// without a static depth, and those with calls, get as much as a thread
+// usually has.
+#define STACK_RESERVE (64 * 1024)
+#define STACK_DEFAULT (8 * 1024 * 1024)
+
+typedef struct {
+	u8 *base;     // The guard page, then the stack itself.
+	size_t size;  // Of the stack, without the guard page.
+} RunStack;
+
+static size_t
+run_stack_size_needed(u8 *program, size_t program_len, const CompileOptions *opts)
+{
+	int max_depth;
+	int *depths = find_stack_depths(program, program_len, &max_depth);
+	if (!depths) {
+		return STACK_DEFAULT;
+	}
+	free(depths);
+	size_t size = STACK_RESERVE + 32 * ((size_t) max_depth + 1);
+	if (opts->optimize) {
+		size += 8 * program_len;
+	}
+	size_t page = system_page_size();
+	return (size + page - 1) & ~(page - 1);
+}
+
+static RunStack *
+run_stack_create(size_t size)
+{
+	RunStack *stack = malloc(sizeof(*stack));
+	assert(stack);
+	stack->size = size;
+#if _WIN32
+	// Windows puts a guard page below every thread's stack, we only pick
+	// the size, see `stack_run_start`.
+	stack->base = NULL;
+#else
+	size_t page = system_page_size();
+	stack->base = mmap(NULL, page + size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (stack->base == MAP_FAILED || mprotect(stack->base, page, PROT_NONE) != 0) {
+		fprintf(stderr, "Failed to allocate a stack of %zu bytes\n", size);
+		exit(1);
+	}
+#endif
+	return stack;
+}
+
+static void
+run_stack_destroy(RunStack *stack)
+{
+#ifndef _WIN32
+	munmap(stack->base, system_page_size() + stack->size);
+#endif
+	free(stack);
+}
+
+// Run `fun(arg)` in a new thread, on `stack` if it's not `NULL`, otherwise on
+// the usual one.
+typedef struct {
+	void (*fun)(void *arg);
+	void *arg;
+	RunStack *stack;
+	Thread thread;
+} StackRun;
+
+#if _WIN32
+static DWORD WINAPI
+stack_run_main(LPVOID arg)
+{
+	StackRun *run = arg;
+	run->fun(run->arg);
+	return 0;
+}
+
+static void
+stack_run_start(StackRun *run)
+{
+	SIZE_T size = run->stack ? run->stack->size : 0;
+	run->thread = CreateThread(NULL, size, stack_run_main, run, STACK_SIZE_PARAM_IS_A_RESERVATION, NULL);
+	if (!run->thread) {
+		fprintf(stderr, "Failed to start a thread\n");
+		exit(1);
+	}
+}
+
+static void
+stack_run_join(StackRun *run)
+{
+	WaitForSingleObject(run->thread, INFINITE);
+	CloseHandle(run->thread);
+}
+#else
+// The stack the current thread runs on, for `run_stack_overflow` to tell whether
+// a fault is in its guard page.
+static _Thread_local RunStack *run_stack_current;
+
+// The handler of SIGSEGV, which runs on its own small stack (the thread's one
+// is full). Faults other than in the guard page get the default action once
+// we return and the instruction faults again.
+static void
+run_stack_overflow(int sig, siginfo_t *info, void *context)
+{
+	(void) context;
+	RunStack *stack = run_stack_current;
+	u8 *addr = info->si_addr;
+	if (stack && addr >= stack->base && addr < stack->base + system_page_size()) {
+		static const char message[] = "Stack overflow\n";
+		ssize_t written = write(2, message, sizeof(message) - 1);
+		(void) written;
+		_exit(1);
+	}
+	signal(sig, SIG_DFL);
+}
+
+static void *
+stack_run_main(void *arg)
+{
+	StackRun *run = arg;
+	stack_t alt = { .ss_size = 64 * 1024 };
+	if (run->stack) {
+		alt.ss_sp = malloc(alt.ss_size);
+		assert(alt.ss_sp);
+		sigaltstack(&alt, NULL);
+		run_stack_current = run->stack;
+	}
+	run->fun(run->arg);
+	if (run->stack) {
+		run_stack_current = NULL;
+		alt.ss_flags = SS_DISABLE;
+		sigaltstack(&alt, NULL);
+		free(alt.ss_sp);
+	}
+	return NULL;
+}
+
+static void
+stack_run_start(StackRun *run)
+{
+	static atomic_flag installed = ATOMIC_FLAG_INIT;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if (run->stack) {
+		if (!atomic_flag_test_and_set(&installed)) {
+			struct sigaction action = { .sa_sigaction = run_stack_overflow, .sa_flags = SA_SIGINFO | SA_ONSTACK };
+			sigemptyset(&action.sa_mask);
+			sigaction(SIGSEGV, &action, NULL);
+		}
+		pthread_attr_setstack(&attr, run->stack->base + system_page_size(), run->stack->size);
+	}
+	if (pthread_create(&run->thread, &attr, stack_run_main, run) != 0) {
+		fprintf(stderr, "Failed to start a thread\n");
+		exit(1);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static void
+stack_run_join(StackRun *run)
+{
+	pthread_join(run->thread, NULL);
+}
+#endif
 
-	// Now we will go through all instructions and translate them one by
-	// one. For each instruction we have a snippet of assembly, that will be
-	// interpolated with value computed from embedded C expressions
-	// ("encoding-time constants").
-	u8 *instrptr = program;
-	u8 *end = program + program_len;
+// A part of a batch run by one thread of `batch_run_parallel`.
+typedef struct {
+	void (*fun)(Batch *batch);
+	Batch batch;
+	StackRun run;
+} BatchWorker;
 
-	// This macro is a helper, which reads a 4 byte immediate operand from
-	// a position one byte behind the instruction pointer (which skips the
-	// opcode).
-	#define OPERAND() ((i32) ( \
-		((u32)instrptr[1] << 0) | \
-		((u32)instrptr[2] << 8) | \
-		((u32)instrptr[3] << 16) | \
-		((u32)instrptr[4] << 24)))
+// The `i`th of `nparts` parts of consecutive records of `batch`, the first
+// ones a record longer if they don't split evenly.
+static Batch
+batch_part(const Batch *batch, size_t nparts, size_t i)
+{
+	size_t base = batch->count / nparts;
+	size_t extra = batch->count % nparts;
+	size_t first = i * base + (i < extra ? i : extra);
+	Batch part = *batch;
+	part.records = batch->records + first * batch->record_len;
+	part.outputs = batch->outputs + first * batch->outputs_len;
+	part.count = base + (i < extra);
+	return part;
+}
 
-	while (instrptr < end) {
+static void
+batch_worker_main(void *arg)
+{
+	BatchWorker *worker = arg;
+	worker->fun(&worker->batch);
+}
 
-		// Read the current opcode, which distinguishes the current
-		// instruction.
-		enum op op = (enum op)*instrptr;
+// Run the program compiled for batches over `batch`, split into `nthreads`
+// parts of consecutive records, each in its own thread. The records are
+// independent and each of them has its own output slots, so the parts don't
+// have to synchronize at all. The calling thread runs the first part, unless
+// each part gets its own stack of `stack_size` bytes, see `RunStack`.
+static void
+batch_run_parallel(void (*fun)(Batch *batch), const Batch *batch, size_t nthreads, size_t stack_size)
+{
+	if (nthreads > batch->count) {
+		nthreads = batch->count;
+	}
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+	if (nthreads == 1 && !stack_size) {
+		Batch whole = *batch;
+		fun(&whole);
+		return;
+	}
+	BatchWorker *workers = calloc(nthreads, sizeof(workers[0]));
+	assert(workers);
+	for (size_t i = 0; i < nthreads; i++) {
+		BatchWorker *worker = &workers[i];
+		worker->fun = fun;
+		worker->batch = batch_part(batch, nthreads, i);
+		if (i == 0 && !stack_size) {
+			continue;
+		}
+		worker->run.fun = batch_worker_main;
+		worker->run.arg = worker;
+		worker->run.stack = stack_size ? run_stack_create(stack_size) : NULL;
+		stack_run_start(&worker->run);
+	}
+	if (!stack_size) {
+		fun(&workers[0].batch);
+	}
+	for (size_t i = stack_size ? 0 : 1; i < nthreads; i++) {
+		stack_run_join(&workers[i].run);
+		if (workers[i].run.stack) {
+			run_stack_destroy(workers[i].run.stack);
+		}
+	}
+	free(workers);
+}
 
-		// Put here a label corresponding to this instructions byte
-		// offset. Any preceding or following jumps to this instruction
-		// will find this label. Note that we cast the offset to an
-		// `int`. This is because DynASM expects all arguments to
-		// `dasm_put` to `int`s. As mentioned above, in this ABI `int`
-		// is 32 bit, so all values passed to DynASM are limited to the
-		// 32 bit range. This is mostly OK, since in the x86-64 most
-		// immediates encoded in the instruction stream are also limited
-		// to 4 bytes. This 32 bit limitation is thus a limitation of
-		// our target architecture, not necessarily of DynASM, and we
-		// have to somehow deal with that.
-		//
-		// Note that in this case, it's unlikely that we would have
-		// programs larger than 4 gigabytes, i.e. offset would not fit
-		// into 32 bits. But even shorter programs could produce x86-64
-		// executable code larger than 4 gigabytes, and there 32 bit
-		// relative offsets for jumps and calls would also not be
-		// enough.
-		//
-		// Also at the start of the instruction, there is a (commented
-		// out) `int3` instruction. Comment with `//!` (i.e. two forward
-		// slashes and exclamation mark) is not a special syntax
-		// understood by DynASM, just something different than `//|`,
-		// but still a C comment. The `int3` instruction is a "trap to
-		// the debugger". So if you were to uncomment it and run this
-		// program in debugger, the debugger would stop before each
-		// executed (jitted) bytecode instruction. This can be very
-		// useful for debugging, also if paired with a print of some
-		// debug information before/after each trap.
+// Run the compiled program (not a batch) on a stack of `stack_size` bytes,
+// see `RunStack`.
+typedef struct {
+	void (*fun)(Input *in, Output *out);
+	Input *in;
+	Output *out;
+} ProgramRun;
 
-		int offset = (int) (instrptr - program);
-		//|=> offset:
-		//! int3
+static void
+program_run_main(void *arg)
+{
+	ProgramRun *program = arg;
+	program->fun(program->in, program->out);
+}
 
-		// The above  will be translated to roughly:
-		//
-		//         dasm_put(..., offset);
-		//
-		// We could have also said:
-		//
-		//         |=> (int) (instrptr - program)
-		//
-		// Which would translate to:
-		//
-		//         dasm_put(..., (int) (instrptr - program));
-		//
-		// There is nothing much more magic about the embedded C
-		// expressions - DynASM handles them textually, and they are
-		// evaluated at runtime like ordinary C expressions and passed
-		// as arguments to `dasm_put`. Note that officially the
-		// evaluation order of arguments is undefined in C, so it might
-		// a good idea to explicitly evaluate the expressions before
-		// using them in assembly snippets, if they can have side
-		// effects, and even if they don't.
+static void
+program_run_on_stack(void (*fun)(Input *in, Output *out), Input *in, Output *out, size_t stack_size)
+{
+	ProgramRun program = { .fun = fun, .in = in, .out = out };
+	StackRun run = { .fun = program_run_main, .arg = &program, .stack = run_stack_create(stack_size) };
+	stack_run_start(&run);
+	stack_run_join(&run);
+	run_stack_destroy(run.stack);
+}
 
-		switch (op) {
-		case OP_CONSTANT: {
-			// If the next instruction is `OP_CONSTANT` we need to
-			// append the code for it, we do it by having an
-			// assembly snippet here, which translates to
-			// `dasm_put`. The instruction has an immediate operand
-			// which we read with a macro and store it in a variable
-			// before passing it to the snippet. While the
-			// `OP_CONSTANT` instruction is generic and an
-			// interpreter has to load the constant from bytecode
-			// everytime, this particular `OP_CONSTANT` will always
-			// have this one same operand, so we can just
-			// embed it in the code. The below translates to `push 4`
-			// if the operand in the instruction stream is
-			// the number 4. This will be pattern matched by DynASM
-			// to be a push of 32 bit immediate (see the unofficial
-			// DynASM instruction reference or other x86-64
-			// instruction references). This is perfect for us,
-			// since we want to push a 32 bit value. If we wanted
-			// to push 64 bit value, we would first have to somehow
-			// get the value to a register (see later) and then use
-			// `push REG`, because there just isn't an instruction
-			// that is able to push 64 bit immediates. DynASM won't
-			// do that for us automatically. What's worse the
-			// argument (passed as vararg) is expected to be an int,
-			// so passing larger values will only result in silent
-			// truncation. Beware!
+// The `wait_stub` of the stream, see `ProgramStream`. It's jumped to with the
+// cell in rax and the register cache empty, so it's free to call C.
+static void *
+compile_stream_stub(Jit *jit, ProgramStream *stream)
+{
+	dasm_State **ds = &jit->ds;
+	dasm_setup(Dst, our_dasm_actions);
+	jit->reloc_labels = 0;
+	jit->nrelocs = 0;
+	jit->nlines = 0;
+	uintptr_t address = (uintptr_t) stream;
+	//| mov rsi, rax
+	//| mov64 rdi, address
+	emit_call(jit, SYM_STREAM_WAIT);
+	//| jmp rax
+	return jit_encode(jit, "stream_wait_stub", 0, NULL);
+}
 
-			i32 operand = OPERAND();
-			//| push operand
+// Compile the chunks in order, making each available as soon as it's done.
+static void
+stream_run(ProgramStream *stream)
+{
+	Jit *jit = jit_create(&stream->opts, stream->cache);
+	jit->stream = stream;
+	for (size_t i = 0; i < stream->nchunks && !atomic_load(&stream->stop); i++) {
+		size_t start = stream->starts[i];
+		size_t end = stream->starts[i + 1];
+		jit->chunk_start = start;
+		u8 *code = compile_template(jit, stream->program + start, end - start, NULL);
+		stream->chunks[i] = code;
+		code_cache_seal(stream->cache);
+		// The labels of the chunk are those of the whole program from
+		// the one at its start, up to the one at the next chunk.
+		int first = jump_label(&stream->labels, start);
+		int last = end < stream->program_len ? jump_label(&stream->labels, end) : (int) stream->labels.count;
+		for (int j = first; j < last; j++) {
+			atomic_store(&stream->entries[j], (void *) (code + dasm_getpclabel(&jit->ds, j - first)));
+		}
+		if (i == 0) {
+			atomic_store(&stream->code, (void *) code);
+		}
+		if (atomic_load(&stream->waiting) > 0) {
+			mutex_lock(&stream->lock);
+			cond_broadcast(&stream->compiled);
+			mutex_unlock(&stream->lock);
+		}
+	}
+	jit_destroy(jit);
+}
 
-			// This instruction is 5 bytes long, we have to advance
-			// the instruction pointer by 5 bytes and switch on the
-			// opcode to decide on what to compile next.
+#if _WIN32
+static DWORD WINAPI
+stream_main(LPVOID arg)
+{
+	stream_run(arg);
+	return 0;
+}
+#else
+static void *
+stream_main(void *arg)
+{
+	stream_run(arg);
+	return NULL;
+}
+#endif
 
-			instrptr += 5; break;
+// Start compiling the program in chunks of at least `chunk_len` bytes in the
+// background, see `ProgramStream`. Chunks start only where a block (see
+// `find_input_checks`) starts anyway, so that the input is checked at the
+// same places as in the whole program. The program has to stay alive until
+// `stream_destroy`. The entry is
+// `stream_wait(stream, &stream->code)`, a function like the one `compile`
+// gives.
+static ProgramStream *
+stream_create(u8 *program, size_t program_len, size_t chunk_len, const CompileOptions *opts, CodeCache *cache)
+{
+	assert(program_len > 0 && chunk_len > 0);
+	ProgramStream *stream = calloc(1, sizeof(*stream));
+	assert(stream);
+	stream->program = program;
+	stream->program_len = program_len;
+	stream->cache = cache;
+	stream->opts = *opts;
+	stream->targets = find_jump_targets(program, program_len);
+	stream->starts = malloc((program_len / chunk_len + 2) * sizeof(stream->starts[0]));
+	assert(stream->starts);
+	int block = 1;
+	for (u8 *instrptr = program; instrptr < program + program_len; instrptr += op_length(*instrptr)) {
+		size_t offset = (size_t) (instrptr - program);
+		block |= stream->targets[offset] != 0;
+		if (stream->nchunks == 0 || (block && offset >= stream->starts[stream->nchunks - 1] + chunk_len)) {
+			stream->starts[stream->nchunks++] = offset;
+			stream->targets[offset] |= TARGET_JUMP;
 		}
-		case OP_ADD: {
-			// Pop the second argument, pop the first argument, add
-			// the second to the first and push their result. The
-			// operations here are 64 bit. Since stacks work with 64
-			// bit values, the `pop`s and `push`es have to be 64 bit,
-			// but the arithmetic doesn't -- we could just as well
-			// have written `add eax, ecx` to operate on 32 bit
-			// parts of the registers (which will zero out the
-			// upper 32 bits). It would have save us a byte in the
-			// encoding of the instructions and be slightly faster
-			// in runtime (adding 32 bits is faster than adding 64),
-			// but we don't care about such small improvements.
+		block = op_ends_block(*instrptr);
+	}
+	stream->starts[stream->nchunks] = program_len;
+	stream->labels = find_jump_labels(stream->targets, program_len);
+	stream->entries = malloc(stream->labels.count * sizeof(stream->entries[0]));
+	stream->chunks = calloc(stream->nchunks, sizeof(stream->chunks[0]));
+	assert(stream->entries && stream->chunks);
 
-			//| pop rcx
-			//| pop rax
-			//| add rax, rcx
-			//| push rax
+	Jit *jit = jit_create(opts, cache);
+	stream->wait_stub = compile_stream_stub(jit, stream);
+	jit_destroy(jit);
+	code_cache_seal(cache);
+	for (size_t i = 0; i < stream->labels.count; i++) {
+		atomic_init(&stream->entries[i], stream->wait_stub);
+	}
+	atomic_init(&stream->code, stream->wait_stub);
+	atomic_init(&stream->waiting, 0);
+	atomic_init(&stream->stop, 0);
+	mutex_init(&stream->lock);
+	cond_init(&stream->compiled);
+#if _WIN32
+	stream->thread = CreateThread(NULL, 0, stream_main, stream, 0, NULL);
+	assert(stream->thread);
+#else
+	int status = pthread_create(&stream->thread, NULL, stream_main, stream);
+	assert(status == 0);
+	(void) status;
+#endif
+	return stream;
+}
 
-			instrptr += 1; break;
+// Stop compiling (the program can't run anymore) and free the code.
+static void
+stream_destroy(ProgramStream *stream)
+{
+	atomic_store(&stream->stop, 1);
+#if _WIN32
+	WaitForSingleObject(stream->thread, INFINITE);
+	CloseHandle(stream->thread);
+#else
+	pthread_join(stream->thread, NULL);
+#endif
+	for (size_t i = 0; i < stream->nchunks; i++) {
+		if (stream->chunks[i]) {
+			code_free(stream->cache, stream->chunks[i]);
 		}
-		case OP_PRINT: {
-			// Printing is a little tricky. Barring system calls, we
-			// have to call an external function to do the print.
-			// This could be either our own function, or
-			// even one from external library, like `printf`.
-			// There is one problem though normal calls are based on
-			// signed 32 bit relative offsets, while the x86-64
-			// space is 64 bit, so call targets can be much further
-			// than +-2 GiB. Here we find ourselves at runtime,
-			// where both the static and dynamic loader/linker
-			// have already figured out where everything in the
-			// memory is, after all, our program is already
-			// running. So for example the (64 bit) address of the
-			// `printf` function is already known. But since we have
-			// not yet mmaped pages for our code, we don't know
-			// whether it will be close to `printf`!. DynASM has the
-			// capability to handle external names through a
-			// callback which will let us handle that in the
-			// encoding stage where we already know the
-			// destination of our code, but let's not go that far
-			// right now. What we can do is use an _indirect_
-			// through a register - we will store the 64 bit address
-			// of `printf` in a register, and then call it
-			// with `call REG`. Most instructions don't allow 64 bit
-			// immediate operands, but one does, DynASM calls it
-			// fittingly `mov64`, but other assemblers call it
-			// `movabs`. It can store a 64 bit immediate in a
-			// register. Perfect for us. Though there is another
-			// problem, since the parameters to `dasm_put` are all
-			// 32 bit integers (`int`), how are we going to pass it
-			// to DynASM? Well, DynASM preprocessor knows that the
-			// instruction operand is special and handles it by
-			// passing the lower 32 bits and upper 32 bits
-			// separately. Since the argument to `dasm_put` is
-			// determined by a simple text substitution, and here
-			// the argument will be evaluated twice, we should be
-			// even more careful about complex expressions and side
-			// effects.
-			//
-			// To printf, we also have to pass the format string as
-			// a second argument, we also take its address and move
-			// it into a register as 64 bit immediate. The second
-			// argument should be the number to print -- we pop that
-			// from the stack into a register. Finally we call the
-			// function with an indirect call instruction.
-			// Note that we cast the addresses to integers to avoid
-			// compiler warnings (because dynasm follows it with
-			// truncation to 32 bits or extraction of upper 32 bits
-			// respectively.
-			//
-			// It is important to note, that printf respects the
-			// ABI, so we have to presume it destroys the
-			// values in caller saved registers, we only store our
-			// state in rbx, so we our fine.
+	}
+	code_free(stream->cache, stream->wait_stub);
+	cond_destroy(&stream->compiled);
+	mutex_destroy(&stream->lock);
+	free(stream->chunks);
+	free(stream->entries);
+	free(stream->labels.offsets);
+	free(stream->starts);
+	free(stream->targets);
+	free(stream);
+}
+
+// How the interpreter gets to compiled code: once any backward jump is taken
+// `hot` times to the same target, the program is compiled, either right away
+// with `jit`, or in the background with `pool` (if not NULL), in which case
+// the interpreter goes on and switches to the compiled code at the first
+// loop head reached after the code is ready (and which the code can be
+// entered at). With `hot` zero, the program is only interpreted.
+//
+// With the optimizing tier, the interpreter also notes which ways each
+// `OP_JGT` went, in `branches`, for the compiled code to be specialized to
+// them. When the code exits because a branch went another way, the
+// interpreter goes on from there (with the new way noted), and the program is
+// compiled again once some loop is hot again. Each exit adds a way, so this
+// happens at most twice per `OP_JGT`.
+//
+// With `trace`, a hot loop is recorded and compiled as a trace with `jit`
+// instead, see `Trace`, and the interpreter enters it at the start of the
+// loop for as long as it keeps coming back there. A trace doesn't change
+// after that: its exits go on in the interpreter until the next iteration.
+typedef struct {
+	u32 hot;
+	int trace;
+	Jit *jit;
+	CompilePool *pool;
+} Tiering;
 
-			//| mov64 rdi, ((uintptr_t) "%zd\n")
-			//| pop rsi
-			//| mov64 rax, ((uintptr_t) printf)
-			//| call rax
+enum {
+	TRACE_ABORT,
+	TRACE_RECORDING,
+	TRACE_DONE,
+};
 
-			// The above is translated to roughly the following:
-			//
-			//     dasm_put(...,
-			//         (unsigned int)(((uintptr_t) "%zd\n")),
-			//         (unsigned int)((((uintptr_t) "%zd\n"))>>32)
-			//         (unsigned int)(((uintptr_t) printf)),
-			//         (unsigned int)((((uintptr_t) printf))>>32),
-			//     )
+// Record the instruction about to run, with the stack before it, into the
+// trace, keeping the lowest depth of the stack any instruction touches in
+// `*low`. Once back at the start, with the stack as deep as it was there,
+// the trace is done.
+static int
+trace_record(Trace *trace, size_t *low, const Stack *stack, u8 *program, u8 *instrptr)
+{
+	if ((size_t) (instrptr - program) == trace->start && trace->len > 0) {
+		if (stack->depth != trace->entry_depth) {
+			return TRACE_ABORT;
+		}
+		trace->depth = (u32) (trace->entry_depth - *low);
+		return TRACE_DONE;
+	}
+	if (trace->len == TRACE_MAX) {
+		return TRACE_ABORT;
+	}
+	size_t reach = 0;
+	switch ((enum op) *instrptr) {
+	case OP_ADD:
+	case OP_CMP:
+		reach = 2;
+		break;
+	case OP_PRINT:
+	case OP_DISCARD:
+		reach = 1;
+		break;
+	case OP_GET:
+		reach = (size_t) read_operand(instrptr) + 1;
+		break;
+	case OP_SET:
+		reach = (size_t) read_operand(instrptr) + 2;
+		break;
+	case OP_JGT:
+		reach = 1;
+		trace->taken[trace->ntaken++] = stack->items[stack->depth - 1] > 0;
+		break;
+	case OP_HALT:
+	case OP_CALL:
+	case OP_RET:
+		return TRACE_ABORT;
+	default:
+		break;
+	}
+	if (stack->depth - reach < *low) {
+		*low = stack->depth - reach;
+	}
+	trace->len++;
+	return TRACE_RECORDING;
+}
 
+// Run the program in the interpreter, see `Tiering` for when it stops
+// interpreting.
+static void
+interpret(u8 *program, size_t program_len, Input *in, Output *out, const Tiering *tiering)
+{
+	// We check the bounds of the input exactly where the compiled code
+	// does, so that both stop at the same place when it runs out.
+	u8 *targets = find_jump_targets(program, program_len);
+	u32 *checks = find_input_checks(program, program_len, targets);
+	// With a `BlockProfile`, we count the runs of blocks as instrumented
+	// code does, at their starts, by the number of the block plus one (the
+	// cycles are only measured in the compiled code).
+	u32 *block_ids = NULL;
+	if (out->profile) {
+		size_t nblocks;
+		u8 *blocks = find_blocks(program, program_len, targets, &nblocks);
+		block_ids = calloc(program_len ? program_len : 1, sizeof(block_ids[0]));
+		assert(block_ids);
+		u32 block = 0;
+		for (size_t i = 0; i < program_len; i++) {
+			block_ids[i] = blocks[i] ? ++block : 0;
+		}
+		free(blocks);
+	}
+	free(targets);
+	Stack stack = {0};
+	u32 hot = tiering->hot;
+	u32 *counters = hot ? calloc(program_len ? program_len : 1, sizeof(u32)) : NULL;
+	const CompileOptions *opts = tiering->pool ? &tiering->pool->opts : tiering->jit ? &tiering->jit->opts : NULL;
+	u8 *branches = hot && opts->optimize ? calloc(program_len ? program_len : 1, 1) : NULL;
+	Compiled *compiled = NULL;
+	CompileJob job;
+	int queued = 0;
+	size_t *calls = NULL;
+	size_t ncalls = 0;
+	// The traces by the start of their loop, and the one being recorded.
+	Compiled **traces = hot && tiering->trace ? calloc(program_len ? program_len : 1, sizeof(traces[0])) : NULL;
+	Trace *trace = traces ? malloc(sizeof(*trace)) : NULL;
+	size_t trace_low = 0;
+	int recording = 0;
+	u8 *instrptr = program;
+	u8 *end = program + program_len;
+	while (instrptr < end) {
+		if (recording) {
+			int state = trace_record(trace, &trace_low, &stack, program, instrptr);
+			if (state == TRACE_DONE) {
+				traces[trace->start] = compile_trace(tiering->jit, program, program_len, trace);
+				code_cache_seal(tiering->jit->cache);
+			}
+			recording = state == TRACE_RECORDING;
+		}
+		if (block_ids && block_ids[instrptr - program]) {
+			out->profile->blocks[block_ids[instrptr - program] - 1].runs++;
+		}
+		u32 need = checks[instrptr - program];
+		if (need && (size_t) (in->end - in->next) < need && !input_refill(in, in->next, need)) {
+			output_flush(out);
+			goto halt;
+		}
+		switch ((enum op) *instrptr) {
+		case OP_CONSTANT:
+			stack_push(&stack, read_operand(instrptr));
+			instrptr += 5; break;
+		case OP_ADD: {
+			u64 b = (u64) stack_pop(&stack);
+			u64 a = (u64) stack_pop(&stack);
+			stack_push(&stack, (i64) (a + b));
 			instrptr += 1; break;
 		}
-		case OP_INPUT: {
-			// We have to read 32 bits from the place where rbx (the
-			// input pointer) points to and advance it by
-			// those 32 bits so next time we read the next input
-			// value.
-			//
-			// For reading a 32 bit value (aka dword) from memory,
-			// we could just issue a read into some 32 bit
-			// register, like `eax`, i.e. `mov eax, [rbx]`, which
-			// says "read a 32 bit value from a 64 bit address
-			// stored in the rbx register. The size of the read is
-			// determined implicitly from the (in this case
-			// destination) register size. In cases involving
-			// immediates, we usually have to specify whether we are
-			// storing an 8/16/32/64 bit immediate by including the
-			// right keyword for the size (`byte`, `word`, `dword`,
-			// `qword` respectively). But we can also include these
-			// keywords when they are not necessary, if we prefer
-			// that, as we do below by specifying "dword read", even
-			// though it would have been implicit from the use of
-			// `eax` as the destination.
-
-			//| mov eax, dword [rbx]
-			//| push rax
-			//| add rbx, 4
+		case OP_PRINT:
+			output_int(out, stack_pop(&stack));
+			instrptr += 1; break;
+		case OP_INPUT:
+			stack_push(&stack, (i64) (u32) *in->next++);
+			instrptr += 1; break;
+		case OP_DISCARD:
+			stack_pop(&stack);
+			instrptr += 1; break;
+		case OP_GET: {
+			i64 value = *stack_slot(&stack, read_operand(instrptr));
+			stack_push(&stack, value);
+			instrptr += 5; break;
+		}
+		case OP_SET: {
+			i64 value = stack_pop(&stack);
+			*stack_slot(&stack, read_operand(instrptr)) = value;
+			instrptr += 5; break;
+		}
+		case OP_CMP: {
+			i64 b = stack_pop(&stack);
+			i64 a = stack_pop(&stack);
+			stack_push(&stack, a > b ? 1 : a == b ? 0 : -1);
+			instrptr += 1; break;
+		}
+		case OP_JGT: {
+			i32 rel = read_operand(instrptr);
+			int taken = stack_pop(&stack) > 0;
+			if (branches) {
+				branches[instrptr - program] |= taken ? BRANCH_TAKEN : BRANCH_NOT_TAKEN;
+			}
+			if (!taken) {
+				instrptr += 5; break;
+			}
+			instrptr += rel;
+			size_t target = (size_t) (instrptr - program);
+			if (!counters || rel > 0) {
+				break;
+			}
+			// The entry of a trace is its safepoint 0, with the
+			// slots it needs.
+			if (traces && traces[target] && !recording && stack.depth >= traces[target]->safepoints[0].depth) {
+				const Safepoint *exit = osr_enter(traces[target], target, &stack, in, out);
+				if (!exit) {
+					goto halt;
+				}
+				instrptr = program + exit->offset;
+				break;
+			} else if (traces) {
+				// Each loop is recorded once, when it gets hot.
+				if (!traces[target] && !recording && counters[target] < hot && ++counters[target] == hot) {
+					*trace = (Trace) { .start = target, .entry_depth = stack.depth };
+					trace_low = stack.depth;
+					recording = 1;
+				}
+				break;
+			}
+			if (queued && !compiled) {
+				compiled = compile_job_poll(&job);
+			} else if (!compiled && ++counters[target] >= hot) {
+				if (tiering->pool) {
+					compile_pool_submit(tiering->pool, &job, program, program_len, branches);
+					queued = 1;
+				} else {
+					compiled = compile_enterable(tiering->jit, program, program_len, branches);
+					code_cache_seal(tiering->jit->cache);
+				}
+			}
+			// The compiled code keeps its own return stack, it
+			// can only take over with an empty one.
+			if (compiled && compiled->entries[target] >= 0 && ncalls == 0) {
+				const Safepoint *exit = osr_enter(compiled, target, &stack, in, out);
+				if (!exit) {
+					goto halt;
+				}
+				branches[exit->branch] |= exit->direction;
+				instrptr = program + exit->offset;
+				compiled_free(compiled);
+				compiled = NULL;
+				queued = 0;
+				memset(counters, 0, (program_len ? program_len : 1) * sizeof(counters[0]));
+			}
+			break;
+		}
+		case OP_HALT:
+			output_flush(out);
+			goto halt;
+		case OP_CALL:
+			if (!calls) {
+				calls = malloc(CALL_DEPTH_MAX * sizeof(calls[0]));
+				assert(calls);
+			}
+			if (ncalls == CALL_DEPTH_MAX) {
+				output_flush(out);
+				goto halt;
+			}
+			calls[ncalls++] = (size_t) (instrptr - program) + 5;
+			instrptr += read_operand(instrptr);
+			break;
+		case OP_RET:
+			if (ncalls == 0) {
+				output_flush(out);
+				goto halt;
+			}
+			instrptr = program + calls[--ncalls];
+			break;
+		}
+	}
+halt:
+	// A job still running refers to our program and to the job itself.
+	if (queued && !compiled) {
+		compiled = compile_pool_wait(tiering->pool, &job);
+	}
+	if (compiled) {
+		compiled_free(compiled);
+	}
+	for (size_t i = 0; traces && i < program_len; i++) {
+		if (traces[i]) {
+			compiled_free(traces[i]);
+		}
+	}
+	free(traces);
+	free(trace);
+	free(checks);
+	free(block_ids);
+	free(counters);
+	free(branches);
+	free(calls);
+	free(stack.items);
+}
 
-			instrptr += 1; break;
+// Time `n` compilations of the program, once with a single compiler context
+// reused for all of them and once with a fresh context for each.
+static void
+bench_compile(u8 *program, size_t program_len, const CompileOptions *opts, int dual_map, long n)
+{
+	CodeCache *cache = code_cache_create(dual_map);
+	for (int reuse = 1; reuse >= 0; reuse--) {
+		Jit *reused = reuse ? jit_create(opts, cache) : NULL;
+		double start = now();
+		for (long i = 0; i < n; i++) {
+			Jit *jit = reuse ? reused : jit_create(opts, cache);
+			Module *module = program_has_calls(program, program_len) ? module_create(program, program_len, opts, cache) : NULL;
+			jit->module = module;
+			jit->function = -1;
+			void *code = compile(jit, program, program_len, NULL);
+			jit->module = NULL;
+			code_free(cache, code);
+			if (module) {
+				module_destroy(module);
+			}
+			if (!reuse) {
+				jit_destroy(jit);
+			}
 		}
-		case OP_DISCARD: {
-			// We just `pop` into a register and don't use the
-			// value. That is what `OP_DISCARD` really is. Okay,
-			// since we don't do anything interesting with the
-			// value, we could just increment the stack pointer with
-			// `add rsp, 8`, which would have saved a load to `rax`,
-			// but since we don't care about preserving `rax`, and
-			// use `push` and `pop` instructions in other places, so
-			// we do it for consistency.
+		double elapsed = now() - start;
+		if (reuse) {
+			jit_destroy(reused);
+		}
+		printf("%s context: %.0f compiles/s\n", reuse ? "reused" : "fresh", (double) n / elapsed);
+	}
+	code_cache_destroy(cache);
+}
 
-			//| pop rax
+// Time `n` compilations of the program, all submitted at once to a pool of
+// `nthreads` compiler threads.
+static void
+bench_compile_pool(u8 *program, size_t program_len, const CompileOptions *opts, int dual_map, long n, size_t nthreads)
+{
+	CodeCache *cache = code_cache_create(dual_map);
+	CompilePool *pool = compile_pool_create(nthreads, opts, cache);
+	CompileJob *jobs = calloc((size_t) n, sizeof(jobs[0]));
+	assert(jobs);
+	double start = now();
+	for (long i = 0; i < n; i++) {
+		compile_pool_submit(pool, &jobs[i], program, program_len, NULL);
+	}
+	for (long i = 0; i < n; i++) {
+		compiled_free(compile_pool_wait(pool, &jobs[i]));
+	}
+	double elapsed = now() - start;
+	printf("%zu threads: %.0f compiles/s\n", nthreads, (double) n / elapsed);
+	compile_pool_destroy(pool);
+	free(jobs);
+	code_cache_destroy(cache);
+}
 
-			instrptr += 1; break;
+// A corpus of synthetic programs for benchmarks, from a few bytes to
+// megabytes. They are built from counting loops, which keep an accumulator
+// at the bottom of the operand stack, and the loop counters above it:
+//
+//         acc, counter_1, ..., counter_depth
+//
+// and of "branches", chains of forward `OP_JGT`s, each skipping over the rest
+// of the chain. The programs don't read input, they leave the accumulator on
+// the stack and halt. What they print is thrown away, the output of the
+// benchmark is only the results.
+typedef struct {
+	u8 *bytes;
+	size_t len;
+	size_t cap;
+} Bytecode;
+
+static void
+bytecode_emit(Bytecode *bc, enum op op, i32 operand)
+{
+	if (bc->len + 5 > bc->cap) {
+		bc->cap = bc->cap ? 2 * bc->cap : 256;
+		bc->bytes = realloc(bc->bytes, bc->cap);
+		assert(bc->bytes);
+	}
+	bc->bytes[bc->len++] = (u8) op;
+	if (op_length(op) == 5) {
+		u32 value = (u32) operand;
+		for (int i = 0; i < 4; i++) {
+			bc->bytes[bc->len++] = (u8) (value >> (8 * i));
 		}
-		case OP_GET: {
-			// For `OP_GET` we have a 32 bit immediate operand which
-			// we will have to use as an offset to the top of the
-			// stack. The offset is in number of elements, and in
-			// our case each elements is 8 bytes. Since we load the
-			// both the constant 8 and the operand as well as the
-			// result of their multiplication are runtime known
-			// values, but constants from the point of view of the
-			// instruction - the multiplication is performed now and
-			// the instruction will only contain the offset
-			// as an immediate, for example if operand is 5, the
-			// instruction will have the immediate value 40 encoded
-			// in it. The way we do that below is slightly risky, we
-			// put the multiplication and read of the operand in the
-			// assembly snippet. The syntax may seem similar to the
-			// well known complex addressing modes of x86-64, where
-			// for example `[rsp + 8 * rax]` would mean of the
-			// possible addressings. The trick here is that DynASM
-			// expects to see `[rsp + rax * 8]`, so it isn't
-			// confused by the leading `8 *`. Since `8 * OPERAND()`
-			// is an encoding time constant, an entirely different
-			// addressing mode will be used `[REG + IMMEDIATE]`.
-			// Evaluating the "constant" before the assembly snippet
-			// and storing it in a variable would have probably made
-			// it much clearer.
+	}
+}
 
-			//| mov rax, [rsp + 8 * OPERAND()]
-			//| push rax
+// Add the innermost counter to the accumulator, `body` times, with the
+// accumulator `depth` slots below the top, or print the counter if `body` is
+// negative.
+static void
+bytecode_loop_body(Bytecode *bc, int depth, int body)
+{
+	for (int i = 0; i < -body; i++) {
+		bytecode_emit(bc, OP_GET, 0);
+		bytecode_emit(bc, OP_PRINT, 0);
+	}
+	for (int i = 0; i < body; i++) {
+		bytecode_emit(bc, OP_GET, depth);
+		bytecode_emit(bc, OP_GET, 1);
+		bytecode_emit(bc, OP_ADD, 0);
+		bytecode_emit(bc, OP_SET, depth);
+	}
+}
 
-			// The above translates roughly to:
-			//
-			//     dasm_put(..., 8 * OPERAND());
+// A loop running `iters` times (as the `level`-th loop of a nest), around
+// loops nested `nest` levels deep.
+static void
+bytecode_loop(Bytecode *bc, int level, int nest, i32 iters, int body)
+{
+	bytecode_emit(bc, OP_CONSTANT, iters);
+	size_t start = bc->len;
+	if (nest > 0) {
+		bytecode_loop(bc, level + 1, nest - 1, iters, body);
+	} else {
+		bytecode_loop_body(bc, level, body);
+	}
+	bytecode_emit(bc, OP_GET, 0);
+	bytecode_emit(bc, OP_CONSTANT, -1);
+	bytecode_emit(bc, OP_ADD, 0);
+	bytecode_emit(bc, OP_SET, 0);
+	bytecode_emit(bc, OP_GET, 0);
+	bytecode_emit(bc, OP_JGT, -(i32) (bc->len - start));
+	bytecode_emit(bc, OP_DISCARD, 0);
+}
 
-			instrptr += 5; break;
+// A chain of `n` nested forward branches: each one is taken depending on the
+// accumulator, and skips to the end of the chain.
+static void
+bytecode_branches(Bytecode *bc, int n)
+{
+	size_t *jumps = malloc((size_t) n * sizeof(jumps[0]) + 1);
+	assert(jumps);
+	for (int i = 0; i < n; i++) {
+		bytecode_emit(bc, OP_GET, 0);
+		bytecode_emit(bc, OP_CONSTANT, i);
+		bytecode_emit(bc, OP_CMP, 0);
+		jumps[i] = bc->len;
+		bytecode_emit(bc, OP_JGT, 0);
+		bytecode_emit(bc, OP_CONSTANT, 1);
+		bytecode_emit(bc, OP_ADD, 0);
+	}
+	for (int i = 0; i < n; i++) {
+		i32 rel = (i32) (bc->len - jumps[i]);
+		for (int j = 0; j < 4; j++) {
+			bc->bytes[jumps[i] + 1 + j] = (u8) ((u32) rel >> (8 * j));
 		}
-		case OP_SET: {
-			// There isn't anything interesting to `OP_SET`, we
-			// pop a value from top of the stack and then store it
-			// to an offset from (the new) top of the stack.
+	}
+	free(jumps);
+}
 
-			//| pop rax
-			//| mov [rsp + 8 * OPERAND()], rax
+typedef struct {
+	const char *name;
+	int blocks;     // Number of times the pieces below are repeated.
+	int nest;       // Depth of the loop nest, -1 for none.
+	i32 iters;      // Iterations of each loop.
+	int body;       // Size of the body of the innermost loop, negative to print.
+	int branches;   // Length of the chain of branches.
+} BenchProgram;
 
-			instrptr += 5; break;
+static const BenchProgram bench_programs[] = {
+	{ "small",    1,    0,  10000,  1,    0 },
+	{ "loop",     1,    0,  1000000, 8,   0 },
+	{ "print",    1,    0,  1000000, -1,  0 },
+	{ "nested",   1,    7,  6,      2,    0 },
+	{ "branchy",  64,   -1, 0,      0,    256 },
+	{ "large",    256,  3,  4,      16,   64 },
+	{ "huge",     4096, 3,  2,      16,   64 },
+};
+
+static void
+bench_discard(void *ctx, const char *data, size_t len)
+{
+	(void) ctx;
+	(void) data;
+	(void) len;
+}
+
+static Bytecode
+bench_program_build(const BenchProgram *bp)
+{
+	Bytecode bc = {0};
+	bytecode_emit(&bc, OP_CONSTANT, 0);
+	for (int i = 0; i < bp->blocks; i++) {
+		if (bp->nest >= 0) {
+			bytecode_loop(&bc, 1, bp->nest, bp->iters, bp->body);
 		}
-		case OP_CMP: {
-			// Here we need to compare two numbers and push a
-			// positive number / negative number / zero as
-			// appropriate. Let's not use setcc, and instead
-			// showcase some local control flow using local labels.
-			// Remember, the "arrows" (`<`, `>`) of local labels
-			// point in the direction where the label is defined,
-			// here we refer to forward labels only. The labels are
-			// also purely based on the order of the instructions,
-			// i.e. the order dasm receives them in, lexical order
-			// in the C source doesn't matter at all.
+		bytecode_branches(&bc, bp->branches);
+	}
+	bytecode_emit(&bc, OP_DISCARD, 0);
+	bytecode_emit(&bc, OP_HALT, 0);
+	return bc;
+}
 
-			//| pop rcx
-			//| pop rax
-			//| cmp rax, rcx
-			//| jg >1
-			//| je >2
-			//| push -1
-			//| jmp >3
-			//|1:
-			//| push 1
-			//| jmp >3
-			//|2:
-			//| push 0
-			//|3:
-			instrptr += 1; break;
+// Run the benchmarks of the programs in the corpus matching `name` ("all" for
+// all of them) and print the results, one JSON object per line:
+//
+//  - compile time per byte of bytecode, and the split of the compile time
+//    into emitting, linking and encoding,
+//  - run time of the compiled code and of the interpreter.
+//
+// Each measurement is repeated until it takes long enough to be measurable.
+static int
+bench_corpus(const char *name, const CompileOptions *opts, int dual_map)
+{
+	int found = 0;
+	for (size_t p = 0; p < sizeof(bench_programs) / sizeof(bench_programs[0]); p++) {
+		const BenchProgram *bp = &bench_programs[p];
+		if (strcmp(name, "all") != 0 && strcmp(name, bp->name) != 0) {
+			continue;
 		}
-		case OP_JGT: {
-			// Conditional branch based on whether the top of the
-			// stack is a positive number. We set the flags based on
-			// the top of the stack by popping it into a register
-			// and then testing the register with itself. This
-			// effectively compares the register to zero, so we can
-			// use the "greater than" conditional jump. The relative
-			// byte offset to the destination is encoded in
-			// the instruction stream, so we figure out the
-			// (absolute) byte offset from the beginning, which also
-			// is the index of dynamic label we either already put
-			// there, or will later.
+		found = 1;
+		Bytecode bc = bench_program_build(bp);
+		CodeCache *cache = code_cache_create(dual_map);
+		Jit *jit = jit_create(opts, cache);
+		jit->profile = 1;
 
-			int offset = (int) (instrptr - program + OPERAND());
-			//| pop rax
-			//| test rax, rax
-			//| jg => offset
+		long compiles = 0;
+		size_t code_size = 0;
+		double start = now();
+		double elapsed;
+		void *code;
+		do {
+			code = compile(jit, bc.bytes, bc.len, &code_size);
+			compiles++;
+			elapsed = now() - start;
+			if (elapsed < 0.2) {
+				code_free(cache, code);
+			}
+		} while (elapsed < 0.2);
+		code_cache_seal(cache);
 
-			instrptr += 5; break;
+		Input in = {0};
+		Output out;
+		output_init(&out, -1);
+		out.sink = bench_discard;
+		long jit_runs = 0;
+		start = now();
+		do {
+			((void (*)(Input *, Output *)) code)(&in, &out);
+			jit_runs++;
+		} while (now() - start < 0.2);
+		double jit_time = (now() - start) / (double) jit_runs;
+
+		Tiering interp = {0};
+		long interp_runs = 0;
+		start = now();
+		do {
+			interpret(bc.bytes, bc.len, &in, &out, &interp);
+			interp_runs++;
+		} while (now() - start < 0.2);
+		double interp_time = (now() - start) / (double) interp_runs;
+
+		double per_compile = elapsed / (double) compiles;
+		printf("{\"program\": \"%s\", \"bytecode_bytes\": %zu, \"code_bytes\": %zu, "
+			"\"compile_us\": %.3f, \"compile_us_per_byte\": %.5f, "
+			"\"emit_us\": %.3f, \"link_us\": %.3f, \"encode_us\": %.3f, "
+			"\"jit_run_us\": %.3f, \"interp_run_us\": %.3f, \"speedup\": %.2f}\n",
+			bp->name, bc.len, code_size,
+			per_compile * 1e6, per_compile * 1e6 / (double) bc.len,
+			jit->times[0] * 1e6 / (double) compiles, jit->times[1] * 1e6 / (double) compiles, jit->times[2] * 1e6 / (double) compiles,
+			jit_time * 1e6, interp_time * 1e6, interp_time / jit_time);
+		fflush(stdout);
+
+		output_free(&out);
+		code_free(cache, code);
+		jit_destroy(jit);
+		code_cache_destroy(cache);
+		free(bc.bytes);
+	}
+	if (!found) {
+		fprintf(stderr, "Unknown benchmark '%s'\n", name);
+	}
+	return found;
+}
+
+// An empty profile for the program, see `BlockProfile`.
+static BlockProfile *
+block_profile_create(u8 *program, size_t program_len)
+{
+	u8 *targets = find_jump_targets(program, program_len);
+	size_t nblocks;
+	free(find_blocks(program, program_len, targets, &nblocks));
+	free(targets);
+	BlockProfile *profile = calloc(1, sizeof(*profile) + nblocks * sizeof(profile->blocks[0]));
+	assert(profile);
+	profile->nblocks = nblocks;
+	profile->overhead = UINT64_MAX;
+	for (int i = 0; i < 1000; i++) {
+		u64 start = __rdtsc();
+		u64 overhead = __rdtsc() - start;
+		profile->overhead = overhead < profile->overhead ? overhead : profile->overhead;
+	}
+	return profile;
+}
+
+// Add the counts of `from` to those of `to`, a profile of the same program.
+static void
+block_profile_merge(BlockProfile *to, const BlockProfile *from)
+{
+	for (size_t i = 0; i < to->nblocks; i++) {
+		to->blocks[i].runs += from->blocks[i].runs;
+		to->blocks[i].cycles += from->blocks[i].cycles;
+	}
+}
+
+// Programs with calls can't be compiled for batches (see `Module`), but as
+// the plain compiled code is reentrant (see `Output`), it can run over the
+// records of a batch: once for each record, in `nthreads` threads at once.
+// Each thread has an `Executor` with the state of its runs, nothing is
+// shared but the code and the `Module`. The values a record prints go right
+// to its output slots, and if the code is instrumented (`profile` isn't
+// `NULL`), each thread counts into its own profile, added to `profile` at the
+// end.
+typedef struct {
+	void (*fun)(Input *in, Output *out);
+	Batch batch;
+	Output out;
+	StackRun run;
+} Executor;
+
+static void
+executor_main(void *arg)
+{
+	Executor *exec = arg;
+	Batch *batch = &exec->batch;
+	for (size_t i = 0; i < batch->count; i++) {
+		const i32 *record = batch->records + i * batch->record_len;
+		Input in = { .next = record, .end = record + batch->record_len };
+		exec->out.values = batch->outputs + i * batch->outputs_len;
+		exec->out.values_len = batch->outputs_len;
+		exec->fun(&in, &exec->out);
+	}
+}
+
+static void
+executor_run_parallel(void (*fun)(Input *in, Output *out), const Batch *batch, size_t nthreads, size_t stack_size, BlockProfile *profile, u8 *program, size_t program_len)
+{
+	if (nthreads > batch->count) {
+		nthreads = batch->count;
+	}
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+	Executor *execs = calloc(nthreads, sizeof(execs[0]));
+	assert(execs);
+	for (size_t i = 0; i < nthreads; i++) {
+		Executor *exec = &execs[i];
+		exec->fun = fun;
+		exec->batch = batch_part(batch, nthreads, i);
+		exec->out.profile = profile ? block_profile_create(program, program_len) : NULL;
+		exec->run = (StackRun) { .fun = executor_main, .arg = exec };
+		if (i == 0 && !stack_size) {
+			continue;
 		}
-		case OP_HALT: {
-			// When the code compiled by us encounters this
-			// instruction, it should halt the execution, since we
-			// structure the code as a function, here is the right
-			// place for return -- an epilogue including a `ret`
-			// instruction.
-			//
-			// In our scheme we decided to first save rbx and then
-			// rbp/rsp, so here we do the reverse - restore the base
-			// and stack pointers and then restore rbx to the
-			// caller's value.
+		exec->run.stack = stack_size ? run_stack_create(stack_size) : NULL;
+		stack_run_start(&exec->run);
+	}
+	if (!stack_size) {
+		executor_main(&execs[0]);
+	}
+	for (size_t i = 0; i < nthreads; i++) {
+		Executor *exec = &execs[i];
+		if (i > 0 || stack_size) {
+			stack_run_join(&exec->run);
+		}
+		if (exec->run.stack) {
+			run_stack_destroy(exec->run.stack);
+		}
+		if (exec->out.profile) {
+			block_profile_merge(profile, exec->out.profile);
+			free(exec->out.profile);
+		}
+	}
+	free(execs);
+}
 
-			//| mov rsp, rbp
-			//| pop rbp
-			//| pop rbx
-			//| ret
+static const char *
+op_name(enum op op)
+{
+	switch (op) {
+	case OP_CONSTANT: return "CONSTANT";
+	case OP_ADD: return "ADD";
+	case OP_PRINT: return "PRINT";
+	case OP_INPUT: return "INPUT";
+	case OP_DISCARD: return "DISCARD";
+	case OP_GET: return "GET";
+	case OP_SET: return "SET";
+	case OP_CMP: return "CMP";
+	case OP_JGT: return "JGT";
+	case OP_HALT: return "HALT";
+	case OP_CALL: return "CALL";
+	case OP_RET: return "RET";
+	}
+	return "?";
+}
 
-			instrptr += 1; break;
+typedef struct {
+	size_t offset;
+	BlockCounter counter;
+} BlockReport;
+
+static int
+block_report_compare(const void *a, const void *b)
+{
+	const BlockCounter *x = &((const BlockReport *) a)->counter;
+	const BlockCounter *y = &((const BlockReport *) b)->counter;
+	if (x->cycles != y->cycles) {
+		return x->cycles < y->cycles ? 1 : -1;
+	}
+	if (x->runs != y->runs) {
+		return x->runs < y->runs ? 1 : -1;
+	}
+	return 0;
+}
+
+// Print the `top` blocks which took the most cycles (or ran the most times,
+// if the cycles weren't measured), with their share of the total and their
+// instructions, one per line. The cycles are estimated from the sampled runs.
+static void
+block_profile_report(FILE *f, u8 *program, size_t program_len, const BlockProfile *profile, size_t top)
+{
+	u8 *targets = find_jump_targets(program, program_len);
+	size_t nblocks;
+	u8 *blocks = find_blocks(program, program_len, targets, &nblocks);
+	free(targets);
+	assert(nblocks == profile->nblocks);
+	BlockReport *report = malloc((nblocks ? nblocks : 1) * sizeof(report[0]));
+	assert(report);
+	BlockCounter total = {0};
+	size_t n = 0;
+	for (size_t offset = 0; offset < program_len; offset++) {
+		if (blocks[offset]) {
+			BlockCounter c = profile->blocks[n];
+			u64 overhead = c.runs / BLOCK_SAMPLE_PERIOD * profile->overhead;
+			c.cycles = c.cycles > overhead ? (c.cycles - overhead) * BLOCK_SAMPLE_PERIOD : 0;
+			report[n] = (BlockReport) { .offset = offset, .counter = c };
+			total.runs += c.runs;
+			total.cycles += c.cycles;
+			n++;
+		}
+	}
+	qsort(report, n, sizeof(report[0]), block_report_compare);
+	fprintf(f, "%8s %12s %14s %6s  instructions\n", "offset", "runs", "cycles", "%");
+	for (size_t i = 0; i < n && i < top && report[i].counter.runs > 0; i++) {
+		const BlockCounter *c = &report[i].counter;
+		u64 share = total.cycles ? c->cycles : c->runs;
+		u64 whole = total.cycles ? total.cycles : total.runs;
+		fprintf(f, "%8zu %12llu %14llu %5.1f%% ", report[i].offset, (unsigned long long) c->runs, (unsigned long long) c->cycles, 100.0 * (double) share / (double) whole);
+		u8 *instrptr = program + report[i].offset;
+		do {
+			if (op_length(*instrptr) == 5 && instrptr + 5 <= program + program_len) {
+				fprintf(f, " %s %d;", op_name(*instrptr), read_operand(instrptr));
+			} else {
+				fprintf(f, " %s;", op_name(*instrptr));
+			}
+			instrptr += op_length(*instrptr);
+		} while (instrptr < program + program_len && !blocks[instrptr - program]);
+		fprintf(f, "\n");
+	}
+	free(report);
+	free(blocks);
+}
+
+// Get the contents of the whole file, in `*data` and `*size`. On POSIX
+// systems the file is mapped, so no matter how large it is, we don't copy it.
+// (The mapping lives until the process exits.)
+static int
+map_file(const char *path, u8 **data, size_t *size)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f || fseek(f, 0, SEEK_END) != 0) {
+		if (f) {
+			fclose(f);
 		}
+		return 0;
+	}
+	long len = ftell(f);
+	*size = len > 0 ? (size_t) len : 0;
+	*data = NULL;
+	if (*size > 0) {
+#ifdef _WIN32
+		u8 *buf = malloc(*size);
+		assert(buf);
+		if (fseek(f, 0, SEEK_SET) != 0 || fread(buf, 1, *size, f) != *size) {
+			free(buf);
+			buf = NULL;
 		}
+		*data = buf;
+#else
+		void *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		*data = map == MAP_FAILED ? NULL : map;
+#endif
+	}
+	fclose(f);
+	return *size == 0 || *data;
+}
+
+// Make the whole file the input span, see `map_file`.
+static int
+input_map_file(Input *in, const char *path)
+{
+	u8 *data;
+	size_t size;
+	if (!map_file(path, &data, &size)) {
+		return 0;
 	}
+	in->next = (const i32 *) (void *) data;
+	in->end = in->next + size / sizeof(i32);
+	return 1;
+}
 
-	// We `dasm_put` all snippets. Now we need to link and encode them. See
-	// the description of the function for more details.
-	void *code = our_dasm_link_and_encode(Dst);
-
-	// Here we could keep the same DASM state, call `dasm_setup` and
-	// continue with compilation of other programs, we just needed this
-	// single one. (Also in the case we wanted to compile more programs, we
-	// would probably split the dasm state initialization and
-	// deinitialization into separate functions called just once, which
-	// would have made it possible to use the same state with the `compile`
-	// function multiple times.
-	dasm_free(Dst);
-	return code;
+// If `arg` is of the form `name=value` return pointer to the value.
+static const char *
+option_value(const char *arg, const char *name)
+{
+	size_t len = strlen(name);
+	if (strncmp(arg, name, len) == 0 && arg[len] == '=') {
+		return arg + len + 1;
+	}
+	return NULL;
 }
 
 int
@@ -1124,22 +9785,401 @@ main(int argc, char **argv)
 
 		OP_HALT,
 	};
+	u8 *bytecode = program;
+	size_t bytecode_len = sizeof(program);
+
+	// Options come first. They all start with two dashes, so they can't be
+	// confused with (negative) numbers of the input.
+	CompileOptions opts = default_compile_options;
+	const char *dump = NULL;
+	long bench_compiles = 0;
+	int dual_map = 0;
+	const char *exec = "jit";
+	u32 hot = 1000;
+	long threads = 0;
+	int own_stack = 0;
+	const char *disk_cache = NULL;
+	const char *bench = NULL;
+	const char *input_file = NULL;
+	const char *program_file = NULL;
+	size_t chunk_len = (size_t) 1 << 20;
+	size_t report_top = 20;
+	int debug_kinds = 0;
+	const char *stats_file = NULL;
+	const char *stats_log = NULL;
+	int output_fd = 1;
+	size_t batch_outputs = 1;
+	int argi = 1;
+	for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++) {
+		const char *value;
+		if ((value = option_value(argv[argi], "--tos-regs"))) {
+			opts.tos_regs = atoi(value);
+		} else if ((value = option_value(argv[argi], "--pin-slots"))) {
+			opts.pin_slots = atoi(value);
+		} else if ((value = option_value(argv[argi], "--peephole"))) {
+			opts.peephole = atoi(value);
+		} else if ((value = option_value(argv[argi], "--batch"))) {
+			opts.batch = atoi(value);
+		} else if ((value = option_value(argv[argi], "--batch-outputs"))) {
+			batch_outputs = (size_t) atol(value);
+		} else if ((value = option_value(argv[argi], "--simd"))) {
+			opts.simd = atoi(value);
+		} else if ((value = option_value(argv[argi], "--narrow"))) {
+			opts.narrow = atoi(value);
+		} else if ((value = option_value(argv[argi], "--optimize"))) {
+			opts.optimize = atoi(value);
+		} else if ((value = option_value(argv[argi], "--instrument"))) {
+			opts.instrument = atoi(value);
+		} else if ((value = option_value(argv[argi], "--report-top"))) {
+			report_top = (size_t) atol(value);
+		} else if ((value = option_value(argv[argi], "--exec"))) {
+			exec = value;
+		} else if ((value = option_value(argv[argi], "--hot"))) {
+			hot = (u32) atol(value);
+		} else if ((value = option_value(argv[argi], "--threads"))) {
+			threads = atol(value);
+		} else if ((value = option_value(argv[argi], "--own-stack"))) {
+			own_stack = atoi(value);
+		} else if ((value = option_value(argv[argi], "--disk-cache"))) {
+			disk_cache = value;
+		} else if ((value = option_value(argv[argi], "--dual-map"))) {
+			dual_map = atoi(value);
+		} else if ((value = option_value(argv[argi], "--input-file"))) {
+			input_file = value;
+		} else if ((value = option_value(argv[argi], "--program-file"))) {
+			program_file = value;
+		} else if ((value = option_value(argv[argi], "--chunk"))) {
+			chunk_len = (size_t) atol(value);
+		} else if ((value = option_value(argv[argi], "--output-fd"))) {
+			output_fd = atoi(value);
+			if (output_fd < 0) {
+				fprintf(stderr, "Invalid file descriptor '%s'\n", value);
+				return 1;
+			}
+		} else if ((value = option_value(argv[argi], "--dump"))) {
+			dump = value;
+		} else if ((value = option_value(argv[argi], "--debug-info"))) {
+			int all = strcmp(value, "all") == 0;
+			debug_kinds |= all || strstr(value, "perf-map") ? DEBUG_PERF_MAP : 0;
+			debug_kinds |= all || strstr(value, "jitdump") ? DEBUG_JITDUMP : 0;
+			debug_kinds |= all || strstr(value, "gdb") ? DEBUG_GDB : 0;
+		} else if ((value = option_value(argv[argi], "--stats"))) {
+			stats_file = value;
+		} else if ((value = option_value(argv[argi], "--stats-log"))) {
+			stats_log = value;
+		} else if ((value = option_value(argv[argi], "--bench"))) {
+			bench = value;
+		} else if ((value = option_value(argv[argi], "--bench-compile"))) {
+			bench_compiles = atol(value);
+		} else {
+			fprintf(stderr, "Unknown option '%s'\n", argv[argi]);
+			return 1;
+		}
+	}
+
+	// Instead of the program above, we can run one from a file.
+	if (program_file && !map_file(program_file, &bytecode, &bytecode_len)) {
+		fprintf(stderr, "Failed to read program from '%s'\n", program_file);
+		return 1;
+	}
+
+	// Nothing checks the program as it runs, so it's verified upfront, see
+	// `ProgramInfo`.
+	char error[256];
+	ProgramInfo *info = verify_program(bytecode, bytecode_len, error, sizeof(error));
+	if (!info) {
+		fprintf(stderr, "Invalid program: %s\n", error);
+		return 1;
+	}
 
-	// The input for us are just two command line arguments.
-	if (argc != 3) {
+	// A program with calls is compiled in units, see `Module`, which
+	// batches don't support, so over a batch it runs record after record,
+	// see `Executor`.
+	int calls = program_has_calls(bytecode, bytecode_len);
+	size_t exec_record_len = calls && opts.batch > 0 ? (size_t) opts.batch : 0;
+
+	if (bench) {
+		return bench_corpus(bench, &opts, dual_map) ? 0 : 1;
+	} else if (bench_compiles > 0 && threads > 0) {
+		bench_compile_pool(bytecode, bytecode_len, &opts, dual_map, bench_compiles, (size_t) threads);
+		return 0;
+	} else if (bench_compiles > 0) {
+		bench_compile(bytecode, bytecode_len, &opts, dual_map, bench_compiles);
+		return 0;
+	}
+
+	// The input for us are just two command line arguments, unless it
+	// comes from a file. A program from a file takes any number of them.
+	i32 *args = NULL;
+	Input in = {0};
+	InputStream stream = {0};
+	if (input_file) {
+		if (argc - argi != 0) {
+			fprintf(stderr, "Expected no arguments with --input-file\n");
+			return 1;
+		}
+		if (strcmp(input_file, "-") == 0) {
+			stream.f = stdin;
+			in.refill = input_stream_refill;
+			in.ctx = &stream;
+		} else if (!input_map_file(&in, input_file)) {
+			fprintf(stderr, "Failed to read input from '%s'\n", input_file);
+			return 1;
+		}
+	} else if (!program_file && argc - argi != 2) {
 		fprintf(stderr, "Expected exactly 2 arguments\n");
 		return 1;
+	} else {
+		size_t nargs = (size_t) (argc - argi);
+		args = malloc((nargs ? nargs : 1) * sizeof(args[0]));
+		assert(args);
+		for (size_t i = 0; i < nargs; i++) {
+			args[i] = atoi(argv[argi + (int) i]);
+		}
+		in.next = args;
+		in.end = args + nargs;
+	}
+	if (opts.batch > 0 && (!input_file || in.refill || strcmp(exec, "jit") != 0)) {
+		fprintf(stderr, "Batches need --input-file=FILE and --exec=jit\n");
+		return 1;
+	}
+	if (opts.batch > 0 && opts.instrument && !exec_record_len) {
+		fprintf(stderr, "Batches can't be instrumented\n");
+		return 1;
+	}
+	if (opts.instrument && strcmp(exec, "trace") == 0) {
+		fprintf(stderr, "Traces can't be instrumented\n");
+		return 1;
+	}
+	if (own_stack && strcmp(exec, "jit") != 0) {
+		fprintf(stderr, "Own stacks need --exec=jit\n");
+		return 1;
+	}
+
+	// The input of a batch is all there before we compile, so the compiler
+	// can be told how large its values are, see `Range`.
+	if (exec_record_len) {
+		opts.batch = 0;
+	} else if (opts.batch > 0) {
+		u32 bits = 0;
+		for (const i32 *value = in.next; value < in.end; value++) {
+			bits |= (u32) *value;
+		}
+		opts.input_bits = 1;
+		while (opts.input_bits < 32 && bits >> opts.input_bits) {
+			opts.input_bits++;
+		}
+	}
+	Output out;
+	output_init(&out, output_fd);
+	if (opts.instrument) {
+		out.profile = block_profile_create(bytecode, bytecode_len);
 	}
-	i32 input[] = { atoi(argv[1]), atoi(argv[2]) };
 
-	// Compile the program by calling the compile function with the program
-	// and its size.
-	void (*fun)(i32 *input) = compile(program, sizeof(program));
+	// Profilers and debuggers can be told about the compiled code, see
+	// `DebugInfo`.
+	DebugInfo *debug = NULL;
+	if (debug_kinds && !(debug = debug_info_create(debug_kinds, program_file ? program_file : "builtin"))) {
+		fprintf(stderr, "Failed to set up --debug-info\n");
+		return 1;
+	}
 
-	// And run the function passing it pointer to the input array. We don't
-	// pass the length, the compiled program doesn't need it -- it expects
-	// the input array to be of sufficient length.
-	fun(input);
+	// The compilations can be counted, see `CompileStats`.
+	CompileStats *stats = NULL;
+	if (stats_file || stats_log) {
+		if (!JIT_STATS) {
+			fprintf(stderr, "Compile statistics are compiled out (JIT_STATS)\n");
+			return 1;
+		}
+		FILE *log = NULL;
+		if (stats_log && !(log = fopen(stats_log, "w"))) {
+			fprintf(stderr, "Failed to open '%s'\n", stats_log);
+			return 1;
+		}
+		stats = compile_stats_create(log);
+	}
 
-	return 0;
+	// Without the JIT, or with the JIT for hot loops (or their traces)
+	// only, the program starts in the interpreter. Traces are compiled
+	// right away, they are short.
+	if (strcmp(exec, "interp") == 0 || strcmp(exec, "tiered") == 0 || strcmp(exec, "trace") == 0) {
+		CodeCache *cache = code_cache_create(dual_map);
+		cache->debug = debug;
+		cache->stats = stats;
+		Tiering tiering = {
+			.hot = strcmp(exec, "interp") != 0 ? hot : 0,
+			.trace = strcmp(exec, "trace") == 0,
+		};
+		if (threads > 0 && !tiering.trace) {
+			tiering.pool = compile_pool_create((size_t) threads, &opts, cache);
+		} else {
+			tiering.jit = jit_create(&opts, cache);
+		}
+		interpret(bytecode, bytecode_len, &in, &out, &tiering);
+		output_free(&out);
+		if (out.error) {
+			fprintf(stderr, "Failed to write the output: %s\n", strerror(out.error));
+		}
+		if (out.profile) {
+			block_profile_report(stderr, bytecode, bytecode_len, out.profile, report_top);
+			free(out.profile);
+		}
+		if (tiering.pool) {
+			compile_pool_destroy(tiering.pool);
+		} else {
+			jit_destroy(tiering.jit);
+		}
+		if (stats) {
+			if (stats_file && !compile_stats_save(stats, cache, stats_file)) {
+				fprintf(stderr, "Failed to write '%s'\n", stats_file);
+			}
+			compile_stats_destroy(stats);
+		}
+		program_info_free(info);
+		code_cache_destroy(cache);
+		if (debug) {
+			debug_info_destroy(debug);
+		}
+		free(args);
+		return out.error ? 1 : 0;
+	} else if (strcmp(exec, "jit") != 0) {
+		fprintf(stderr, "Unknown execution mode '%s'\n", exec);
+		return 1;
+	}
+
+	// Compile the program by calling the compile function with a compiler
+	// context, the program and its size. We compile just this one program,
+	// so we can get rid of the context right away.
+	// The code goes into a code cache, from where we'll free it when we are
+	// done. Before we can run it, we have to seal the cache, which makes
+	// the code executable.
+	//
+	// With a disk cache, we first look for the code there, and only if it
+	// isn't there we compile, and store the code for the next time.
+	//
+	// A program larger than a chunk starts running as soon as its first
+	// chunk is compiled, see `ProgramStream`, unless something needs the
+	// code of the whole program.
+	//
+	// Of a program with calls, only the main unit is compiled here, the
+	// functions are compiled once they are called, see `Module`. Their code
+	// points to the module, which is only valid in this process, so it
+	// isn't kept in the disk cache, nor is it streamed.
+	//
+	// Calls are patched while other threads may run the code, which needs
+	// the cache mapped twice, see `call_link`.
+	CodeCache *cache = code_cache_create(dual_map || (exec_record_len && threads > 1));
+	cache->debug = debug;
+	cache->stats = stats;
+	size_t code_size;
+	void (*fun)(Input *in, Output *out) = NULL;
+	ProgramStream *program_stream = NULL;
+	Module *module = NULL;
+	if (chunk_len > 0 && bytecode_len > chunk_len && opts.batch == 0 && !opts.optimize && !opts.instrument && !disk_cache && !dump && !calls) {
+		program_stream = stream_create(bytecode, bytecode_len, chunk_len, &opts, cache);
+		fun = (void (*)(Input *, Output *)) stream_wait(program_stream, &program_stream->code);
+	} else {
+		u64 key = disk_cache_key(&opts, bytecode, bytecode_len);
+		if (disk_cache && !calls) {
+			fun = disk_cache_load(disk_cache, cache, key, bytecode, bytecode_len, &code_size);
+		}
+		if (!fun) {
+			Jit *jit = jit_create(&opts, cache);
+			jit->info = info;
+			if (calls) {
+				module = module_create(bytecode, bytecode_len, &opts, cache);
+				module->shared = exec_record_len && threads > 1;
+				jit->module = module;
+				jit->function = -1;
+			}
+			fun = compile(jit, bytecode, bytecode_len, &code_size);
+			if (disk_cache && !calls) {
+				disk_cache_store(disk_cache, jit, key, (void *) fun, code_size, bytecode, bytecode_len);
+			}
+			jit_destroy(jit);
+		}
+		code_cache_seal(cache);
+	}
+
+	// The generated code can be written out and inspected with e.g.:
+	//
+	//         objdump -D -b binary -m i386:x86-64 -M intel FILE
+	if (dump) {
+		FILE *f = fopen(dump, "wb");
+		if (!f || fwrite((void *) fun, 1, code_size, f) != code_size) {
+			fprintf(stderr, "Failed to write code to '%s'\n", dump);
+			return 1;
+		}
+		fclose(f);
+	}
+
+	// And run the function passing it the input and where the program
+	// prints to.
+	//
+	// A batch is run over the whole input, record after record, possibly
+	// in multiple threads. Then we print all output slots of all records,
+	// record after record, the slots the program didn't print to are zero.
+	//
+	// With `--own-stack` each thread runs on a stack sized for the program,
+	// see `RunStack`.
+	size_t stack_size = own_stack ? run_stack_size_needed(bytecode, bytecode_len, &opts) : 0;
+	if (opts.batch > 0 || exec_record_len) {
+		size_t record_len = exec_record_len ? exec_record_len : (size_t) opts.batch;
+		Batch batch = {
+			.records = in.next,
+			.count = (size_t) (in.end - in.next) / record_len,
+			.record_len = record_len,
+			.outputs_len = batch_outputs,
+		};
+		batch.outputs = calloc(batch.count * batch.outputs_len + 1, sizeof(batch.outputs[0]));
+		assert(batch.outputs);
+		size_t nthreads = threads > 0 ? (size_t) threads : 1;
+		if (exec_record_len) {
+			executor_run_parallel(fun, &batch, nthreads, stack_size, out.profile, bytecode, bytecode_len);
+		} else {
+			batch_run_parallel((void (*)(Batch *)) (void *) fun, &batch, nthreads, stack_size);
+		}
+		for (size_t i = 0; i < batch.count * batch.outputs_len; i++) {
+			output_int(&out, batch.outputs[i]);
+		}
+		output_flush(&out);
+		free(batch.outputs);
+	} else if (stack_size) {
+		program_run_on_stack(fun, &in, &out, stack_size);
+	} else {
+		fun(&in, &out);
+	}
+	output_free(&out);
+	if (out.error) {
+		fprintf(stderr, "Failed to write the output: %s\n", strerror(out.error));
+	}
+	if (out.profile) {
+		block_profile_report(stderr, bytecode, bytecode_len, out.profile, report_top);
+		free(out.profile);
+	}
+
+	// The statistics are written while the code is still there, to count
+	// in the occupancy of the code cache.
+	if (stats) {
+		if (stats_file && !compile_stats_save(stats, cache, stats_file)) {
+			fprintf(stderr, "Failed to write '%s'\n", stats_file);
+		}
+		compile_stats_destroy(stats);
+	}
+
+	if (program_stream) {
+		stream_destroy(program_stream);
+	} else {
+		code_free(cache, (void *) fun);
+	}
+	if (module) {
+		module_destroy(module);
+	}
+	program_info_free(info);
+	code_cache_destroy(cache);
+	if (debug) {
+		debug_info_destroy(debug);
+	}
+	free(args);
+	return out.error ? 1 : 0;
 }
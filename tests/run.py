@@ -0,0 +1,477 @@
+#!/usr/bin/env python3
+# Differential tests of the compilers: each program runs in the interpreter
+# (`--exec=interp`), which defines what it should print, and then with each
+# of the options of its suite, which have to print the same. Batches run
+# each record in the interpreter, and have to print the first outputs of
+# each, see `--batch-outputs`.
+#
+#     run.py DEMO SUITE
+#
+# Programs are written in a small assembly, one instruction per line, with
+# `label:` lines as the targets of `JGT` and `CALL`.
+
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+
+OPS = dict(CONSTANT=0, ADD=1, PRINT=2, INPUT=3, DISCARD=4, GET=5, SET=6,
+           CMP=7, JGT=8, HALT=9, CALL=10, RET=11)
+WITH_OPERAND = ('CONSTANT', 'GET', 'SET', 'JGT', 'CALL')
+
+
+def assemble(source):
+    lines = []
+    for line in source.strip().splitlines():
+        line = line.split('#')[0].strip()
+        if line:
+            lines.append(line)
+    labels, offset = {}, 0
+    for line in lines:
+        if line.endswith(':'):
+            labels[line[:-1]] = offset
+        else:
+            offset += 5 if line.split()[0] in WITH_OPERAND else 1
+    code, offset = bytearray(), 0
+    for line in lines:
+        if line.endswith(':'):
+            continue
+        op, *arg = line.split()
+        code.append(OPS[op])
+        if op in WITH_OPERAND:
+            value = labels[arg[0]] - offset if op in ('JGT', 'CALL') else int(arg[0], 0)
+            code += struct.pack('<i', value)
+            offset += 5
+        else:
+            offset += 1
+    return bytes(code)
+
+
+# The loop counting `slot 1` up to `slot 0` leaves its count as the limit of
+# the loop after it, which both get simplified.
+COUNTED_LOOPS = """
+    CONSTANT 13
+    CONSTANT 5
+    CONSTANT 20
+l1:
+    GET 1
+    CONSTANT 1
+    ADD
+    SET 1
+    GET 0
+    GET 2
+    CMP
+    JGT l1
+l2:
+    GET 2
+    CONSTANT -1
+    ADD
+    SET 2
+    GET 2
+    GET 2
+    CMP
+    JGT l2
+    GET 2
+    PRINT
+    GET 1
+    PRINT
+    HALT
+"""
+
+# Counts the input down to 0, adding the next input each time.
+SUM_INPUTS = """
+    INPUT
+    CONSTANT 0
+loop:
+    INPUT
+    ADD
+    GET 1
+    CONSTANT -1
+    ADD
+    SET 1
+    GET 1
+    JGT loop
+    PRINT
+    HALT
+"""
+
+# Goes both ways of the branch in the loop, depending on the input.
+BRANCHY = """
+    INPUT
+    CONSTANT 0
+loop:
+    INPUT
+    JGT odd
+    GET 0
+    CONSTANT 3
+    ADD
+    SET 0
+    CONSTANT 1
+    JGT next
+odd:
+    GET 0
+    PRINT
+next:
+    GET 1
+    CONSTANT -1
+    ADD
+    SET 1
+    GET 1
+    JGT loop
+    GET 0
+    PRINT
+    HALT
+"""
+
+# Pushes inputs until one isn't positive, so the depth of the stack isn't
+# static, and prints the last one pushed before it.
+PUSH_INPUTS = """
+    CONSTANT 0
+loop:
+    INPUT
+    GET 0
+    JGT loop
+    DISCARD
+    PRINT
+    HALT
+"""
+
+# Sums 1 to the input recursively, the function reads its argument from the
+# stack of the caller and leaves the sum there.
+RECURSIVE_SUM = """
+    INPUT
+    CALL sum
+    PRINT
+    HALT
+sum:
+    GET 0
+    JGT more
+    RET
+more:
+    GET 0
+    CONSTANT -1
+    ADD
+    CALL sum
+    ADD
+    RET
+"""
+
+# Prints the sum of the first two inputs and how the third compares to 7,
+# without loops, so batches of it can run in narrow lanes.
+LINEAR = """
+    INPUT
+    INPUT
+    ADD
+    PRINT
+    INPUT
+    CONSTANT 7
+    CMP
+    PRINT
+    HALT
+"""
+
+# Multiplies the two inputs by adding, in a loop.
+MULTIPLY = """
+    INPUT
+    INPUT
+    CONSTANT 0
+loop:
+    GET 1
+    JGT body
+    PRINT
+    HALT
+body:
+    GET 2
+    ADD
+    GET 1
+    CONSTANT -1
+    ADD
+    SET 1
+    CONSTANT 1
+    JGT loop
+"""
+
+# Prints 1 + 2 + ... + n for the input n down to 1, the function computes
+# each of them with a loop.
+LOOP_CALLS = """
+    INPUT
+loop:
+    GET 0
+    CALL triangle
+    PRINT
+    GET 0
+    CONSTANT -1
+    ADD
+    SET 0
+    GET 0
+    JGT loop
+    HALT
+triangle:
+    CONSTANT 0
+tloop:
+    GET 1
+    JGT tbody
+    SET 0
+    RET
+tbody:
+    GET 1
+    ADD
+    GET 1
+    CONSTANT -1
+    ADD
+    SET 1
+    CONSTANT 1
+    JGT tloop
+"""
+
+# A function called at different depths of the stack, and from another one.
+NESTED_CALLS = """
+    INPUT
+    INPUT
+    CALL add3
+    PRINT
+    CONSTANT 10
+    GET 1
+    CALL twice
+    ADD
+    PRINT
+    HALT
+add3:
+    CONSTANT 3
+    ADD
+    RET
+twice:
+    GET 0
+    ADD
+    CALL add3
+    CALL add3
+    RET
+"""
+
+# (name, program, input)
+PROGRAMS = {
+    'optimizer': [
+        ('counted loops', COUNTED_LOOPS, []),
+        ('sum inputs', SUM_INPUTS, [5, 1, 2, 3, 4, 5]),
+        ('branchy', BRANCHY, [6, 1, 0, 0, 1, 0, 1]),
+    ],
+    'verifier': [
+        ('push inputs', PUSH_INPUTS, [3, 4, 5, 0]),
+        ('push no inputs', PUSH_INPUTS, [0]),
+        ('recursive sum', RECURSIVE_SUM, [100]),
+    ],
+    'calls': [
+        ('recursive sum', RECURSIVE_SUM, [100]),
+        # Deeper than the calls may go, the program stops there.
+        ('recursive sum too deep', RECURSIVE_SUM, [5000]),
+        ('loop calls', LOOP_CALLS, [30]),
+        ('nested calls', NESTED_CALLS, [5, 8]),
+        ('nested calls without input', NESTED_CALLS, [5]),
+    ],
+}
+
+# Batches: (name, program, values per record, largest value). The records
+# are random, but always the same.
+BATCHES = {
+    'batch': [
+        ('linear', LINEAR, 3, 20),
+        # Values which don't fit in 32-bit lanes.
+        ('linear wide', LINEAR, 3, 2**32 - 1),
+        ('multiply', MULTIPLY, 2, 30),
+        ('sum inputs', SUM_INPUTS, 5, 6),
+        ('branchy', BRANCHY, 4, 3),
+        # Run record by record, see `--batch`.
+        ('loop calls', LOOP_CALLS, 1, 20),
+        ('nested calls', NESTED_CALLS, 2, 1000),
+    ],
+}
+
+
+def op(name, operand=None):
+    code = bytes([OPS[name]])
+    return code if operand is None else code + struct.pack('<i', operand)
+
+
+# Programs the verifier has to reject: (name, bytecode, input).
+REJECTED = {
+    'verifier': [
+        ('unknown opcode', bytes([12]), []),
+        ('cut off operand', op('CONSTANT', 1)[:3], []),
+        ('jump into an operand', op('INPUT') + op('JGT', 3) + op('HALT'), [1]),
+        ('jump backward into an operand', op('CONSTANT', 1) + op('JGT', -4) + op('HALT'), []),
+        ('jump past the end', op('INPUT') + op('JGT', 100) + op('HALT'), [1]),
+        ('add underflow', op('ADD'), []),
+        ('empty program', b'', [3]),
+        ('loop falls off the end', assemble("""
+            INPUT
+        l:
+            GET 0
+            CONSTANT -1
+            ADD
+            SET 0
+            GET 0
+            PRINT
+            GET 0
+            JGT l
+        """), [3]),
+        ('function falls off the end', assemble("""
+            INPUT
+            CALL f
+            PRINT
+            HALT
+        f:
+            CONSTANT 1
+            ADD
+        """), [3]),
+        ('get out of range', op('INPUT') + op('GET', 1) + op('PRINT') + op('HALT'), [1]),
+        ('negative slot', op('INPUT') + op('GET', -1) + op('PRINT') + op('HALT'), [1]),
+        ('underflow on one way', op('INPUT') + op('JGT', 6) + op('INPUT') + op('PRINT') + op('HALT'), [1]),
+        # The slot needs more values than fit in 32 bits.
+        ('slot near 2^31', op('CONSTANT', 1) + op('INPUT') + op('JGT', 10) + op('CONSTANT', 7)
+         + op('SET', 2**31 - 1) + op('HALT'), [1]),
+        ('get near 2^31', op('CONSTANT', 1) + op('INPUT') + op('JGT', 10) + op('GET', 2**31 - 1)
+         + op('PRINT') + op('HALT'), [1]),
+        # A function setting a slot below what its caller has on the stack.
+        ('set out of range in a function', assemble("""
+            INPUT
+            CALL f
+            PRINT
+            HALT
+        f:
+            CONSTANT 7
+            SET 3
+            RET
+        """), [1]),
+        ('call underflow', assemble("""
+            CALL f
+            HALT
+        f:
+            ADD
+            RET
+        """), []),
+        # Each call pops one more value than it pushes.
+        ('recursion shrinking the stack', assemble("""
+            INPUT
+            INPUT
+            CALL f
+            HALT
+        f:
+            JGT f2
+            RET
+        f2:
+            CALL f
+            RET
+        """), [1, 1]),
+    ],
+}
+
+# The options each suite runs the programs with.
+MODES = {
+    'verifier': [
+        ['--exec=jit'],
+        ['--exec=jit', '--optimize=1'],
+        ['--exec=tiered', '--hot=1'],
+        ['--exec=trace', '--hot=1'],
+    ],
+    'optimizer': [
+        ['--exec=jit'],
+        ['--exec=jit', '--optimize=1'],
+        ['--exec=tiered', '--hot=1', '--optimize=1'],
+        ['--exec=tiered', '--hot=2', '--optimize=1'],
+        ['--exec=trace', '--hot=1'],
+        ['--exec=trace', '--hot=2'],
+    ],
+    'calls': [
+        ['--exec=jit'],
+        ['--exec=jit', '--optimize=1'],
+        ['--exec=jit', '--own-stack=1'],
+        ['--exec=jit', '--tos-regs=0'],
+        ['--exec=tiered', '--hot=1'],
+        ['--exec=tiered', '--hot=2', '--threads=1'],
+        ['--exec=trace', '--hot=1'],
+    ],
+    # With `--batch-outputs=2` and `--batch` added.
+    'batch': [
+        [],
+        ['--simd=0'],
+        ['--narrow=0'],
+        ['--simd=0', '--narrow=0'],
+        ['--threads=3'],
+        ['--own-stack=1'],
+    ],
+}
+
+
+def run(demo, args, program, inputs):
+    with tempfile.TemporaryDirectory() as tmp:
+        path = os.path.join(tmp, 'program.bin')
+        with open(path, 'wb') as f:
+            f.write(program)
+        result = subprocess.run([demo, *args, '--program-file=' + path, *map(str, inputs)],
+                                capture_output=True, timeout=60)
+        return result.returncode, result.stdout.decode(), result.stderr.decode()
+
+
+def records(seed, count, length, largest):
+    rnd = random.Random(seed)
+    small = [v for v in (0, 1, 2, 3, 7) if v <= largest]
+    return [[rnd.choice(small + [largest]) if rnd.random() < 0.3 else rnd.randint(0, largest)
+             for _ in range(length)] for _ in range(count)]
+
+
+# What the batch prints, `outputs` values for each record (0 for those the
+# record didn't print), from running the records in the interpreter.
+def batch_expected(demo, program, batch, outputs):
+    expected = []
+    for record in batch:
+        rc, stdout, stderr = run(demo, ['--exec=interp'], program, record)
+        if rc != 0:
+            return rc, stdout, stderr
+        printed = stdout.split()[:outputs]
+        expected += printed + ['0'] * (outputs - len(printed))
+    return 0, ''.join(v + '\n' for v in expected), ''
+
+
+def run_batch(demo, args, program, length, batch, outputs):
+    with tempfile.TemporaryDirectory() as tmp:
+        path = os.path.join(tmp, 'input.bin')
+        with open(path, 'wb') as f:
+            for record in batch:
+                f.write(struct.pack('<%dI' % length, *record))
+        return run(demo, ['--exec=jit', '--batch=%d' % length, '--batch-outputs=%d' % outputs,
+                          '--input-file=' + path, *args], program, [])
+
+
+def main():
+    demo, suite = sys.argv[1], sys.argv[2]
+    failed = 0
+    for name, source, inputs in PROGRAMS.get(suite, []):
+        program = assemble(source)
+        expected = run(demo, ['--exec=interp'], program, inputs)
+        for args in MODES[suite]:
+            got = run(demo, args, program, inputs)
+            if got[:2] != expected[:2]:
+                print('FAIL %s %s: expected %r, got %r' % (name, ' '.join(args), expected, got))
+                failed += 1
+    for name, program, inputs in REJECTED.get(suite, []):
+        for args in [['--exec=interp'], *MODES[suite]]:
+            got = run(demo, args, program, inputs)
+            if got[0] != 1 or not got[2].startswith('Invalid program'):
+                print('FAIL %s %s: not rejected, got %r' % (name, ' '.join(args), got))
+                failed += 1
+    for i, (name, source, length, largest) in enumerate(BATCHES.get(suite, [])):
+        program = assemble(source)
+        batch = records(i, 37, length, largest)
+        expected = batch_expected(demo, program, batch, 2)
+        for args in MODES[suite]:
+            got = run_batch(demo, args, program, length, batch, 2)
+            if got[:2] != expected[:2]:
+                print('FAIL batch %s %s: expected %r, got %r' % (name, ' '.join(args), expected, got))
+                failed += 1
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())